@@ -4,6 +4,7 @@ Subject: Advanced Systems Programming
 University of Windsor
 Project
 */
+#define _GNU_SOURCE  // strptime and the endian conversion helpers
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -17,10 +18,27 @@ Project
 #include <errno.h>
 #include <time.h>
 #include <ctype.h> // Include ctype.h for character type functions
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
 
 #define PORT 12345  // The port number to connect to the server on
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 4096  // Also the longest command line (the server takes up to 4095 bytes)
 #define MAX_RETRIES 5
+
+// Wire protocol shared with serverw24.c: a 16-byte header (magic, type, status,
+// flags, 32-bit request ID, 64-bit payload length, big-endian) then the payload
+#define W24_MAGIC 0x57
+#define W24_HEADER_SIZE 16
+#define W24_TYPE_COMMAND 1      // Client -> server: command text
+#define W24_TYPE_TEXT 2         // Server -> client: text to print
+#define W24_TYPE_ARCHIVE 3      // Server -> client: tar.gz bytes to save
+#define W24_TYPE_TAR 4          // Server -> client: uncompressed tar bytes (-z none)
+#define W24_TYPE_TREE 5         // Server -> client: encoded w24tree listing (see serverw24.c)
+#define W24_TYPE_FILE 6         // Server -> client: bytes of one file, or a range of it (w24get)
+#define W24_STATUS_OK 0
+#define W24_FLAG_MORE 0x01      // More frames follow for the same request
+uint32_t next_request_id = 1;   // Request ID given to the next command
 int sockfd = -1;
 struct sockaddr_in serv_addr; // Struct for server address details
 struct hostent *server; // Struct to hold info about the host/server
@@ -158,11 +176,33 @@ int writeFully(int sockfd, const char *buffer, size_t length) { // Function to w
         if (bytesWritten < 0) error("ERROR writing to socket", errno);
         totalWritten += bytesWritten;
     }
+    return 0;
 }
-void sendCommand(int sockfd, const char* command) { // Function to send a command over the socket
-    if (write(sockfd, command, strlen(command)) < 0) {
-        error("ERROR writing to socket", errno);
+int readFully(int sockfd, void *buffer, size_t length) { // Function to read exactly length bytes; returns -1 if the server closes first
+    size_t totalRead = 0;
+    ssize_t bytesRead;
+    while (totalRead < length) {
+        bytesRead = read(sockfd, (char *)buffer + totalRead, length - totalRead);
+        if (bytesRead < 0 && errno == EINTR) continue;
+        if (bytesRead <= 0) return -1;
+        totalRead += bytesRead;
     }
+    return 0;
+}
+uint32_t sendCommand(int sockfd, const char* command) { // Function to send a command over the socket as one COMMAND frame; returns its request ID
+    unsigned char header[W24_HEADER_SIZE];
+    uint32_t request_id = next_request_id++;
+    uint32_t id = htobe32(request_id);
+    uint64_t len = htobe64(strlen(command));
+    header[0] = W24_MAGIC;
+    header[1] = W24_TYPE_COMMAND;
+    header[2] = W24_STATUS_OK;
+    header[3] = 0;
+    memcpy(header + 4, &id, 4);
+    memcpy(header + 8, &len, 8);
+    writeFully(sockfd, (const char *)header, sizeof(header));
+    writeFully(sockfd, command, strlen(command));
+    return request_id;
 }
 void ensure_w24project_directory_exists() {
     char path[1024];
@@ -174,74 +214,282 @@ void ensure_w24project_directory_exists() {
     }
 }
 
-void handleServerResponse(int sockfd) {
-    char response[BUFFER_SIZE];
-    int bytes_read;
-
-    // Set a timeout for the read function
-    struct timeval tv;
-    tv.tv_sec = 10;  // 10 second timeout
-    tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    bytes_read = read(sockfd, response, BUFFER_SIZE - 1);  // Leave space for null terminator
-    if (bytes_read < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            printf("Timeout reached, no more data received from server.\n");
+// Read one LEB128 varint of a tree listing; returns -1 past the end
+int readVarint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// Decode a saved w24tree listing and print what it holds
+void summarizeTree(const char *file_path) {
+    FILE *fp = fopen(file_path, "rb");
+    if (fp == NULL) return;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        free(data);
+        return;
+    }
+    fclose(fp);
+
+    const unsigned char *p = data + 5, *end = data + size;
+    uint64_t value, parent, shared, suffix, entries = 0, kinds[4] = {0}, bytes = 0, declared = 0;
+    char root[4097] = "";
+    int ok = size > 5 && memcmp(data, "W24T", 4) == 0 && data[4] == 1 &&
+             readVarint(&p, end, &value) == 0 && value < sizeof(root) && (uint64_t)(end - p) >= value;
+    if (ok) {
+        memcpy(root, p, value);
+        root[value] = '\0';
+        p += value;
+        ok = readVarint(&p, end, &value) == 0;  // Root mtime
+    }
+    while (ok) {
+        if (readVarint(&p, end, &parent) < 0) {
+            ok = 0;
+        } else if (parent == 0) {
+            ok = readVarint(&p, end, &declared) == 0 && declared == entries;
+            break;
+        } else if (p >= end || *p > 3) {
+            ok = 0;
         } else {
-            perror("ERROR reading from socket");
+            int kind = *p++;
+            ok = readVarint(&p, end, &shared) == 0 && readVarint(&p, end, &suffix) == 0 &&
+                 (uint64_t)(end - p) >= suffix;
+            if (!ok) break;
+            p += suffix;
+            if (kind != 1) {
+                ok = readVarint(&p, end, &value) == 0;
+                bytes += value;
+            }
+            ok = ok && readVarint(&p, end, &value) == 0;  // mtime delta
+            kinds[kind]++;
+            entries++;
         }
-        return;
     }
+    if (ok) {
+        printf("Tree of %s: %llu directories, %llu files (%llu bytes), %llu links, %llu other\n", root,
+               (unsigned long long)kinds[1], (unsigned long long)kinds[0], (unsigned long long)bytes,
+               (unsigned long long)kinds[2], (unsigned long long)kinds[3]);
+    } else {
+        fprintf(stderr, "The tree listing is damaged or incomplete.\n");
+    }
+    free(data);
+}
 
-    response[bytes_read] = '\0';  // Properly null-terminate the string
+// Split "w24get <path> [offset len]" the way the server does: the range is the
+// last two words when both are numbers. Returns the path's length; ranged is
+// -1 when a lone number ends the command, which the server refuses.
+size_t parseGetRange(const char* args, long long *offset, int *ranged) {
+    size_t len = strlen(args);
+    const char *words[2] = {NULL, NULL};
+    while (len > 0 && args[len - 1] == ' ') len--;
+    size_t end = len;
+    for (int i = 1; i >= 0; i--) {
+        size_t space = end;
+        while (space > 0 && args[space - 1] != ' ') space--;
+        if (space == 0 || space == end || strspn(args + space, "0123456789") < end - space) break;
+        words[i] = args + space;
+        end = space - 1;
+    }
+    *offset = 0;
+    *ranged = words[0] != NULL ? 1 : words[1] != NULL ? -1 : 0;
+    if (*ranged <= 0) return len;
+    *offset = atoll(words[0]);
+    while (end > 0 && args[end - 1] == ' ') end--;
+    return end;
+}
 
-    // Check if the response contains only printable characters
-    int is_binary = 0;
-    for (int i = 0; i < bytes_read; i++) {
-        if (!isprint(response[i]) && !isspace(response[i])) {
-            is_binary = 1;
+// Check that a w24get path can be kept under w24project as it is: no "." or
+// ".." components, which could lead the saved file out of it
+int validGetPath(const char* path, size_t len) {
+    for (size_t i = 0; i < len;) {
+        size_t n = strcspn(path + i, "/");
+        if (n > len - i) n = len - i;
+        if ((n == 1 && path[i] == '.') || (n == 2 && path[i] == '.' && path[i + 1] == '.')) return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+// Open the file a w24get saves into: w24project/<path>, the path as it was
+// asked for (without a leading '/'), so different files never share a name.
+// A range is written in place, so the pieces of a file can be fetched separately.
+int openGetTarget(const char* command, char *file_path, size_t size, long long *offset) {
+    int ranged;
+    const char *args = command + 7;
+    while (*args == ' ') args++;
+    size_t len = parseGetRange(args, offset, &ranged);
+    while (len > 0 && *args == '/') args++, len--;
+    while (len > 0 && args[len - 1] == '/') len--;
+    if (len == 0 || !validGetPath(args, len) ||
+        snprintf(file_path, size, "%s/w24project/%.*s", getenv("HOME"), (int)len, args) >= (int)size) {
+        fprintf(stderr, "Cannot save %.*s under w24project.\n", (int)len, args);
+        return -1;
+    }
+    ensure_w24project_directory_exists();
+    // Create the directories on the way
+    for (char *slash = strchr(file_path + strlen(getenv("HOME")) + 11, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(file_path, 0700);
+        *slash = '/';
+    }
+    int fd = open(file_path, O_WRONLY | O_CREAT | O_NOFOLLOW | (ranged ? 0 : O_TRUNC), 0644);
+    if (fd < 0) perror("Failed to open file");
+    return fd;
+}
+
+// Read frames until the last one of the response to request_id: text is
+// printed, archives are saved. Frames answering any other request are skipped.
+void handleServerResponse(int sockfd, const char* command, uint32_t request_id) {
+    char response[BUFFER_SIZE];
+    unsigned char header[W24_HEADER_SIZE];
+    FILE *fp = NULL;
+    char file_path[1024];
+    int tree = 0;
+    uint64_t archive_bytes = 0;
+    int more = 1;
+
+    while (more) {
+        if (readFully(sockfd, header, sizeof(header)) < 0) {
+            fprintf(stderr, "Connection closed by server.\n");
             break;
         }
-    }
+        if (header[0] != W24_MAGIC) {
+            fprintf(stderr, "Invalid response from server.\n");
+            break;
+        }
+        int type = header[1];
+        uint32_t id;
+        uint64_t length;
+        memcpy(&id, header + 4, 4);
+        memcpy(&length, header + 8, 8);
+        length = be64toh(length);
 
-    if (is_binary) {
-        // Assume binary data, save to a file
-        ensure_w24project_directory_exists();  // Ensure the directory exists
-        printf("Received binary data, saving to w24project/received_files.tar.gz\n");
-        char file_path[1024];
-        snprintf(file_path, sizeof(file_path), "%s/w24project/received_files.tar.gz", getenv("HOME"));
-        FILE *fp = fopen(file_path, "wb");
-        if (fp == NULL) {
-            perror("Failed to open file");
-            return;
+        if (be32toh(id) != request_id) {
+            // Left over from an earlier request: not part of this answer
+            fprintf(stderr, "Skipping %llu bytes answering request %u.\n", (unsigned long long)length, be32toh(id));
+            while (length > 0) {
+                size_t chunk = length < sizeof(response) ? length : sizeof(response);
+                if (readFully(sockfd, response, chunk) < 0) {
+                    fprintf(stderr, "Connection closed by server.\n");
+                    more = 0;
+                    break;
+                }
+                length -= chunk;
+            }
+            continue;
         }
-        fwrite(response, 1, bytes_read, fp);
-        // Read the rest of the data and write to file
-        while ((bytes_read = read(sockfd, response, BUFFER_SIZE)) > 0) {
-            fwrite(response, 1, bytes_read, fp);
+        more = header[3] & W24_FLAG_MORE;
+
+        if (type == W24_TYPE_FILE) {
+            // A w24get answer: the bytes go to their offset in the saved file
+            long long offset;
+            int fd = openGetTarget(command, file_path, sizeof(file_path), &offset);
+            uint64_t total = length;
+            while (length > 0) {
+                size_t chunk = length < sizeof(response) ? length : sizeof(response);
+                if (readFully(sockfd, response, chunk) < 0) {
+                    fprintf(stderr, "Connection closed by server.\n");
+                    more = 0;
+                    break;
+                }
+                if (fd >= 0 && pwrite(fd, response, chunk, offset) != (ssize_t)chunk) {
+                    perror("Failed to write file");
+                    close(fd);
+                    fd = -1;
+                }
+                offset += chunk;
+                length -= chunk;
+            }
+            if (fd >= 0) {
+                close(fd);
+                printf("Received %llu bytes, saved to %s\n", (unsigned long long)total, file_path);
+            }
+        } else if (type == W24_TYPE_ARCHIVE || type == W24_TYPE_TAR || type == W24_TYPE_TREE) {
+            if (fp == NULL) {
+                // First archive frame of the response: open the output file
+                const char *name = type == W24_TYPE_TAR ? "received_files.tar" :
+                                   type == W24_TYPE_TREE ? "received_tree.w24t" : "received_files.tar.gz";
+                tree = type == W24_TYPE_TREE;
+                ensure_w24project_directory_exists();  // Ensure the directory exists
+                printf("Receiving %s, saving to w24project/%s\n", tree ? "tree" : "archive", name);
+                snprintf(file_path, sizeof(file_path), "%s/w24project/%s", getenv("HOME"), name);
+                fp = fopen(file_path, "wb");
+                if (fp == NULL) {
+                    perror("Failed to open file");
+                }
+            }
+            // Copy exactly length bytes from the socket to the file
+            while (length > 0) {
+                size_t chunk = length < sizeof(response) ? length : sizeof(response);
+                if (readFully(sockfd, response, chunk) < 0) {
+                    fprintf(stderr, "Connection closed by server.\n");
+                    more = 0;
+                    break;
+                }
+                if (fp) fwrite(response, 1, chunk, fp);
+                archive_bytes += chunk;
+                length -= chunk;
+            }
+        } else {
+            // Text (or an unknown type): print the payload
+            while (length > 0) {
+                size_t chunk = length < sizeof(response) - 1 ? length : sizeof(response) - 1;
+                if (readFully(sockfd, response, chunk) < 0) {
+                    fprintf(stderr, "Connection closed by server.\n");
+                    more = 0;
+                    break;
+                }
+                response[chunk] = '\0';
+                printf("%s", response);
+                length -= chunk;
+            }
+            if (!more) printf("\n");
+            fflush(stdout); // A watch prints its changes as they come
         }
+    }
+
+    if (fp) {
         fclose(fp);
-    } else {
-        // Data is text, print it
-        printf("%s\n", response);
+        printf("Received %llu bytes\n", (unsigned long long)archive_bytes);
+        if (tree) summarizeTree(file_path);
     }
 }
-// Function to verify directory listing commands
+// Function to verify directory listing commands: -a or -t, then an optional page size and cursor
 int verifyDirlist(const char* cmd) {
-    if (strcmp(cmd, "dirlist -a") == 0) {
-        return 1; // Valid command for alphabetical listing
-    } else if (strcmp(cmd, "dirlist -t") == 0) {
-        return 1; // Valid command for time-based listing
+    char sort[8], option[8], value[BUFFER_SIZE];
+    const char *p = cmd + 8;
+    int used;
+    if (sscanf(p, "%7s%n", sort, &used) == 1 && (strcmp(sort, "-a") == 0 || strcmp(sort, "-t") == 0)) {
+        p += used;
+        while (sscanf(p, "%7s %4095s%n", option, value, &used) == 2) {
+            if (strcmp(option, "-n") == 0 && atol(value) > 0) {
+                p += used;
+            } else if (strcmp(option, "-c") == 0) {
+                p += used;
+            } else {
+                break;
+            }
+        }
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0') return 1; // Valid listing command
     }
-    printf("Invalid directory listing command. Use 'dirlist -a' or 'dirlist -t'.\n");
+    printf("Invalid directory listing command. Use 'dirlist -a' or 'dirlist -t', optionally with '-n <count>' and '-c <cursor>'.\n");
     return 0;
 }
 
-// Function to verify the w24fn command
+// Function to verify the w24fn command: one or more names or glob patterns, -a for all matches
 int verifyW24fn(const char* filename) {
-    if (filename[0] == '\0') {
-        printf("Filename cannot be empty. Use 'w24fn <filename>'.\n");
+    if (filename[0] == '\0' || strcmp(filename, "-a") == 0) {
+        printf("Filename cannot be empty. Use 'w24fn [-a] <filename|pattern> ...'.\n");
         return 0;
     }
     // Further checks for filename validity can be implemented here
@@ -250,8 +498,8 @@ int verifyW24fn(const char* filename) {
 
 // Function to verify the w24fz command
 int verifyW24fz(const char* sizes) {
-    int size1, size2;
-    if (sscanf(sizes, "%d %d", &size1, &size2) == 2) {
+    long long size1, size2;
+    if (sscanf(sizes, "%lld %lld", &size1, &size2) == 2) {
         if (size1 <= size2 && size1 >= 0 && size2 >= 0) {
             return 1;
         }
@@ -284,8 +532,204 @@ int verifyW24ft(const char* extensions) {
     return 0;
 }
 
+// Function to verify the w24find command: -l and key:value predicates; the server checks the values
+int verifyW24find(const char* args) {
+    char copy[BUFFER_SIZE];
+    int predicates = 0;
+    snprintf(copy, sizeof(copy), "%s", args);
+    for (char *token = strtok(copy, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (strcmp(token, "-l") == 0) continue;
+        char *value = strchr(token, ':');
+        if (value == NULL || value[1] == '\0' ||
+            (strncmp(token, "size:", 5) != 0 && strncmp(token, "ext:", 4) != 0 && strncmp(token, "after:", 6) != 0 &&
+             strncmp(token, "before:", 7) != 0 && strncmp(token, "name:", 5) != 0)) {
+            printf("Invalid predicate '%s'. Use size:<min>-<max>, ext:<ext>[,...], after:YYYY-MM-DD, "
+                   "before:YYYY-MM-DD or name:<pattern>.\n", token);
+            return 0;
+        }
+        if ((strncmp(token, "after:", 6) == 0 || strncmp(token, "before:", 7) == 0) && !verifyDate(value + 1))
+            return 0;
+        predicates++;
+    }
+    if (predicates == 0) {
+        printf("Give at least one predicate. Use 'w24find [-l] <predicate> ...'.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to verify the w24watch command: w24find predicates and an optional resume:<token>
+int verifyW24watch(const char* args) {
+    char predicates[BUFFER_SIZE] = "", copy[BUFFER_SIZE];
+    snprintf(copy, sizeof(copy), "%s", args);
+    for (char *token = strtok(copy, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (strncmp(token, "resume:", 7) == 0 || strcmp(token, "-l") == 0) {
+            if (token[0] == '-') {
+                printf("w24watch takes predicates only. Use 'w24watch [resume:<token>] <predicate> ...'.\n");
+                return 0;
+            }
+            continue;
+        }
+        strcat(predicates, " ");
+        strcat(predicates, token);
+    }
+    return verifyW24find(predicates);
+}
+
+// Function to verify the w24tree and w24du commands: an optional path, then an optional depth
+int verifyTreeArgs(const char* command, const char* args) {
+    char path[BUFFER_SIZE], depth[32], extra[2];
+    int n = sscanf(args, "%4095s %31s %1s", path, depth, extra);
+    if (n <= 0) return 1; // The whole home directory
+    if (n == 1 || (n == 2 && strspn(depth, "0123456789") == strlen(depth) && atol(depth) > 0)) {
+        if (n == 2 || strspn(path, "0123456789") != strlen(path) || atol(path) > 0)
+            return 1;
+    }
+    printf("Invalid %s command. Use '%s [path] [depth]', with a depth of 1 or more.\n", command, command);
+    return 0;
+}
+
+// Function to verify the w24count predicates; none counts every file
+int verifyW24count(const char* args) {
+    while (isspace((unsigned char)*args)) args++;
+    if (*args == '\0') return 1;
+    if (strcmp(args, "-l") == 0 || strncmp(args, "-l ", 3) == 0 || strstr(args, " -l") != NULL) {
+        printf("w24count, w24top and w24sum take predicates only, no -l.\n");
+        return 0;
+    }
+    return verifyW24find(args);
+}
+
+// Function to verify the w24top command: size or mtime, a count, then optional predicates
+int verifyW24top(const char* args) {
+    char order[16];
+    long n;
+    int used = 0;
+    if (sscanf(args, "%15s %ld%n", order, &n, &used) == 2 && n >= 1 && n <= 10000 &&
+        (strcmp(order, "size") == 0 || strcmp(order, "mtime") == 0) && (args[used] == '\0' || args[used] == ' ')) {
+        return verifyW24count(args + used);
+    }
+    printf("Invalid w24top command. Use 'w24top size|mtime <N> [predicate ...]', N from 1 to 10000.\n");
+    return 0;
+}
+
+// Function to verify the w24sum command: -s for SHA-256, then optional predicates
+int verifyW24sum(const char* args) {
+    while (*args == ' ') args++;
+    if (strcmp(args, "-s") == 0 || strncmp(args, "-s ", 3) == 0) args += 2;
+    return verifyW24count(args);
+}
+
+// Function to verify the w24grep command: -E and -b <budget>, a pattern ("..." if it
+// has spaces), then up to three extensions
+int verifyW24grep(const char* args) {
+    const char *p = args;
+    int count = 0;
+    while (*p == ' ') p++;
+    while (strncmp(p, "-E ", 3) == 0 || strncmp(p, "-b ", 3) == 0) {
+        if (p[1] == 'b') {
+            char *end;
+            p += 3;
+            if (strtoll(p, &end, 10) <= 0 || end == p) {
+                printf("Invalid budget. Use '-b <size>', e.g. -b 500M.\n");
+                return 0;
+            }
+            p = end + strcspn(end, " ");
+        } else {
+            p += 3;
+        }
+        while (*p == ' ') p++;
+    }
+    if (*p == '"') {
+        const char *close = strchr(p + 1, '"');
+        if (close == NULL || close == p + 1) {
+            printf("Unterminated or empty quoted pattern.\n");
+            return 0;
+        }
+        p = close + 1;
+    } else if (*p) {
+        p += strcspn(p, " ");
+    } else {
+        printf("Invalid w24grep command. Use 'w24grep [-E] [-b <budget>] <pattern> [ext1] [ext2] [ext3]'.\n");
+        return 0;
+    }
+    for (p += strspn(p, " "); *p; p += strspn(p, " ")) {
+        p += strcspn(p, " ");
+        count++;
+    }
+    if (count > 3) {
+        printf("Up to 3 extensions can be given to w24grep.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to verify the optional "-z <codec>" suffix of the archive commands.
+// On success the suffix is cut off so the remaining arguments can be checked.
+int verifyCodec(char* cmd) {
+    char *opt = strstr(cmd, " -z ");
+    if (opt == NULL) {
+        return 1; // No codec requested, the server adapts the level
+    }
+    const char *codec = opt + 4;
+    if (strcmp(codec, "none") == 0 || strcmp(codec, "fast") == 0 || strcmp(codec, "default") == 0 ||
+        strcmp(codec, "max") == 0 || strcmp(codec, "auto") == 0) {
+        *opt = '\0';
+        return 1;
+    }
+    printf("Invalid codec. Use '-z none', '-z fast', '-z default', '-z max' or '-z auto'.\n");
+    return 0;
+}
+
+// Function to verify the optional "-m [xxh64|sha256]" suffix of the archive commands,
+// which asks for the list of files instead of the archive. Cut off like verifyCodec.
+int verifyManifest(char* cmd, int codec_given) {
+    char *opt = NULL;
+    for (char *p = strstr(cmd, " -m"); p; p = strstr(p + 1, " -m"))
+        if (p[3] == '\0' || p[3] == ' ') opt = p;
+    if (opt == NULL) {
+        return 1;
+    }
+    const char *hash = opt[3] ? opt + 4 : opt + 3;
+    if (*hash != '\0' && strcmp(hash, "xxh64") != 0 && strcmp(hash, "sha256") != 0) {
+        printf("Invalid hash. Use '-m', '-m xxh64' or '-m sha256'.\n");
+        return 0;
+    }
+    if (codec_given) {
+        printf("A manifest (-m) is not compressed, leave out -z.\n");
+        return 0;
+    }
+    *opt = '\0';
+    return 1;
+}
+
+// Function to verify the w24get command: a path, then optionally an offset and a length
+int verifyW24get(const char* args) {
+    long long offset;
+    int ranged;
+    while (*args == ' ') args++;
+    size_t len = parseGetRange(args, &offset, &ranged);
+    if (len == 0 || ranged < 0) {
+        printf("Invalid w24get command. Use 'w24get <path> [offset len]': len bytes from offset, "
+               "where a len of 0 reads to the end of the file. A path ending in a number needs a range, e.g. '0 0'.\n");
+        return 0;
+    }
+    if (!validGetPath(args, len)) {
+        printf("Invalid w24get path. It is saved under w24project as given, so it cannot contain . or .. components.\n");
+        return 0;
+    }
+    return 1;
+}
+
 // Main command verification function
-int verifyCommand(const char* cmd) {
+int verifyCommand(const char* command) {
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "%s", command);
+    if (strncmp(cmd, "w24fz ", 6) == 0 || strncmp(cmd, "w24ft ", 6) == 0 ||
+        strncmp(cmd, "w24fdb ", 7) == 0 || strncmp(cmd, "w24fda ", 7) == 0 || strncmp(cmd, "w24find ", 8) == 0) {
+        int codec_given = strstr(cmd, " -z ") != NULL;
+        if (!verifyCodec(cmd) || !verifyManifest(cmd, codec_given)) return 0;
+    }
     if (strncmp(cmd, "dirlist ", 8) == 0) {
         return verifyDirlist(cmd);
     } else if (strncmp(cmd, "w24fn ", 6) == 0) {
@@ -298,6 +742,26 @@ int verifyCommand(const char* cmd) {
         return verifyW24fdb(cmd + 7);
     } else if (strncmp(cmd, "w24fda ", 7) == 0) {
         return verifyW24fda(cmd + 7);
+    } else if (strncmp(cmd, "w24find ", 8) == 0) {
+        return verifyW24find(cmd + 8);
+    } else if (strncmp(cmd, "w24watch ", 9) == 0) {
+        return verifyW24watch(cmd + 9); // Prints changes until interrupted
+    } else if (strcmp(cmd, "w24tree") == 0 || strncmp(cmd, "w24tree ", 8) == 0) {
+        return verifyTreeArgs("w24tree", cmd + 7);
+    } else if (strcmp(cmd, "w24du") == 0 || strncmp(cmd, "w24du ", 6) == 0) {
+        return verifyTreeArgs("w24du", cmd + 5);
+    } else if (strncmp(cmd, "w24grep ", 8) == 0) {
+        return verifyW24grep(cmd + 8); // Matching lines stream in as they are found
+    } else if (strncmp(cmd, "w24top ", 7) == 0) {
+        return verifyW24top(cmd + 7);
+    } else if (strcmp(cmd, "w24count") == 0 || strncmp(cmd, "w24count ", 9) == 0) {
+        return verifyW24count(cmd + 8);
+    } else if (strcmp(cmd, "w24sum") == 0 || strncmp(cmd, "w24sum ", 7) == 0) {
+        return verifyW24sum(cmd + 6);
+    } else if (strncmp(cmd, "w24get ", 7) == 0) {
+        return verifyW24get(cmd + 7); // Saved to w24project under the path asked for
+    } else if (strcmp(cmd, "stats") == 0) {
+        return 1; // Server cache statistics, no arguments
     } else if (strcmp(cmd, "quitc") == 0) {
         return 1; // Direct match for quitting
     }
@@ -352,8 +816,8 @@ int main(int argc, char *argv[]) {
         }
 
         if (verifyCommand(buffer)) {
-            sendCommand(sockfd, buffer);  // Send verified command
-            handleServerResponse(sockfd);  // Handle response
+            uint32_t id = sendCommand(sockfd, buffer);  // Send verified command
+            handleServerResponse(sockfd, buffer, id);  // Handle response
         } else {
             printf("Invalid command syntax.\n");
         }
@@ -4,614 +4,8524 @@ Subject: Advanced Systems Programming
 University of Windsor
 Project
 */
+#define _GNU_SOURCE  // strptime, accept4 and the epoll/pthread interfaces
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#include <endian.h>
 #ifndef DT_DIR
 #define DT_DIR 4
 #endif
 #include <time.h>
-#define _XOPEN_SOURCE 700
 #include <signal.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <regex.h>
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
-#define PORT 12345  // Port number for server
+#ifndef PORT
+#define PORT 12345  // Port number for server; the mirrors are this file built with -DPORT=12346 and 12347
+#endif
+#define MAX_EVENTS 256          // Events fetched per epoll_wait call
+#define DEFAULT_WORKERS 4       // Threads serving cheap commands (dirlist, w24fn)
+#define DEFAULT_ARCHIVE_WORKERS 2 // Threads serving the blocking archive commands
+#define QUEUE_CAPACITY 1024     // Pending jobs per pool; past it the event loop holds clients back
+#define IO_CHUNK 65536          // Bytes moved per read/write when streaming payloads
+
+// Wire protocol: every message in either direction is a 16-byte header followed by
+// length payload bytes. Multi-byte fields are big-endian.
+//   byte 0      magic (W24_MAGIC)
+//   byte 1      type (W24_TYPE_*)
+//   byte 2      status (W24_STATUS_*)
+//   byte 3      flags (W24_FLAG_*)
+//   bytes 4-7   request ID, echoed back in every frame of the response
+//   bytes 8-15  payload length
+#define W24_MAGIC 0x57
+#define W24_HEADER_SIZE 16
+#define W24_MAX_COMMAND 4095    // Largest command payload accepted from a client
+#define W24_TYPE_COMMAND 1      // Client -> server: command text
+#define W24_TYPE_TEXT 2         // Server -> client: text to print
+#define W24_TYPE_ARCHIVE 3      // Server -> client: tar.gz bytes to save
+#define W24_TYPE_TAR 4          // Server -> client: uncompressed tar bytes to save
+#define W24_TYPE_TREE 5         // Server -> client: encoded w24tree listing
+#define W24_TYPE_FILE 6         // Server -> client: bytes of one file, or a range of it (w24get)
+#define W24_STATUS_OK 0
+#define W24_STATUS_NOT_FOUND 1  // Nothing matched the request
+#define W24_STATUS_INVALID 2    // Malformed or unknown command
+#define W24_STATUS_ERROR 3      // Server-side failure
+#define W24_FLAG_MORE 0x01      // More frames follow for the same request
+
+// Function to handle error messages
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+int verbose = 0;            // -v: log every request, not only startup and trouble
+
+// Log a line about one request (its outcome, timings, cache use); only with -v
+void log_request(const char *format, ...) {
+    if (!verbose) return;
+    va_list ap;
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+}
+
+// Destination of a response: the client socket and the request being answered
+typedef struct {
+    int sock;
+    uint32_t request_id;
+    uint32_t *zc_next_id;   // Socket's running MSG_ZEROCOPY send counter, lives as long as the socket
+    struct ResultSpool *spool; // Archive payload is also copied here for the result cache, or NULL
+} Reply;
+
+// Write the whole buffer, retrying short writes; returns -1 if the socket fails
+int write_fully(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Serialise a frame header into its 16-byte wire form
+void encode_header(unsigned char *out, int type, int status, int flags, uint32_t request_id, uint64_t length) {
+    uint32_t id = htobe32(request_id);
+    uint64_t len = htobe64(length);
+    out[0] = W24_MAGIC;
+    out[1] = type;
+    out[2] = status;
+    out[3] = flags;
+    memcpy(out + 4, &id, 4);
+    memcpy(out + 8, &len, 8);
+}
+
+// Send a frame header announcing length payload bytes, which the caller writes next
+int send_frame_header(Reply *reply, int type, int status, int flags, uint64_t length) {
+    unsigned char header[W24_HEADER_SIZE];
+    encode_header(header, type, status, flags, reply->request_id, length);
+    return write_fully(reply->sock, header, sizeof(header));
+}
+
+// Send a complete frame, header and payload in one writev
+int send_frame(Reply *reply, int type, int status, int flags, const void *payload, size_t length) {
+    unsigned char header[W24_HEADER_SIZE];
+    encode_header(header, type, status, flags, reply->request_id, length);
+    struct iovec iov[2] = {{header, sizeof(header)}, {(void *)payload, length}};
+    size_t total = sizeof(header) + length;
+    ssize_t n = writev(reply->sock, iov, 2);
+    if (n < 0 && errno != EINTR) return -1;
+    if (n < 0) n = 0;
+    if ((size_t)n == total) return 0;
+    // Short write: finish whatever is left of the header, then the payload
+    if ((size_t)n < sizeof(header)) {
+        if (write_fully(reply->sock, header + n, sizeof(header) - n) < 0) return -1;
+        n = sizeof(header);
+    }
+    return write_fully(reply->sock, (const char *)payload + (n - sizeof(header)), total - n);
+}
+
+// Send a text message as a single TEXT frame
+int send_text(Reply *reply, int status, const char *msg) {
+    return send_frame(reply, W24_TYPE_TEXT, status, 0, msg, strlen(msg));
+}
+
+// Text sent while it is produced, in frames of up to TEXT_CHUNK bytes: every
+// frame but the last carries W24_FLAG_MORE. Other streamed payloads set type
+// after text_stream_init.
+#define TEXT_CHUNK 65536
+
+typedef struct {
+    Reply *reply;
+    int type;               // Frame type, W24_TYPE_TEXT unless changed
+    char *text;
+    size_t len;
+    int failed;             // The client went away
+} TextStream;
+
+int text_stream_init(TextStream *t, Reply *reply) {
+    t->reply = reply;
+    t->type = W24_TYPE_TEXT;
+    t->len = 0;
+    t->failed = 0;
+    t->text = malloc(TEXT_CHUNK);
+    return t->text ? 0 : -1;
+}
+
+// Returns -1 once the client is gone
+int text_stream_write(TextStream *t, const char *data, size_t length) {
+    while (!t->failed && length > 0) {
+        if (t->len == TEXT_CHUNK) {
+            if (send_frame(t->reply, t->type, W24_STATUS_OK, W24_FLAG_MORE, t->text, t->len) < 0)
+                t->failed = 1;
+            t->len = 0;
+        }
+        size_t n = length < TEXT_CHUNK - t->len ? length : TEXT_CHUNK - t->len;
+        memcpy(t->text + t->len, data, n);
+        t->len += n;
+        data += n;
+        length -= n;
+    }
+    return t->failed ? -1 : 0;
+}
+
+// Send what is buffered now, with more to come
+int text_stream_flush(TextStream *t) {
+    if (!t->failed && t->len > 0 &&
+        send_frame(t->reply, t->type, W24_STATUS_OK, W24_FLAG_MORE, t->text, t->len) < 0)
+        t->failed = 1;
+    t->len = 0;
+    return t->failed ? -1 : 0;
+}
+
+// Send what is left as the last frame
+int text_stream_end(TextStream *t, int status) {
+    int r = t->failed ? -1 : send_frame(t->reply, t->type, status, 0, t->text, t->len);
+    free(t->text);
+    t->text = NULL;
+    return r;
+}
+
+// Bounded FIFO of pointers shared between threads: the event loop and the
+// worker pools, and the stages of an archive pipeline
+typedef struct {
+    void **items;           // Ring buffer of queued jobs
+    int capacity;           // Maximum number of queued jobs
+    int head;               // Index of the oldest job
+    int count;              // Number of queued jobs
+    int closed;             // Set once no more jobs will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} WorkQueue;
+
+// Initialise a queue that holds at most capacity jobs
+int queue_init(WorkQueue *q, int capacity) {
+    q->items = calloc(capacity, sizeof(void *));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+// Append a job, waiting while the queue is full; returns -1 once the queue is closed
+int queue_push(WorkQueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Append a job if there is room now; returns -1 if the queue is full or closed
+int queue_try_push(WorkQueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    int pushed = q->count < q->capacity && !q->closed;
+    if (pushed) {
+        q->items[(q->head + q->count) % q->capacity] = item;
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return pushed ? 0 : -1;
+}
+
+// Remove the oldest job, waiting while the queue is empty; returns NULL once closed and drained
+void *queue_pop(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// Number of jobs currently queued
+int queue_length(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    int count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+// Wake every waiting thread and refuse further pushes
+void queue_close(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Release a queue once no thread uses it any more
+void queue_destroy(WorkQueue *q) {
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+// A directory of the listing, with its birth time (its change time where the
+// filesystem records no birth)
+typedef struct {
+    char *name;             // Directory name
+    ino_t ino;
+    struct timespec time;   // Creation time of the directory
+} DirEntry;
+
+// Function to compare directory names alphabetically
+int compare_by_name(const void *a, const void *b) {
+    return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+}
+
+// Function to compare directories by creation time, then name; takes pointers to entries
+int compare_by_time(const void *a, const void *b) {
+    const DirEntry *dirA = *(const DirEntry **)a, *dirB = *(const DirEntry **)b;
+    if (dirA->time.tv_sec != dirB->time.tv_sec) return dirA->time.tv_sec < dirB->time.tv_sec ? -1 : 1;
+    if (dirA->time.tv_nsec != dirB->time.tv_nsec) return dirA->time.tv_nsec < dirB->time.tv_nsec ? -1 : 1;
+    return strcmp(dirA->name, dirB->name);
+}
+
+// ---- Directory listings ----
+// dirlist keeps the last listing of HOME, sorted by name, and serves it as long
+// as HOME's mtime and ctime say no directory came or went: -a then streams
+// without sorting anything. Birth times never change, so a rebuild only statx's
+// the directories it has not seen before, and the -t order is sorted once per
+// listing. Pages are cut with a cursor naming the last entry sent, which stays
+// meaningful when directories are added or removed between pages.
+typedef struct {
+    int refs;               // The cache and each request streaming it
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;
+    int trusted;            // HOME had not changed for a second when it was read: safe to reuse
+    int times_stable;       // Every time is a birth time
+    DirEntry *entries;      // Sorted by name
+    size_t count;
+    char *names;
+    DirEntry **by_time;     // Built by the first -t
+    pthread_mutex_t lock;   // For by_time
+} DirListing;
+
+DirListing *dirlist_cache;
+pthread_mutex_t dirlist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dirlist_release(DirListing *l) {
+    if (!l || __atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(l->by_time);
+    free(l->entries);
+    free(l->names);
+    pthread_mutex_destroy(&l->lock);
+    free(l);
+}
+
+// Creation time of the entry name of directory dirfd; 1 if it is a birth time
+int dirlist_time(int dirfd, const char *name, struct timespec *t, int *is_dir) {
+    struct statx stx;
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_BTIME | STATX_CTIME, &stx) < 0)
+        return -1;
+    *is_dir = S_ISDIR(stx.stx_mode);
+    int birth = (stx.stx_mask & STATX_BTIME) != 0;
+    t->tv_sec = birth ? stx.stx_btime.tv_sec : stx.stx_ctime.tv_sec;
+    t->tv_nsec = birth ? stx.stx_btime.tv_nsec : stx.stx_ctime.tv_nsec;
+    return birth;
+}
+
+// List the subdirectories of dir_path, taking the times of known names from old
+DirListing *dirlist_build(const char *dir_path, const DirListing *old) {
+    DirListing *l = calloc(1, sizeof(DirListing));
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    struct stat st;
+    size_t *offsets = NULL, cap = 0, names_len = 0, names_cap = 0;
+    struct dirent *entry;
+    if (!l || !d || fstat(fd, &st) < 0) {
+        if (d) closedir(d);
+        else if (fd >= 0) close(fd);
+        free(l);
+        return NULL;
+    }
+    l->refs = 1;
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->ctime = st.st_ctim;
+    l->trusted = time(NULL) > st.st_mtim.tv_sec + 1 && time(NULL) > st.st_ctim.tv_sec + 1;
+    l->times_stable = 1;
+    pthread_mutex_init(&l->lock, NULL);
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            continue;
+        DirEntry key = {entry->d_name, entry->d_ino, {0, 0}}, *known = NULL;
+        struct timespec t;
+        int is_dir = 1;
+        if (old && old->times_stable && entry->d_type == DT_DIR)
+            known = bsearch(&key, old->entries, old->count, sizeof(DirEntry), compare_by_name);
+        if (known && known->ino == entry->d_ino) {
+            t = known->time;  // The same directory: born when it was
+        } else {
+            int birth = dirlist_time(fd, entry->d_name, &t, &is_dir);
+            if (birth < 0 || !is_dir) continue;
+            if (!birth) l->times_stable = 0;
+        }
+        size_t len = strlen(entry->d_name) + 1;
+        if (l->count == cap) {
+            size_t grown_cap = cap ? cap * 2 : 256;
+            DirEntry *grown = realloc(l->entries, grown_cap * sizeof(DirEntry));
+            size_t *grown_offsets = realloc(offsets, grown_cap * sizeof(size_t));
+            if (grown) l->entries = grown;
+            if (grown_offsets) offsets = grown_offsets;
+            if (!grown || !grown_offsets) break;
+            cap = grown_cap;
+        }
+        if (names_len + len > names_cap) {
+            size_t grown_cap = names_cap ? names_cap * 2 : 4096;
+            while (grown_cap < names_len + len) grown_cap *= 2;
+            char *grown = realloc(l->names, grown_cap);
+            if (!grown) break;
+            l->names = grown;
+            names_cap = grown_cap;
+        }
+        memcpy(l->names + names_len, entry->d_name, len);
+        offsets[l->count] = names_len;
+        l->entries[l->count].ino = entry->d_ino;
+        l->entries[l->count++].time = t;
+        names_len += len;
+    }
+    closedir(d);
+    // The pool has stopped moving: point the entries into it
+    for (size_t i = 0; i < l->count; i++)
+        l->entries[i].name = l->names + offsets[i];
+    free(offsets);
+    qsort(l->entries, l->count, sizeof(DirEntry), compare_by_name);
+    return l;
+}
+
+// The current listing of dir_path, from the cache when HOME has not changed
+DirListing *dirlist_get(const char *dir_path) {
+    struct stat st;
+    DirListing *l;
+    int current = stat(dir_path, &st) == 0;
+    pthread_mutex_lock(&dirlist_lock);
+    l = dirlist_cache;
+    if (l && current && l->trusted && l->dev == st.st_dev && l->ino == st.st_ino &&
+        l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        l->ctime.tv_sec == st.st_ctim.tv_sec && l->ctime.tv_nsec == st.st_ctim.tv_nsec) {
+        l->refs++;
+        pthread_mutex_unlock(&dirlist_lock);
+        return l;
+    }
+    if (l) l->refs++;  // Keep the old listing for its times while building
+    pthread_mutex_unlock(&dirlist_lock);
+
+    DirListing *fresh = dirlist_build(dir_path, l);
+    if (fresh) {
+        fresh->refs++;
+        pthread_mutex_lock(&dirlist_lock);
+        DirListing *replaced = dirlist_cache;
+        dirlist_cache = fresh;
+        pthread_mutex_unlock(&dirlist_lock);
+        dirlist_release(replaced);
+    }
+    dirlist_release(l);
+    return fresh;
+}
+
+// The listing in time order. Birth times are sorted once per listing; change
+// times can move at any moment, so without birth times every -t reads them anew.
+DirEntry **dirlist_by_time(DirListing *l, DirEntry **fresh, const char *dir_path) {
+    if (!l->times_stable) {
+        DirEntry **order = malloc((l->count + 1) * sizeof(DirEntry *));
+        DirEntry *copies = malloc((l->count + 1) * sizeof(DirEntry));
+        int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!order || !copies || fd < 0) {
+            free(order);
+            free(copies);
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        for (size_t i = 0; i < l->count; i++) {
+            int is_dir;
+            copies[i] = l->entries[i];
+            dirlist_time(fd, copies[i].name, &copies[i].time, &is_dir);
+            order[i] = &copies[i];
+        }
+        close(fd);
+        qsort(order, l->count, sizeof(DirEntry *), compare_by_time);
+        *fresh = copies;
+        return order;
+    }
+    pthread_mutex_lock(&l->lock);
+    if (!l->by_time && (l->by_time = malloc((l->count + 1) * sizeof(DirEntry *))) != NULL) {
+        for (size_t i = 0; i < l->count; i++) l->by_time[i] = &l->entries[i];
+        qsort(l->by_time, l->count, sizeof(DirEntry *), compare_by_time);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return l->by_time;
+}
+
+// Cursors name the last entry of a page: "a<hex name>" or "t<sec>.<nsec>.<hex name>"
+void dirlist_cursor(const DirEntry *e, int sort_by_time, char *cursor, size_t size) {
+    int n = sort_by_time ? snprintf(cursor, size, "t%lld.%ld.", (long long)e->time.tv_sec, (long)e->time.tv_nsec)
+                         : snprintf(cursor, size, "a");
+    for (const unsigned char *p = (const unsigned char *)e->name; *p && (size_t)n + 3 <= size; p++)
+        n += snprintf(cursor + n, size - n, "%02x", *p);
+}
+
+int dirlist_parse_cursor(const char *cursor, int sort_by_time, DirEntry *e, char *name, size_t size) {
+    const char *p = cursor + 1;
+    size_t n = 0;
+    e->time.tv_sec = e->time.tv_nsec = 0;
+    if (cursor[0] != (sort_by_time ? 't' : 'a')) return -1;
+    if (sort_by_time) {
+        long long sec;
+        long nsec;
+        int used;
+        if (sscanf(p, "%lld.%ld.%n", &sec, &nsec, &used) != 2) return -1;
+        e->time.tv_sec = sec;
+        e->time.tv_nsec = nsec;
+        p += used;
+    }
+    for (; p[0] && p[1] && n + 1 < size; p += 2) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]) || sscanf(p, "%2x", &byte) != 1)
+            return -1;
+        name[n++] = byte;
+    }
+    if (*p || n == 0) return -1;
+    name[n] = '\0';
+    e->name = name;
+    return 0;
+}
+
+// Stream the subdirectories of dir_path, by name or by creation time. limit > 0
+// cuts the listing into pages; cursor (or NULL) is where the previous page ended.
+void list_directories(Reply *reply, const char *dir_path, int sort_by_time, size_t limit, const char *cursor) {
+    char output[1024];
+    char name[NAME_MAX + 1];
+    DirEntry after, *fresh = NULL, **by_time = NULL;
+    TextStream out;
+    DirListing *l;
+
+    if (cursor && dirlist_parse_cursor(cursor, sort_by_time, &after, name, sizeof(name)) < 0) {
+        send_text(reply, W24_STATUS_INVALID, "Invalid cursor\n");
+        return;
+    }
+    if ((l = dirlist_get(dir_path)) == NULL) {
+        snprintf(output, sizeof(output), "Failed to open directory %s\n", dir_path);
+        send_text(reply, W24_STATUS_ERROR, output);
+        return;
+    }
+    if ((sort_by_time && (by_time = dirlist_by_time(l, &fresh, dir_path)) == NULL) || text_stream_init(&out, reply) < 0) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        if (fresh) free(by_time);
+        free(fresh);
+        dirlist_release(l);
+        return;
+    }
+
+    // First entry past the cursor
+    size_t lo = 0, hi = l->count;
+    while (cursor && lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const DirEntry *e = sort_by_time ? by_time[mid] : &l->entries[mid];
+        const DirEntry *key = &after;
+        if ((sort_by_time ? compare_by_time(&e, &key) : compare_by_name(e, &after)) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t end = limit > 0 && l->count - lo > limit ? lo + limit : l->count;
+    for (size_t i = lo; i < end && !out.failed; i++) {
+        const char *entry_name = sort_by_time ? by_time[i]->name : l->entries[i].name;
+        text_stream_write(&out, entry_name, strlen(entry_name));
+        text_stream_write(&out, "\n", 1);
+    }
+    if (end < l->count) {
+        char next[2 * NAME_MAX + 64];
+        dirlist_cursor(sort_by_time ? by_time[end - 1] : &l->entries[end - 1], sort_by_time, next, sizeof(next));
+        snprintf(output, sizeof(output), "Next page: dirlist %s -n %zu -c ", sort_by_time ? "-t" : "-a", limit);
+        text_stream_write(&out, output, strlen(output));
+        text_stream_write(&out, next, strlen(next));
+        text_stream_write(&out, "\n", 1);
+    }
+    text_stream_end(&out, W24_STATUS_OK);
+    if (fresh) free(by_time);
+    free(fresh);
+    dirlist_release(l);
+}
+
+// ---- Parallel walks ----
+// Directory walks are spread over a pool of walker threads. Each thread keeps a
+// deque of directories to read; it works depth-first from its own end and,
+// when that is empty, steals from the other end of someone else's. A directory
+// is opened with openat() relative to its parent's fd and read with large
+// getdents64() calls; entries are stat'ed with fstatat() only if the walk needs
+// their metadata, or d_type cannot tell whether they are directories.
+//
+// The thread that asked for the walk replays the results in exactly the order
+// a recursive readdir() walk would produce, so callers see no difference. When
+// it needs a directory nobody has started yet, it reads that one itself: with
+// no walker threads (-p 0) it simply walks alone.
+#define WALK_BUFFER (256 * 1024)        // getdents64 buffer per thread
+#define WALK_MAX_BUFFERED (256 * 1024)  // Entries read ahead of the callers before walkers pause
+#define WALK_MAX_DEPTH 256
+#define WALK_MAX_FDS 256                // Past this many open directories, children are opened by path
+#define WALK_FOLLOW_DEPTH 64            // Following symlinks, no deeper than this
+#define WALK_FOLLOW 0x01        // stat() semantics: links to directories are walked into
+#define WALK_STAT 0x02          // Callers need the metadata of every entry
+#define WALK_DEPTH(n) ((n) << 8) // Directories n levels below the root are listed, not entered
+
+#define WALK_ENTER 1            // Callback events: a directory (before its entries),
+#define WALK_FILE 2             // anything that is not a directory (or is past WALK_DEPTH),
+#define WALK_LEAVE 3            // the end of a directory
+
+int follow_links = 1;       // -P: walks do not follow links to directories
+
+// Callback for the caller's thread. path is the full path, name its last
+// component; st is the entry's metadata (for a directory, fstat of the open
+// directory; without WALK_STAT, only st_mode is set for the others). wd is the
+// watch of a directory, -1 if none. A nonzero return ends the walk.
+typedef int (*walk_callback)(int event, const char *path, const char *name, const struct stat *st,
+                             int hidden, int wd, void *arg);
+// Optional early filter on non-directory names: 0 skips the entry (and its stat)
+typedef int (*walk_filter)(const char *name, void *arg);
+// Optional hook run by the reading thread just before a directory is listed
+// (to add a watch); its return is handed to the callback as wd
+typedef int (*walk_dir_hook)(const char *path, void *arg);
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+typedef struct Walk {
+    int flags;
+    walk_filter filter;
+    walk_dir_hook before_read;
+    void *hook_arg;         // For filter and before_read
+    int cancelled;          // The caller stopped: read nothing more
+    char path[PATH_MAX];    // The replay's path of the current file
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // A directory of this walk was read
+} Walk;
+
+typedef struct WalkDir WalkDir;
+
+typedef struct {
+    uint32_t name;          // Offset into the directory's name pool
+    struct stat st;
+    WalkDir *child;         // Set for directories
+} WalkEntry;
+
+#define WALK_QUEUED 0
+#define WALK_CLAIMED 1
+#define WALK_DONE 2
+
+struct WalkDir {
+    Walk *walk;
+    WalkDir *parent;        // Its fd is what this directory is opened relative to
+    char *path;
+    const char *name;       // Last component of path
+    int depth, hidden;
+    int state;              // WALK_QUEUED, WALK_CLAIMED, WALK_DONE
+    int refs;               // A deque slot and the caller's replay
+    int fd_users;           // This directory's read plus its children not yet opened
+    int fd, wd, opened;
+    struct stat st;         // Of the directory itself
+    WalkEntry *entries;
+    uint32_t count, cap;
+    char *names;
+    size_t names_len, names_cap;
+};
+
+// Directories waiting to be read. The owner pushes and pops at the tail,
+// thieves take from the head.
+typedef struct {
+    pthread_mutex_t lock;
+    WalkDir **items;
+    size_t head, tail, cap;
+} WalkDeque;
+
+int walk_threads = -1;      // -p; -1 picks from the CPU count
+WalkDeque *walk_deques;     // One per walker thread, plus one for the callers' threads
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walk_work = PTHREAD_COND_INITIALIZER;    // Directories were queued
+pthread_cond_t walk_drained = PTHREAD_COND_INITIALIZER; // Callers caught up
+int walk_queued;            // Directories in the deques
+long walk_buffered;         // Entries read but not yet replayed
+int walk_open_fds;          // Directory fds kept open for openat() of their children
+
+void walk_dir_release(WalkDir *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(d->entries);
+    free(d->names);
+    free(d->path);
+    free(d);
+}
+
+void walk_fd_release(WalkDir *d) {
+    if (__atomic_sub_fetch(&d->fd_users, 1, __ATOMIC_ACQ_REL) == 0 && d->fd >= 0) {
+        close(d->fd);
+        d->fd = -1;
+        __atomic_sub_fetch(&walk_open_fds, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void walk_push(int deque, WalkDir *d) {
+    if (walk_threads <= 0 || !walk_deques) {
+        walk_dir_release(d);  // No walkers: the replay reads everything itself
+        return;
+    }
+    WalkDeque *q = &walk_deques[deque];
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 256;
+        WalkDir **items = malloc(cap * sizeof(WalkDir *));
+        if (items) {
+            for (size_t i = q->head; i < q->tail; i++)
+                items[i - q->head] = q->items[i % q->cap];
+            free(q->items);
+            q->items = items;
+            q->tail -= q->head;
+            q->head = 0;
+            q->cap = cap;
+        }
+    }
+    int pushed = q->tail - q->head < q->cap;
+    if (pushed) q->items[q->tail++ % q->cap] = d;
+    pthread_mutex_unlock(&q->lock);
+    if (!pushed) {
+        walk_dir_release(d);  // The caller's replay reads it when it gets there
+        return;
+    }
+    pthread_mutex_lock(&walk_lock);
+    walk_queued++;
+    pthread_cond_signal(&walk_work);
+    pthread_mutex_unlock(&walk_lock);
+}
+
+WalkDir *walk_take(int deque, int steal) {
+    WalkDeque *q = &walk_deques[deque];
+    WalkDir *d = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        d = steal ? q->items[q->head++ % q->cap] : q->items[--q->tail % q->cap];
+    pthread_mutex_unlock(&q->lock);
+    if (d) {
+        pthread_mutex_lock(&walk_lock);
+        walk_queued--;
+        pthread_mutex_unlock(&walk_lock);
+    }
+    return d;
+}
+
+int walk_add_entry(WalkDir *d, const char *name, const struct stat *st) {
+    size_t l = strlen(name) + 1;
+    if (d->count == d->cap) {
+        uint32_t cap = d->cap ? d->cap * 2 : 64;
+        WalkEntry *grown = realloc(d->entries, cap * sizeof(WalkEntry));
+        if (!grown) return -1;
+        d->entries = grown;
+        d->cap = cap;
+    }
+    if (d->names_len + l > d->names_cap) {
+        size_t cap = d->names_cap ? d->names_cap * 2 : 1024;
+        while (cap < d->names_len + l) cap *= 2;
+        char *grown = realloc(d->names, cap);
+        if (!grown) return -1;
+        d->names = grown;
+        d->names_cap = cap;
+    }
+    memcpy(d->names + d->names_len, name, l);
+    d->entries[d->count].name = d->names_len;
+    d->entries[d->count].st = *st;
+    d->entries[d->count].child = NULL;
+    d->names_len += l;
+    return d->count++;
+}
+
+WalkDir *walk_dir_new(Walk *w, WalkDir *parent, const char *path, int hidden) {
+    WalkDir *d = calloc(1, sizeof(WalkDir));
+    if (!d || (d->path = strdup(path)) == NULL) {
+        free(d);
+        return NULL;
+    }
+    const char *slash = strrchr(d->path, '/');
+    d->name = slash && slash[1] ? slash + 1 : d->path;
+    d->walk = w;
+    d->parent = parent;
+    d->depth = parent ? parent->depth + 1 : 0;
+    d->hidden = hidden;
+    d->fd = d->wd = -1;
+    d->refs = 2;
+    d->fd_users = 1;
+    return d;
+}
+
+// Read one directory: open it, list it, stat what needs it and queue its
+// subdirectories on `deque`. Called by whoever claimed it.
+void walk_read_dir(WalkDir *d, char *buf, int deque) {
+    Walk *w = d->walk;
+    int nofollow = w->flags & WALK_FOLLOW ? 0 : AT_SYMLINK_NOFOLLOW;
+    int max_depth = w->flags & WALK_FOLLOW ? WALK_FOLLOW_DEPTH : WALK_MAX_DEPTH;
+    int listed_depth = w->flags >> 8;  // WALK_DEPTH, 0 if none
+
+    int open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (nofollow && d->parent ? O_NOFOLLOW : 0);
+    int parent_fd = d->parent ? d->parent->fd : -1;
+    d->fd = parent_fd >= 0 ? openat(parent_fd, d->name, open_flags) : open(d->path, open_flags);
+    if (d->parent) walk_fd_release(d->parent);
+    if (d->fd >= 0) __atomic_add_fetch(&walk_open_fds, 1, __ATOMIC_RELAXED);
+    if (d->fd < 0 || __atomic_load_n(&w->cancelled, __ATOMIC_RELAXED)) {
+        walk_fd_release(d);
+        return;
+    }
+    if (w->before_read)
+        d->wd = w->before_read(d->path, w->hook_arg);
+    struct stat st;
+    if (fstat(d->fd, &st) == 0) {
+        d->st = st;
+        d->opened = 1;
+    }
+
+    char path[PATH_MAX];
+    size_t path_len = strlen(d->path);
+    memcpy(path, d->path, path_len);
+    path[path_len++] = '/';
+    long n;
+    while ((n = syscall(SYS_getdents64, d->fd, buf, WALK_BUFFER)) > 0) {
+        for (long off = 0; off < n;) {
+            LinuxDirent64 *e = (LinuxDirent64 *)(buf + off);
+            off += e->d_reclen;
+            const char *name = e->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            int type = e->d_type;
+            int need_stat = (w->flags & WALK_STAT) || type == DT_UNKNOWN || type == DT_LNK;
+            if (w->filter && type != DT_DIR && type != DT_UNKNOWN && type != DT_LNK && !w->filter(name, w->hook_arg))
+                continue;
+            memset(&st, 0, sizeof(st));
+            if (need_stat) {
+                if (fstatat(d->fd, name, &st, nofollow) < 0)
+                    continue;
+                if (nofollow && S_ISLNK(st.st_mode)) {
+                    // Links to files are described by their target, links to directories stay links
+                    struct stat target;
+                    if (fstatat(d->fd, name, &target, 0) == 0 && !S_ISDIR(target.st_mode)) st = target;
+                }
+            } else {
+                st.st_mode = type == DT_DIR ? S_IFDIR : type == DT_REG ? S_IFREG : type == DT_FIFO ? S_IFIFO :
+                             type == DT_SOCK ? S_IFSOCK : type == DT_CHR ? S_IFCHR : S_IFBLK;
+            }
+            int is_dir = S_ISDIR(st.st_mode);
+            if (!is_dir && w->filter && !w->filter(name, w->hook_arg))
+                continue;
+            if (is_dir && !nofollow && type != DT_DIR) {
+                // A link to this directory or one above it would loop: skip it
+                const WalkDir *a = d;
+                while (a && (a->st.st_dev != st.st_dev || a->st.st_ino != st.st_ino)) a = a->parent;
+                if (a) continue;
+            }
+            size_t name_len = strlen(name);
+            if (is_dir && listed_depth && d->depth + 1 >= listed_depth) {
+                walk_add_entry(d, name, &st);
+                continue;
+            }
+            if (is_dir && (d->depth >= max_depth || path_len + name_len >= sizeof(path)))
+                continue;
+            int i = walk_add_entry(d, name, &st);
+            if (i < 0 || !is_dir) continue;
+            memcpy(path + path_len, name, name_len + 1);
+            WalkDir *child = walk_dir_new(w, d, path, d->hidden || name[0] == '.');
+            if (!child) {
+                d->count--;
+                continue;
+            }
+            child->st = st;  // Until its own fstat
+            d->entries[i].child = child;
+            __atomic_add_fetch(&d->fd_users, 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    if (__atomic_load_n(&walk_open_fds, __ATOMIC_RELAXED) > WALK_MAX_FDS) {
+        // Too many held open: give this one up now, its children use their paths
+        close(d->fd);
+        d->fd = -1;
+        __atomic_sub_fetch(&walk_open_fds, 1, __ATOMIC_RELAXED);
+    }
+    // Queue the subdirectories last first, so that this thread's depth-first
+    // pops and the replay agree on what comes next
+    for (uint32_t i = d->count; i-- > 0;)
+        if (d->entries[i].child) walk_push(deque, d->entries[i].child);
+    __atomic_add_fetch(&walk_buffered, d->count, __ATOMIC_RELAXED);
+    walk_fd_release(d);
+}
+
+// Mark a claimed directory read and wake the caller waiting for it
+void walk_finish_dir(WalkDir *d) {
+    Walk *w = d->walk;
+    pthread_mutex_lock(&w->lock);
+    __atomic_store_n(&d->state, WALK_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&w->done);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void *walker_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
+    char *buf = malloc(WALK_BUFFER);
+    if (!buf) return NULL;
+    while (1) {
+        pthread_mutex_lock(&walk_lock);
+        while (walk_queued == 0 || __atomic_load_n(&walk_buffered, __ATOMIC_RELAXED) > WALK_MAX_BUFFERED) {
+            if (walk_queued == 0) pthread_cond_wait(&walk_work, &walk_lock);
+            else pthread_cond_wait(&walk_drained, &walk_lock);
+        }
+        pthread_mutex_unlock(&walk_lock);
+        WalkDir *d = walk_take(self, 0);
+        for (int i = 1; !d && i <= walk_threads; i++)
+            d = walk_take((self + i) % (walk_threads + 1), 1);
+        if (!d) continue;
+        int queued = WALK_QUEUED;
+        if (__atomic_compare_exchange_n(&d->state, &queued, WALK_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            walk_read_dir(d, buf, self);
+            walk_finish_dir(d);
+        }
+        walk_dir_release(d);
+    }
+    return NULL;
+}
+
+void walk_pool_start() {
+    if (walk_threads < 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        walk_threads = cpus * 2 < 4 ? 4 : cpus * 2 > 32 ? 32 : cpus * 2;
+    }
+    walk_deques = calloc(walk_threads + 1, sizeof(WalkDeque));
+    if (!walk_deques) error("ERROR allocating walker deques");
+    for (int i = 0; i <= walk_threads; i++)
+        pthread_mutex_init(&walk_deques[i].lock, NULL);
+    for (int i = 0; i < walk_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, walker_thread, (void *)(intptr_t)i) != 0)
+            error("ERROR creating walker thread");
+        pthread_detach(tid);
+    }
+}
+
+// Wait until d has been read, reading it here if no walker has started it
+void walk_wait_dir(WalkDir *d, char *buf) {
+    int queued = WALK_QUEUED;
+    if (__atomic_compare_exchange_n(&d->state, &queued, WALK_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        walk_read_dir(d, buf, walk_threads);
+        __atomic_store_n(&d->state, WALK_DONE, __ATOMIC_RELEASE);
+        return;
+    }
+    Walk *w = d->walk;
+    pthread_mutex_lock(&w->lock);
+    while (__atomic_load_n(&d->state, __ATOMIC_ACQUIRE) != WALK_DONE)
+        pthread_cond_wait(&w->done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Replay one directory and everything below it to the callback, in readdir
+// order. Once the callback has stopped the walk, only wait for and free what is left.
+int walk_replay(WalkDir *d, char *buf, walk_callback cb, void *arg, int stop) {
+    char *path = d->walk->path;
+    walk_wait_dir(d, buf);
+    // A subdirectory that could not be opened is still reported, as empty
+    int known = d->opened || d->parent;
+    if (!stop && known)
+        stop = cb(WALK_ENTER, d->path, d->name, &d->st, d->hidden, d->wd, arg);
+    if (stop) __atomic_store_n(&d->walk->cancelled, 1, __ATOMIC_RELAXED);
+    size_t path_len = strlen(d->path);
+    memcpy(path, d->path, path_len);
+    path[path_len++] = '/';
+    for (uint32_t i = 0; i < d->count; i++) {
+        WalkEntry *e = &d->entries[i];
+        if (e->child) {
+            stop = walk_replay(e->child, buf, cb, arg, stop);
+        } else if (!stop) {
+            const char *name = d->names + e->name;
+            size_t l = strlen(name);
+            if (path_len + l >= PATH_MAX) continue;
+            memcpy(path + path_len, name, l + 1);
+            stop = cb(WALK_FILE, path, name, &e->st, d->hidden || name[0] == '.', -1, arg);
+            if (stop) __atomic_store_n(&d->walk->cancelled, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (!stop && known)
+        stop = cb(WALK_LEAVE, d->path, d->name, &d->st, d->hidden, d->wd, arg);
+    if (__atomic_sub_fetch(&walk_buffered, d->count, __ATOMIC_RELAXED) < WALK_MAX_BUFFERED / 2) {
+        pthread_mutex_lock(&walk_lock);
+        pthread_cond_broadcast(&walk_drained);
+        pthread_mutex_unlock(&walk_lock);
+    }
+    walk_dir_release(d);
+    return stop;
+}
+
+// Walk the tree below root. Returns the callback's nonzero return if it stopped
+// the walk, 0 otherwise.
+int walk_tree(const char *root, int hidden, int flags, walk_filter filter, walk_dir_hook before_read,
+              void *hook_arg, walk_callback cb, void *arg) {
+    Walk *w = malloc(sizeof(Walk));
+    char *buf = malloc(WALK_BUFFER);
+    WalkDir *d = NULL;
+    if (w && buf) {
+        w->flags = flags;
+        w->filter = filter;
+        w->before_read = before_read;
+        w->hook_arg = hook_arg;
+        w->cancelled = 0;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->done, NULL);
+        d = walk_dir_new(w, NULL, root, hidden);
+    }
+    if (!d) {
+        free(w);
+        free(buf);
+        return 0;
+    }
+    d->refs = 1;  // Only the replay: the root is read by this thread
+    int stop = walk_replay(d, buf, cb, arg, 0);
+    free(buf);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->done);
+    free(w);
+    return stop;
+}
+
+
+typedef struct {
+    const char *name;
+    char *result_path;
+    int found;
+} FindFile;
+
+int find_file_filter(const char *name, void *arg) {
+    return strcmp(name, ((FindFile *)arg)->name) == 0;
+}
+
+int find_file_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                    void *arg) {
+    FindFile *f = arg;
+    (void)name, (void)st, (void)hidden, (void)wd;
+    if (event != WALK_FILE || strlen(path) >= 1024) return 0;
+    if (!f->found || strcmp(path, f->result_path) < 0)
+        strcpy(f->result_path, path);  // The first in path order so far
+    f->found = 1;
+    return 0;
+}
+
+// Search for a file in the directory and its subdirectories: of all the
+// matches, the first in path order (byte order of the full path), which is what
+// the index answers too. Links to directories are followed unless -P.
+int find_file(const char *basepath, const char *search_filename, char *result_path) {
+    FindFile f = {search_filename, result_path, 0};
+    walk_tree(basepath, 0, follow_links ? WALK_FOLLOW : 0, find_file_filter, NULL, &f, find_file_visit, &f);
+    return f.found;
+}
+
+// ---- Live metadata index ----
+// A background thread crawls HOME once at startup into a table of nodes (name,
+// parent, type, size, mtime, ctime) and keeps it current with inotify watches
+// on every directory. Once the crawl is done, w24fn and the archive commands are
+// answered from the table instead of walking the disk. If a watch cannot be
+// added (the max_user_watches limit) the index is marked stale and the commands
+// walk the tree as before. When the event queue overflows, every directory whose
+// mtime moved is listed again. The table is saved to a snapshot file now and
+// then, so that a restart only lists the directories that changed meanwhile.
+#define INDEX_NONE UINT32_MAX
+#define NODE_FREE 0
+#define NODE_DIR 1
+#define NODE_FILE 2         // Regular file, or a symlink to one (described by its target, like stat())
+#define NODE_OTHER 3        // Devices, sockets, dangling links
+#define NODE_LINK 4         // Link to a directory: not descended into, counted in dir_links
+#define KIND_FILE 0x01     // Regular file (or link to one)
+#define KIND_HIDDEN 0x02
+#define EXT_NONE 0          // No dot in the name
+#define EXT_OVERFLOW 0xffff // Table full: compare the names instead
+#define EXT_TABLE 131072    // Slots for at most 65534 extensions
+#define NAME_SORTED 0x01   // Listed in the sorted name array (at its name of that time)
+#define NAME_RECENT 0x02   // Listed in the added-since-sorting array
+#define CHANGE_LOG 65536    // File changes kept for w24watch subscribers to catch up on
+#define INDEX_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct {
+    uint32_t parent;        // Directory node, INDEX_NONE for the root
+    uint32_t first_child, next_sibling, prev_sibling;
+    uint32_t hash_next;     // Chain in the (parent, name) hash
+    uint32_t name_next;     // Chain in the basename hash
+    uint32_t name;          // Offset of the NUL-terminated name in the name pool
+    uint8_t type;           // NODE_*
+    uint8_t hidden;         // Name or a directory above starts with a dot
+    uint8_t seen;           // Mark for a directory rescan
+    uint8_t name_flags;     // NAME_SORTED, NAME_RECENT
+    uint32_t mode;
+    int wd;                 // Watch descriptor of a directory, -1 if none
+    uint64_t ino;
+    uint32_t mtime_nsec;    // Seconds and size live in the columns of FileIndex
+    int64_t ctime;
+    int64_t listed;         // Directory mtime when it was last listed, for overflow rescans
+    uint32_t listed_nsec;
+} IndexNode;
+
+// One change to a regular file, as w24watch needs it: the state before and
+// after, either of which may be "not a file" (created, removed, or replaced)
+typedef struct {
+    char *path;
+    uint8_t before, after;  // Was a file / is a file
+    uint8_t hidden;
+    int64_t size[2], mtime[2];
+} IndexChange;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    IndexNode *nodes;
+    uint32_t num_nodes, cap_nodes;   // cap_nodes stays a multiple of 64 for the column scans
+    // Columns scanned by queries, one entry per node. kinds is 0 for anything but
+    // a regular file, so free nodes and the padding up to cap_nodes never match.
+    int64_t *sizes;
+    int64_t *mtimes;
+    uint16_t *exts;         // Extension ID, EXT_NONE without a dot
+    uint8_t *kinds;         // KIND_* bits
+    char **ext_names;       // Extension of each ID
+    uint16_t *ext_table;    // Open-addressed extension -> ID, 0 for an empty slot
+    uint32_t num_exts;
+    uint32_t free_list;     // Free nodes, linked through next_sibling
+    uint32_t live;          // Nodes in use
+    char *names;            // Name pool
+    size_t names_len, names_cap, names_garbage;
+    uint32_t *buckets;      // (parent, name) hash heads
+    uint32_t *name_buckets; // Basename hash heads, as many as buckets
+    uint32_t num_buckets;
+    // Non-directories sorted by name, for prefix and glob lookups. Nodes added
+    // since the sort go to recent instead; the indexer sorts again once that
+    // grows. sorted_ok is cleared if recent cannot grow: lookups then scan.
+    uint32_t *sorted, *recent;
+    uint32_t num_sorted, num_recent, cap_recent;
+    int sorted_ok;
+    uint32_t *wd_nodes;     // Directory node of each watch descriptor
+    int num_wds;
+    int inotify_fd;
+    int ready;              // Initial crawl done: commands may use the index
+    int stale;              // A directory could not be watched: commands must walk
+    uint32_t dir_links;     // NODE_LINK nodes; the walks that follow links cannot use the index then
+    uint64_t generation;    // Bumped on every change, a cheap token for the result cache
+    uint64_t rescans;       // Overflow recoveries
+    uint64_t saved;         // Generation in the snapshot file, UINT64_MAX if there is none
+    time_t saved_at;
+    uint32_t verify_next;   // Next node to re-stat after loading a snapshot, INDEX_NONE when done
+    // Ring of the last CHANGE_LOG file changes; change number seq is at seq % CHANGE_LOG
+    IndexChange *changes;
+    uint64_t change_seq;    // Changes logged so far
+    uint64_t instance;      // Random, so resume tokens from another run are told apart
+    char root[PATH_MAX];
+} FileIndex;
+
+FileIndex file_index = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0,
+                        INDEX_NONE, 0, NULL, 0, 0, 0, NULL, NULL, 0, NULL, NULL, 0, 0, 0, 0,
+                        NULL, 0, -1, 0, 0, 0, 0, 0, UINT64_MAX, 0, INDEX_NONE, NULL, 0, 0, ""};
+
+// Signalled by the indexer when it has logged changes and dropped the write lock
+pthread_mutex_t change_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t change_published;  // x->change_seq as of the last signal
+int watch_wake_fd = -1;     // eventfd of the watch thread, once it runs
+
+// Wake the watch thread: changes were published or a watch joined
+void watch_wake() {
+    int fd = __atomic_load_n(&watch_wake_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) eventfd_write(fd, 1);
+}
+int use_index = 1;          // -i turns the index off
+char index_snapshot[PATH_MAX];  // -S; empty to never save or load one
+
+const char *index_name(const FileIndex *x, uint32_t n) {
+    return x->names + x->nodes[n].name;
+}
+
+uint32_t index_hash(uint32_t parent, const char *name, uint32_t buckets) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ parent;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(h ^ h >> 32) & (buckets - 1);
+}
+
+uint32_t index_lookup(const FileIndex *x, uint32_t parent, const char *name) {
+    if (!x->buckets) return INDEX_NONE;
+    uint32_t n = x->buckets[index_hash(parent, name, x->num_buckets)];
+    while (n != INDEX_NONE && (x->nodes[n].parent != parent || strcmp(index_name(x, n), name) != 0))
+        n = x->nodes[n].hash_next;
+    return n;
+}
+
+// Double the hash table once it is as full as it is long
+int index_grow_hash(FileIndex *x) {
+    uint32_t buckets = x->num_buckets ? x->num_buckets * 2 : 65536;
+    uint32_t *heads = malloc(buckets * sizeof(uint32_t));
+    uint32_t *name_heads = malloc(buckets * sizeof(uint32_t));
+    if (!heads || !name_heads) {
+        free(heads);
+        free(name_heads);
+        return -1;
+    }
+    memset(heads, 0xff, buckets * sizeof(uint32_t));
+    memset(name_heads, 0xff, buckets * sizeof(uint32_t));
+    for (uint32_t n = 0; n < x->num_nodes; n++) {
+        if (x->nodes[n].type == NODE_FREE || x->nodes[n].parent == INDEX_NONE) continue;
+        uint32_t b = index_hash(x->nodes[n].parent, index_name(x, n), buckets);
+        x->nodes[n].hash_next = heads[b];
+        heads[b] = n;
+        b = index_hash(INDEX_NONE, index_name(x, n), buckets);
+        x->nodes[n].name_next = name_heads[b];
+        name_heads[b] = n;
+    }
+    free(x->buckets);
+    free(x->name_buckets);
+    x->buckets = heads;
+    x->name_buckets = name_heads;
+    x->num_buckets = buckets;
+    return 0;
+}
+
+// Copy the names still in use into a fresh pool once most of the old one is garbage
+void index_compact_names(FileIndex *x) {
+    char *pool = malloc(x->names_len - x->names_garbage + 1);
+    if (!pool) return;
+    size_t len = 0;
+    for (uint32_t n = 0; n < x->num_nodes; n++) {
+        if (x->nodes[n].type == NODE_FREE) continue;
+        size_t l = strlen(index_name(x, n)) + 1;
+        memcpy(pool + len, index_name(x, n), l);
+        x->nodes[n].name = len;
+        len += l;
+    }
+    free(x->names);
+    x->names = pool;
+    x->names_len = x->names_cap = len;
+    x->names_garbage = 0;
+}
+
+// Make room for cap nodes in the table and the columns
+int index_grow_nodes(FileIndex *x, uint32_t cap) {
+    IndexNode *nodes = realloc(x->nodes, (size_t)cap * sizeof(IndexNode));
+    if (nodes) x->nodes = nodes;
+    int64_t *sizes = realloc(x->sizes, (size_t)cap * sizeof(int64_t));
+    if (sizes) x->sizes = sizes;
+    int64_t *mtimes = realloc(x->mtimes, (size_t)cap * sizeof(int64_t));
+    if (mtimes) x->mtimes = mtimes;
+    uint16_t *exts = realloc(x->exts, (size_t)cap * sizeof(uint16_t));
+    if (exts) x->exts = exts;
+    uint8_t *kinds = realloc(x->kinds, cap);
+    if (kinds) x->kinds = kinds;
+    if (!nodes || !sizes || !mtimes || !exts || !kinds)
+        return -1;
+    memset(x->kinds + x->cap_nodes, 0, cap - x->cap_nodes);
+    x->cap_nodes = cap;
+    return 0;
+}
+
+// ID of the extension of name, as query_matches sees it; adds new extensions
+// to the table if add is set, otherwise returns -1 for one never seen
+int index_ext_id(FileIndex *x, const char *name, int add) {
+    const char *ext = strrchr(name, '.');
+    if (!ext) return EXT_NONE;
+    ext++;
+    if (!x->ext_table) {
+        if (!add || (x->ext_table = calloc(EXT_TABLE, sizeof(uint16_t))) == NULL ||
+            (x->ext_names = calloc(EXT_OVERFLOW, sizeof(char *))) == NULL)
+            return add ? EXT_OVERFLOW : -1;
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)ext; *p; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    for (uint32_t slot = h & (EXT_TABLE - 1);; slot = (slot + 1) & (EXT_TABLE - 1)) {
+        uint16_t id = x->ext_table[slot];
+        if (id == 0) {
+            if (!add) return -1;
+            if (x->num_exts + 1 >= EXT_OVERFLOW || (x->ext_names[x->num_exts + 1] = strdup(ext)) == NULL)
+                return EXT_OVERFLOW;
+            x->ext_table[slot] = ++x->num_exts;
+            return x->num_exts;
+        }
+        if (strcmp(x->ext_names[id], ext) == 0)
+            return id;
+    }
+}
+
+// Add a node under parent (which must not already have this name)
+uint32_t index_add(FileIndex *x, uint32_t parent, const char *name) {
+    size_t l = strlen(name) + 1;
+    if (x->names_len + l > x->names_cap) {
+        size_t cap = x->names_cap ? x->names_cap * 2 : 1 << 20;
+        while (cap < x->names_len + l) cap *= 2;
+        char *grown = realloc(x->names, cap);
+        if (!grown) return INDEX_NONE;
+        x->names = grown;
+        x->names_cap = cap;
+    }
+    uint32_t n = x->free_list;
+    if (n != INDEX_NONE) {
+        x->free_list = x->nodes[n].next_sibling;
+    } else {
+        if (x->num_nodes == x->cap_nodes && index_grow_nodes(x, x->cap_nodes ? x->cap_nodes * 2 : 65536) < 0)
+            return INDEX_NONE;
+        n = x->num_nodes++;
+    }
+    IndexNode *node = &x->nodes[n];
+    uint8_t recent = node->name_flags & NAME_RECENT;  // A reused node may be listed already
+    memset(node, 0, sizeof(*node));
+    if (recent || x->num_recent < x->cap_recent) {
+        if (!recent) x->recent[x->num_recent++] = n;
+        node->name_flags = NAME_RECENT;
+    } else {
+        x->sorted_ok = 0;
+    }
+    memcpy(x->names + x->names_len, name, l);
+    node->name = x->names_len;
+    x->names_len += l;
+    node->parent = parent;
+    node->first_child = node->prev_sibling = node->next_sibling = node->hash_next = INDEX_NONE;
+    node->wd = -1;
+    node->type = NODE_OTHER;
+    x->sizes[n] = x->mtimes[n] = 0;
+    x->exts[n] = index_ext_id(x, name, 1);
+    x->kinds[n] = 0;
+    x->live++;
+    if (parent != INDEX_NONE) {
+        IndexNode *p = &x->nodes[parent];
+        node->hidden = p->hidden || name[0] == '.';
+        node->next_sibling = p->first_child;
+        if (p->first_child != INDEX_NONE) x->nodes[p->first_child].prev_sibling = n;
+        p->first_child = n;
+        // The rehash files the new node too. If it fails, the table as it is
+        // still works, only with longer chains.
+        if (x->live <= x->num_buckets || index_grow_hash(x) < 0) {
+            uint32_t b = index_hash(parent, name, x->num_buckets);
+            node->hash_next = x->buckets[b];
+            x->buckets[b] = n;
+            b = index_hash(INDEX_NONE, name, x->num_buckets);
+            node->name_next = x->name_buckets[b];
+            x->name_buckets[b] = n;
+        }
+    }
+    return n;
+}
+
+int index_path(const FileIndex *x, uint32_t n, char *buf, size_t size);
+void index_stat(const FileIndex *x, uint32_t n, struct stat *st);
+
+// Log a change to node n for w24watch. before is its state until now, NULL if it
+// was not a regular file; from now on the node describes it, unless removed.
+// Nothing is logged until the index is ready: no one can be watching yet.
+void index_log_change(FileIndex *x, uint32_t n, const struct stat *before, int removed) {
+    char path[PATH_MAX];
+    struct stat st;
+    int after = !removed && x->nodes[n].type == NODE_FILE;
+    if (!x->ready || (!before && !after) || index_path(x, n, path, sizeof(path)) < 0)
+        return;
+    if (!x->changes && (x->changes = calloc(CHANGE_LOG, sizeof(IndexChange))) == NULL)
+        return;
+    IndexChange *c = &x->changes[x->change_seq % CHANGE_LOG];
+    free(c->path);
+    if ((c->path = strdup(path)) == NULL) return;
+    index_stat(x, n, &st);
+    c->before = before != NULL;
+    c->after = after;
+    c->hidden = x->nodes[n].hidden;
+    c->size[0] = before ? before->st_size : 0;
+    c->mtime[0] = before ? before->st_mtime : 0;
+    c->size[1] = after ? st.st_size : 0;
+    c->mtime[1] = after ? st.st_mtime : 0;
+    x->change_seq++;
+}
+
+// Remove a node and everything below it, dropping the watches of its directories
+void index_remove(FileIndex *x, uint32_t n) {
+    while (x->nodes[n].first_child != INDEX_NONE)
+        index_remove(x, x->nodes[n].first_child);
+    if (x->nodes[n].type == NODE_FILE) {
+        struct stat st;
+        index_stat(x, n, &st);
+        index_log_change(x, n, &st, 1);
+    }
+    IndexNode *node = &x->nodes[n];
+    if (node->type == NODE_LINK) x->dir_links--;
+    if (node->wd >= 0) {
+        inotify_rm_watch(x->inotify_fd, node->wd);
+        if (node->wd < x->num_wds) x->wd_nodes[node->wd] = INDEX_NONE;
+    }
+    if (node->parent != INDEX_NONE) {
+        // Unlink from both hash chains; a node missing from one is left alone there
+        uint32_t *link = &x->buckets[index_hash(node->parent, index_name(x, n), x->num_buckets)];
+        while (*link != n && *link != INDEX_NONE) link = &x->nodes[*link].hash_next;
+        if (*link == n) *link = node->hash_next;
+        link = &x->name_buckets[index_hash(INDEX_NONE, index_name(x, n), x->num_buckets)];
+        while (*link != n && *link != INDEX_NONE) link = &x->nodes[*link].name_next;
+        if (*link == n) *link = node->name_next;
+        if (node->prev_sibling != INDEX_NONE) x->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+        else x->nodes[node->parent].first_child = node->next_sibling;
+        if (node->next_sibling != INDEX_NONE) x->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+    }
+    x->names_garbage += strlen(index_name(x, n)) + 1;
+    node->type = NODE_FREE;
+    x->kinds[n] = 0;
+    node->next_sibling = x->free_list;
+    x->free_list = n;
+    x->live--;
+}
+
+// Full path of a node; returns its length, or -1 if it does not fit
+int index_path(const FileIndex *x, uint32_t n, char *buf, size_t size) {
+    uint32_t chain[256];
+    int depth = 0;
+    for (; n != INDEX_NONE && x->nodes[n].parent != INDEX_NONE; n = x->nodes[n].parent)
+        if (depth < 256) chain[depth++] = n;
+        else return -1;
+    size_t len = snprintf(buf, size, "%s", x->root);
+    while (depth > 0 && len < size)
+        len += snprintf(buf + len, size - len, "/%s", index_name(x, chain[--depth]));
+    return len < size ? (int)len : -1;
+}
+
+// Metadata of a node as the walks would have seen it
+void index_stat(const FileIndex *x, uint32_t n, struct stat *st) {
+    const IndexNode *node = &x->nodes[n];
+    memset(st, 0, sizeof(*st));
+    st->st_mode = node->mode;
+    st->st_ino = node->ino;
+    st->st_size = x->sizes[n];
+    st->st_mtim.tv_sec = x->mtimes[n];
+    st->st_mtim.tv_nsec = node->mtime_nsec;
+    st->st_ctim.tv_sec = node->ctime;
+}
+
+void index_set_stat(FileIndex *x, uint32_t n, const struct stat *st) {
+    IndexNode *node = &x->nodes[n];
+    if (node->type == NODE_LINK) x->dir_links--;
+    node->type = S_ISDIR(st->st_mode) ? NODE_DIR : S_ISREG(st->st_mode) ? NODE_FILE : NODE_OTHER;
+    node->mode = st->st_mode;
+    node->ino = st->st_ino;
+    node->mtime_nsec = st->st_mtim.tv_nsec;
+    node->ctime = st->st_ctim.tv_sec;
+    x->sizes[n] = st->st_size;
+    x->mtimes[n] = st->st_mtim.tv_sec;
+    x->kinds[n] = node->type == NODE_FILE ? KIND_FILE | (node->hidden ? KIND_HIDDEN : 0) : 0;
+}
+
+// Mark a node just set from the lstat of a link as a link to a directory
+void index_set_dir_link(FileIndex *x, uint32_t n) {
+    x->nodes[n].type = NODE_LINK;
+    x->dir_links++;
+}
+
+void index_scan_dir(FileIndex *x, uint32_t dir, const char *path);
+
+// Bring the entry `name` of directory node dir in line with the disk:
+// add, update or remove it. New directories are watched and crawled.
+// Returns 1 if the index changed.
+int index_refresh_entry(FileIndex *x, uint32_t dir, const char *dir_path, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir_path, name) >= sizeof(path))
+        return 0;
+    uint32_t n = index_lookup(x, dir, name);
+    if (lstat(path, &st) < 0) {
+        if (n == INDEX_NONE) return 0;
+        index_remove(x, n);
+        return 1;
+    }
+    int dir_link = 0;
+    if (S_ISLNK(st.st_mode)) {
+        // Links to files are described by their target, links to directories stay links
+        struct stat target;
+        if (stat(path, &target) == 0) {
+            if (S_ISDIR(target.st_mode)) dir_link = 1;
+            else st = target;
+        }
+    }
+    if (n != INDEX_NONE && (x->nodes[n].type == NODE_DIR) != (S_ISDIR(st.st_mode) != 0)) {
+        index_remove(x, n);  // Replaced by something of another kind
+        n = INDEX_NONE;
+    }
+    int added = n == INDEX_NONE;
+    if (added && (n = index_add(x, dir, name)) == INDEX_NONE) {
+        x->stale = 1;
+        return 1;
+    }
+    struct stat before;
+    int was_file = !added && x->nodes[n].type == NODE_FILE;
+    index_stat(x, n, &before);
+    index_set_stat(x, n, &st);
+    if (dir_link) index_set_dir_link(x, n);
+    x->nodes[n].seen = 1;
+    if (added && S_ISDIR(st.st_mode))
+        index_scan_dir(x, n, path);
+    int changed = added || before.st_mode != st.st_mode || before.st_ino != st.st_ino || before.st_size != st.st_size ||
+                  before.st_mtim.tv_sec != st.st_mtim.tv_sec || before.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+                  before.st_ctim.tv_sec != st.st_ctim.tv_sec;
+    if (changed) index_log_change(x, n, was_file ? &before : NULL, 0);
+    return changed;
+}
+
+// Record the watch of a directory node
+void index_map_watch(FileIndex *x, uint32_t dir, int wd, const char *path) {
+    if (wd < 0) {
+        if (!x->stale)
+            fprintf(stderr, "Index: cannot watch %s (%s), commands will walk the tree\n", path, strerror(errno));
+        x->stale = 1;
+        return;
+    }
+    if (wd >= x->num_wds) {
+        int count = wd * 2 + 64;
+        uint32_t *grown = realloc(x->wd_nodes, count * sizeof(uint32_t));
+        if (!grown) {
+            x->stale = 1;
+            return;
+        }
+        memset(grown + x->num_wds, 0xff, (count - x->num_wds) * sizeof(uint32_t));
+        x->wd_nodes = grown;
+        x->num_wds = count;
+    }
+    x->wd_nodes[wd] = dir;
+    x->nodes[dir].wd = wd;
+}
+
+// Add a watch on a directory unless it has one
+void index_watch(FileIndex *x, uint32_t dir, const char *path) {
+    if (x->nodes[dir].wd >= 0) return;
+    index_map_watch(x, dir, inotify_add_watch(x->inotify_fd, path, INDEX_MASK), path);
+}
+
+// Watch a directory, then list it: anything created after the watch is added
+// shows up as an event, anything before in the listing
+void index_scan_dir(FileIndex *x, uint32_t dir, const char *path) {
+    index_watch(x, dir, path);
+    DIR *d = opendir(path);
+    struct stat st;
+    if (!d) return;
+    if (fstat(dirfd(d), &st) == 0) {
+        x->nodes[dir].listed = st.st_mtim.tv_sec;
+        x->nodes[dir].listed_nsec = st.st_mtim.tv_nsec;
+    }
+    for (uint32_t c = x->nodes[dir].first_child; c != INDEX_NONE; c = x->nodes[c].next_sibling)
+        x->nodes[c].seen = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        index_refresh_entry(x, dir, path, entry->d_name);
+    }
+    closedir(d);
+    // Whatever the listing no longer shows is gone
+    for (uint32_t c = x->nodes[dir].first_child, next; c != INDEX_NONE; c = next) {
+        next = x->nodes[c].next_sibling;
+        if (!x->nodes[c].seen) index_remove(x, c);
+    }
+}
+
+// The first crawl goes through the parallel walk: walkers add the watches as
+// they list directories, the indexer thread adds what they found
+typedef struct {
+    FileIndex *x;
+    uint32_t stack[WALK_MAX_DEPTH + 1];  // Directory nodes from the root down
+    int depth;
+} IndexCrawl;
+
+int index_crawl_watch(const char *path, void *arg) {
+    return inotify_add_watch(((IndexCrawl *)arg)->x->inotify_fd, path, INDEX_MASK);
+}
+
+int index_crawl_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                      void *arg) {
+    IndexCrawl *c = arg;
+    FileIndex *x = c->x;
+    uint32_t n = 0;
+    (void)hidden;
+    if (event == WALK_LEAVE) {
+        c->depth--;
+        return 0;
+    }
+    if (event == WALK_FILE || c->depth > 0) {
+        if ((n = index_add(x, c->stack[c->depth - 1], name)) == INDEX_NONE) {
+            x->stale = 1;
+            return 1;
+        }
+        index_set_stat(x, n, st);
+        struct stat target;
+        if (S_ISLNK(st->st_mode) && stat(path, &target) == 0 && S_ISDIR(target.st_mode))
+            index_set_dir_link(x, n);
+    }
+    if (event == WALK_ENTER) {
+        x->nodes[n].listed = st->st_mtim.tv_sec;
+        x->nodes[n].listed_nsec = st->st_mtim.tv_nsec;
+        index_map_watch(x, n, wd, path);
+        c->stack[c->depth++] = n;
+    }
+    return 0;
+}
+
+// After an event queue overflow: list again every directory whose mtime moved
+// since it was last listed (events applied since then do not count: the ones
+// lost may have come after them)
+void index_rescan_changed(FileIndex *x, uint32_t dir) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (index_path(x, dir, path, sizeof(path)) < 0 || stat(path, &st) < 0)
+        return;
+    index_set_stat(x, dir, &st);
+    if (st.st_mtim.tv_sec != x->nodes[dir].listed || (uint32_t)st.st_mtim.tv_nsec != x->nodes[dir].listed_nsec) {
+        index_scan_dir(x, dir, path);
+    } else {
+        // Unchanged listing, but files in it may have been written
+        for (uint32_t c = x->nodes[dir].first_child; c != INDEX_NONE; c = x->nodes[c].next_sibling)
+            if (x->nodes[c].type != NODE_DIR)
+                index_refresh_entry(x, dir, path, index_name(x, c));
+    }
+    for (uint32_t c = x->nodes[dir].first_child, next; c != INDEX_NONE; c = next) {
+        next = x->nodes[c].next_sibling;
+        if (x->nodes[c].type == NODE_DIR) index_rescan_changed(x, c);
+    }
+}
+
+// Apply one inotify event (write lock held)
+void index_apply_event(FileIndex *x, const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        printf("Index: event queue overflowed, rescanning changed directories\n");
+        index_rescan_changed(x, 0);
+        x->rescans++;
+        x->generation++;
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= x->num_wds || x->wd_nodes[ev->wd] == INDEX_NONE)
+        return;
+    uint32_t dir = x->wd_nodes[ev->wd];
+    if (ev->mask & IN_IGNORED) {
+        x->wd_nodes[ev->wd] = INDEX_NONE;
+        x->nodes[dir].wd = -1;
+        return;
+    }
+    if (ev->len == 0) {
+        if (dir == 0 && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+            fprintf(stderr, "Index: %s went away, commands will walk the tree\n", x->root);
+            x->stale = 1;
+        }
+        return;  // Other changes to a directory itself arrive as events in its parent
+    }
+    char path[PATH_MAX];
+    if (index_path(x, dir, path, sizeof(path)) < 0)
+        return;
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        uint32_t n = index_lookup(x, dir, ev->name);
+        if (n != INDEX_NONE) index_remove(x, n);
+    } else {
+        index_refresh_entry(x, dir, path, ev->name);
+    }
+    x->generation++;
+}
+
+// ---- State files ----
+// Snapshots and caches kept across restarts are trusted when read back, so they
+// live in a directory only the server's user can reach (/tmp/w24-<uid> unless
+// the options name other files), are opened without following links and must
+// belong to that user. New versions are written to a fresh mkstemp() file and
+// renamed over the old one.
+char state_dir[64];
+
+// Create dir 0700 if it is missing; refuse a link, another owner or access for
+// others. Returns 0 if it is safe to keep state in.
+int private_dir(const char *dir) {
+    struct stat st;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    if (lstat(dir, &st) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+// Open a state file: a regular file of ours, reached without a symlink
+int open_state_file(const char *path, int flags) {
+    struct stat st;
+    int fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
+}
+
+// Create a new file next to path to be renamed over it; tmp receives its name
+int create_state_temp(const char *path, char *tmp, size_t size) {
+    if ((size_t)snprintf(tmp, size, "%s.XXXXXX", path) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return mkostemp(tmp, O_CLOEXEC);
+}
+
+// ---- Index snapshots ----
+// The file is a header followed by the node table, the size and mtime columns
+// and the name pool exactly as they are in memory. It is written to a temporary name and renamed, and
+// loaded with mmap; a wrong magic, version, layout, root or checksum discards it, and so does any
+// name offset or node id that points outside the tables or a tree that does not hang together.
+#define SNAPSHOT_MAGIC "W24INDX"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_INTERVAL 60    // Seconds between saves while the tree keeps changing
+#define VERIFY_BATCH 4096       // Files re-stat'ed per write-lock hold after a load
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;     // sizeof(IndexNode) of the writer
+    uint64_t num_nodes;
+    uint64_t names_len;
+    uint64_t checksum;      // Of everything after the header
+    char root[PATH_MAX];
+} SnapshotHeader;
+
+// 64-bit FNV-1a over words rather than bytes: fast enough for a few hundred MB
+uint64_t snapshot_checksum(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for (; len > 0; p++, len--)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Save the index. Only the indexer thread changes the table, so it needs no lock to read it.
+void index_save(FileIndex *x) {
+    char tmp[PATH_MAX + 16];
+    SnapshotHeader h;
+    if (!index_snapshot[0] || x->stale) return;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.node_size = sizeof(IndexNode);
+    h.num_nodes = x->num_nodes;
+    h.names_len = x->names_len;
+    h.checksum = snapshot_checksum(0xcbf29ce484222325ULL, x->nodes, (size_t)x->num_nodes * sizeof(IndexNode));
+    h.checksum = snapshot_checksum(h.checksum, x->sizes, (size_t)x->num_nodes * sizeof(int64_t));
+    h.checksum = snapshot_checksum(h.checksum, x->mtimes, (size_t)x->num_nodes * sizeof(int64_t));
+    h.checksum = snapshot_checksum(h.checksum, x->names, x->names_len);
+    strcpy(h.root, x->root);
+    int fd = create_state_temp(index_snapshot, tmp, sizeof(tmp));
+    if (fd < 0) {
+        fprintf(stderr, "Index: cannot write %s: %s\n", index_snapshot, strerror(errno));
+        return;
+    }
+    int failed = write_all(fd, &h, sizeof(h)) < 0 ||
+                 write_all(fd, x->nodes, (size_t)x->num_nodes * sizeof(IndexNode)) < 0 ||
+                 write_all(fd, x->sizes, (size_t)x->num_nodes * sizeof(int64_t)) < 0 ||
+                 write_all(fd, x->mtimes, (size_t)x->num_nodes * sizeof(int64_t)) < 0 ||
+                 write_all(fd, x->names, x->names_len) < 0 || fsync(fd) < 0;
+    if (close(fd) < 0 || failed || rename(tmp, index_snapshot) < 0) {
+        fprintf(stderr, "Index: cannot write %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    x->saved = x->generation;
+    x->saved_at = time(NULL);
+}
+
+// Forget a half-loaded snapshot so that the crawl starts from an empty index
+void index_clear(FileIndex *x) {
+    free(x->names);
+    x->names = NULL;
+    x->names_len = x->names_cap = x->names_garbage = 0;
+    if (x->kinds) memset(x->kinds, 0, x->cap_nodes);
+    x->num_nodes = x->live = x->num_buckets = x->dir_links = 0;
+    x->num_sorted = x->num_recent = 0;
+    x->sorted_ok = 0;
+    x->free_list = INDEX_NONE;
+}
+
+int index_id_ok(const FileIndex *x, uint32_t n) {
+    return n == INDEX_NONE || n < x->num_nodes;
+}
+
+// Check a loaded table before anything follows its offsets and ids: every name
+// lies in the pool, every id is in range, and the live nodes form one tree
+// under the root whose child lists agree with the parent links.
+int index_check_loaded(FileIndex *x) {
+    if (x->names_len == 0 || x->names[x->names_len - 1] != '\0' || x->nodes[0].type != NODE_DIR ||
+        x->nodes[0].parent != INDEX_NONE)
+        return -1;
+    uint32_t live = 0;
+    for (uint32_t n = 0; n < x->num_nodes; n++) {
+        const IndexNode *e = &x->nodes[n];
+        x->nodes[n].seen = 0;
+        if (e->type == NODE_FREE) continue;
+        live++;
+        if (e->type > NODE_LINK || e->name >= x->names_len || !index_id_ok(x, e->parent) ||
+            !index_id_ok(x, e->first_child) || !index_id_ok(x, e->next_sibling) ||
+            !index_id_ok(x, e->prev_sibling) || (e->type != NODE_DIR && e->first_child != INDEX_NONE))
+            return -1;
+    }
+    // Depth-first through the child lists; seen marks the nodes reached, so a cycle shows as a revisit
+    uint32_t reached = 1, n = 0;
+    x->nodes[0].seen = 1;
+    while (1) {
+        uint32_t c = x->nodes[n].first_child, parent = n, prev = INDEX_NONE;
+        while (c == INDEX_NONE && n != 0) {  // n is done: on to its next sibling, or up a level
+            c = x->nodes[n].next_sibling;
+            parent = x->nodes[n].parent;
+            prev = n;
+            if (c == INDEX_NONE) n = parent;
+        }
+        if (c == INDEX_NONE) break;
+        IndexNode *e = &x->nodes[c];
+        if (e->type == NODE_FREE || e->seen || e->parent != parent || e->prev_sibling != prev)
+            return -1;
+        e->seen = 1;
+        reached++;
+        n = c;
+    }
+    for (uint32_t i = 0; i < x->num_nodes; i++)
+        x->nodes[i].seen = 0;
+    return reached == live ? 0 : -1;
+}
+
+// Load the snapshot into the (empty) index. Returns 0 on success.
+int index_load(FileIndex *x) {
+    int fd = index_snapshot[0] ? open_state_file(index_snapshot, O_RDONLY) : -1;
+    struct stat st;
+    if (fd < 0) {
+        if (errno == EPERM)
+            fprintf(stderr, "Index: ignoring snapshot %s (not a file of this user)\n", index_snapshot);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const SnapshotHeader *h = (const SnapshotHeader *)map;
+    const char *nodes = map + sizeof(SnapshotHeader);
+    const char *why = NULL;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != SNAPSHOT_VERSION ||
+        h->node_size != sizeof(IndexNode))
+        why = "written by another version";
+    else if (h->num_nodes == 0 || h->num_nodes >= INDEX_NONE ||
+             (uint64_t)st.st_size != sizeof(SnapshotHeader) + h->num_nodes * (sizeof(IndexNode) + 2 * sizeof(int64_t)) +
+                                     h->names_len)
+        why = "truncated";
+    else if (strncmp(h->root, x->root, sizeof(h->root)) != 0)
+        why = "of another directory";
+    else if (snapshot_checksum(0xcbf29ce484222325ULL, nodes, st.st_size - sizeof(SnapshotHeader)) != h->checksum)
+        why = "corrupt";
+    if (why) {
+        fprintf(stderr, "Index: ignoring snapshot %s (%s)\n", index_snapshot, why);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const char *sizes = nodes + h->num_nodes * sizeof(IndexNode);
+    const char *mtimes = sizes + h->num_nodes * sizeof(int64_t);
+    const char *names = mtimes + h->num_nodes * sizeof(int64_t);
+    x->names_len = x->names_cap = h->names_len;
+    x->names = malloc(x->names_len ? x->names_len : 1);
+    if (!x->names || index_grow_nodes(x, (h->num_nodes + 63) & ~63ULL) < 0) {
+        munmap(map, st.st_size);
+        index_clear(x);
+        return -1;
+    }
+    x->num_nodes = h->num_nodes;
+    memcpy(x->nodes, nodes, (size_t)x->num_nodes * sizeof(IndexNode));
+    memcpy(x->sizes, sizes, (size_t)x->num_nodes * sizeof(int64_t));
+    memcpy(x->mtimes, mtimes, (size_t)x->num_nodes * sizeof(int64_t));
+    memcpy(x->names, names, x->names_len);
+    munmap(map, st.st_size);
+    if (index_check_loaded(x) < 0) {
+        fprintf(stderr, "Index: ignoring snapshot %s (inconsistent)\n", index_snapshot);
+        index_clear(x);
+        return -1;
+    }
+
+    // Rebuild what is not saved: the free list, the name hash, the watches
+    size_t names_used = 0;
+    x->live = x->dir_links = 0;
+    x->free_list = INDEX_NONE;
+    for (uint32_t n = x->num_nodes; n-- > 0;) {
+        x->nodes[n].wd = -1;
+        x->nodes[n].name_flags = 0;
+        if (x->nodes[n].type == NODE_FREE) {
+            x->nodes[n].next_sibling = x->free_list;
+            x->free_list = n;
+        } else {
+            x->live++;
+            names_used += strlen(index_name(x, n)) + 1;
+            if (x->nodes[n].type == NODE_LINK) x->dir_links++;
+        }
+        x->exts[n] = x->nodes[n].type == NODE_FREE ? EXT_NONE : index_ext_id(x, index_name(x, n), 1);
+        x->kinds[n] = x->nodes[n].type == NODE_FILE ? KIND_FILE | (x->nodes[n].hidden ? KIND_HIDDEN : 0) : 0;
+    }
+    x->names_garbage = x->names_len - names_used;
+    while (x->num_buckets < x->live)
+        x->num_buckets = x->num_buckets ? x->num_buckets * 2 : 65536;
+    x->num_buckets /= 2;
+    if (index_grow_hash(x) < 0) {
+        index_clear(x);
+        return -1;
+    }
+    return 0;
+}
+
+// Watch every directory of a loaded index and list again those whose mtime
+// moved since the snapshot. The watch comes first, so nothing falls between.
+void index_revalidate(FileIndex *x, uint32_t dir, uint64_t *relisted) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (index_path(x, dir, path, sizeof(path)) < 0)
+        return;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        if (dir != 0) index_remove(x, dir);
+        else x->stale = 1;
+        return;
+    }
+    index_set_stat(x, dir, &st);
+    index_watch(x, dir, path);
+    if (st.st_mtim.tv_sec != x->nodes[dir].listed || (uint32_t)st.st_mtim.tv_nsec != x->nodes[dir].listed_nsec) {
+        index_scan_dir(x, dir, path);
+        (*relisted)++;
+    }
+    // Directories index_scan_dir just crawled are watched already; the rest are not
+    for (uint32_t c = x->nodes[dir].first_child, next; c != INDEX_NONE; c = next) {
+        next = x->nodes[c].next_sibling;
+        if (x->nodes[c].type == NODE_DIR && x->nodes[c].wd < 0)
+            index_revalidate(x, c, relisted);
+    }
+}
+
+// A name to sort by: its first 8 bytes as a big-endian number settle most
+// comparisons without touching the name pool
+typedef struct {
+    uint64_t key;
+    uint32_t node;
+} NameKey;
+
+int compare_name_keys(const void *a, const void *b, void *arg) {
+    const NameKey *p = a, *q = b;
+    if (p->key != q->key) return p->key < q->key ? -1 : 1;
+    int c = strcmp(index_name(arg, p->node), index_name(arg, q->node));
+    return c ? c : (p->node > q->node) - (p->node < q->node);
+}
+
+// Sort the names of all non-directories again. The sort runs without the lock
+// (only this thread changes the index); readers wait only for the swap.
+void index_sort_names(FileIndex *x) {
+    uint32_t count = 0;
+    NameKey *keys = malloc(((size_t)x->live + 1) * sizeof(NameKey));
+    uint32_t cap = x->live / 4 > 65536 ? x->live / 4 : 65536;
+    uint32_t *recent = malloc((size_t)cap * sizeof(uint32_t));
+    if (!keys || !recent) {
+        free(keys);
+        free(recent);
+        return;
+    }
+    for (uint32_t n = 1; n < x->num_nodes; n++) {
+        if (x->nodes[n].type == NODE_FREE || x->nodes[n].type == NODE_DIR) continue;
+        const unsigned char *name = (const unsigned char *)index_name(x, n);
+        uint64_t key = 0;
+        for (int i = 0, end = 0; i < 8; i++) {
+            end = end || !name[i];
+            key = key << 8 | (end ? 0 : name[i]);
+        }
+        keys[count].key = key;
+        keys[count++].node = n;
+    }
+    qsort_r(keys, count, sizeof(NameKey), compare_name_keys, x);
+    uint32_t *sorted = (uint32_t *)keys;  // Compacted in place: each id moves to a lower address
+    for (uint32_t i = 0; i < count; i++)
+        sorted[i] = keys[i].node;
+
+    pthread_rwlock_wrlock(&x->lock);
+    for (uint32_t n = 0; n < x->num_nodes; n++)
+        x->nodes[n].name_flags = 0;
+    for (uint32_t i = 0; i < count; i++)
+        x->nodes[sorted[i]].name_flags = NAME_SORTED;
+    free(x->sorted);
+    free(x->recent);
+    x->sorted = sorted;
+    x->num_sorted = count;
+    x->recent = recent;
+    x->num_recent = 0;
+    x->cap_recent = cap;
+    x->sorted_ok = 1;
+    pthread_rwlock_unlock(&x->lock);
+}
+
+// Re-stat the next batch of files of a loaded index: a file written while the
+// server was down leaves the mtime of its directory alone
+void index_verify_batch(FileIndex *x) {
+    char path[PATH_MAX];
+    uint32_t parent = INDEX_NONE, n = x->verify_next, end = n + VERIFY_BATCH;
+    int changed = 0;
+    for (; n < x->num_nodes && n < end; n++) {
+        if (x->nodes[n].type == NODE_FREE || x->nodes[n].type == NODE_DIR || x->nodes[n].parent == INDEX_NONE)
+            continue;
+        if (x->nodes[n].parent != parent) {
+            parent = x->nodes[n].parent;
+            if (index_path(x, parent, path, sizeof(path)) < 0) continue;
+        }
+        changed |= index_refresh_entry(x, parent, path, index_name(x, n));
+    }
+    x->verify_next = n < x->num_nodes ? n : INDEX_NONE;
+    if (changed) x->generation++;
+}
+
+// Wake the watches if changes were logged (indexer thread, lock dropped)
+void index_publish_changes(FileIndex *x) {
+    if (x->change_seq == change_published) return;
+    pthread_mutex_lock(&change_lock);
+    change_published = x->change_seq;
+    pthread_mutex_unlock(&change_lock);
+    watch_wake();
+}
+
+// Indexer thread: load the snapshot or crawl HOME, then follow the events
+void *index_thread(void *arg) {
+    FileIndex *x = arg;
+    struct timespec t0, t1;
+    struct stat st;
+    uint64_t relisted = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_rwlock_wrlock(&x->lock);
+    int loaded = index_load(x) == 0;
+    if (loaded) {
+        index_revalidate(x, 0, &relisted);
+        x->saved = 0;
+        x->verify_next = 1;
+    } else {
+        uint32_t root = index_add(x, INDEX_NONE, "");
+        if (root == INDEX_NONE || index_grow_hash(x) < 0 || stat(x->root, &st) < 0) {
+            pthread_rwlock_unlock(&x->lock);
+            fprintf(stderr, "Index: cannot index %s, commands will walk the tree\n", x->root);
+            return NULL;
+        }
+        index_set_stat(x, root, &st);
+        IndexCrawl *crawl = calloc(1, sizeof(IndexCrawl));
+        if (crawl) {
+            crawl->x = x;
+            walk_tree(x->root, 0, WALK_STAT, NULL, index_crawl_watch, crawl, index_crawl_visit, crawl);
+            free(crawl);
+            if (x->nodes[root].wd < 0) index_map_watch(x, root, -1, x->root);
+        } else {
+            index_scan_dir(x, root, x->root);
+        }
+    }
+    pthread_rwlock_unlock(&x->lock);
+    __atomic_store_n(&x->ready, 1, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (loaded)
+        printf("Index: %u entries under %s loaded from %s in %.2f s, %llu changed directories listed%s\n",
+               x->live, x->root, index_snapshot, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+               (unsigned long long)relisted, x->stale ? " (incomplete)" : "");
+    else
+        printf("Index: %u entries under %s in %.2f s%s\n", x->live, x->root,
+               (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, x->stale ? " (incomplete)" : "");
+    if (follow_links && x->dir_links)
+        printf("Index: %u links to directories; searches that follow them walk the tree (-P skips the links)\n",
+               x->dir_links);
+    if (!loaded) index_save(x);
+
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        if (!x->sorted_ok || x->num_recent > x->cap_recent / 4 * 3)
+            index_sort_names(x);
+        // Wake up for events, for the next verify batch, or to save the snapshot
+        int timeout = -1;
+        if (x->verify_next != INDEX_NONE) {
+            timeout = 0;
+        } else if (x->generation != x->saved) {
+            long wait = x->saved_at + SNAPSHOT_INTERVAL - time(NULL);
+            timeout = wait > 0 ? wait * 1000 : 0;
+        }
+        struct pollfd pfd = {x->inotify_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        if (ready == 0) {
+            if (x->verify_next != INDEX_NONE) {
+                pthread_rwlock_wrlock(&x->lock);
+                index_verify_batch(x);
+                pthread_rwlock_unlock(&x->lock);
+                index_publish_changes(x);
+                if (x->verify_next == INDEX_NONE && x->generation != x->saved) index_save(x);
+            } else {
+                index_save(x);
+            }
+            continue;
+        }
+        ssize_t len = read(x->inotify_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        pthread_rwlock_wrlock(&x->lock);
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            index_apply_event(x, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if (x->names_garbage > (1 << 20) && x->names_garbage > x->names_len / 2)
+            index_compact_names(x);
+        pthread_rwlock_unlock(&x->lock);
+        index_publish_changes(x);
+    }
+    return NULL;
+}
+
+void index_start(FileIndex *x) {
+    const char *home = getenv("HOME");
+    if (!home || strlen(home) >= sizeof(x->root) || (x->inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "Index: not available, commands will walk the tree\n");
+        return;
+    }
+    strcpy(x->root, home);  // As given, so paths match what the walks produce
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    x->instance = ((uint64_t)getpid() << 40) ^ ((uint64_t)now.tv_sec << 20) ^ (uint64_t)now.tv_nsec;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, index_thread, x) != 0)
+        error("ERROR creating index thread");
+    pthread_detach(tid);
+}
+
+// Take the read lock if the index can answer commands; returns 0 (unlocked) if not
+int index_acquire(FileIndex *x) {
+    if (!use_index || !__atomic_load_n(&x->ready, __ATOMIC_ACQUIRE))
+        return 0;  // Not while the crawl holds the write lock
+    pthread_rwlock_rdlock(&x->lock);
+    if (x->ready && !x->stale) return 1;
+    pthread_rwlock_unlock(&x->lock);
+    return 0;
+}
+
+// index_acquire for the commands whose walks follow links to directories: the
+// index does not descend into them, so it cannot answer while it holds any
+int index_acquire_following(FileIndex *x) {
+    if (!index_acquire(x)) return 0;
+    if (!follow_links || x->dir_links == 0) return 1;
+    pthread_rwlock_unlock(&x->lock);
+    return 0;
+}
+
+// w24fn from the index: the non-directory with this name that comes first in
+// path order, as find_file picks it. Returns 1 and the path if found, 0 if
+// not, -1 if the index cannot answer.
+int index_find_file(const char *search_filename, char *result_path, size_t size) {
+    FileIndex *x = &file_index;
+    char path[PATH_MAX];
+    int found = 0;
+    if (!index_acquire_following(x)) return -1;
+    for (uint32_t n = x->name_buckets[index_hash(INDEX_NONE, search_filename, x->num_buckets)]; n != INDEX_NONE;
+         n = x->nodes[n].name_next) {
+        if (x->nodes[n].type == NODE_DIR || strcmp(index_name(x, n), search_filename) != 0 ||
+            index_path(x, n, path, sizeof(path)) < 0 || strlen(path) >= size)
+            continue;
+        if (!found || strcmp(path, result_path) < 0)
+            strcpy(result_path, path);
+        found = 1;
+    }
+    pthread_rwlock_unlock(&x->lock);
+    return found;
+}
+
+// Function to send file information back to the client
+void send_file_info(Reply *reply, const char *filename) {
+    char full_path[1024];
+    char output[2048];
+    struct stat statbuf;
+    char created[32];
+
+    // Ask the index, or search from the home directory if it cannot answer
+    int found = index_find_file(filename, full_path, sizeof(full_path));
+    if (found < 0)
+        found = find_file(getenv("HOME"), filename, full_path);
+    if (found) {
+        if (stat(full_path, &statbuf) == 0) {
+            // Prepare the output message with file details
+            snprintf(output, sizeof(output), "File: %s\nSize: %lld bytes\nCreated: %sPermissions: %o\n",
+                     filename, (long long)statbuf.st_size, ctime_r(&statbuf.st_ctime, created), statbuf.st_mode & 0777);
+            send_text(reply, W24_STATUS_OK, output);
+        } else {
+            // Failed to stat the file, even though it was found
+            send_text(reply, W24_STATUS_ERROR, "Error accessing file details.\n");
+        }
+    } else {
+        // File not found
+        send_text(reply, W24_STATUS_NOT_FOUND, "File not found\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// In-process tar.gz writer: a deflate encoder (RFC 1951) wrapped in gzip
+// members (RFC 1952) and fed by a ustar writer, so archives stream straight
+// onto the socket without temp files or an external tar.
+// ---------------------------------------------------------------------------
+
+#define DEFLATE_WSIZE 32768     // LZ77 window size
+#define DEFLATE_WMASK (DEFLATE_WSIZE - 1)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+#define DEFLATE_MAX_DIST (DEFLATE_WSIZE - DEFLATE_MIN_LOOKAHEAD)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_HASH_MASK (DEFLATE_HASH_SIZE - 1)
+#define DEFLATE_BLOCK_SYMBOLS 16384 // Symbols buffered before a block is emitted
+#define DEFLATE_OUT_SIZE IO_CHUNK   // Compressed bytes buffered before the sink is called
+#define DEFLATE_STORED_MAX 65535    // Largest stored block payload
+
+#define LEVEL_NONE 0            // Stored blocks only
+#define LEVEL_FAST 1
+#define LEVEL_DEFAULT 6
+#define LEVEL_MAX 9
+#define CODEC_AUTO -1           // Start at LEVEL_DEFAULT and follow the link speed
+#define CODEC_INVALID -2
+#define CODEC_MANIFEST -3       // -m: list what the archive would hold instead
+#define CODEC_MANIFEST_XXH64 -4 // -m xxh64: the same, with each file's digest
+#define CODEC_MANIFEST_SHA256 -5
+
+#define STORE_MIN_SIZE 8192     // Smaller files are always compressed
+#define STORE_SAMPLE 4096       // Bytes sampled to estimate a file's entropy
+#define STORE_ENTROPY 7.5       // Bits per byte above which a file is stored as is
+
+// Match search effort for one compression level
+typedef struct {
+    int max_chain;      // Hash chain links followed per search
+    int nice_length;    // Stop searching once a match this long is found
+    int lazy;           // Defer a match by one byte to look for a longer one
+} DeflateParams;
+
+// Receives compressed bytes as they are produced
+typedef void (*deflate_sink)(void *arg, const unsigned char *data, size_t len);
+
+typedef struct {
+    unsigned char window[2 * DEFLATE_WSIZE]; // Input history plus lookahead
+    int head[DEFLATE_HASH_SIZE];    // Latest window position for each hash, -1 if none
+    int prev[DEFLATE_WSIZE];        // Previous position with the same hash
+    int window_end;     // Valid bytes in window
+    int pos;            // Next window position to encode
+    int block_start;    // First window position of the current block
+    int sym_end;        // Window position up to which symbols have been recorded
+    int match_length;   // Lazy matching state, carried between calls
+    int match_start;
+    int prev_length;
+    int prev_match;
+    int match_available;
+
+    uint16_t sym_lit[DEFLATE_BLOCK_SYMBOLS];  // Literal byte, or match length
+    uint16_t sym_dist[DEFLATE_BLOCK_SYMBOLS]; // 0 for literals, else match distance
+    int sym_count;
+    uint32_t lit_freq[286];
+    uint32_t dist_freq[30];
+
+    uint64_t bitbuf;    // Bits not yet written out, LSB first
+    int bitcount;
+    unsigned char out[DEFLATE_OUT_SIZE];
+    size_t outlen;
+
+    int level;
+    DeflateParams params;
+    deflate_sink sink;
+    void *sink_arg;
+    uint32_t crc;       // gzip trailer: CRC-32 and length of the uncompressed data
+    uint32_t isize;
+} Deflater;
+
+uint32_t crc_table[256];
+uint8_t length_code[DEFLATE_MAX_MATCH + 1];   // Match length -> length code index (0..28)
+uint8_t dist_code[DEFLATE_WSIZE + 1];         // Match distance -> distance code (0..29)
+const int length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+const int length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+const int dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+const int dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+const uint8_t codelen_order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+// Build the CRC-32 and length/distance code lookup tables; called once from main
+void compression_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+    for (int code = 0; code < 29; code++) {
+        int end = code == 28 ? DEFLATE_MAX_MATCH : length_base[code] + (1 << length_extra[code]) - 1;
+        for (int len = length_base[code]; len <= end; len++)
+            length_code[len] = code;
+    }
+    length_code[DEFLATE_MAX_MATCH] = 28;  // 258 has its own code rather than 227 + 31
+    for (int code = 0; code < 30; code++) {
+        int end = dist_base[code] + (1 << dist_extra[code]) - 1;
+        for (int dist = dist_base[code]; dist <= end && dist <= DEFLATE_WSIZE; dist++)
+            dist_code[dist] = code;
+    }
+}
+
+// Update a running CRC-32 with len more bytes
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Map a level 0-9 to its match search effort
+DeflateParams deflate_params(int level) {
+    DeflateParams p;
+    if (level <= 0) {
+        p.max_chain = 0; p.nice_length = 0; p.lazy = 0;
+    } else if (level <= 3) {
+        p.max_chain = 4 << (level - 1); p.nice_length = 16 << (level - 1); p.lazy = 0;
+    } else if (level <= 6) {
+        p.max_chain = 16 << (level - 4); p.nice_length = 64 << (level - 4); p.lazy = 1;
+    } else {
+        p.max_chain = 256 << (level - 7); p.nice_length = DEFLATE_MAX_MATCH; p.lazy = 1;
+    }
+    if (p.nice_length > DEFLATE_MAX_MATCH) p.nice_length = DEFLATE_MAX_MATCH;
+    return p;
+}
+
+// Hand the buffered compressed bytes to the sink
+void deflate_flush_output(Deflater *d) {
+    if (d->outlen > 0) {
+        d->sink(d->sink_arg, d->out, d->outlen);
+        d->outlen = 0;
+    }
+}
+
+void put_byte(Deflater *d, unsigned char c) {
+    d->out[d->outlen++] = c;
+    if (d->outlen == DEFLATE_OUT_SIZE)
+        deflate_flush_output(d);
+}
+
+// Append n bits (n <= 32) to the stream, least significant bit first
+void put_bits(Deflater *d, uint32_t value, int n) {
+    d->bitbuf |= (uint64_t)value << d->bitcount;
+    d->bitcount += n;
+    while (d->bitcount >= 8) {
+        put_byte(d, d->bitbuf & 0xff);
+        d->bitbuf >>= 8;
+        d->bitcount -= 8;
+    }
+}
+
+// Pad the bit stream with zeros up to the next byte boundary
+void align_bits(Deflater *d) {
+    if (d->bitcount > 0)
+        put_bits(d, 0, 8 - d->bitcount);
+}
+
+// Start a raw deflate stream at the given level (0-9)
+void deflate_init(Deflater *d, int level, deflate_sink sink, void *sink_arg) {
+    memset(d->head, 0xff, sizeof(d->head));
+    memset(d->lit_freq, 0, sizeof(d->lit_freq));
+    memset(d->dist_freq, 0, sizeof(d->dist_freq));
+    d->window_end = d->pos = d->block_start = d->sym_end = 0;
+    d->match_length = d->prev_length = DEFLATE_MIN_MATCH - 1;
+    d->match_start = d->prev_match = 0;
+    d->match_available = 0;
+    d->sym_count = 0;
+    d->bitbuf = 0;
+    d->bitcount = 0;
+    d->outlen = 0;
+    d->level = level < 0 ? 0 : level > 9 ? 9 : level;
+    d->params = deflate_params(d->level);
+    d->sink = sink;
+    d->sink_arg = sink_arg;
+    d->crc = 0;
+    d->isize = 0;
+}
+
+// Compute Huffman code lengths no longer than max_bits for n symbols.
+// At least two symbols always get a code, as some inflaters reject single-code trees.
+void build_code_lengths(const uint32_t *freq_in, int n, int max_bits, uint8_t *lengths) {
+    uint32_t freq[286];
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        freq[i] = freq_in[i];
+        if (freq[i]) count++;
+    }
+    for (int i = 0; count < 2 && i < n; i++) {
+        if (!freq[i]) {
+            freq[i] = 1;
+            count++;
+        }
+    }
+
+    while (1) {
+        // Nodes 0..n-1 are leaves, internal nodes follow; pick the two lightest each round
+        uint32_t weight[2 * 286];
+        int parent[2 * 286];
+        int alive[2 * 286];
+        int nodes = n;
+        for (int i = 0; i < n; i++) {
+            weight[i] = freq[i];
+            parent[i] = -1;
+            alive[i] = freq[i] > 0;
+        }
+        for (int round = 0; round < count - 1; round++) {
+            int a = -1, b = -1;
+            for (int i = 0; i < nodes; i++) {
+                if (!alive[i]) continue;
+                if (a < 0 || weight[i] < weight[a]) { b = a; a = i; }
+                else if (b < 0 || weight[i] < weight[b]) b = i;
+            }
+            weight[nodes] = weight[a] + weight[b];
+            parent[nodes] = -1;
+            alive[nodes] = 1;
+            parent[a] = parent[b] = nodes;
+            alive[a] = alive[b] = 0;
+            nodes++;
+        }
+
+        int too_long = 0;
+        for (int i = 0; i < n; i++) {
+            int depth = 0;
+            if (freq[i])
+                for (int p = i; parent[p] >= 0; p = parent[p]) depth++;
+            lengths[i] = depth;
+            if (depth > max_bits) too_long = 1;
+        }
+        if (!too_long)
+            return;
+        // Flatten the distribution and rebuild until the tree fits
+        for (int i = 0; i < n; i++)
+            if (freq[i]) freq[i] = (freq[i] + 1) / 2;
+    }
+}
+
+// Assign canonical codes to the lengths, bit-reversed for LSB-first output
+void build_codes(const uint8_t *lengths, int n, uint16_t *codes) {
+    int bl_count[16] = {0};
+    int next_code[16];
+    for (int i = 0; i < n; i++) bl_count[lengths[i]]++;
+    bl_count[0] = 0;
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        int len = lengths[i];
+        if (!len) continue;
+        int c = next_code[len]++, r = 0;
+        for (int k = 0; k < len; k++) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = r;
+    }
+}
+
+// Run-length encode the literal/length and distance code lengths (symbols 0-18)
+int encode_code_lengths(const uint8_t *lens, int n, uint8_t *syms, uint8_t *extra) {
+    int count = 0;
+    for (int i = 0; i < n;) {
+        int cur = lens[i], run = 1;
+        while (i + run < n && lens[i + run] == cur) run++;
+        i += run;
+        if (cur == 0) {
+            while (run >= 11) {
+                int r = run > 138 ? 138 : run;
+                syms[count] = 18; extra[count++] = r - 11; run -= r;
+            }
+            if (run >= 3) {
+                syms[count] = 17; extra[count++] = run - 3; run = 0;
+            }
+        } else {
+            syms[count] = cur; extra[count++] = 0; run--;
+            while (run >= 3) {
+                int r = run > 6 ? 6 : run;
+                syms[count] = 16; extra[count++] = r - 3; run -= r;
+            }
+        }
+        while (run-- > 0) {
+            syms[count] = cur; extra[count++] = 0;
+        }
+    }
+    return count;
+}
+
+// Bits needed to encode the buffered symbols with the given code lengths
+uint64_t symbol_bits(Deflater *d, const uint8_t *lit_len, const uint8_t *dist_len) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 286; i++) {
+        bits += (uint64_t)d->lit_freq[i] * lit_len[i];
+        if (i >= 257) bits += (uint64_t)d->lit_freq[i] * length_extra[i - 257];
+    }
+    for (int i = 0; i < 30; i++)
+        bits += (uint64_t)d->dist_freq[i] * (dist_len[i] + dist_extra[i]);
+    return bits;
+}
+
+// Write the buffered symbols using the given Huffman codes
+void write_symbols(Deflater *d, const uint16_t *lit_code, const uint8_t *lit_len,
+                   const uint16_t *dcode, const uint8_t *dlen) {
+    for (int i = 0; i < d->sym_count; i++) {
+        int dist = d->sym_dist[i];
+        if (dist == 0) {
+            int c = d->sym_lit[i];
+            put_bits(d, lit_code[c], lit_len[c]);
+        } else {
+            int len = d->sym_lit[i];
+            int lc = length_code[len];
+            put_bits(d, lit_code[257 + lc], lit_len[257 + lc]);
+            if (length_extra[lc]) put_bits(d, len - length_base[lc], length_extra[lc]);
+            int dc = dist_code[dist];
+            put_bits(d, dcode[dc], dlen[dc]);
+            if (dist_extra[dc]) put_bits(d, dist - dist_base[dc], dist_extra[dc]);
+        }
+    }
+    put_bits(d, lit_code[256], lit_len[256]);
+}
+
+// Emit the recorded symbols as one block, choosing stored, fixed or dynamic Huffman coding
+void emit_block(Deflater *d, int final) {
+    const unsigned char *raw = d->window + d->block_start;
+    int raw_len = d->sym_end - d->block_start;
+    uint8_t lit_len[286], dist_len[30];
+    uint16_t lit_code[286], dcode[30];
+
+    d->lit_freq[256] = 1;  // End-of-block marker
+
+    // Stored cost: 3 header bits, padding, then 4 bytes of LEN/NLEN per 64 KiB chunk
+    int stored_chunks = raw_len == 0 ? 1 : (raw_len + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX;
+    uint64_t stored_bits = (uint64_t)stored_chunks * (3 + 7 + 32) + (uint64_t)raw_len * 8;
+
+    if (d->level == LEVEL_NONE) {
+        goto stored;
+    }
+
+    // Fixed Huffman cost
+    uint8_t fixed_lit[288], fixed_dist[30];
+    for (int i = 0; i < 288; i++) fixed_lit[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    for (int i = 0; i < 30; i++) fixed_dist[i] = 5;
+    uint64_t fixed_bits = 3 + symbol_bits(d, fixed_lit, fixed_dist);
+
+    // Dynamic Huffman cost, including the tree description
+    build_code_lengths(d->lit_freq, 286, 15, lit_len);
+    build_code_lengths(d->dist_freq, 30, 15, dist_len);
+    int hlit = 286, hdist = 30;
+    while (hlit > 257 && lit_len[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && dist_len[hdist - 1] == 0) hdist--;
+    uint8_t all_lens[286 + 30], cl_syms[286 + 30], cl_extra[286 + 30];
+    memcpy(all_lens, lit_len, hlit);
+    memcpy(all_lens + hlit, dist_len, hdist);
+    int cl_count = encode_code_lengths(all_lens, hlit + hdist, cl_syms, cl_extra);
+    uint32_t cl_freq[19] = {0};
+    for (int i = 0; i < cl_count; i++) cl_freq[cl_syms[i]]++;
+    uint8_t cl_len[19];
+    uint16_t cl_code[19];
+    build_code_lengths(cl_freq, 19, 7, cl_len);
+    int hclen = 19;
+    while (hclen > 4 && cl_len[codelen_order[hclen - 1]] == 0) hclen--;
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + symbol_bits(d, lit_len, dist_len);
+    for (int i = 0; i < cl_count; i++) {
+        dynamic_bits += cl_len[cl_syms[i]];
+        dynamic_bits += cl_syms[i] == 16 ? 2 : cl_syms[i] == 17 ? 3 : cl_syms[i] == 18 ? 7 : 0;
+    }
+
+    if (stored_bits <= fixed_bits && stored_bits <= dynamic_bits)
+        goto stored;
+
+    if (fixed_bits <= dynamic_bits) {
+        uint16_t fixed_lcode[288], fixed_dcode[30];
+        build_codes(fixed_lit, 288, fixed_lcode);
+        build_codes(fixed_dist, 30, fixed_dcode);
+        put_bits(d, final, 1);
+        put_bits(d, 1, 2);
+        write_symbols(d, fixed_lcode, fixed_lit, fixed_dcode, fixed_dist);
+    } else {
+        build_codes(lit_len, 286, lit_code);
+        build_codes(dist_len, 30, dcode);
+        build_codes(cl_len, 19, cl_code);
+        put_bits(d, final, 1);
+        put_bits(d, 2, 2);
+        put_bits(d, hlit - 257, 5);
+        put_bits(d, hdist - 1, 5);
+        put_bits(d, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++)
+            put_bits(d, cl_len[codelen_order[i]], 3);
+        for (int i = 0; i < cl_count; i++) {
+            put_bits(d, cl_code[cl_syms[i]], cl_len[cl_syms[i]]);
+            if (cl_syms[i] == 16) put_bits(d, cl_extra[i], 2);
+            else if (cl_syms[i] == 17) put_bits(d, cl_extra[i], 3);
+            else if (cl_syms[i] == 18) put_bits(d, cl_extra[i], 7);
+        }
+        write_symbols(d, lit_code, lit_len, dcode, dist_len);
+    }
+    goto done;
+
+stored:
+    do {
+        int chunk = raw_len > DEFLATE_STORED_MAX ? DEFLATE_STORED_MAX : raw_len;
+        put_bits(d, final && chunk == raw_len, 1);
+        put_bits(d, 0, 2);
+        align_bits(d);
+        put_byte(d, chunk & 0xff);
+        put_byte(d, chunk >> 8);
+        put_byte(d, ~chunk & 0xff);
+        put_byte(d, (~chunk >> 8) & 0xff);
+        for (int i = 0; i < chunk; i++) put_byte(d, raw[i]);
+        raw += chunk;
+        raw_len -= chunk;
+    } while (raw_len > 0);
+
+done:
+    d->block_start = d->sym_end;
+    d->sym_count = 0;
+    memset(d->lit_freq, 0, sizeof(d->lit_freq));
+    memset(d->dist_freq, 0, sizeof(d->dist_freq));
+}
+
+// Record a literal byte; emits a block when the symbol buffer is full
+void tally_literal(Deflater *d, int c) {
+    d->sym_lit[d->sym_count] = c;
+    d->sym_dist[d->sym_count++] = 0;
+    d->lit_freq[c]++;
+    d->sym_end++;
+    if (d->sym_count == DEFLATE_BLOCK_SYMBOLS) emit_block(d, 0);
+}
+
+// Record a (length, distance) match; emits a block when the symbol buffer is full
+void tally_match(Deflater *d, int len, int dist) {
+    d->sym_lit[d->sym_count] = len;
+    d->sym_dist[d->sym_count++] = dist;
+    d->lit_freq[257 + length_code[len]]++;
+    d->dist_freq[dist_code[dist]]++;
+    d->sym_end += len;
+    if (d->sym_count == DEFLATE_BLOCK_SYMBOLS) emit_block(d, 0);
+}
+
+// Insert the 3-byte string at pos into the hash chains; returns the previous chain head
+int insert_string(Deflater *d, int pos) {
+    const unsigned char *w = d->window + pos;
+    int h = ((w[0] << 10) ^ (w[1] << 5) ^ w[2]) & DEFLATE_HASH_MASK;
+    int head = d->head[h];
+    d->prev[pos & DEFLATE_WMASK] = head;
+    d->head[h] = pos;
+    return head;
+}
+
+// Follow the hash chain from cur_match looking for a match longer than best_len
+int longest_match(Deflater *d, int cur_match, int best_len) {
+    int chain = d->params.max_chain;
+    int lookahead = d->window_end - d->pos;
+    int max_len = lookahead < DEFLATE_MAX_MATCH ? lookahead : DEFLATE_MAX_MATCH;
+    int limit = d->pos > DEFLATE_MAX_DIST ? d->pos - DEFLATE_MAX_DIST : 0;
+    const unsigned char *scan = d->window + d->pos;
+    if (best_len >= max_len)
+        return best_len;
+    do {
+        const unsigned char *m = d->window + cur_match;
+        if (m[best_len] != scan[best_len] || m[0] != scan[0] || m[1] != scan[1])
+            continue;
+        int len = 2;
+        while (len < max_len && m[len] == scan[len]) len++;
+        if (len > best_len) {
+            best_len = len;
+            d->match_start = cur_match;
+            if (len >= d->params.nice_length || len >= max_len) break;
+        }
+    } while ((cur_match = d->prev[cur_match & DEFLATE_WMASK]) > limit && cur_match >= 0 && --chain > 0);
+    return best_len;
+}
+
+// Encode buffered input. Without flush, MIN_LOOKAHEAD bytes are kept back so matches can extend.
+void deflate_process(Deflater *d, int flush) {
+    if (d->level == LEVEL_NONE) {
+        d->pos = d->sym_end = d->window_end;
+        return;
+    }
+    while (1) {
+        int lookahead = d->window_end - d->pos;
+        if (lookahead < DEFLATE_MIN_LOOKAHEAD && (!flush || lookahead == 0))
+            break;
+        int head = lookahead >= DEFLATE_MIN_MATCH ? insert_string(d, d->pos) : -1;
+
+        if (!d->params.lazy) {
+            // Greedy: take the first acceptable match
+            int len = 0;
+            if (head >= 0 && d->pos - head <= DEFLATE_MAX_DIST)
+                len = longest_match(d, head, DEFLATE_MIN_MATCH - 1);
+            if (len >= DEFLATE_MIN_MATCH) {
+                tally_match(d, len, d->pos - d->match_start);
+                for (int i = 1; i < len; i++)
+                    if (d->pos + i + DEFLATE_MIN_MATCH <= d->window_end)
+                        insert_string(d, d->pos + i);
+                d->pos += len;
+            } else {
+                tally_literal(d, d->window[d->pos]);
+                d->pos++;
+            }
+            continue;
+        }
+
+        // Lazy: only commit to the previous match if this position does not beat it
+        d->prev_length = d->match_length;
+        d->prev_match = d->match_start;
+        d->match_length = DEFLATE_MIN_MATCH - 1;
+        if (head >= 0 && d->prev_length < d->params.nice_length && d->pos - head <= DEFLATE_MAX_DIST) {
+            d->match_length = longest_match(d, head, DEFLATE_MIN_MATCH - 1);
+            if (d->match_length == DEFLATE_MIN_MATCH && d->pos - d->match_start > 4096)
+                d->match_length = DEFLATE_MIN_MATCH - 1;  // A distant 3-byte match costs more than literals
+        }
+        if (d->prev_length >= DEFLATE_MIN_MATCH && d->match_length <= d->prev_length) {
+            int max_insert = d->window_end - DEFLATE_MIN_MATCH;
+            tally_match(d, d->prev_length, d->pos - 1 - d->prev_match);
+            for (int i = 1; i < d->prev_length - 1; i++)
+                if (d->pos + i <= max_insert)
+                    insert_string(d, d->pos + i);
+            d->pos += d->prev_length - 1;
+            d->match_available = 0;
+            d->match_length = DEFLATE_MIN_MATCH - 1;
+        } else {
+            if (d->match_available)
+                tally_literal(d, d->window[d->pos - 1]);
+            d->match_available = 1;
+            d->pos++;
+        }
+    }
+    if (flush && d->match_available) {
+        tally_literal(d, d->window[d->pos - 1]);
+        d->match_available = 0;
+    }
+}
+
+// Move the upper half of the window down, closing the current block first if its bytes would be lost
+void slide_window(Deflater *d) {
+    if (d->block_start < DEFLATE_WSIZE)
+        emit_block(d, 0);
+    memmove(d->window, d->window + DEFLATE_WSIZE, DEFLATE_WSIZE);
+    d->window_end -= DEFLATE_WSIZE;
+    d->pos -= DEFLATE_WSIZE;
+    d->block_start -= DEFLATE_WSIZE;
+    d->sym_end -= DEFLATE_WSIZE;
+    d->match_start -= DEFLATE_WSIZE;
+    d->prev_match -= DEFLATE_WSIZE;
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++)
+        d->head[i] = d->head[i] >= DEFLATE_WSIZE ? d->head[i] - DEFLATE_WSIZE : -1;
+    for (int i = 0; i < DEFLATE_WSIZE; i++)
+        d->prev[i] = d->prev[i] >= DEFLATE_WSIZE ? d->prev[i] - DEFLATE_WSIZE : -1;
+}
+
+// Feed uncompressed bytes into the encoder
+void deflate_write(Deflater *d, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        if (d->window_end == 2 * DEFLATE_WSIZE) {
+            deflate_process(d, 0);
+            slide_window(d);
+        }
+        size_t n = 2 * DEFLATE_WSIZE - d->window_end;
+        if (n > len) n = len;
+        memcpy(d->window + d->window_end, p, n);
+        d->window_end += n;
+        p += n;
+        len -= n;
+    }
+}
+
+// Encode everything still buffered and write the final block, byte-aligned
+void deflate_finish(Deflater *d) {
+    deflate_process(d, 1);
+    emit_block(d, 1);
+    align_bits(d);
+}
+
+// Start a gzip member: 10-byte header, then a deflate stream
+void gzip_begin(Deflater *d, int level, deflate_sink sink, void *sink_arg) {
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    deflate_init(d, level, sink, sink_arg);
+    for (int i = 0; i < 10; i++) put_byte(d, header[i]);
+}
+
+// Add uncompressed bytes to the gzip member
+void gzip_write(Deflater *d, const void *data, size_t len) {
+    d->crc = crc32_update(d->crc, data, len);
+    d->isize += len;
+    deflate_write(d, data, len);
+}
+
+// Finish the gzip member with its CRC-32 and size trailer
+void gzip_end(Deflater *d) {
+    deflate_finish(d);
+    for (int i = 0; i < 4; i++) put_byte(d, (d->crc >> (8 * i)) & 0xff);
+    for (int i = 0; i < 4; i++) put_byte(d, (d->isize >> (8 * i)) & 0xff);
+    deflate_flush_output(d);
+}
+
+#define PIPELINE_DEPTH 8        // Chunks buffered between two archive stages
+#define PIPELINE_FILES 256      // Matched files buffered ahead of the reader
+#define DEFAULT_BLOCK_SIZE (128 * 1024) // Tar bytes per independently compressed gzip member
+
+int compress_threads = 0;       // Compressor threads per archive (-c), 0 = one per CPU
+size_t block_size = DEFAULT_BLOCK_SIZE; // Bytes per gzip member (-b)
+
+// A block of tar bytes (read -> compress) or the gzip member made from it (compress -> send)
+// A chunk with fd >= 0 carries no bytes: it stands for len bytes of that file from
+// offset, which the sender passes to sendfile() (plain tar only).
+typedef struct Chunk {
+    uint64_t seq;       // Block number within the archive, restores order after compression
+    int store;          // Block holds already-compressed data: emit it as stored deflate blocks
+    int packed;         // Already gzip members (a cache hit): compressors pass it through
+    struct CacheFill *fill; // Block belongs to a file whose members are being cached
+    int fill_last;      // Last block of that file
+    int fd;             // File to send from instead of data, or -1
+    off_t offset;
+    size_t len;
+    size_t cap;
+    uint32_t zc_first, zc_last; // MSG_ZEROCOPY send IDs covering this chunk
+    uint32_t zc_done;   // IDs of this chunk the kernel has reported complete
+    struct Chunk *next; // Sender's list of blocks that arrived early, or still in flight
+    unsigned char data[];
+} Chunk;
+
+Chunk *chunk_alloc(size_t cap) {
+    Chunk *c = malloc(sizeof(Chunk) + cap);
+    if (c) {
+        c->seq = 0;
+        c->store = 0;
+        c->packed = 0;
+        c->fill = NULL;
+        c->fill_last = 0;
+        c->fd = -1;
+        c->offset = 0;
+        c->len = 0;
+        c->cap = cap;
+        c->zc_first = c->zc_last = c->zc_done = 0;
+        c->next = NULL;
+    }
+    return c;
+}
+
+void cache_fill_commit(struct CacheFill *f, int keep);
+
+// Free a chunk; the last chunk of a file being cached also ends its fill, unstored
+void chunk_free(Chunk *c) {
+    if (c && c->fd >= 0) close(c->fd);
+    if (c && c->fill_last) cache_fill_commit(c->fill, 0);
+    free(c);
+}
+
+int zero_copy = 1;              // Use sendfile/MSG_ZEROCOPY; -n turns it off for comparisons
+#define ZEROCOPY_MIN 16384      // Smaller buffers are cheaper to copy than to pin
+#define ZEROCOPY_INFLIGHT 32    // Chunks allowed to wait for completion before the sender blocks
+
+// Zero-copy state for one response stream. Buffers sent with MSG_ZEROCOPY stay
+// pinned by the kernel until it reports them complete on the socket error queue,
+// so they are parked on a list instead of being freed after send().
+typedef struct {
+    int sock;
+    int enabled;        // SO_ZEROCOPY accepted by the socket
+    uint32_t next_id;   // ID the kernel assigns to the next zero-copy send call
+    Chunk *inflight;    // Chunks the kernel may still read from
+    int inflight_count;
+    uint64_t copied;    // Sends the kernel completed by copying after all (e.g. loopback)
+} ZeroCopySender;
+
+void zc_init(ZeroCopySender *z, Reply *reply) {
+    int one = 1;
+    memset(z, 0, sizeof(*z));
+    z->sock = reply->sock;
+    z->next_id = reply->zc_next_id ? *reply->zc_next_id : 0;
+    z->enabled = zero_copy && reply->zc_next_id &&
+                 setsockopt(z->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+// Read completion notifications and free the chunks they cover.
+// With wait set, block until at least one notification arrives.
+void zc_reap(ZeroCopySender *z, int wait) {
+    while (z->inflight_count > 0) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(z->sock, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Socket is gone; the kernel has dropped its references
+                while (z->inflight) {
+                    Chunk *c = z->inflight;
+                    z->inflight = c->next;
+                    chunk_free(c);
+                }
+                z->inflight_count = 0;
+                return;
+            }
+            if (!wait) return;
+            struct pollfd pfd = {z->sock, 0, 0};  // The error queue signals POLLERR
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t lo = ee->ee_info, hi = ee->ee_data;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) z->copied += hi - lo + 1;
+            // Credit the completed ID range to every chunk it overlaps
+            for (Chunk **link = &z->inflight; *link;) {
+                Chunk *c = *link;
+                uint32_t a = c->zc_first > lo ? c->zc_first : lo;
+                uint32_t b = c->zc_last < hi ? c->zc_last : hi;
+                if ((int32_t)(b - a) >= 0) c->zc_done += b - a + 1;
+                if (c->zc_done == c->zc_last - c->zc_first + 1) {
+                    *link = c->next;
+                    chunk_free(c);
+                    z->inflight_count--;
+                } else {
+                    link = &c->next;
+                }
+            }
+        }
+        wait = 0;  // Got one; drain the rest without blocking
+    }
+}
+
+// Send len bytes of a file with sendfile(), zero-filling if the file shrank
+int send_file_range(int sock, int fd, off_t offset, uint64_t len) {
+    while (len > 0) {
+        ssize_t n = zero_copy ? sendfile(sock, fd, &offset, len < (1 << 30) ? len : (1 << 30)) : -1;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Either sendfile is off/unsupported or the file ended early: copy the rest by hand
+            char buf[IO_CHUNK];
+            ssize_t r = n < 0 ? pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset) : 0;
+            if (r < 0) r = 0;
+            if (r == 0) {
+                r = len < sizeof(buf) ? len : sizeof(buf);
+                memset(buf, 0, r);
+            }
+            if (write_fully(sock, buf, r) < 0) return -1;
+            offset += r;
+            n = r;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Send one chunk as a frame. The header is written with MSG_MORE so it shares a
+// segment with the payload. Large buffers go out with MSG_ZEROCOPY and are kept
+// until the kernel releases them; file chunks use sendfile(). Takes ownership of c.
+int zc_send_chunk(ZeroCopySender *z, Reply *reply, int type, int flags, Chunk *c) {
+    unsigned char header[W24_HEADER_SIZE];
+    encode_header(header, type, W24_STATUS_OK, flags, reply->request_id, c->len);
+    // Once the kernel reports it had to copy (loopback, no scatter-gather NIC) zero-copy
+    // only adds the notification overhead, so the rest of the response is copied directly
+    if (c->fd < 0 && (!z->enabled || z->copied > 0 || c->len < ZEROCOPY_MIN)) {
+        int rc = send_frame(reply, type, W24_STATUS_OK, flags, c->data, c->len);
+        chunk_free(c);
+        return rc;
+    }
+    const unsigned char *h = header;
+    size_t hlen = sizeof(header);
+    while (hlen > 0) {
+        ssize_t n = send(z->sock, h, hlen, MSG_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            chunk_free(c);
+            return -1;
+        }
+        h += n;
+        hlen -= n;
+    }
+    if (c->fd >= 0) {
+        int rc = send_file_range(z->sock, c->fd, c->offset, c->len);
+        chunk_free(c);
+        return rc;
+    }
+
+    size_t off = 0;
+    int zc_calls = 0;
+    c->zc_first = z->next_id;
+    while (off < c->len) {
+        ssize_t n = send(z->sock, c->data + off, c->len - off, MSG_ZEROCOPY);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == ENOBUFS) {
+            // Out of pinned-page budget: copy the rest the ordinary way
+            int rc = write_fully(z->sock, c->data + off, c->len - off);
+            off = c->len;
+            if (rc < 0) break;
+            continue;
+        }
+        if (n < 0) break;
+        off += n;
+        z->next_id++;
+        zc_calls++;
+    }
+    int rc = off == c->len ? 0 : -1;
+    if (zc_calls == 0) {
+        chunk_free(c);
+        return rc;
+    }
+    c->zc_last = z->next_id - 1;
+    c->zc_done = 0;
+    c->next = z->inflight;
+    z->inflight = c;
+    z->inflight_count++;
+    zc_reap(z, 0);
+    while (z->inflight_count > ZEROCOPY_INFLIGHT)
+        zc_reap(z, 1);
+    return rc;
+}
+
+// Deflater sink that appends the output to a growable chunk
+void chunk_sink(void *arg, const unsigned char *data, size_t len) {
+    Chunk **cp = arg;
+    Chunk *c = *cp;
+    if (!c) return;
+    if (c->len + len > c->cap) {
+        size_t cap = c->cap * 2 > c->len + len ? c->cap * 2 : c->len + len;
+        Chunk *grown = realloc(c, sizeof(Chunk) + cap);
+        if (!grown) {
+            free(c);
+            *cp = NULL;
+            return;
+        }
+        c = *cp = grown;
+        c->cap = cap;
+    }
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+}
+
+// Compress len bytes into one complete gzip member. Members are independent, so
+// blocks can be compressed on any thread and simply concatenated: a multi-member
+// stream that gzip, tar -xzf and zlib all read as one. Returns NULL if out of memory.
+Chunk *gzip_block(Deflater *d, int level, const unsigned char *data, size_t len) {
+    Chunk *out = chunk_alloc(len / 2 + 1024);
+    if (!out) return NULL;
+    gzip_begin(d, level, chunk_sink, &out);
+    gzip_write(d, data, len);
+    gzip_end(d);
+    return out;
+}
+
+// ---- Compressed member cache ----
+// Files of CACHE_MIN_SIZE and up are compressed into gzip members of their own
+// (data plus tar padding, the header stays in the surrounding block), and those
+// members are kept keyed by (device, inode, mtime, size, codec). A later archive
+// containing the same unchanged file sends the cached members after a fresh tar
+// header instead of compressing it again. Entries live in memory, or as files in
+// a cache directory (-C) so they survive restarts; either way the total is capped
+// (-m) and the least recently used entries are dropped first.
+#define CACHE_MIN_SIZE 16384        // Smaller files are not worth a member of their own
+#define DEFAULT_CACHE_MIB 256
+
+typedef struct CacheEntry {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    off_t size;
+    int codec;              // Codec setting the members were made for (a level or CODEC_AUTO)
+    size_t bytes;           // Size of the members
+    unsigned char *data;    // Members, or NULL when they are in the cache directory
+    struct CacheEntry *hash_next;
+    struct CacheEntry *newer, *older; // LRU list
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t num_buckets;
+    CacheEntry *newest, *oldest;
+    size_t bytes, limit;    // Bytes held and the cap; limit 0 disables the cache
+    size_t entries;
+    uint64_t hits, misses, evictions;
+    const char *dir;        // Cache directory, NULL to keep members in memory
+} MemberCache;
+
+MemberCache member_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, 0,
+                            (size_t)DEFAULT_CACHE_MIB << 20, 0, 0, 0, 0, NULL};
+
+// Members being collected by the sender for one file, committed once complete
+typedef struct CacheFill {
+    CacheEntry key;
+    unsigned char *data;
+    size_t len, cap;
+    int overflow;           // Grew past what the cache would keep; dropped at commit
+} CacheFill;
+
+size_t cache_hash(dev_t dev, ino_t ino, size_t buckets) {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev * 0xC2B2AE3D27D4EB4FULL;
+    return (h ^ h >> 29) % buckets;
+}
+
+void cache_entry_path(const MemberCache *c, const CacheEntry *e, char *path, size_t size) {
+    snprintf(path, size, "%s/%llx-%llx-%llx.%lx-%llx-%d.gz", c->dir, (unsigned long long)e->dev,
+             (unsigned long long)e->ino, (unsigned long long)e->mtime_sec, e->mtime_nsec,
+             (unsigned long long)e->size, e->codec);
+}
+
+int cache_match(const CacheEntry *e, const struct stat *st, int codec) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime_sec == st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec && e->codec == codec;
+}
+
+// LRU list maintenance, called with the lock held
+void cache_unlink(MemberCache *c, CacheEntry *e) {
+    if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+void cache_push_newest(MemberCache *c, CacheEntry *e) {
+    e->older = c->newest;
+    e->newer = NULL;
+    if (c->newest) c->newest->newer = e; else c->oldest = e;
+    c->newest = e;
+}
+
+// Remove an entry from every structure and free it (lock held)
+void cache_remove(MemberCache *c, CacheEntry *e) {
+    CacheEntry **link = &c->buckets[cache_hash(e->dev, e->ino, c->num_buckets)];
+    while (*link != e) link = &(*link)->hash_next;
+    *link = e->hash_next;
+    cache_unlink(c, e);
+    if (c->dir) {
+        char path[PATH_MAX];
+        cache_entry_path(c, e, path, sizeof(path));
+        unlink(path);  // Readers that already opened it keep their copy
+    }
+    c->bytes -= e->bytes;
+    c->entries--;
+    free(e->data);
+    free(e);
+}
+
+// Add an entry and evict from the old end until the cache fits its cap (lock held)
+void cache_insert(MemberCache *c, CacheEntry *e) {
+    size_t b = cache_hash(e->dev, e->ino, c->num_buckets);
+    e->hash_next = c->buckets[b];
+    c->buckets[b] = e;
+    cache_push_newest(c, e);
+    c->bytes += e->bytes;
+    c->entries++;
+    while (c->bytes > c->limit && c->oldest && c->oldest != e) {
+        cache_remove(c, c->oldest);
+        c->evictions++;
+    }
+}
+
+// Look the file up; on a hit return its members as a chunk ready for the sender
+// (a copy, or a reference to the cache file), which survives later eviction
+Chunk *cache_lookup(MemberCache *c, const struct stat *st, int codec) {
+    Chunk *out = NULL;
+    pthread_mutex_lock(&c->lock);
+    CacheEntry *e = c->buckets[cache_hash(st->st_dev, st->st_ino, c->num_buckets)];
+    while (e && !cache_match(e, st, codec)) e = e->hash_next;
+    if (e && c->dir) {
+        char path[PATH_MAX];
+        cache_entry_path(c, e, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && (out = chunk_alloc(0)) != NULL) {
+            out->fd = fd;
+            out->len = e->bytes;
+            futimens(fd, NULL);  // File times carry the LRU order across restarts
+        } else if (fd >= 0) {
+            close(fd);
+        } else {
+            cache_remove(c, e);  // Deleted behind our back
+            e = NULL;
+        }
+    } else if (e && (out = chunk_alloc(e->bytes)) != NULL) {
+        memcpy(out->data, e->data, e->bytes);
+        out->len = e->bytes;
+    }
+    if (out) {
+        cache_unlink(c, e);
+        cache_push_newest(c, e);
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return out;
+}
+
+CacheFill *cache_fill_new(const struct stat *st, int codec) {
+    CacheFill *f = calloc(1, sizeof(CacheFill));
+    if (!f) return NULL;
+    f->key.dev = st->st_dev;
+    f->key.ino = st->st_ino;
+    f->key.mtime_sec = st->st_mtim.tv_sec;
+    f->key.mtime_nsec = st->st_mtim.tv_nsec;
+    f->key.size = st->st_size;
+    f->key.codec = codec;
+    return f;
+}
+
+void cache_fill_append(CacheFill *f, const unsigned char *data, size_t len) {
+    if (f->overflow) return;
+    if (f->len + len > member_cache.limit / 8) {
+        f->overflow = 1;  // One file must not flush most of the cache
+        free(f->data);
+        f->data = NULL;
+        return;
+    }
+    if (f->len + len > f->cap) {
+        size_t cap = f->cap * 2 > f->len + len ? f->cap * 2 : f->len + len;
+        unsigned char *grown = realloc(f->data, cap);
+        if (!grown) {
+            f->overflow = 1;
+            return;
+        }
+        f->data = grown;
+        f->cap = cap;
+    }
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+}
+
+// Store the collected members (or drop them) and free the fill
+void cache_fill_commit(CacheFill *f, int keep) {
+    MemberCache *c = &member_cache;
+    CacheEntry *e = NULL;
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    if (keep && !f->overflow && f->len > 0 && (e = malloc(sizeof(CacheEntry))) != NULL) {
+        *e = f->key;
+        e->bytes = f->len;
+        e->data = NULL;
+        if (c->dir) {
+            // Written under a temporary name and renamed, so a crash never leaves half an entry
+            cache_entry_path(c, e, path, sizeof(path));
+            snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long)pthread_self());
+            int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0 || write_fully(fd, f->data, f->len) < 0 || close(fd) < 0) {
+                if (fd >= 0) unlink(tmp);
+                free(e);
+                e = NULL;
+            }
+        } else {
+            e->data = f->data;
+            f->data = NULL;
+        }
+    }
+    if (e) {
+        pthread_mutex_lock(&c->lock);
+        // Replace whatever is cached for this file: a stale version, or the same
+        // version filled by a concurrent archive
+        CacheEntry *old = c->buckets[cache_hash(e->dev, e->ino, c->num_buckets)];
+        while (old && !(old->dev == e->dev && old->ino == e->ino && old->codec == e->codec))
+            old = old->hash_next;
+        if (old) cache_remove(c, old);
+        if (c->dir && rename(tmp, path) < 0) {
+            unlink(tmp);
+            free(e);
+        } else {
+            cache_insert(c, e);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    free(f->data);
+    free(f);
+}
+
+// An entry found in the cache directory at startup and when it was last used
+typedef struct {
+    struct timespec used;
+    CacheEntry *entry;
+} CacheFound;
+
+int compare_found_age(const void *a, const void *b) {
+    const struct timespec *x = &((const CacheFound *)a)->used, *y = &((const CacheFound *)b)->used;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Set up the cache; with a directory, index the entries a previous run left there,
+// oldest first so the LRU order carries over
+void cache_init(MemberCache *c) {
+    c->num_buckets = 16384;
+    c->buckets = calloc(c->num_buckets, sizeof(CacheEntry *));
+    if (!c->buckets)
+        error("ERROR allocating cache");
+    if (!c->dir || c->limit == 0)
+        return;
+    if (mkdir(c->dir, 0700) < 0 && errno != EEXIST)
+        error("ERROR creating cache directory");
+    DIR *dir = opendir(c->dir);
+    if (!dir)
+        error("ERROR opening cache directory");
+
+    CacheFound *found = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        unsigned long long dev, ino, msec, size;
+        unsigned long mnsec;
+        int codec, end = 0;
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", c->dir, d->d_name);
+        if (sscanf(d->d_name, "%llx-%llx-%llx.%lx-%llx-%d.gz%n", &dev, &ino, &msec, &mnsec, &size, &codec, &end) != 6 ||
+            d->d_name[end] != '\0') {
+            if (strstr(d->d_name, ".tmp")) unlink(path);  // Interrupted write
+            continue;
+        }
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            CacheFound *grown = realloc(found, cap * sizeof(CacheFound));
+            if (!grown) break;
+            found = grown;
+        }
+        CacheEntry *e = calloc(1, sizeof(CacheEntry));
+        if (!e) break;
+        e->dev = dev;
+        e->ino = ino;
+        e->mtime_sec = msec;
+        e->mtime_nsec = mnsec;
+        e->size = size;
+        e->codec = codec;
+        e->bytes = st.st_size;
+        found[count].used = st.st_mtim;
+        found[count++].entry = e;
+    }
+    closedir(dir);
+    if (found) qsort(found, count, sizeof(CacheFound), compare_found_age);
+    for (size_t i = 0; i < count; i++)
+        cache_insert(c, found[i].entry);
+    printf("Member cache: %zu entries, %zu MiB loaded from %s\n", c->entries, c->bytes >> 20, c->dir);
+    free(found);
+}
+
+// ---- Result cache ----
+// Finished archive responses are kept as files, keyed by the normalized command
+// and a generation token of the tree. The token hashes the mtime of every
+// directory under HOME, so it changes whenever a file is created, removed or
+// renamed anywhere in the tree. A file edited in place does not touch its directory:
+// on a hit the files that went into the archive are checked again, and
+// the TTL bounds how long a file that changed into a predicate can be missed.
+#define DEFAULT_RESULT_MIB 512
+#define DEFAULT_RESULT_TTL 300
+
+// A file that went into a cached archive, checked again before the archive is reused
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} ResultFile;
+
+#define FLIGHT_RUNNING 0
+#define FLIGHT_OK 1         // Complete archive in the spool
+#define FLIGHT_NOT_FOUND 2  // Nothing matched
+#define FLIGHT_FAILED 3
+
+// An archive command being answered that identical commands arriving meanwhile
+// attach to: they stream the leader's spool as it grows instead of running again
+typedef struct Flight {
+    char *key;
+    char path[PATH_MAX];    // The leader's spool
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    uint64_t bytes;         // Spooled so far
+    int frame_type;
+    int state;              // FLIGHT_*
+    int broken;             // The spool is incomplete; followers cannot go on
+    int refs;
+    struct Flight *next;
+} Flight;
+
+// Copy of an archive response as it is sent, read by followers of its flight
+// and kept in the result cache afterwards, together with the files that went in
+typedef struct ResultSpool {
+    int fd;
+    char path[PATH_MAX];
+    uint64_t bytes;
+    int frame_type;
+    int complete;       // The sender finished the response without error
+    int not_found;      // The sender answered that nothing matched
+    int broken;         // A write failed: the copy is unusable
+    int discard;        // Usable, but not to be kept (too large, or a file changed while read)
+    Flight *flight;     // Followers to wake as the spool grows, or NULL
+    ResultFile *files;
+    size_t num_files, files_cap;
+} ResultSpool;
+
+typedef struct ResultEntry {
+    char *key;              // Normalized command, codec included
+    uint64_t id;            // Serial number, tells a replaced entry from the one looked at
+    uint64_t generation;
+    time_t created;
+    char *path;             // The response payload
+    uint64_t bytes;
+    int frame_type;
+    ResultFile *files;
+    size_t num_files;
+    struct ResultEntry *newer, *older; // LRU list
+} ResultEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ResultEntry *newest, *oldest;
+    size_t entries;
+    uint64_t bytes, limit;  // limit 0 disables the cache
+    int ttl;                // Seconds a result may be served
+    uint64_t hits, misses, expired, invalidated, evicted;
+    uint64_t next_id;
+    char dir[96];           // Spools and results; empty if no private directory could be had
+} ResultCache;
+
+ResultCache result_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, (uint64_t)DEFAULT_RESULT_MIB << 20,
+                            DEFAULT_RESULT_TTL, 0, 0, 0, 0, 0, 0, ""};
+
+// One result may take a quarter of the cache
+size_t result_entry_limit() {
+    return result_cache.limit / 4;
+}
+
+// Tell followers how far the spool has got
+void result_spool_progress(ResultSpool *s) {
+    Flight *f = s->flight;
+    if (!f) return;
+    pthread_mutex_lock(&f->lock);
+    f->bytes = s->bytes;
+    f->broken = s->broken;
+    pthread_cond_broadcast(&f->progress);
+    pthread_mutex_unlock(&f->lock);
+}
+
+void result_spool_write(ResultSpool *s, const void *data, size_t len) {
+    if (s->broken) return;
+    if (write_fully(s->fd, data, len) < 0)
+        s->broken = 1;
+    else
+        s->bytes += len;
+    if (s->bytes > result_entry_limit())
+        s->discard = 1;
+    result_spool_progress(s);
+}
+
+// Copy len bytes of a file into the spool without passing them through user space.
+// Like the sender, zero-fill if the file shrank.
+void result_spool_copy(ResultSpool *s, int fd, off_t offset, size_t len) {
+    if (s->broken) return;
+    while (len > 0) {
+        ssize_t n = copy_file_range(fd, &offset, s->fd, NULL, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            unsigned char zeros[IO_CHUNK] = {0};
+            n = len < sizeof(zeros) ? len : sizeof(zeros);
+            if (write_fully(s->fd, zeros, n) < 0) {
+                s->broken = 1;
+                break;
+            }
+            s->discard = 1;
+        }
+        len -= n;
+        s->bytes += n;
+    }
+    if (s->bytes > result_entry_limit())
+        s->discard = 1;
+    result_spool_progress(s);
+}
+
+void result_spool_add_file(ResultSpool *s, const char *path, const struct stat *st) {
+    if (s->discard) return;
+    if (s->num_files == s->files_cap) {
+        size_t cap = s->files_cap ? s->files_cap * 2 : 64;
+        ResultFile *grown = realloc(s->files, cap * sizeof(ResultFile));
+        if (!grown) {
+            s->discard = 1;
+            return;
+        }
+        s->files = grown;
+        s->files_cap = cap;
+    }
+    ResultFile *f = &s->files[s->num_files];
+    if (!(f->path = strdup(path))) {
+        s->discard = 1;
+        return;
+    }
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->size = st->st_size;
+    f->mtime = st->st_mtim;
+    s->num_files++;
+}
+
+// A matched file waiting to be read (traverse -> read)
+typedef struct {
+    char *path;
+    struct stat st;
+    uint64_t location;  // Physical byte offset of the first extent, for layout ordering
+    int has_extent;     // location came from FIEMAP
+} FileItem;
+
+#define ORDER_WALK 0    // Files are read in the order the walk finds them
+#define ORDER_DISK 1    // Sorted by physical location (FIEMAP, else inode number)
+#define ORDER_EXT 2     // Grouped by extension, physical location within a group
+
+int file_order = ORDER_WALK;  // -o walk|disk|ext
+
+// One archive response, built by four stages connected by bounded queues:
+// the walk (calling thread) -> reader -> compressors -> sender. A full queue
+// blocks the stage feeding it, so memory stays constant and every stage
+// overlaps with the others. The compressor stage is several threads, each
+// turning whole blocks into gzip members; the sender puts them back in order.
+// The stages run on threads started once (see pipeline_pools_start).
+typedef struct {
+    Reply *reply;
+    WorkQueue files;    // FileItem: traverse -> read
+    WorkQueue raw;      // Chunk of tar stream: read -> compress
+    WorkQueue packed;   // Chunk holding one gzip member: compress -> send
+    Chunk *current;     // Reader's partially filled block
+    int store_mode;     // Reader is copying a file that will not compress
+    struct CacheFill *fill; // Reader is copying a file whose members will be cached
+    uint64_t blocks;    // Blocks handed to the compressors so far
+    int codec;          // Requested level, LEVEL_NONE for plain tar, or CODEC_AUTO
+    int level;          // Level the compressors use for the next block
+    uint64_t stored_bytes; // File bytes passed through uncompressed
+    // Rates sampled for CODEC_AUTO since the last adjustment
+    uint64_t comp_in, comp_ns;  // Raw bytes compressed and compressor time
+    uint64_t comp_out;          // Compressed bytes produced
+    uint64_t send_bytes, send_ns; // Bytes written to the socket and time spent writing
+    uint64_t send_cpu_ns;       // CPU time of the sender thread, for CPU-per-GB figures
+    uint64_t zc_copied;         // Zero-copy sends the kernel had to copy anyway
+    int zc_used;                // MSG_ZEROCOPY was enabled on the socket
+    int compressors_running; // Compressor threads still working, the last one closes packed
+    int num_compressors;
+    int failed;         // Set when the client can no longer be written to
+    int files_added;    // Files added to the tar stream
+    uint64_t raw_bytes; // Tar bytes produced
+    uint64_t bytes_sent;// Compressed bytes written to the client
+    int cache_hits, cache_misses; // Member cache lookups for this archive
+    int stages_running; // Stage runs not yet finished, under stage_lock
+    pthread_mutex_t stage_lock;
+    pthread_cond_t stages_done;
+    FileItem **held;    // Ordered modes: the whole match set, sorted before reading
+    size_t num_held, held_cap;
+} ArchivePipeline;
+
+int pipeline_failed(ArchivePipeline *p) {
+    return __atomic_load_n(&p->failed, __ATOMIC_RELAXED);
+}
+
+// Receives the bytes of a tar stream
+typedef void (*byte_sink)(void *arg, const void *data, size_t len);
+
+// Fill in the checksum of a 512-byte tar header
+void tar_checksum(unsigned char *h) {
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < 512; i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+}
+
+// Store a numeric header field in octal, or base-256 when it does not fit (sizes past 8 GiB)
+void tar_number(unsigned char *field, int width, uint64_t value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf((char *)field, width, "%0*llo", width - 1, (unsigned long long)value);
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = 0x80;
+    for (int i = width - 1; i > 0 && value; i--, value >>= 8)
+        field[i] = value & 0xff;
+}
+
+// Write the ustar header(s) for one member; names that do not fit get a GNU long-name entry
+void tar_write_header(byte_sink out, void *arg, const char *name, const struct stat *st, char type) {
+    unsigned char h[512];
+    size_t len = strlen(name);
+
+    memset(h, 0, sizeof(h));
+    if (len > 100) {
+        // Try the ustar prefix/name split at a '/' first
+        const char *split = NULL;
+        for (const char *p = name + len - 1; p > name; p--) {
+            if (*p == '/' && (size_t)(p - name) <= 155 && strlen(p + 1) <= 100 && p[1]) {
+                split = p;
+                break;
+            }
+        }
+        if (split) {
+            memcpy(h + 345, name, split - name);
+            memcpy(h, split + 1, strlen(split + 1));
+        } else {
+            unsigned char lh[512], pad[512] = {0};
+            memset(lh, 0, sizeof(lh));
+            strcpy((char *)lh, "././@LongLink");
+            tar_number(lh + 100, 8, 0644);
+            tar_number(lh + 108, 8, 0);
+            tar_number(lh + 116, 8, 0);
+            tar_number(lh + 124, 12, len + 1);
+            tar_number(lh + 136, 12, 0);
+            lh[156] = 'L';
+            memcpy(lh + 257, "ustar  ", 8);  // GNU magic
+            tar_checksum(lh);
+            out(arg, lh, 512);
+            out(arg, name, len + 1);
+            out(arg, pad, (512 - (len + 1) % 512) % 512);
+            memcpy(h, name, 100);
+        }
+    } else {
+        memcpy(h, name, len);
+    }
+    tar_number(h + 100, 8, st->st_mode & 07777);
+    tar_number(h + 108, 8, st->st_uid);
+    tar_number(h + 116, 8, st->st_gid);
+    tar_number(h + 124, 12, type == '0' ? (uint64_t)st->st_size : 0);
+    tar_number(h + 136, 12, st->st_mtime > 0 ? (uint64_t)st->st_mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    tar_checksum(h);
+    out(arg, h, 512);
+}
+
+// Hand the reader's current block to the compressors
+void pipeline_push_raw(ArchivePipeline *p) {
+    if (p->current && (p->current->len > 0 || p->current->fill_last)) {
+        p->current->seq = p->blocks++;
+        if (queue_push(&p->raw, p->current) < 0)
+            chunk_free(p->current);
+        p->current = NULL;
+    }
+}
+
+// Make sure the reader has a chunk with free space; returns NULL if out of memory
+Chunk *pipeline_chunk(ArchivePipeline *p) {
+    if (p->current && (p->current->len == p->current->cap || p->current->store != p->store_mode ||
+                       p->current->fill != p->fill))
+        pipeline_push_raw(p);
+    if (!p->current && (p->current = chunk_alloc(block_size)) != NULL) {
+        p->current->store = p->store_mode;
+        p->current->fill = p->fill;
+    }
+    return p->current;
+}
+
+// byte_sink for the reader: append tar bytes to the current chunk
+void pipeline_emit(void *arg, const void *data, size_t len) {
+    ArchivePipeline *p = arg;
+    const unsigned char *src = data;
+    while (len > 0) {
+        Chunk *c = pipeline_chunk(p);
+        if (!c) {
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        size_t n = c->cap - c->len;
+        if (n > len) n = len;
+        memcpy(c->data + c->len, src, n);
+        c->len += n;
+        src += n;
+        len -= n;
+        p->raw_bytes += n;
+    }
+}
+
+// Extensions of formats that are already compressed
+const char *compressed_exts[] = {"gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar", "apk",
+                                 "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "aac", "ogg", "flac",
+                                 "mp4", "mkv", "mov", "avi", "webm", "docx", "xlsx", "pptx", "odt", NULL};
+
+// Decide whether a file's content is already compressed, from its extension or,
+// failing that, the Shannon entropy of its first bytes
+int is_incompressible(int fd, const char *path, off_t size) {
+    if (size < STORE_MIN_SIZE)
+        return 0;
+    const char *ext = strrchr(path, '.');
+    if (ext && !strchr(ext, '/')) {
+        for (int i = 0; compressed_exts[i]; i++)
+            if (strcasecmp(ext + 1, compressed_exts[i]) == 0)
+                return 1;
+    }
+
+    unsigned char sample[STORE_SAMPLE];
+    ssize_t n = pread(fd, sample, sizeof(sample), 0);
+    if (n < 512)
+        return 0;
+    unsigned counts[256] = {0};
+    for (ssize_t i = 0; i < n; i++) counts[sample[i]]++;
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (!counts[i]) continue;
+        double f = (double)counts[i] / n;
+        entropy -= f * log2(f);
+    }
+    return entropy > STORE_ENTROPY;
+}
+
+// ---- Batched file ingest ----
+// The reader takes matched files in batches and has their open, stat and first
+// INGEST_BUFFER bytes done concurrently, so a tree of small files is not read one
+// blocking syscall at a time. With io_uring the whole batch is a few io_uring_enter()
+// calls; where io_uring is missing or disabled (-q 0) a shared thread pool does the
+// same work with plain syscalls.
+#define DEFAULT_INGEST_DEPTH 64     // io_uring entries per archive (-q)
+#define INGEST_THREADS 8            // Fallback pool size
+#define INGEST_BUFFER IO_CHUNK      // Bytes read ahead per file; larger files stream the rest
+
+int ingest_depth = DEFAULT_INGEST_DEPTH;
+int ingest_uring = 1;               // io_uring worked when probed at startup
+WorkQueue ingest_queue;             // IngestSlot jobs for the fallback pool
+
+// Minimal io_uring: the raw syscalls and the two mmap'd rings
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned queued;    // SQEs filled in but not yet submitted
+} Uring;
+
+int uring_init(Uring *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(r, 0, sizeof(*r));
+    memset(&params, 0, sizeof(params));
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) return -1;
+    r->entries = params.sq_entries;
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) goto fail;
+    }
+    r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    close(r->fd);
+    return -1;
+}
+
+void uring_destroy(Uring *r) {
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+// Next free submission entry, cleared, or NULL when the ring is full
+struct io_uring_sqe *uring_sqe(Uring *r) {
+    unsigned tail = *r->sq_tail + r->queued;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+        return NULL;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->queued++;
+    return sqe;
+}
+
+// Submit the queued entries and wait until wait_for completions are available
+int uring_submit(Uring *r, unsigned wait_for) {
+    unsigned submit = r->queued;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+    r->queued = 0;
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, r->fd, submit, wait_for, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0 || errno != EINTR) return n;
+        submit = 0;  // Already consumed by the interrupted call
+    }
+}
+
+// Pop one completion; returns 0 when the queue is empty
+int uring_complete(Uring *r, uint64_t *user_data, int *res) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// One file of a batch and what the ingest engine found out about it
+typedef struct IngestSlot {
+    FileItem *item;
+    int fd;             // Open file, or -errno
+    struct stat st;
+    int stat_ok;
+    ssize_t got;        // Bytes read into buf, or -errno
+    unsigned char *buf; // INGEST_BUFFER bytes, part of the registered region
+    struct IngestBatch *batch;
+    struct statx stx;   // io_uring statx target
+} IngestSlot;
+
+// Completion count for a batch handed to the fallback pool
+typedef struct IngestBatch {
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} IngestBatch;
+
+typedef struct {
+    Uring ring;
+    int use_ring;
+    int fixed;          // Buffers are registered, reads use IORING_OP_READ_FIXED
+    int batch_max;      // Files per batch: half the ring, each file takes one entry per round
+    unsigned char *buffers;
+    IngestSlot *slots;
+    IngestBatch batch;
+} IngestEngine;
+
+int ingest_init(IngestEngine *e) {
+    memset(e, 0, sizeof(*e));
+    if (ingest_uring) {
+        if (uring_init(&e->ring, ingest_depth) < 0)
+            return -1;  // Out of locked memory or similar: the reader goes file by file
+        e->use_ring = 1;
+    }
+    e->batch_max = e->use_ring ? (int)e->ring.entries / 2 : INGEST_THREADS * 4;
+    e->buffers = mmap(NULL, (size_t)e->batch_max * INGEST_BUFFER, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    e->slots = calloc(e->batch_max, sizeof(IngestSlot));
+    if (e->buffers == MAP_FAILED || !e->slots) {
+        if (e->buffers != MAP_FAILED) munmap(e->buffers, (size_t)e->batch_max * INGEST_BUFFER);
+        free(e->slots);
+        if (e->use_ring) uring_destroy(&e->ring);
+        return -1;
+    }
+    for (int i = 0; i < e->batch_max; i++) {
+        e->slots[i].buf = e->buffers + (size_t)i * INGEST_BUFFER;
+        e->slots[i].batch = &e->batch;
+    }
+    if (e->use_ring) {
+        // Registered buffers spare the kernel from pinning pages on every read
+        struct iovec *iov = calloc(e->batch_max, sizeof(struct iovec));
+        if (iov) {
+            for (int i = 0; i < e->batch_max; i++) {
+                iov[i].iov_base = e->slots[i].buf;
+                iov[i].iov_len = INGEST_BUFFER;
+            }
+            e->fixed = syscall(__NR_io_uring_register, e->ring.fd, IORING_REGISTER_BUFFERS, iov, e->batch_max) == 0;
+            free(iov);
+        }
+    }
+    pthread_mutex_init(&e->batch.lock, NULL);
+    pthread_cond_init(&e->batch.done, NULL);
+    return 0;
+}
+
+void ingest_destroy(IngestEngine *e) {
+    if (e->use_ring) uring_destroy(&e->ring);  // Closing the ring also drops the registration
+    munmap(e->buffers, (size_t)e->batch_max * INGEST_BUFFER);
+    free(e->slots);
+    pthread_mutex_destroy(&e->batch.lock);
+    pthread_cond_destroy(&e->batch.done);
+}
+
+// Fallback path: open, stat and read the head of one file with ordinary syscalls
+void ingest_slot_sync(IngestSlot *s) {
+    s->fd = open(s->item->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (s->fd < 0) {
+        s->fd = -errno;
+        return;
+    }
+    s->stat_ok = fstat(s->fd, &s->st) == 0;
+    s->got = 0;
+    if (s->stat_ok && S_ISREG(s->st.st_mode) && s->st.st_size > 0) {
+        size_t want = s->st.st_size < INGEST_BUFFER ? s->st.st_size : INGEST_BUFFER;
+        s->got = pread(s->fd, s->buf, want, 0);
+        if (s->got < 0) s->got = -errno;
+    }
+}
+
+// Fallback pool thread
+void *ingest_thread(void *arg) {
+    IngestSlot *s;
+    (void)arg;
+    while ((s = queue_pop(&ingest_queue)) != NULL) {
+        ingest_slot_sync(s);
+        pthread_mutex_lock(&s->batch->lock);
+        if (--s->batch->pending == 0)
+            pthread_cond_signal(&s->batch->done);
+        pthread_mutex_unlock(&s->batch->lock);
+    }
+    return NULL;
+}
+
+void statx_to_stat(const struct statx *x, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = x->stx_mode;
+    st->st_uid = x->stx_uid;
+    st->st_gid = x->stx_gid;
+    st->st_size = x->stx_size;
+    st->st_nlink = x->stx_nlink;
+    st->st_ino = x->stx_ino;
+    st->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+// Wait for expected completions, handing each to done
+void uring_wait_all(Uring *r, int expected, void (*done)(IngestEngine *, uint64_t, int), IngestEngine *e) {
+    uint64_t tag;
+    int res;
+    while (expected > 0) {
+        if (!uring_complete(r, &tag, &res)) {
+            uring_submit(r, 1);
+            continue;
+        }
+        done(e, tag, res);
+        expected--;
+    }
+}
+
+void ingest_opened(IngestEngine *e, uint64_t tag, int res) {
+    e->slots[tag].fd = res;
+}
+
+// A kernel that cannot statx a descriptor in the ring still has fstat()
+void ingest_statted(IngestEngine *e, uint64_t tag, int res) {
+    IngestSlot *s = &e->slots[tag];
+    if (res == 0) statx_to_stat(&s->stx, &s->st);
+    s->stat_ok = res == 0 || fstat(s->fd, &s->st) == 0;
+}
+
+void ingest_read(IngestEngine *e, uint64_t tag, int res) {
+    e->slots[tag].got = res;
+}
+
+// io_uring path: a round of opens for the batch, a round of statx on the
+// descriptors they returned, then a round of reads. The stat must describe the
+// file that was opened, not whatever the path names by then, and O_NONBLOCK
+// keeps a path swapped for a FIFO since the walk from blocking the open.
+void ingest_batch_uring(IngestEngine *e, int n) {
+    Uring *r = &e->ring;
+    for (int i = 0; i < n; i++) {
+        IngestSlot *s = &e->slots[i];
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)s->item->path;
+        sqe->open_flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+        sqe->user_data = i;
+    }
+    if (uring_submit(r, n) < 0) {
+        for (int i = 0; i < n; i++) ingest_slot_sync(&e->slots[i]);
+        return;
+    }
+    uring_wait_all(r, n, ingest_opened, e);
+
+    int expected = 0;
+    for (int i = 0; i < n; i++) {
+        IngestSlot *s = &e->slots[i];
+        if (s->fd < 0) continue;
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = s->fd;
+        sqe->addr = (uint64_t)(uintptr_t)"";
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&s->stx;
+        sqe->user_data = i;
+        expected++;
+    }
+    if (expected > 0 && uring_submit(r, expected) < 0) {
+        for (int i = 0; i < n; i++)
+            if (e->slots[i].fd >= 0) e->slots[i].stat_ok = fstat(e->slots[i].fd, &e->slots[i].st) == 0;
+    } else {
+        uring_wait_all(r, expected, ingest_statted, e);
+    }
+
+    expected = 0;
+    for (int i = 0; i < n; i++) {
+        IngestSlot *s = &e->slots[i];
+        s->got = 0;
+        if (s->fd < 0 || !s->stat_ok || !S_ISREG(s->st.st_mode) || s->st.st_size == 0)
+            continue;
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = e->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = s->fd;
+        sqe->addr = (uint64_t)(uintptr_t)s->buf;
+        sqe->len = s->st.st_size < INGEST_BUFFER ? s->st.st_size : INGEST_BUFFER;
+        sqe->off = 0;
+        sqe->buf_index = i;
+        sqe->user_data = i;
+        expected++;
+    }
+    if (expected > 0 && uring_submit(r, expected) < 0) {
+        for (int i = 0; i < n; i++) {
+            IngestSlot *s = &e->slots[i];
+            if (s->fd >= 0 && s->stat_ok && S_ISREG(s->st.st_mode) && s->st.st_size > 0) {
+                s->got = pread(s->fd, s->buf, s->st.st_size < INGEST_BUFFER ? s->st.st_size : INGEST_BUFFER, 0);
+                if (s->got < 0) s->got = -errno;
+            }
+        }
+        return;
+    }
+    uring_wait_all(r, expected, ingest_read, e);
+}
+
+// Open, stat and read ahead every file of the batch in slots[0..n)
+void ingest_batch(IngestEngine *e, int n) {
+    for (int i = 0; i < n; i++) {
+        e->slots[i].fd = -1;
+        e->slots[i].stat_ok = 0;
+        e->slots[i].got = 0;
+    }
+    if (e->use_ring) {
+        ingest_batch_uring(e, n);
+        // Kernels with io_uring but without these opcodes answer -EINVAL
+        for (int i = 0; i < n; i++)
+            if (e->slots[i].fd == -EINVAL)
+                ingest_slot_sync(&e->slots[i]);
+        return;
+    }
+    e->batch.pending = n;
+    for (int i = 0; i < n; i++) {
+        if (queue_push(&ingest_queue, &e->slots[i]) < 0) {
+            ingest_slot_sync(&e->slots[i]);
+            e->batch.pending--;
+        }
+    }
+    pthread_mutex_lock(&e->batch.lock);
+    while (e->batch.pending > 0)
+        pthread_cond_wait(&e->batch.done, &e->batch.lock);
+    pthread_mutex_unlock(&e->batch.lock);
+}
+
+// Check once at startup whether io_uring can be used (it may be compiled out or
+// disabled by sysctl/seccomp)
+void ingest_probe() {
+    Uring probe;
+    ingest_uring = ingest_depth >= 2 && uring_init(&probe, 2) == 0;
+    if (ingest_uring)
+        uring_destroy(&probe);
+}
+
+// Append one file to the tar stream. The first `have` bytes are already in head;
+// the rest is read straight into the chunk buffers. Takes ownership of fd.
+void pipeline_append_file(ArchivePipeline *p, const char *path, int fd, const struct stat *stp,
+                          const unsigned char *head, size_t have) {
+    struct stat st = *stp;
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        return;  // Replaced by something else since the walk saw it
+    }
+
+    // Member names are relative, like tar's "Removing leading '/'"
+    const char *name = path;
+    while (*name == '/') name++;
+    tar_write_header(pipeline_emit, p, name, &st, '0');
+    if (p->reply->spool)
+        result_spool_add_file(p->reply->spool, path, &st);
+
+    // Already-compressed content gets blocks of its own that are stored, not deflated
+    if (p->codec != LEVEL_NONE && is_incompressible(fd, path, st.st_size)) {
+        p->store_mode = 1;
+        p->stored_bytes += st.st_size;
+    }
+
+    // Large enough files get members of their own: sent from the cache if an
+    // earlier archive compressed this version, otherwise compressed and collected
+    if (p->codec != LEVEL_NONE && member_cache.limit > 0 && st.st_size >= CACHE_MIN_SIZE) {
+        pipeline_push_raw(p);  // The header ends the current block
+        Chunk *hit = cache_lookup(&member_cache, &st, p->codec);
+        if (hit) {
+            hit->packed = 1;
+            hit->seq = p->blocks++;
+            if (queue_push(&p->raw, hit) < 0)
+                chunk_free(hit);
+            p->raw_bytes += st.st_size + (512 - st.st_size % 512) % 512;
+            p->cache_hits++;
+            p->store_mode = 0;
+            close(fd);
+            p->files_added++;
+            return;
+        }
+        p->fill = cache_fill_new(&st, p->codec);
+        p->cache_misses++;
+    }
+
+    // Plain tar: large files are not read here at all, the sender splices them
+    // from the page cache to the socket with sendfile()
+    if (p->codec == LEVEL_NONE && zero_copy && st.st_size >= IO_CHUNK) {
+        Chunk *ref = chunk_alloc(0);
+        if (ref) {
+            pipeline_push_raw(p);
+            ref->fd = fd;
+            ref->len = st.st_size;
+            ref->seq = p->blocks++;
+            if (queue_push(&p->raw, ref) < 0)
+                chunk_free(ref);
+            p->raw_bytes += st.st_size;
+            unsigned char pad[512] = {0};
+            pipeline_emit(p, pad, (512 - st.st_size % 512) % 512);
+            p->files_added++;
+            return;  // The chunk owns fd now
+        }
+    }
+
+    // Copy exactly st_size bytes: zero-fill if the file shrank, stop if it grew
+    if (have > (uint64_t)st.st_size) have = st.st_size;
+    pipeline_emit(p, head, have);
+    uint64_t remaining = st.st_size - have;
+    while (remaining > 0 && !pipeline_failed(p)) {
+        Chunk *c = pipeline_chunk(p);
+        if (!c) break;
+        size_t want = c->cap - c->len;
+        if (want > remaining) want = remaining;
+        if (want > IO_CHUNK) want = IO_CHUNK;
+        ssize_t n = pread(fd, c->data + c->len, want, st.st_size - remaining);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            memset(c->data + c->len, 0, want);  // File shrank under us
+            n = want;
+        }
+        c->len += n;
+        p->raw_bytes += n;
+        remaining -= n;
+    }
+    unsigned char pad[512] = {0};
+    pipeline_emit(p, pad, (512 - st.st_size % 512) % 512);
+    if (p->fill) {
+        // Padding belongs to the file's members; cut so the next header starts a new block.
+        // The sender commits the fill when it reaches the block marked last.
+        Chunk *c = pipeline_chunk(p);
+        if (c) {
+            c->fill_last = 1;
+            pipeline_push_raw(p);
+        } else {
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+        }
+        p->fill = NULL;
+    }
+    p->store_mode = 0;
+    close(fd);
+    p->files_added++;
+}
+
+// Append one file to the tar stream without read-ahead
+void pipeline_read_file(ArchivePipeline *p, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;  // Vanished or unreadable since the walk saw it; skip like tar does
+    }
+    pipeline_append_file(p, path, fd, &st, NULL, 0);
+}
+
+// Reader stage: turn matched files into tar stream chunks, a batch at a time
+void *pipeline_reader(void *arg) {
+    ArchivePipeline *p = arg;
+    IngestEngine engine;
+    int batched = ingest_init(&engine) == 0;
+    while (1) {
+        // Do not sit on a partial block while the walk is slow: ship the first
+        // block at once for a quick first byte, later ones once reasonably full
+        if (p->current && queue_length(&p->files) == 0 &&
+            (p->blocks == 0 || p->current->len >= p->current->cap / 4))
+            pipeline_push_raw(p);
+        FileItem *item = queue_pop(&p->files);
+        if (item == NULL)
+            break;
+        if (!batched) {
+            if (!pipeline_failed(p))
+                pipeline_read_file(p, item->path);
+            free(item->path);
+            free(item);
+            continue;
+        }
+        // Take whatever else the walk has queued, up to a batch; the reader is the
+        // only consumer, so a non-empty queue never blocks
+        int n = 0;
+        engine.slots[n].fd = -1;
+        engine.slots[n++].item = item;
+        while (n < engine.batch_max && queue_length(&p->files) > 0) {
+            engine.slots[n].fd = -1;
+            engine.slots[n++].item = queue_pop(&p->files);
+        }
+        if (!pipeline_failed(p))
+            ingest_batch(&engine, n);
+        for (int i = 0; i < n; i++) {
+            IngestSlot *s = &engine.slots[i];
+            if (!pipeline_failed(p) && s->fd >= 0 && s->stat_ok)
+                pipeline_append_file(p, s->item->path, s->fd, &s->st, s->buf, s->got > 0 ? s->got : 0);
+            else if (s->fd >= 0)
+                close(s->fd);
+            free(s->item->path);
+            free(s->item);
+        }
+    }
+    if (batched) ingest_destroy(&engine);
+    if (p->files_added > 0) {
+        unsigned char zeros[1024] = {0};  // End-of-archive marker
+        pipeline_emit(p, zeros, sizeof(zeros));
+    }
+    pipeline_push_raw(p);
+    chunk_free(p->current);
+    p->current = NULL;
+    queue_close(&p->raw);
+    return NULL;
+}
+
+// Compressor stage, one of several threads: turn each block into a gzip member
+void *pipeline_compressor(void *arg) {
+    ArchivePipeline *p = arg;
+    Deflater *d = malloc(sizeof(Deflater));
+    Chunk *c;
+    if (!d)
+        __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+    while ((c = queue_pop(&p->raw)) != NULL) {
+        Chunk *member = NULL;
+        if (p->codec == LEVEL_NONE || c->packed) {
+            member = c;  // Plain tar or cached members: blocks go to the sender untouched
+            c = NULL;
+        } else if (d && !pipeline_failed(p)) {
+            struct timespec t0, t1;
+            int level = c->store ? LEVEL_NONE : __atomic_load_n(&p->level, __ATOMIC_RELAXED);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            member = gzip_block(d, level, c->data, c->len);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (!member) {
+                __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            } else if (!c->store) {
+                __atomic_add_fetch(&p->comp_in, c->len, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&p->comp_out, member->len, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&p->comp_ns, (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec,
+                                   __ATOMIC_RELAXED);
+            }
+        }
+        if (member && c) {
+            member->seq = c->seq;
+            member->fill = c->fill;  // The fill travels on with the member
+            member->fill_last = c->fill_last;
+            c->fill_last = 0;
+        }
+        if (member) {
+            if (queue_push(&p->packed, member) < 0)
+                chunk_free(member);
+        }
+        chunk_free(c);
+    }
+    free(d);
+    if (__atomic_sub_fetch(&p->compressors_running, 1, __ATOMIC_ACQ_REL) == 0)
+        queue_close(&p->packed);
+    return NULL;
+}
+
+#define ADAPT_INTERVAL 8        // Blocks sent between two CODEC_AUTO level adjustments
+
+// CODEC_AUTO: compare how fast the compressors produce with how fast the socket
+// drains, both in raw tar bytes per second. If the link is the bottleneck, extra
+// CPU spent on compression is free, so raise the level; if the compressors are,
+// lower it.
+void pipeline_adapt_level(ArchivePipeline *p) {
+    uint64_t comp_in = __atomic_exchange_n(&p->comp_in, 0, __ATOMIC_RELAXED);
+    uint64_t comp_out = __atomic_exchange_n(&p->comp_out, 0, __ATOMIC_RELAXED);
+    uint64_t comp_ns = __atomic_exchange_n(&p->comp_ns, 0, __ATOMIC_RELAXED);
+    uint64_t send_bytes = p->send_bytes, send_ns = p->send_ns;
+    p->send_bytes = p->send_ns = 0;
+    if (!comp_in || !comp_out || !comp_ns || !send_bytes)
+        return;
+
+    double cpu_rate = (double)comp_in / comp_ns * p->num_compressors;  // Raw bytes/ns all compressors can take
+    double ratio = (double)comp_in / comp_out;
+    double net_rate = send_ns ? (double)send_bytes / send_ns * ratio : cpu_rate * 2;  // Raw bytes/ns the link carries
+    int level = p->level;
+    if (cpu_rate > net_rate * 1.5 && level < LEVEL_MAX)
+        level++;
+    else if (cpu_rate < net_rate && level > LEVEL_FAST)
+        level--;
+    __atomic_store_n(&p->level, level, __ATOMIC_RELAXED);
+}
+
+// Sender stage: write gzip members as ARCHIVE frames in block order.
+// The socket is corked for the whole response so frame headers and payloads
+// leave in full segments; uncorking at the end pushes out the tail.
+void *pipeline_sender(void *arg) {
+    ArchivePipeline *p = arg;
+    Chunk *c, *early = NULL;  // Members that finished ahead of their turn, sorted by seq
+    uint64_t next_seq = 0;
+    int sent_any = 0;
+    int frame_type = p->codec == LEVEL_NONE ? W24_TYPE_TAR : W24_TYPE_ARCHIVE;
+    int cork = 1;
+    ZeroCopySender zc;
+    struct timespec cpu0, cpu1;
+
+    zc_init(&zc, p->reply);
+    setsockopt(p->reply->sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    while ((c = queue_pop(&p->packed)) != NULL) {
+        Chunk **link = &early;
+        while (*link && (*link)->seq < c->seq) link = &(*link)->next;
+        c->next = *link;
+        *link = c;
+        while (early && early->seq == next_seq) {
+            c = early;
+            early = c->next;
+            next_seq++;
+            if (pipeline_failed(p)) {
+                chunk_free(c);  // After a failure keep draining so upstream stages never block
+                continue;
+            }
+            struct timespec t0, t1;
+            size_t len = c->len;
+            if (p->reply->spool) {
+                if (c->fd >= 0)
+                    result_spool_copy(p->reply->spool, c->fd, c->offset, c->len);
+                else
+                    result_spool_write(p->reply->spool, c->data, c->len);
+            }
+            if (c->fill) {
+                cache_fill_append(c->fill, c->data, c->len);
+                if (c->fill_last) {
+                    cache_fill_commit(c->fill, 1);
+                    c->fill_last = 0;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (zc_send_chunk(&zc, p->reply, frame_type, W24_FLAG_MORE, c) < 0)
+                __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            else
+                p->bytes_sent += len;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            p->send_bytes += len;
+            p->send_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+            if (p->codec == CODEC_AUTO && next_seq % ADAPT_INTERVAL == 0)
+                pipeline_adapt_level(p);
+            sent_any = 1;
+        }
+    }
+    while (early) {  // Only left over if a block was lost to a failure
+        c = early;
+        early = c->next;
+        chunk_free(c);
+    }
+    if (pipeline_failed(p)) {
+        if (sent_any)
+            shutdown(p->reply->sock, SHUT_RDWR);  // A half-sent response cannot be recovered
+        else
+            send_text(p->reply, W24_STATUS_ERROR, "Error: Failed to build archive\n");
+    } else if (sent_any) {
+        if (send_frame(p->reply, frame_type, W24_STATUS_OK, 0, NULL, 0) == 0 && p->reply->spool) {
+            p->reply->spool->complete = 1;
+            p->reply->spool->frame_type = frame_type;
+        }
+    } else {
+        send_text(p->reply, W24_STATUS_NOT_FOUND, "No file found\n");
+        if (p->reply->spool)
+            p->reply->spool->not_found = 1;
+    }
+    cork = 0;
+    setsockopt(p->reply->sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    // Every notification must be consumed, or the idle socket would keep reporting EPOLLERR
+    while (zc.inflight_count > 0)
+        zc_reap(&zc, 1);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    p->send_cpu_ns = (cpu1.tv_sec - cpu0.tv_sec) * 1000000000ULL + cpu1.tv_nsec - cpu0.tv_nsec;
+    if (p->reply->zc_next_id) *p->reply->zc_next_id = zc.next_id;
+    p->zc_copied = zc.copied;
+    p->zc_used = zc.enabled;
+    return NULL;
+}
+
+// Persistent threads for the stages, one pool per stage: a reader and a sender
+// for each archive worker, and compress_threads compressors for each of those.
+// Every archive running at once gets all of its stages at once, and none of
+// them creates a thread. A pool thread runs its stage for one pipeline to the end.
+typedef struct {
+    WorkQueue queue;        // Pipelines waiting for this stage
+    void *(*run)(void *);
+} StagePool;
+
+StagePool reader_pool = {.run = pipeline_reader};
+StagePool compressor_pool = {.run = pipeline_compressor};
+StagePool sender_pool = {.run = pipeline_sender};
+
+void *stage_thread(void *arg) {
+    StagePool *pool = arg;
+    ArchivePipeline *p;
+    while ((p = queue_pop(&pool->queue)) != NULL) {
+        pool->run(p);
+        // The pipeline may be gone as soon as the lock is dropped
+        pthread_mutex_lock(&p->stage_lock);
+        if (--p->stages_running == 0)
+            pthread_cond_signal(&p->stages_done);
+        pthread_mutex_unlock(&p->stage_lock);
+    }
+    return NULL;
+}
+
+void stage_pool_start(StagePool *pool, int threads) {
+    if (queue_init(&pool->queue, threads > QUEUE_CAPACITY ? threads : QUEUE_CAPACITY) < 0)
+        error("ERROR allocating pipeline queue");
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, stage_thread, pool) != 0)
+            error("ERROR creating pipeline thread");
+        pthread_detach(tid);
+    }
+}
+
+// archives: how many can run at once, the -a archive workers
+void pipeline_pools_start(int archives) {
+    stage_pool_start(&reader_pool, archives);
+    stage_pool_start(&compressor_pool, archives * compress_threads);
+    stage_pool_start(&sender_pool, archives);
+}
+
+// Set up the queues and hand the pipeline to the reader, compressor and sender pools
+int pipeline_start(ArchivePipeline *p, Reply *reply, int codec) {
+    memset(p, 0, sizeof(*p));
+    p->reply = reply;
+    p->codec = codec;
+    p->level = codec == CODEC_AUTO ? LEVEL_DEFAULT : codec;
+    if (queue_init(&p->files, PIPELINE_FILES) < 0 || queue_init(&p->raw, PIPELINE_DEPTH) < 0 ||
+        queue_init(&p->packed, PIPELINE_DEPTH) < 0) {
+        send_text(reply, W24_STATUS_ERROR, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    p->num_compressors = compress_threads;
+    p->compressors_running = compress_threads;
+    p->stages_running = 2 + compress_threads;
+    pthread_mutex_init(&p->stage_lock, NULL);
+    pthread_cond_init(&p->stages_done, NULL);
+    queue_push(&reader_pool.queue, p);
+    for (int i = 0; i < compress_threads; i++)
+        queue_push(&compressor_pool.queue, p);
+    queue_push(&sender_pool.queue, p);
+    return 0;
+}
+
+// Where the file's data starts on disk: FIEMAP's first extent, if the filesystem has one
+void locate_file(FileItem *item) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    item->has_extent = 0;
+    item->location = item->st.st_ino;
+    int fd = open(item->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0) fd = open(item->path, O_RDONLY | O_CLOEXEC);  // O_NOATIME needs ownership
+    if (fd < 0) return;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents == 1 &&
+        !(fm.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        item->location = fm.extent.fe_physical;
+        item->has_extent = 1;
+    }
+    close(fd);
+}
+
+// Extension used for grouping, "" when there is none
+const char *file_ext(const char *path) {
+    const char *ext = strrchr(path, '.');
+    return ext && !strchr(ext, '/') ? ext + 1 : "";
+}
+
+int compare_location(const void *a, const void *b) {
+    const FileItem *x = *(FileItem *const *)a, *y = *(FileItem *const *)b;
+    return x->location < y->location ? -1 : x->location > y->location;
+}
+
+int compare_ext_location(const void *a, const void *b) {
+    const FileItem *x = *(FileItem *const *)a, *y = *(FileItem *const *)b;
+    int c = strcasecmp(file_ext(x->path), file_ext(y->path));
+    return c ? c : compare_location(a, b);
+}
+
+// Head travel of reading the files in this order: the distance from the end of
+// one file to the start of the next, summed. Empty files cost nothing.
+uint64_t layout_travel(FileItem **items, size_t n) {
+    uint64_t travel = 0, head = 0;
+    int started = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (items[i]->st.st_size == 0) continue;
+        uint64_t start = items[i]->location;
+        if (started) travel += start > head ? start - head : head - start;
+        head = start + (items[i]->has_extent ? (uint64_t)items[i]->st.st_size : 1);
+        started = 1;
+    }
+    return travel;
+}
+
+// Sort the held match set and hand it to the reader, reporting how much
+// head travel the new order saves over walk order
+void pipeline_release_held(ArchivePipeline *p) {
+    size_t n = p->num_held, located = 0;
+    for (size_t i = 0; i < n; i++)
+        located += p->held[i]->has_extent || p->held[i]->st.st_size == 0;
+    // Physical offsets and inode numbers do not mix: use inodes for all unless every file has an extent
+    int physical = located == n;
+    if (!physical)
+        for (size_t i = 0; i < n; i++)
+            p->held[i]->location = p->held[i]->st.st_ino;
+    uint64_t before = layout_travel(p->held, n);
+    qsort(p->held, n, sizeof(FileItem *), file_order == ORDER_EXT ? compare_ext_location : compare_location);
+    uint64_t after = layout_travel(p->held, n);
+    log_request("Archive order %s: %zu files by %s, travel %llu -> %llu %s (%.1f%% less)\n",
+           file_order == ORDER_EXT ? "ext" : "disk", n, physical ? "extent" : "inode",
+           (unsigned long long)(physical ? before >> 20 : before),
+           (unsigned long long)(physical ? after >> 20 : after), physical ? "MiB" : "inodes",
+           before ? 100.0 * (double)(before - (after < before ? after : before)) / before : 0.0);
+    for (size_t i = 0; i < n; i++) {
+        if (queue_push(&p->files, p->held[i]) < 0) {
+            free(p->held[i]->path);
+            free(p->held[i]);
+        }
+    }
+    free(p->held);
+    p->held = NULL;
+    p->num_held = p->held_cap = 0;
+}
+
+// Match callback for the walk: queue the file for the reader. Returns nonzero to stop the walk.
+int pipeline_add_file(const char *path, const struct stat *st, void *arg) {
+    ArchivePipeline *p = arg;
+    if (pipeline_failed(p)) return 1;
+    FileItem *item = malloc(sizeof(FileItem));
+    if (!item || !(item->path = strdup(path))) {
+        free(item);
+        __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    item->st = *st;
+    if (file_order == ORDER_WALK) {
+        queue_push(&p->files, item);
+        return 0;
+    }
+    // Ordered modes hold everything back until the walk is done; the reader idles meanwhile
+    if (p->num_held == p->held_cap) {
+        size_t cap = p->held_cap ? p->held_cap * 2 : 256;
+        FileItem **grown = realloc(p->held, cap * sizeof(FileItem *));
+        if (!grown) {
+            free(item->path);
+            free(item);
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        p->held = grown;
+        p->held_cap = cap;
+    }
+    locate_file(item);
+    p->held[p->num_held++] = item;
+    return 0;
+}
+
+// Signal the end of the walk, then wait for the stages to drain
+void pipeline_finish(ArchivePipeline *p) {
+    if (p->num_held > 0)
+        pipeline_release_held(p);
+    free(p->held);  // Left over only if the walk failed before holding anything
+    queue_close(&p->files);
+    pthread_mutex_lock(&p->stage_lock);
+    while (p->stages_running > 0)
+        pthread_cond_wait(&p->stages_done, &p->stage_lock);
+    pthread_mutex_unlock(&p->stage_lock);
+    pthread_mutex_destroy(&p->stage_lock);
+    pthread_cond_destroy(&p->stages_done);
+    log_request("Archive sent: %d files, %llu bytes tar (%llu stored), %llu bytes sent (ratio %.2f), level %d%s%s\n",
+           p->files_added, (unsigned long long)p->raw_bytes, (unsigned long long)p->stored_bytes,
+           (unsigned long long)p->bytes_sent, p->bytes_sent ? (double)p->raw_bytes / p->bytes_sent : 0.0,
+           p->level, p->codec == CODEC_AUTO ? " (auto)" : "", pipeline_failed(p) ? " (failed)" : "");
+    if (p->cache_hits + p->cache_misses > 0) {
+        pthread_mutex_lock(&member_cache.lock);
+        log_request("Member cache: %d hits, %d misses (total %llu hits, %llu misses, %llu evicted, %zu entries, %zu MiB)\n",
+               p->cache_hits, p->cache_misses, (unsigned long long)member_cache.hits,
+               (unsigned long long)member_cache.misses, (unsigned long long)member_cache.evictions,
+               member_cache.entries, member_cache.bytes >> 20);
+        pthread_mutex_unlock(&member_cache.lock);
+    }
+    if (p->bytes_sent > 0)
+        log_request("Sender CPU: %.1f ms/GB (%s, %llu zero-copy sends copied by the kernel)\n",
+               p->send_cpu_ns / 1e6 / (p->bytes_sent / 1e9),
+               p->zc_used ? "zero-copy" : "copying", (unsigned long long)p->zc_copied);
+    queue_destroy(&p->files);
+    queue_destroy(&p->raw);
+    queue_destroy(&p->packed);
+}
+
+// What an archive command selects. Every field set in `fields` must match.
+#define QUERY_SIZE 0x01     // size_min <= size <= size_max
+#define QUERY_TYPE 0x02     // Extension is one of types
+#define QUERY_BEFORE 0x04   // Modified on or before date
+#define QUERY_AFTER 0x08    // Modified on or after date
+#define QUERY_NAME 0x10     // Name matches the glob pattern name
+
+typedef struct {
+    unsigned fields;
+    off_t size_min, size_max;
+    char types[3][64];
+    int num_types;
+    time_t before, after;
+    char name[256];
+    int skip_hidden;        // Ignore dot-files and everything below dot-directories
+} Query;
+
+int glob_match(const char *pattern, const char *name);
+
+// The part of a query that needs only the file name: lets a walk skip the
+// stat of files that cannot match
+int query_name_matches(const Query *q, const char *name) {
+    if (q->fields & QUERY_TYPE) {
+        const char *ext = strrchr(name, '.');  // Find the file extension
+        int i;
+        for (i = 0; ext && i < q->num_types; i++)
+            if (strcmp(ext + 1, q->types[i]) == 0)
+                break;
+        if (!ext || i == q->num_types)
+            return 0;
+    }
+    if ((q->fields & QUERY_NAME) && !glob_match(q->name, name))
+        return 0;
+    return 1;
+}
+
+// Does a file found by the walk satisfy the query? hidden is set when the file
+// or one of its directories below the walk root starts with a dot.
+int query_matches(const Query *q, const char *name, const struct stat *st, int hidden) {
+    if (!S_ISREG(st->st_mode) || (hidden && q->skip_hidden))
+        return 0;
+    if ((q->fields & QUERY_SIZE) && (st->st_size < q->size_min || st->st_size > q->size_max))
+        return 0;
+    if ((q->fields & QUERY_BEFORE) && st->st_mtime > q->before)
+        return 0;
+    if ((q->fields & QUERY_AFTER) && st->st_mtime < q->after)
+        return 0;
+    return query_name_matches(q, name);
+}
+
+// Called for every regular file the walk finds; a nonzero return stops the walk
+typedef int (*file_visitor)(const char *path, const char *name, const struct stat *st, int hidden, void *arg);
+
+typedef struct {
+    file_visitor visit;
+    void *arg;
+} WalkFiles;
+
+int walk_files_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                     void *arg) {
+    WalkFiles *f = arg;
+    (void)wd;
+    if (event != WALK_FILE || !S_ISREG(st->st_mode)) return 0;
+    return f->visit(path, name, st, hidden, f->arg);
+}
+
+// Visit every regular file below base_path, following symlinks like stat() does
+// (links to directories are skipped with -P).
+// filter, if set, is asked about each name first and saves the stat of the ones it rejects.
+int walk_files(const char *base_path, int hidden, walk_filter filter, file_visitor visit, void *arg) {
+    WalkFiles f = {visit, arg};
+    return walk_tree(base_path, hidden, (follow_links ? WALK_FOLLOW : 0) | WALK_STAT, filter, NULL, arg,
+                     walk_files_visit, &f);
+}
+
+// ---- Shared scans ----
+// Archive commands that run at the same time share one walk of HOME: the walk
+// evaluates every member's query per file and feeds each its own pipeline. The
+// walk logs the files it has seen so that a query joining halfway first replays
+// the log and then takes live files from where it joined, missing nothing.
+#define SCAN_LOG_BLOCK 4096
+#define SCAN_LOG_MAX (256 * 1024)   // Past this the log stops and no one else may join
+
+typedef struct {
+    char *path;
+    struct stat st;
+    int hidden;
+} ScanRecord;
+
+typedef struct ScanLogBlock {
+    ScanRecord records[SCAN_LOG_BLOCK];
+    struct ScanLogBlock *next;
+} ScanLogBlock;
+
+// A query taking part in a scan
+typedef struct ScanMember {
+    const Query *query;
+    ArchivePipeline *pipeline;
+    uint64_t start;         // Log index from which the walk delivers to this member
+    int stopped;            // Its pipeline failed; deliver nothing more
+    pthread_mutex_t lock;   // The walk and the member's own replay may deliver at once
+    struct ScanMember *next;
+} ScanMember;
+
+typedef struct {
+    ScanMember *members;    // Prepended under scan_lock; links never change afterwards
+    ScanLogBlock *head, *tail;
+    uint64_t count;         // Files in the log
+    int closed;             // Walk finished or log full: no more joiners
+    int done;               // Walk finished
+    int refs;               // Queries still using the log
+} SharedScan;
+
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+SharedScan *current_scan;   // Walk that new queries can join, or NULL
+uint64_t scans_started, scans_joined;
+
+void scan_deliver(ScanMember *m, const char *path, const struct stat *st, int hidden) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    pthread_mutex_lock(&m->lock);
+    if (!m->stopped && query_matches(m->query, name, st, hidden))
+        m->stopped = pipeline_add_file(path, st, m->pipeline);
+    pthread_mutex_unlock(&m->lock);
+}
+
+// file_visitor for the walk: log the file, then offer it to every member that joined before it
+int scan_visit(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    SharedScan *s = arg;
+    (void)name;
+    pthread_mutex_lock(&scan_lock);
+    uint64_t index = s->count;
+    if (!s->closed) {
+        if (s->count == SCAN_LOG_MAX) {
+            s->closed = 1;
+            if (current_scan == s) current_scan = NULL;
+        } else if (!s->tail || s->count % SCAN_LOG_BLOCK == 0) {
+            ScanLogBlock *b = malloc(sizeof(ScanLogBlock));
+            if (b) {
+                b->next = NULL;
+                if (s->tail) s->tail->next = b; else s->head = b;
+                s->tail = b;
+            } else {
+                s->closed = 1;
+                if (current_scan == s) current_scan = NULL;
+            }
+        }
+        ScanRecord *r = s->closed ? NULL : &s->tail->records[s->count % SCAN_LOG_BLOCK];
+        if (r && (r->path = strdup(path)) != NULL) {
+            r->st = *st;
+            r->hidden = hidden;
+            s->count++;
+        } else if (!s->closed) {
+            s->closed = 1;
+            if (current_scan == s) current_scan = NULL;
+        }
+    }
+    ScanMember *members = s->members;
+    pthread_mutex_unlock(&scan_lock);
+
+    for (ScanMember *m = members; m; m = m->next)
+        if (index >= m->start)
+            scan_deliver(m, path, st, hidden);
+    return 0;
+}
+
+void scan_release(SharedScan *s) {
+    pthread_mutex_lock(&scan_lock);
+    int last = --s->refs == 0;
+    pthread_mutex_unlock(&scan_lock);
+    if (!last) return;
+    uint64_t left = s->count;
+    for (ScanLogBlock *b = s->head, *next; b; b = next) {
+        next = b->next;
+        for (uint64_t i = 0; i < SCAN_LOG_BLOCK && left > 0; i++, left--)
+            free(b->records[i].path);
+        free(b);
+    }
+    free(s);
+}
+
+// Feed every file of HOME matching q into the pipeline: by joining the walk
+// already in progress if there is one, otherwise by starting one others can join
+void scan_query(const Query *q, ArchivePipeline *p) {
+    ScanMember me = {q, p, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL};
+    SharedScan *s;
+
+    pthread_mutex_lock(&scan_lock);
+    if ((s = current_scan) != NULL) {
+        me.start = s->count;
+        me.next = s->members;
+        s->members = &me;
+        s->refs++;
+        scans_joined++;
+        pthread_mutex_unlock(&scan_lock);
+        log_request("Joined the scan in progress after %llu files\n", (unsigned long long)me.start);
+
+        // Catch up on what the walk saw before we joined, then wait for it to finish
+        uint64_t i = 0;
+        for (ScanLogBlock *b = s->head; b && i < me.start; b = b->next)
+            for (int j = 0; j < SCAN_LOG_BLOCK && i < me.start; j++, i++)
+                scan_deliver(&me, b->records[j].path, &b->records[j].st, b->records[j].hidden);
+        pthread_mutex_lock(&scan_lock);
+        while (!s->done)
+            pthread_cond_wait(&scan_done, &scan_lock);
+        pthread_mutex_unlock(&scan_lock);
+        scan_release(s);
+        return;
+    }
+    s = calloc(1, sizeof(SharedScan));
+    if (!s) {
+        pthread_mutex_unlock(&scan_lock);
+        __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    s->members = &me;
+    s->refs = 1;
+    current_scan = s;
+    scans_started++;
+    pthread_mutex_unlock(&scan_lock);
+
+    walk_files(getenv("HOME"), 0, NULL, scan_visit, s);
+
+    pthread_mutex_lock(&scan_lock);
+    if (current_scan == s) current_scan = NULL;
+    s->closed = 1;
+    s->done = 1;
+    pthread_cond_broadcast(&scan_done);
+    pthread_mutex_unlock(&scan_lock);
+    scan_release(s);
+}
+
+// ---- Column scans ----
+// A query compiled against the index columns: a node matches when its size and
+// mtime are within range, its kind bits masked by kind_mask equal KIND_FILE, and
+// (if num_exts >= 0) its extension ID is one of exts. Each pass turns 64 nodes
+// into one word of a match bitmap, with AVX2 compares where the CPU has them.
+typedef struct {
+    int64_t size_lo, size_hi;
+    int64_t mtime_lo, mtime_hi;
+    uint8_t kind_mask;
+    int num_exts;           // -1: any extension
+    uint16_t exts[4];       // The query's types, plus EXT_OVERFLOW if the table is full
+} ColumnQuery;
+
+int scan_avx2;              // Set at startup if the CPU supports AVX2
+
+// Returns 0 if no node can match (a type never seen in the tree)
+int column_compile(FileIndex *x, const Query *q, ColumnQuery *cq) {
+    cq->size_lo = cq->mtime_lo = INT64_MIN;
+    cq->size_hi = cq->mtime_hi = INT64_MAX;
+    cq->kind_mask = KIND_FILE | (q->skip_hidden ? KIND_HIDDEN : 0);
+    cq->num_exts = -1;
+    if (q->fields & QUERY_SIZE) {
+        cq->size_lo = q->size_min;
+        cq->size_hi = q->size_max;
+    }
+    if (q->fields & QUERY_BEFORE) cq->mtime_hi = q->before;
+    if (q->fields & QUERY_AFTER) cq->mtime_lo = q->after;
+    if (q->fields & QUERY_TYPE) {
+        char name[80];
+        cq->num_exts = 0;
+        for (int i = 0; i < q->num_types; i++) {
+            snprintf(name, sizeof(name), ".%s", q->types[i]);
+            int id = index_ext_id(x, name, 0);
+            if (id >= 0) cq->exts[cq->num_exts++] = id;
+        }
+        if (x->num_exts + 1 >= EXT_OVERFLOW) cq->exts[cq->num_exts++] = EXT_OVERFLOW;
+        if (cq->num_exts == 0) return 0;
+    }
+    return 1;
+}
+
+void column_scan_scalar(const FileIndex *x, const ColumnQuery *cq, uint64_t *bits, uint32_t words) {
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t word = 0;
+        for (uint32_t i = 0, n = w * 64; i < 64; i++, n++) {
+            int ok = x->sizes[n] >= cq->size_lo && x->sizes[n] <= cq->size_hi &&
+                     x->mtimes[n] >= cq->mtime_lo && x->mtimes[n] <= cq->mtime_hi &&
+                     (x->kinds[n] & cq->kind_mask) == KIND_FILE;
+            if (cq->num_exts >= 0) {
+                int ext = 0;
+                for (int e = 0; e < cq->num_exts; e++) ext |= x->exts[n] == cq->exts[e];
+                ok &= ext;
+            }
+            word |= (uint64_t)ok << i;
+        }
+        bits[w] = word;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void column_scan_avx2(const FileIndex *x, const ColumnQuery *cq, uint64_t *bits, uint32_t words) {
+    const __m256i size_lo = _mm256_set1_epi64x(cq->size_lo), size_hi = _mm256_set1_epi64x(cq->size_hi);
+    const __m256i mtime_lo = _mm256_set1_epi64x(cq->mtime_lo), mtime_hi = _mm256_set1_epi64x(cq->mtime_hi);
+    const __m256i kind_mask = _mm256_set1_epi8(cq->kind_mask), kind_file = _mm256_set1_epi8(KIND_FILE);
+    __m256i ext[4];
+    for (int e = 0; e < 4; e++)
+        ext[e] = _mm256_set1_epi16(e < cq->num_exts ? cq->exts[e] : cq->exts[0]);
+
+    for (uint32_t w = 0; w < words; w++) {
+        uint32_t base = w * 64;
+        // Kinds: 32 nodes per compare
+        uint64_t word = 0;
+        for (int h = 0; h < 2; h++) {
+            __m256i k = _mm256_loadu_si256((const __m256i *)(x->kinds + base + 32 * h));
+            k = _mm256_cmpeq_epi8(_mm256_and_si256(k, kind_mask), kind_file);
+            word |= (uint64_t)(uint32_t)_mm256_movemask_epi8(k) << (32 * h);
+        }
+        if (!word) {
+            bits[w] = 0;  // Directories, free nodes, hidden files: nothing to compare
+            continue;
+        }
+        // Sizes and mtimes: 4 nodes per compare; out of range is lo > v or v > hi
+        uint64_t range = 0;
+        for (int j = 0; j < 16; j++) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(x->sizes + base + 4 * j));
+            __m256i m = _mm256_loadu_si256((const __m256i *)(x->mtimes + base + 4 * j));
+            __m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi64(size_lo, s), _mm256_cmpgt_epi64(s, size_hi)),
+                                          _mm256_or_si256(_mm256_cmpgt_epi64(mtime_lo, m), _mm256_cmpgt_epi64(m, mtime_hi)));
+            range |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xf) << (4 * j);
+        }
+        word &= range;
+        // Extensions: 16 nodes per compare, packed to bytes for one movemask per 32
+        if (cq->num_exts >= 0 && word) {
+            uint64_t types = 0;
+            for (int h = 0; h < 2; h++) {
+                __m256i eq[2];
+                for (int j = 0; j < 2; j++) {
+                    __m256i v = _mm256_loadu_si256((const __m256i *)(x->exts + base + 32 * h + 16 * j));
+                    eq[j] = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi16(v, ext[0]), _mm256_cmpeq_epi16(v, ext[1])),
+                                            _mm256_or_si256(_mm256_cmpeq_epi16(v, ext[2]), _mm256_cmpeq_epi16(v, ext[3])));
+                }
+                // packs interleaves the 128-bit lanes; the permute puts them back in node order
+                __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(eq[0], eq[1]), 0xd8);
+                types |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << (32 * h);
+            }
+            word &= types;
+        }
+        bits[w] = word;
+    }
+}
+#endif
+
+// Fill the match bitmap for nodes [0, words * 64); the caller holds the read lock
+void column_scan(const FileIndex *x, const ColumnQuery *cq, uint64_t *bits, uint32_t words) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (scan_avx2) {
+        column_scan_avx2(x, cq, bits, words);
+        return;
+    }
+#endif
+    column_scan_scalar(x, cq, bits, words);
+}
+
+// Answer a query from the live index. The columns give a bitmap of candidates,
+// which query_matches confirms one by one (cheap, and exact for the extension
+// overflow case, the name pattern and the files added by the query); visit is
+// called for each match under the read lock, so it must only tally or copy.
+// Returns -1 if the index cannot answer and the tree must be walked.
+int index_query_visit(const Query *q, file_visitor visit, void *arg, uint64_t *seq) {
+    FileIndex *x = &file_index;
+    size_t count = 0;
+    char path[PATH_MAX];
+    struct stat st;
+    ColumnQuery cq;
+    struct timespec t0, t1;
+
+    // Walks follow links to directories, the index does not. w24watch, the one
+    // caller after seq, reports the index's own changes and takes it as it is.
+    if (!(seq ? index_acquire(x) : index_acquire_following(x))) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint32_t words = (x->num_nodes + 63) / 64;
+    uint64_t *bits = column_compile(x, q, &cq) ? malloc((size_t)words * sizeof(uint64_t)) : NULL;
+    if (bits) column_scan(x, &cq, bits, words);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int stop = 0;
+    for (uint32_t w = 0; bits && w < words && !stop; w++) {
+        for (uint64_t word = bits[w]; word && !stop; word &= word - 1) {
+            uint32_t n = w * 64 + __builtin_ctzll(word);
+            index_stat(x, n, &st);
+            const char *name = index_name(x, n);
+            if (!query_matches(q, name, &st, x->nodes[n].hidden) || index_path(x, n, path, sizeof(path)) < 0)
+                continue;
+            stop = visit(path, name, &st, x->nodes[n].hidden, arg);
+            count++;
+        }
+    }
+    log_request("Index scan: %u entries, %zu matches in %.3f ms (%s)\n", x->num_nodes, count,
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e6, scan_avx2 ? "avx2" : "scalar");
+    if (seq) *seq = x->change_seq;  // The answer is as of this change
+    pthread_rwlock_unlock(&x->lock);
+    free(bits);
+    return 0;
+}
+
+typedef struct {
+    ScanRecord *matches;
+    size_t count, cap;
+} RecordList;
+
+int record_list_add(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    RecordList *l = arg;
+    (void)name;
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        ScanRecord *grown = realloc(l->matches, cap * sizeof(ScanRecord));
+        if (!grown) return 1;
+        l->matches = grown;
+        l->cap = cap;
+    }
+    if ((l->matches[l->count].path = strdup(path)) == NULL) return 1;
+    l->matches[l->count].st = *st;
+    l->matches[l->count].hidden = hidden;
+    l->count++;
+    return 0;
+}
+
+// The index's matches copied out, so that whatever the caller does with them
+// never holds up the indexer; the caller frees the records
+int index_query_records(const Query *q, ScanRecord **records, size_t *num_records, uint64_t *seq) {
+    RecordList l = {NULL, 0, 0};
+    if (index_query_visit(q, record_list_add, &l, seq) < 0) return -1;
+    *records = l.matches;
+    *num_records = l.count;
+    return 0;
+}
+
+// Archive the index's answer to a query; -1 if the tree must be walked instead
+int index_query(const Query *q, ArchivePipeline *p) {
+    ScanRecord *matches;
+    size_t count;
+    if (index_query_records(q, &matches, &count, NULL) < 0) return -1;
+    int stop = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!stop) stop = pipeline_add_file(matches[i].path, &matches[i].st, p);
+        free(matches[i].path);
+    }
+    free(matches);
+    return 0;
+}
+
+void send_manifest(Reply *reply, const Query *q, int codec);
+
+// Build an archive of every file matching the query, or its manifest (-m)
+void send_query_archive(Reply *reply, const Query *q, int codec) {
+    ArchivePipeline pipeline;
+    if (codec <= CODEC_MANIFEST) {
+        send_manifest(reply, q, codec);
+        return;
+    }
+    if (pipeline_start(&pipeline, reply, codec) < 0)
+        return;
+    if (index_query(q, &pipeline) < 0)
+        scan_query(q, &pipeline);
+    pipeline_finish(&pipeline);
+}
+
+void send_files_by_size(Reply *reply, off_t size1, off_t size2, int codec) {
+    Query q = {0};
+    q.fields = QUERY_SIZE;
+    q.size_min = size1;
+    q.size_max = size2;
+    send_query_archive(reply, &q, codec);
+}
+
+void send_files_by_type(Reply *reply, char *types_string, int codec) {
+    Query q = {0};
+    char *saveptr;  // strtok_r keeps the position per call, several workers may parse at once
+    char *token = strtok_r(types_string, " ", &saveptr);
+    while (token != NULL && q.num_types < 3) {
+        snprintf(q.types[q.num_types++], sizeof(q.types[0]), "%s", token);
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+    q.fields = QUERY_TYPE;
+    send_query_archive(reply, &q, codec);
+}
+
+// Helper function to convert date string to time_t
+time_t parse_date(const char *date_str) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+    strptime(date_str, "%Y-%m-%d", &tm);
+    return mktime(&tm);
+}
+
+// Main function for archiving and sending files
+void send_files_by_date(Reply *reply, const char *date, int before, int codec) {
+    Query q = {0};
+    q.fields = before ? QUERY_BEFORE : QUERY_AFTER;
+    q.before = q.after = parse_date(date);
+    q.skip_hidden = 1;  // The date commands have always left dot-files out
+    log_request("Searching and archiving files...\n");
+    send_query_archive(reply, &q, codec);
+}
+
+// Public functions that handle sending files before and after a specific date
+void send_files_by_date_before(Reply *reply, const char *date, int codec) {
+    send_files_by_date(reply, date, 1, codec);  // before = 1
+}
+
+void send_files_by_date_after(Reply *reply, const char *date, int codec) {
+    send_files_by_date(reply, date, 0, codec);  // before = 0
+}
+
+// ---- Compound queries ----
+// w24find [-l] size:10M-1G ext:log,txt after:2024-03-01 before:2024-06-30 name:app*
+// combines what w24fz, w24ft, w24fda and w24fdb select with a name pattern.
+// The command is parsed once into a Query, which a single index scan or walk
+// evaluates; the answer is one archive or, with -l, the list of paths.
+// A size in bytes with an optional K, M, G or T suffix (powers of 1024)
+int parse_find_size(const char *s, const char **end, off_t *size) {
+    char *e;
+    int shift = 0;
+    errno = 0;
+    long long v = strtoll(s, &e, 10);
+    if (e == s || v < 0 || errno) return -1;
+    switch (*e) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    case 't': case 'T': shift = 40; break;
+    }
+    if (shift) e++;
+    if (v > (LLONG_MAX >> shift)) return -1;
+    *size = (off_t)(v << shift);
+    *end = e;
+    return 0;
+}
+
+// size:A-B, size:A- or size:-B; a single size selects exactly that size
+int parse_find_range(const char *v, Query *q) {
+    const char *e = v;
+    q->size_min = 0;
+    q->size_max = LLONG_MAX;
+    if (*v != '-' && parse_find_size(v, &e, &q->size_min) < 0) return -1;
+    if (*e == '\0') {
+        q->size_max = q->size_min;
+        return 0;
+    }
+    if (*e++ != '-' || (e == v + 1 && *e == '\0')) return -1;
+    if (*e && (parse_find_size(e, &e, &q->size_max) < 0 || *e)) return -1;
+    return q->size_min <= q->size_max ? 0 : -1;
+}
+
+// YYYY-MM-DD, taken the way w24fda and w24fdb take it
+int parse_find_date(const char *v, time_t *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(v, "%Y-%m-%d", &tm);
+    if (!end || *end) return -1;
+    *t = parse_date(v);
+    return 0;
+}
+
+// Parse the arguments of w24find into q; -l sets list. Returns -1 with a message in err.
+int parse_find_query(char *args, Query *q, int *list, char *err, size_t size) {
+    char *saveptr, *token;
+    memset(q, 0, sizeof(*q));
+    *list = 0;
+    for (token = strtok_r(args, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(token, "-l") == 0) {
+            *list = 1;
+            continue;
+        }
+        char *value = strchr(token, ':');
+        if (value) *value++ = '\0';
+        if (!value || !*value) {
+            snprintf(err, size, "Expected key:value, got '%s'\n", token);
+            return -1;
+        }
+        if (strcmp(token, "size") == 0) {
+            if ((q->fields & QUERY_SIZE) || parse_find_range(value, q) < 0) {
+                snprintf(err, size, "Invalid size range '%s'. Use size:<min>-<max> with K, M, G or T suffixes\n", value);
+                return -1;
+            }
+            q->fields |= QUERY_SIZE;
+        } else if (strcmp(token, "ext") == 0) {
+            char *save_ext;
+            for (char *t = strtok_r(value, ",", &save_ext); t; t = strtok_r(NULL, ",", &save_ext)) {
+                if (*t == '.') t++;
+                int seen = 0;
+                for (int i = 0; i < q->num_types; i++) seen |= strcmp(q->types[i], t) == 0;
+                if (seen) continue;
+                if (!*t || strlen(t) >= sizeof(q->types[0]) || q->num_types == 3) {
+                    snprintf(err, size, "Invalid extension list. Use ext:<ext1>[,ext2][,ext3], up to 3 extensions\n");
+                    return -1;
+                }
+                snprintf(q->types[q->num_types++], sizeof(q->types[0]), "%s", t);
+            }
+            q->fields |= QUERY_TYPE;
+        } else if (strcmp(token, "after") == 0 || strcmp(token, "before") == 0) {
+            int before = token[0] == 'b';
+            if ((q->fields & (before ? QUERY_BEFORE : QUERY_AFTER)) ||
+                parse_find_date(value, before ? &q->before : &q->after) < 0) {
+                snprintf(err, size, "Invalid date '%s'. Use %s:YYYY-MM-DD\n", value, token);
+                return -1;
+            }
+            q->fields |= before ? QUERY_BEFORE : QUERY_AFTER;
+        } else if (strcmp(token, "name") == 0) {
+            if ((q->fields & QUERY_NAME) || strlen(value) >= sizeof(q->name)) {
+                snprintf(err, size, "Invalid name pattern '%s'\n", value);
+                return -1;
+            }
+            snprintf(q->name, sizeof(q->name), "%s", value);
+            q->fields |= QUERY_NAME;
+        } else {
+            snprintf(err, size, "Unknown predicate '%s'. Use size:, ext:, after:, before: or name:\n", token);
+            return -1;
+        }
+    }
+    if (q->fields == 0) {
+        snprintf(err, size, "Usage: w24find [-l] [size:<min>-<max>] [ext:<ext>[,...]] [after:YYYY-MM-DD] "
+                            "[before:YYYY-MM-DD] [name:<pattern>]\n");
+        return -1;
+    }
+    // Order the types so that the same query always gets the same cache key
+    qsort(q->types, q->num_types, sizeof(q->types[0]), (int (*)(const void *, const void *))strcmp);
+    return 0;
+}
+
+// The canonical form of a w24find query, for the result cache
+int find_query_key(const Query *q, char *key, size_t size) {
+    int n = snprintf(key, size, "w24find");
+    if (q->fields & QUERY_SIZE)
+        n += snprintf(key + n, size - n, " size:%lld-%lld", (long long)q->size_min, (long long)q->size_max);
+    for (int i = 0; i < q->num_types && (size_t)n < size; i++)
+        n += snprintf(key + n, size - n, "%s%s", i ? "," : " ext:", q->types[i]);
+    if ((q->fields & QUERY_AFTER) && (size_t)n < size)
+        n += snprintf(key + n, size - n, " after:%lld", (long long)q->after);
+    if ((q->fields & QUERY_BEFORE) && (size_t)n < size)
+        n += snprintf(key + n, size - n, " before:%lld", (long long)q->before);
+    if ((q->fields & QUERY_NAME) && (size_t)n < size)
+        n += snprintf(key + n, size - n, " name:%s", q->name);
+    return (size_t)n < size ? n : -1;
+}
+
+// A listing streamed as the matches come in
+typedef struct {
+    TextStream out;
+    const Query *query;
+    unsigned long long count, bytes;
+} FindListing;
+
+int find_listing_add(FindListing *l, const char *path, off_t size) {
+    l->count++;
+    l->bytes += size;
+    if (text_stream_write(&l->out, path, strlen(path)) < 0 || text_stream_write(&l->out, "\n", 1) < 0)
+        return 1;
+    return 0;
+}
+
+// walk_filter and file_visitor for the walk fallback
+int find_listing_filter(const char *name, void *arg) {
+    return query_name_matches(((FindListing *)arg)->query, name);
+}
+
+int find_listing_visit(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    FindListing *l = arg;
+    if (!query_matches(l->query, name, st, hidden)) return 0;
+    return find_listing_add(l, path, st->st_size);
+}
+
+// w24find -l: one path per line, then a count
+void send_find_listing(Reply *reply, const Query *q) {
+    FindListing l = {{0}, q, 0, 0};
+    ScanRecord *matches;
+    size_t count;
+    char summary[128];
+    if (text_stream_init(&l.out, reply) < 0) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    if (index_query_records(q, &matches, &count, NULL) == 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (!l.out.failed) find_listing_add(&l, matches[i].path, matches[i].st.st_size);
+            free(matches[i].path);
+        }
+        free(matches);
+    } else {
+        walk_files(getenv("HOME"), 0, find_listing_filter, find_listing_visit, &l);
+    }
+    if (l.count == 0) {
+        // Nothing was streamed yet
+        free(l.out.text);
+        send_text(reply, W24_STATUS_NOT_FOUND, "No file found\n");
+        return;
+    }
+    int n = snprintf(summary, sizeof(summary), "%llu files, %llu bytes\n", l.count, l.bytes);
+    text_stream_write(&l.out, summary, n);
+    text_stream_end(&l.out, W24_STATUS_OK);
+}
+
+void send_find(Reply *reply, char *args, int codec) {
+    Query q;
+    int list;
+    char err[256];
+    if (parse_find_query(args, &q, &list, err, sizeof(err)) < 0) {
+        send_text(reply, W24_STATUS_INVALID, err);
+        return;
+    }
+    if (list && codec <= CODEC_MANIFEST)
+        send_text(reply, W24_STATUS_INVALID, "-l already lists the files, it takes no -m\n");
+    else if (list)
+        send_find_listing(reply, &q);
+    else
+        send_query_archive(reply, &q, codec);
+}
+
+// ---- Tree listings ----
+// w24tree [path] [depth] sends a whole subtree of HOME in one response, encoded
+// while the walk replays it, as W24_TYPE_TREE frames. Integers are LEB128
+// varints; signed ones are zigzag-encoded first.
+//   header  "W24T", version, root path length and bytes, root mtime (signed)
+//   entry   parent delta, kind, shared prefix, suffix length, suffix bytes,
+//           size (not for directories), mtime delta (signed)
+//   end     0, number of entries
+// Entries come in walk order, each directory before its contents, numbered
+// from 1 (the root is 0); the parent delta is an entry's number minus its
+// directory's, so it is never 0 before the end. Names are front-coded against
+// the previous entry of the same directory, and mtimes (in seconds) are
+// relative to it too, the first entry's to its directory's. Symlinks to files
+// are described by their target, as everywhere else, and links to directories
+// are not followed. With a depth, directories that many levels down are listed
+// but not entered.
+#define TREE_MAGIC "W24T"
+#define TREE_VERSION 1
+#define TREE_FILE 0
+#define TREE_DIR 1
+#define TREE_LINK 2             // To a directory, or dangling
+#define TREE_OTHER 3
+#define TREE_RECORD 300         // Longest encoded entry: a 255-byte name and five varints
+
+typedef struct {
+    uint64_t id;
+    char last[256];         // Name of the previous entry of this directory
+    size_t last_len;
+    int64_t last_mtime;
+} TreeLevel;
+
+typedef struct {
+    TextStream out;
+    TreeLevel levels[WALK_MAX_DEPTH + 2];
+    int depth;              // Levels in use: levels[depth - 1] is the current directory
+    int entered;            // The root's WALK_ENTER was seen
+    uint64_t count;         // Entries sent
+} TreeListing;
+
+size_t tree_put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+size_t tree_put_signed(unsigned char *p, int64_t v) {
+    return tree_put_varint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+int tree_listing_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                       void *arg) {
+    TreeListing *t = arg;
+    (void)path, (void)hidden, (void)wd;
+    if (event == WALK_LEAVE) {
+        t->depth--;
+        return 0;
+    }
+    if (!t->entered) {
+        t->entered = 1;  // The root is described by the header
+        return 0;
+    }
+    TreeLevel *dir = &t->levels[t->depth - 1];
+    int kind = S_ISDIR(st->st_mode) ? TREE_DIR : S_ISREG(st->st_mode) ? TREE_FILE :
+               S_ISLNK(st->st_mode) ? TREE_LINK : TREE_OTHER;
+    size_t len = strlen(name), shared = 0;
+    if (len > 255) return 0;
+    while (shared < len && shared < dir->last_len && name[shared] == dir->last[shared])
+        shared++;
+
+    unsigned char rec[TREE_RECORD];
+    uint64_t id = ++t->count;
+    size_t n = tree_put_varint(rec, id - dir->id);
+    rec[n++] = kind;
+    n += tree_put_varint(rec + n, shared);
+    n += tree_put_varint(rec + n, len - shared);
+    memcpy(rec + n, name + shared, len - shared);
+    n += len - shared;
+    if (kind != TREE_DIR)
+        n += tree_put_varint(rec + n, st->st_size);
+    n += tree_put_signed(rec + n, st->st_mtim.tv_sec - dir->last_mtime);
+    memcpy(dir->last, name, len);
+    dir->last_len = len;
+    dir->last_mtime = st->st_mtim.tv_sec;
+
+    if (event == WALK_ENTER) {
+        TreeLevel *sub = &t->levels[t->depth++];
+        sub->id = id;
+        sub->last_len = 0;
+        sub->last_mtime = st->st_mtim.tv_sec;
+    }
+    return text_stream_write(&t->out, (const char *)rec, n) < 0;
+}
+
+// A path relative to HOME, or absolute inside it, with trailing slashes
+// dropped. Returns its length (size or more if it did not fit), or -1 if it
+// would leave HOME.
+int resolve_home_path(const char *rel, char *path, size_t size) {
+    const char *home = getenv("HOME");
+    size_t home_len = strlen(home);
+    int n, valid = 1;
+    if (rel[0] == '/') {
+        valid = strncmp(rel, home, home_len) == 0 && (rel[home_len] == '/' || rel[home_len] == '\0');
+        n = snprintf(path, size, "%s", rel);
+    } else {
+        n = snprintf(path, size, rel[0] ? "%s/%s" : "%s", home, rel);
+    }
+    for (const char *c = path; valid && (c = strstr(c, "..")) != NULL; c += 2)
+        valid = !((c == path || c[-1] == '/') && (c[2] == '/' || c[2] == '\0'));
+    if (!valid)
+        return -1;
+    while (n > 1 && (size_t)n < size && path[n - 1] == '/')
+        path[--n] = '\0';
+    return n;
+}
+
+// Open a path from resolve_home_path without letting a symlink lead out of
+// HOME. openat2() resolves it beneath HOME in the kernel; where that is missing,
+// or refuses an absolute link (even one that stays inside), the path's
+// realpath() must start with HOME's. Returns -1 with errno EXDEV if it leaves.
+int open_beneath_home(const char *path, int flags) {
+    const char *home = getenv("HOME");
+    const char *rel = path + strlen(home);
+    while (*rel == '/') rel++;
+#ifdef SYS_openat2
+    int home_fd = open(home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (home_fd >= 0) {
+        struct open_how how = {.flags = flags | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+        int fd = syscall(SYS_openat2, home_fd, rel[0] ? rel : ".", &how, sizeof(how));
+        int saved = errno;
+        close(home_fd);
+        errno = saved;
+        if (fd >= 0 || (saved != ENOSYS && saved != EXDEV))
+            return fd;
+    }
+#endif
+    char real[PATH_MAX], real_home[PATH_MAX];
+    if (!realpath(path, real) || !realpath(home, real_home))
+        return -1;
+    size_t n = strcmp(real_home, "/") == 0 ? 0 : strlen(real_home);
+    if (strncmp(real, real_home, n) != 0 || (real[n] != '/' && real[n] != '\0')) {
+        errno = EXDEV;
+        return -1;
+    }
+    return open(real, flags | O_CLOEXEC | O_NOFOLLOW);
+}
+
+// The [path] [depth] arguments of w24tree and w24du: a lone number is a depth
+// (a directory called "3" is "./3"); paths are relative to HOME, or absolute
+// inside it, and must not leave it through a symlink either. root is set to
+// the resolved directory. Sends the error and returns -1 if they do not name one.
+int parse_tree_args(Reply *reply, const char *command, char *args, char *root, size_t size, struct stat *st,
+                    long *depth) {
+    char *saveptr, *tokens[3], msg[128];
+    int num_tokens = 0;
+    for (char *tok = strtok_r(args, " ", &saveptr); tok && num_tokens < 3; tok = strtok_r(NULL, " ", &saveptr))
+        tokens[num_tokens++] = tok;
+    const char *rel = "";
+    int valid = num_tokens < 3;
+    *depth = 0;
+    if (valid && num_tokens > 0 && strspn(tokens[num_tokens - 1], "0123456789") == strlen(tokens[num_tokens - 1])) {
+        *depth = atol(tokens[--num_tokens]);
+        valid = *depth > 0;
+    }
+    if (valid && num_tokens == 1)
+        rel = tokens[0];
+    else if (num_tokens > 1)
+        valid = 0;
+    if (!valid) {
+        snprintf(msg, sizeof(msg), "Usage: %s [path] [depth], depth 1 or more\n", command);
+        send_text(reply, W24_STATUS_INVALID, msg);
+        return -1;
+    }
+
+    int n = resolve_home_path(rel, root, size);
+    int fd = n < 0 || (size_t)n >= size ? -1 : open_beneath_home(root, O_PATH | O_DIRECTORY);
+    if (n < 0 || (fd < 0 && errno == EXDEV)) {
+        snprintf(msg, sizeof(msg), "%s only lists directories inside the home directory\n", command);
+        send_text(reply, W24_STATUS_INVALID, msg);
+        return -1;
+    }
+    if (fd < 0 || fstat(fd, st) < 0 || !S_ISDIR(st->st_mode)) {
+        if (fd >= 0) close(fd);
+        send_text(reply, W24_STATUS_NOT_FOUND, "Directory not found\n");
+        return -1;
+    }
+    // Walk the directory that was checked, by its resolved name, so that no
+    // link in the path given can be swapped to lead somewhere else meanwhile
+    char proc[32];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(proc, root, size - 1);
+    if (len > 0) root[len] = '\0';
+    close(fd);
+    return 0;
+}
+
+void send_tree(Reply *reply, char *args) {
+    char root[PATH_MAX];
+    struct stat st;
+    long depth;
+    if (parse_tree_args(reply, "w24tree", args, root, sizeof(root), &st, &depth) < 0)
+        return;
+    int n = strlen(root);
+
+    TreeListing *t = malloc(sizeof(TreeListing));
+    if (!t || text_stream_init(&t->out, reply) < 0) {
+        free(t);
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    t->out.type = W24_TYPE_TREE;
+    t->depth = 1;
+    t->entered = 0;
+    t->count = 0;
+    t->levels[0].id = 0;
+    t->levels[0].last_len = 0;
+    t->levels[0].last_mtime = st.st_mtim.tv_sec;
+
+    unsigned char head[32];
+    size_t h = 4;
+    memcpy(head, TREE_MAGIC, 4);
+    head[h++] = TREE_VERSION;
+    h += tree_put_varint(head + h, n);
+    text_stream_write(&t->out, (const char *)head, h);
+    text_stream_write(&t->out, root, n);
+    h = tree_put_signed(head, st.st_mtim.tv_sec);
+    text_stream_write(&t->out, (const char *)head, h);
+
+    walk_tree(root, 0, WALK_STAT | (depth ? WALK_DEPTH(depth < WALK_MAX_DEPTH ? depth : WALK_MAX_DEPTH) : 0),
+              NULL, NULL, NULL, tree_listing_visit, t);
+
+    h = tree_put_varint(head, 0);
+    h += tree_put_varint(head + h, t->count);
+    text_stream_write(&t->out, (const char *)head, h);
+    text_stream_end(&t->out, W24_STATUS_OK);
+    free(t);
+}
+
+// ---- Aggregate queries ----
+// Answers that are a few lines however much matches: w24du [path] [depth] sums
+// sizes per directory, w24top size|mtime N [predicates] keeps the N largest or
+// newest files in a bounded heap, and w24count <predicates> counts matches and
+// their bytes. Each is one pass: a walk, or for the queries the index scan
+// that w24find uses when the index can answer.
+#define TOP_LIMIT 10000         // Largest N for w24top
+
+// Visit every file matching q, from the index if it can answer, else from a walk
+typedef struct {
+    const Query *query;
+    file_visitor visit;
+    void *arg;
+} QueryVisit;
+
+int query_visit_filter(const char *name, void *arg) {
+    return query_name_matches(((QueryVisit *)arg)->query, name);
+}
+
+int query_visit_file(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    QueryVisit *v = arg;
+    return query_matches(v->query, name, st, hidden) ? v->visit(path, name, st, hidden, v->arg) : 0;
+}
+
+void query_files(const Query *q, file_visitor visit, void *arg) {
+    QueryVisit v = {q, visit, arg};
+    if (index_query_visit(q, visit, arg, NULL) < 0)
+        walk_files(getenv("HOME"), 0, query_visit_filter, query_visit_file, &v);
+}
+
+// The same with the index's matches copied out first, for visitors that may
+// block (queueing work, writing to the client) and must not hold up the indexer
+void query_files_copied(const Query *q, file_visitor visit, void *arg) {
+    QueryVisit v = {q, visit, arg};
+    ScanRecord *files;
+    size_t count;
+    if (index_query_records(q, &files, &count, NULL) < 0) {
+        walk_files(getenv("HOME"), 0, query_visit_filter, query_visit_file, &v);
+        return;
+    }
+    int stop = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *slash = strrchr(files[i].path, '/');
+        if (!stop) stop = visit(files[i].path, slash ? slash + 1 : files[i].path, &files[i].st, files[i].hidden, arg);
+        free(files[i].path);
+    }
+    free(files);
+}
+
+// Predicates for w24top and w24count, which take no -l; none at all matches every file
+int parse_aggregate_query(Reply *reply, const char *command, char *args, Query *q) {
+    char err[256];
+    int list;
+    while (*args == ' ') args++;
+    if (*args == '\0') {
+        memset(q, 0, sizeof(*q));
+        return 0;
+    }
+    if (parse_find_query(args, q, &list, err, sizeof(err)) < 0 || list) {
+        if (list) snprintf(err, sizeof(err), "%s takes predicates only, no -l\n", command);
+        send_text(reply, W24_STATUS_INVALID, err);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    unsigned long long count, bytes;
+} QueryCount;
+
+int query_count_add(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    QueryCount *c = arg;
+    (void)path, (void)name, (void)hidden;
+    c->count++;
+    c->bytes += st->st_size;
+    return 0;
+}
+
+// w24count: "N files, B bytes"
+void send_count(Reply *reply, char *args) {
+    Query q;
+    QueryCount c = {0, 0};
+    char msg[128];
+    if (parse_aggregate_query(reply, "w24count", args, &q) < 0)
+        return;
+    query_files(&q, query_count_add, &c);
+    snprintf(msg, sizeof(msg), "%llu files, %llu bytes\n", c.count, c.bytes);
+    send_text(reply, W24_STATUS_OK, msg);
+}
+
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+} TopFile;
+
+typedef struct {
+    TopFile *heap;          // Min-heap: heap[0] is the first to go
+    size_t count, limit;
+    int by_mtime;
+} TopFiles;
+
+// Does a rank below b? Ties go to the later path, so the answer does not
+// depend on the order files are found in.
+int top_below(const TopFiles *t, const TopFile *a, const TopFile *b) {
+    if (t->by_mtime) {
+        if (a->mtime.tv_sec != b->mtime.tv_sec) return a->mtime.tv_sec < b->mtime.tv_sec;
+        if (a->mtime.tv_nsec != b->mtime.tv_nsec) return a->mtime.tv_nsec < b->mtime.tv_nsec;
+    } else if (a->size != b->size) {
+        return a->size < b->size;
+    }
+    return strcmp(a->path, b->path) > 0;
+}
+
+void top_sift_down(TopFiles *t, size_t i) {
+    while (1) {
+        size_t low = i, l = 2 * i + 1, r = l + 1;
+        if (l < t->count && top_below(t, &t->heap[l], &t->heap[low])) low = l;
+        if (r < t->count && top_below(t, &t->heap[r], &t->heap[low])) low = r;
+        if (low == i) return;
+        TopFile tmp = t->heap[i];
+        t->heap[i] = t->heap[low];
+        t->heap[low] = tmp;
+        i = low;
+    }
+}
+
+int top_files_add(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    TopFiles *t = arg;
+    TopFile f = {(char *)path, st->st_size, st->st_mtim};
+    (void)name, (void)hidden;
+    if (t->count == t->limit && !top_below(t, &t->heap[0], &f))
+        return 0;  // Not among the best so far: no copy made
+    if ((f.path = strdup(path)) == NULL) return 0;
+    if (t->count == t->limit) {
+        free(t->heap[0].path);
+        t->heap[0] = f;
+        top_sift_down(t, 0);
+        return 0;
+    }
+    size_t i = t->count++;
+    t->heap[i] = f;
+    while (i > 0 && top_below(t, &t->heap[i], &t->heap[(i - 1) / 2])) {
+        TopFile tmp = t->heap[i];
+        t->heap[i] = t->heap[(i - 1) / 2];
+        t->heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+// w24top: "size YYYY-MM-DD HH:MM:SS path" lines, best first
+void send_top(Reply *reply, char *args) {
+    char order[16], line[PATH_MAX + 64];
+    long n = 0;
+    int used = 0;
+    Query q;
+    if (sscanf(args, "%15s %ld%n", order, &n, &used) != 2 || n < 1 || n > TOP_LIMIT ||
+        (strcmp(order, "size") != 0 && strcmp(order, "mtime") != 0) || (args[used] && args[used] != ' ')) {
+        snprintf(line, sizeof(line), "Usage: w24top size|mtime <N> [predicates], N from 1 to %d\n", TOP_LIMIT);
+        send_text(reply, W24_STATUS_INVALID, line);
+        return;
+    }
+    if (parse_aggregate_query(reply, "w24top", args + used, &q) < 0)
+        return;
+
+    TopFiles t = {malloc(n * sizeof(TopFile)), 0, n, order[0] == 'm'};
+    TextStream out;
+    if (!t.heap || text_stream_init(&out, reply) < 0) {
+        free(t.heap);
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    query_files(&q, top_files_add, &t);
+    if (t.count == 0) {
+        free(out.text);
+        free(t.heap);
+        send_text(reply, W24_STATUS_NOT_FOUND, "No file found\n");
+        return;
+    }
+    // Popping the heap gives the worst first: fill the order in from the end
+    size_t count = t.count;
+    TopFile *best = malloc(count * sizeof(TopFile));
+    for (size_t i = count; best && i-- > 0;) {
+        best[i] = t.heap[0];
+        t.heap[0] = t.heap[--t.count];
+        top_sift_down(&t, 0);
+    }
+    for (size_t i = 0; i < count; i++) {
+        TopFile *f = best ? &best[i] : &t.heap[i];
+        struct tm tm;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&f->mtime.tv_sec, &tm));
+        int len = snprintf(line, sizeof(line), "%lld %s %s\n", (long long)f->size, when, f->path);
+        text_stream_write(&out, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+        free(f->path);
+    }
+    text_stream_end(&out, W24_STATUS_OK);
+    free(best);
+    free(t.heap);
+}
+
+// w24du: one "bytes files path" line per directory after everything in it,
+// deepest first like du; every file counts, only the first depth levels are listed
+typedef struct {
+    unsigned long long bytes, files;
+} DuLevel;
+
+typedef struct {
+    TextStream out;
+    DuLevel levels[WALK_MAX_DEPTH + 1];
+    int depth;              // Directories open: levels[depth - 1] is the current one
+    long max_depth;         // Levels listed below the root, 0 for all
+} DiskUsage;
+
+int disk_usage_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                     void *arg) {
+    DiskUsage *u = arg;
+    (void)name, (void)hidden, (void)wd;
+    if (event == WALK_ENTER) {
+        u->levels[u->depth].bytes = u->levels[u->depth].files = 0;
+        u->depth++;
+    } else if (event == WALK_FILE) {
+        u->levels[u->depth - 1].bytes += S_ISDIR(st->st_mode) ? 0 : st->st_size;
+        u->levels[u->depth - 1].files++;
+    } else {
+        DuLevel *d = &u->levels[--u->depth];
+        if (u->depth > 0) {
+            u->levels[u->depth - 1].bytes += d->bytes;
+            u->levels[u->depth - 1].files += d->files;
+        }
+        if (!u->max_depth || u->depth <= u->max_depth) {
+            char line[PATH_MAX + 64];
+            int len = snprintf(line, sizeof(line), "%llu %llu %s\n", d->bytes, d->files, path);
+            return text_stream_write(&u->out, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1) < 0;
+        }
+    }
+    return 0;
+}
+
+void send_disk_usage(Reply *reply, char *args) {
+    char root[PATH_MAX];
+    struct stat st;
+    long depth;
+    if (parse_tree_args(reply, "w24du", args, root, sizeof(root), &st, &depth) < 0)
+        return;
+    DiskUsage *u = malloc(sizeof(DiskUsage));
+    if (!u || text_stream_init(&u->out, reply) < 0) {
+        free(u);
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    u->depth = 0;
+    u->max_depth = depth;
+    walk_tree(root, 0, WALK_STAT, NULL, NULL, NULL, disk_usage_visit, u);
+    text_stream_end(&u->out, W24_STATUS_OK);
+    free(u);
+}
+
+// ---- Content reads ----
+// w24grep and w24sum read whole files. A shared pool of content threads does
+// the reading, one file per job, each thread with a CONTENT_BUFFER of its own;
+// the thread serving the request queues its files as one batch and waits for
+// the batch to drain.
+#define CONTENT_BUFFER (1024 * 1024)    // Bytes read per chunk
+#define CONTENT_CHECK_EVERY 256         // Files queued between two looks at the client socket
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;    // pending dropped to 0
+    int pending;            // Jobs queued or running
+} ContentBatch;
+
+typedef struct ContentJob {
+    void (*run)(struct ContentJob *job, int self, char *buf); // self numbers the content thread
+    ContentBatch *batch;
+    void *arg;
+    char *path;
+    struct stat st;
+} ContentJob;
+
+int content_threads;
+WorkQueue content_queue;
+
+void *content_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
+    char *buf = malloc(CONTENT_BUFFER);
+    ContentJob *j;
+    while ((j = queue_pop(&content_queue)) != NULL) {
+        ContentBatch *b = j->batch;
+        if (buf) j->run(j, self, buf);
+        free(j->path);
+        free(j);
+        pthread_mutex_lock(&b->lock);
+        if (--b->pending == 0) pthread_cond_signal(&b->idle);
+        pthread_mutex_unlock(&b->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+void content_pool_start() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    content_threads = cpus < 2 ? 2 : cpus > 16 ? 16 : cpus;
+    if (queue_init(&content_queue, QUEUE_CAPACITY) < 0)
+        error("ERROR allocating content queue");
+    for (int i = 0; i < content_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, content_thread, (void *)(intptr_t)i) != 0)
+            error("ERROR creating content thread");
+        pthread_detach(tid);
+    }
+}
+
+void content_batch_init(ContentBatch *b) {
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->idle, NULL);
+    b->pending = 0;
+}
+
+// Queue run(path) for the content threads, waiting while the queue is full
+void content_queue_file(ContentBatch *b, void (*run)(ContentJob *, int, char *), void *arg, const char *path,
+                        const struct stat *st) {
+    ContentJob *j = malloc(sizeof(ContentJob));
+    if (!j || (j->path = strdup(path)) == NULL) {
+        free(j);
+        return;
+    }
+    j->run = run;
+    j->batch = b;
+    j->arg = arg;
+    j->st = *st;
+    pthread_mutex_lock(&b->lock);
+    b->pending++;
+    pthread_mutex_unlock(&b->lock);
+    if (queue_push(&content_queue, j) < 0) {
+        free(j->path);
+        free(j);
+        pthread_mutex_lock(&b->lock);
+        b->pending--;
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+// Wait for every job of the batch, then release it
+void content_batch_finish(ContentBatch *b) {
+    pthread_mutex_lock(&b->lock);
+    while (b->pending > 0)
+        pthread_cond_wait(&b->idle, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->idle);
+}
+
+// Has the client hung up? Anything it sends meanwhile waits for its turn.
+int client_gone(Reply *reply) {
+    struct pollfd pfd = {reply->sock, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// ---- Content search ----
+// w24grep [-E] [-b <budget>] <pattern> [ext ...] lists the lines of files below
+// HOME that contain pattern (a POSIX extended regex with -E) as path:line:text
+// records, streamed while the search runs. The thread serving the request finds
+// the files (up to three extensions narrow them, as for w24ft) and the content
+// threads search them. Literals are found 32 bytes at a time by comparing the
+// pattern's first and last bytes (AVX2), elsewhere with memchr on the first
+// byte, and confirmed with memcmp. The search stops once it has read about its
+// byte budget or the client hangs up.
+#define GREP_LINE_MAX 256           // Bytes of a matching line sent back; a line is also cut at CONTENT_BUFFER
+#define GREP_BUDGET (1LL << 30)     // Bytes read per search unless -b says otherwise
+#define GREP_BINARY_SAMPLE 4096     // A NUL in this many leading bytes makes a file binary
+#define GREP_BUDGET_SPENT 1
+#define GREP_CANCELLED 2
+
+typedef struct {
+    const char *pattern;
+    size_t pattern_len;
+    regex_t *regexes;       // -E: a copy per content thread, as regexec serialises on a shared one
+    Reply *reply;
+    ContentBatch batch;
+    TextStream out;         // Under lock
+    pthread_mutex_t lock;
+    int stopped;            // GREP_BUDGET_SPENT or GREP_CANCELLED
+    long long budget;       // Bytes that may still be read
+    unsigned long long files, bytes, lines, matched_files;
+} GrepSearch;
+
+const char *grep_find_scalar(const char *p, const char *end, const char *pat, size_t k) {
+    while ((size_t)(end - p) >= k && (p = memchr(p, pat[0], end - p - k + 1)) != NULL) {
+        if (memcmp(p + 1, pat + 1, k - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Candidates are positions where both the first and the last byte of the
+// pattern line up, which rules out nearly everything before a memcmp (k >= 2)
+__attribute__((target("avx2")))
+const char *grep_find_avx2(const char *p, const char *end, const char *pat, size_t k) {
+    const __m256i first = _mm256_set1_epi8(pat[0]), last = _mm256_set1_epi8(pat[k - 1]);
+    for (; end - p >= (ptrdiff_t)(k - 1 + 32); p += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + k - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *c = p + __builtin_ctz(mask);
+            if (memcmp(c + 1, pat + 1, k - 2) == 0) return c;
+        }
+    }
+    return grep_find_scalar(p, end, pat, k);
+}
+#endif
+
+// First match in [p, end), or NULL; self picks the grep thread's regex copy
+const char *grep_next(const GrepSearch *s, const char *buf, const char *p, const char *end, int self) {
+    if (s->regexes) {
+        regmatch_t m = {p - buf, end - buf};
+        return regexec(&s->regexes[self], buf, 1, &m, REG_STARTEND) == 0 ? buf + m.rm_so : NULL;
+    }
+    if (s->pattern_len == 1) return memchr(p, s->pattern[0], end - p);
+#if defined(__x86_64__) || defined(__i386__)
+    if (scan_avx2) return grep_find_avx2(p, end, s->pattern, s->pattern_len);
+#endif
+    return grep_find_scalar(p, end, s->pattern, s->pattern_len);
+}
+
+unsigned long long grep_count_lines(const char *p, const char *end) {
+    unsigned long long n = 0;
+    for (; p < end; p++) n += *p == '\n';
+    return n;
+}
+
+// Append a record to the file's output, which goes out in one piece
+int grep_append(char **out, size_t *len, size_t *cap, const char *data, size_t n) {
+    if (*len + n > *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 4096;
+        while (grown_cap < *len + n) grown_cap *= 2;
+        char *grown = realloc(*out, grown_cap);
+        if (!grown) return -1;
+        *out = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*out + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+// Search one file, chunk by chunk: each chunk is cut after its last newline and
+// the partial line carried over to the next
+void grep_file(GrepSearch *s, const char *path, int self, char *buf) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char *out = NULL, prefix[PATH_MAX + 32];
+    size_t out_len = 0, out_cap = 0, have = 0;
+    unsigned long long lineno = 1, lines = 0, read_bytes = 0;
+    int binary = -1, eof = 0;
+    while (!eof && !(binary > 0 && lines > 0) && !__atomic_load_n(&s->stopped, __ATOMIC_RELAXED)) {
+        ssize_t n = read(fd, buf + have, CONTENT_BUFFER - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            eof = 1;
+            n = 0;
+        }
+        read_bytes += n;
+        if (__atomic_sub_fetch(&s->budget, n, __ATOMIC_RELAXED) < 0)
+            __atomic_store_n(&s->stopped, GREP_BUDGET_SPENT, __ATOMIC_RELAXED);
+        size_t len = have + n, end = len;
+        if (binary < 0 && (eof || len >= GREP_BINARY_SAMPLE))
+            binary = memchr(buf, 0, len < GREP_BINARY_SAMPLE ? len : GREP_BINARY_SAMPLE) != NULL;
+        if (!eof) {
+            const char *nl = memrchr(buf, '\n', len);
+            if (nl) {
+                end = nl - buf + 1;
+            } else if (len < CONTENT_BUFFER) {
+                have = len;  // No whole line yet
+                continue;
+            }
+        }
+
+        const char *p = buf, *region_end = buf + end, *counted = buf, *m;
+        while (p < region_end && (m = grep_next(s, buf, p, region_end, self)) != NULL) {
+            const char *line = memrchr(p, '\n', m - p);
+            line = line ? line + 1 : p;
+            const char *line_end = memchr(m, '\n', region_end - m);
+            if (!line_end) line_end = region_end;
+            lineno += grep_count_lines(counted, line);
+            counted = line;
+            lines++;
+            if (binary > 0) break;  // Reported once, below
+            size_t text = line_end - line;
+            if (text > 0 && line[text - 1] == '\r') text--;
+            if (text > GREP_LINE_MAX) text = GREP_LINE_MAX;
+            int l = snprintf(prefix, sizeof(prefix), "%s:%llu:", path, lineno);
+            if (grep_append(&out, &out_len, &out_cap, prefix, l) < 0 ||
+                grep_append(&out, &out_len, &out_cap, line, text) < 0 ||
+                grep_append(&out, &out_len, &out_cap, "\n", 1) < 0)
+                break;
+            p = line_end + 1;
+        }
+        lineno += grep_count_lines(counted, region_end);
+        memmove(buf, buf + end, len - end);
+        have = len - end;
+    }
+    close(fd);
+    if (binary > 0 && lines > 0) {
+        int l = snprintf(prefix, sizeof(prefix), "%s: binary file matches\n", path);
+        grep_append(&out, &out_len, &out_cap, prefix, l);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->bytes += read_bytes;
+    s->lines += lines;
+    if (lines > 0) s->matched_files++;
+    if (out_len > 0 && text_stream_write(&s->out, out, out_len) < 0)
+        __atomic_store_n(&s->stopped, GREP_CANCELLED, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    free(out);
+}
+
+void grep_run(ContentJob *j, int self, char *buf) {
+    GrepSearch *s = j->arg;
+    if (!__atomic_load_n(&s->stopped, __ATOMIC_RELAXED))
+        grep_file(s, j->path, self, buf);
+}
+
+// file_visitor: queue one file for the content threads
+int grep_queue_file(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    GrepSearch *s = arg;
+    (void)name, (void)hidden;
+    if (__atomic_load_n(&s->stopped, __ATOMIC_RELAXED)) return 1;
+    if (++s->files % CONTENT_CHECK_EVERY == 0 && client_gone(s->reply)) {
+        __atomic_store_n(&s->stopped, GREP_CANCELLED, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (st->st_size > 0)
+        content_queue_file(&s->batch, grep_run, s, path, st);
+    return 0;
+}
+
+void send_grep(Reply *reply, char *args) {
+    const char *usage = "Usage: w24grep [-E] [-b <budget>] <pattern> [ext1] [ext2] [ext3], "
+                        "quoting a pattern with spaces in \"...\"\n";
+    GrepSearch s;
+    Query q = {0};
+    char msg[256], *p = args;
+    int regex = 0;
+    memset(&s, 0, sizeof(s));
+    s.budget = GREP_BUDGET;
+    s.reply = reply;
+
+    // Options, then the pattern, then the extensions
+    while (*p == ' ') p++;
+    while (*p == '-' && (p[1] == 'E' || p[1] == 'b') && p[2] == ' ') {
+        if (p[1] == 'E') {
+            regex = 1;
+            p += 3;
+        } else {
+            const char *end;
+            off_t budget;
+            if (parse_find_size(p + 3, &end, &budget) < 0 || budget == 0 || (*end != ' ' && *end)) {
+                send_text(reply, W24_STATUS_INVALID, "Invalid budget. Use -b <size> with K, M, G or T suffixes\n");
+                return;
+            }
+            s.budget = budget;
+            p = (char *)end;
+        }
+        while (*p == ' ') p++;
+    }
+    char *pattern = p;
+    if (*p == '"') {
+        pattern = ++p;
+        p = strchr(p, '"');
+        if (!p) pattern = p;
+    } else {
+        p += strcspn(p, " ");
+    }
+    if (!pattern || p == pattern) {
+        send_text(reply, W24_STATUS_INVALID, usage);
+        return;
+    }
+    if (*p) *p++ = '\0';
+    char *saveptr;
+    for (char *t = strtok_r(p, " ", &saveptr); t; t = strtok_r(NULL, " ", &saveptr)) {
+        if (*t == '.') t++;
+        if (!*t || strlen(t) >= sizeof(q.types[0]) || q.num_types == 3) {
+            send_text(reply, W24_STATUS_INVALID, usage);
+            return;
+        }
+        snprintf(q.types[q.num_types++], sizeof(q.types[0]), "%s", t);
+        q.fields |= QUERY_TYPE;
+    }
+    s.pattern = pattern;
+    s.pattern_len = strlen(pattern);
+    if (regex) {
+        s.regexes = calloc(content_threads, sizeof(regex_t));
+        int compiled = 0, rc = s.regexes ? 0 : REG_ESPACE;
+        while (rc == 0 && compiled < content_threads &&
+               (rc = regcomp(&s.regexes[compiled], pattern, REG_EXTENDED | REG_NEWLINE)) == 0)
+            compiled++;
+        if (rc != 0) {
+            int l = snprintf(msg, sizeof(msg), "Invalid regular expression: ");
+            regerror(rc, compiled < content_threads && s.regexes ? &s.regexes[compiled] : NULL, msg + l, sizeof(msg) - l - 1);
+            strcat(msg, "\n");
+            for (int i = 0; i < compiled; i++) regfree(&s.regexes[i]);
+            free(s.regexes);
+            send_text(reply, W24_STATUS_INVALID, msg);
+            return;
+        }
+    }
+    if (text_stream_init(&s.out, reply) < 0) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        if (s.regexes) {
+            for (int i = 0; i < content_threads; i++) regfree(&s.regexes[i]);
+            free(s.regexes);
+        }
+        return;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    content_batch_init(&s.batch);
+
+    query_files_copied(&q, grep_queue_file, &s);
+    content_batch_finish(&s.batch);
+
+    int l = snprintf(msg, sizeof(msg), "# %llu matching lines in %llu of %llu files, %llu bytes searched\n",
+                     s.lines, s.matched_files, s.files, s.bytes);
+    if (s.stopped == GREP_BUDGET_SPENT)
+        l += snprintf(msg + l, sizeof(msg) - l, "# Stopped at the byte budget, use -b to search further\n");
+    text_stream_write(&s.out, msg, l);
+    text_stream_end(&s.out, s.lines > 0 ? W24_STATUS_OK : W24_STATUS_NOT_FOUND);
+    if (s.stopped == GREP_CANCELLED)
+        log_request("w24grep cancelled: the client went away\n");
+    if (s.regexes) {
+        for (int i = 0; i < content_threads; i++) regfree(&s.regexes[i]);
+        free(s.regexes);
+    }
+    pthread_mutex_destroy(&s.lock);
+}
+
+// ---- Checksums ----
+// w24sum [-s] [predicates] sends a "digest size path" line for every matching
+// file: XXH64 by default, SHA-256 with -s. The content threads hash the files.
+// Digests are kept keyed by (device, inode) together with the size and mtime
+// they were computed for, so a rerun only reads the files that changed. The
+// cache is an append-only file (-H, "" to keep it in memory only, by default in
+// the private state_dir), read at startup and rewritten whenever superseded
+// records come to outnumber the live ones.
+#define SUM_NONE -1             // Manifests without a hash only list the files
+#define SUM_XXH64 0
+#define SUM_SHA256 1
+#define SUM_MAGIC "W24SUMS"
+#define SUM_VERSION 1
+
+// XXH64, streamed
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t mem_len;
+} Xxh64;
+
+uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return xxh_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+void xxh64_init(Xxh64 *h) {
+    h->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    h->v[1] = XXH_PRIME2;
+    h->v[2] = 0;
+    h->v[3] = -XXH_PRIME1;
+    h->total = 0;
+    h->mem_len = 0;
+}
+
+void xxh64_update(Xxh64 *h, const unsigned char *p, size_t len) {
+    h->total += len;
+    if (h->mem_len + len < 32) {
+        memcpy(h->mem + h->mem_len, p, len);
+        h->mem_len += len;
+        return;
+    }
+    if (h->mem_len) {
+        size_t fill = 32 - h->mem_len;
+        memcpy(h->mem + h->mem_len, p, fill);
+        for (int i = 0; i < 4; i++) h->v[i] = xxh_round(h->v[i], xxh_read64(h->mem + 8 * i));
+        p += fill;
+        len -= fill;
+        h->mem_len = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+        h->v[0] = xxh_round(h->v[0], xxh_read64(p));
+        h->v[1] = xxh_round(h->v[1], xxh_read64(p + 8));
+        h->v[2] = xxh_round(h->v[2], xxh_read64(p + 16));
+        h->v[3] = xxh_round(h->v[3], xxh_read64(p + 24));
+    }
+    memcpy(h->mem, p, len);
+    h->mem_len = len;
+}
+
+uint64_t xxh64_final(const Xxh64 *h) {
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = (acc ^ xxh_round(0, h->v[i])) * XXH_PRIME1 + XXH_PRIME4;
+    } else {
+        acc = XXH_PRIME5;
+    }
+    acc += h->total;
+    const unsigned char *p = h->mem, *end = h->mem + h->mem_len;
+    for (; p + 8 <= end; p += 8)
+        acc = xxh_rotl(acc ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        acc = xxh_rotl(acc ^ (uint64_t)le32toh(v) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        acc = xxh_rotl(acc ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    acc ^= acc >> 33;
+    acc *= XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= XXH_PRIME3;
+    return acc ^ (acc >> 32);
+}
+
+// SHA-256 (FIPS 180-4), streamed
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;
+    unsigned char block[64];
+    size_t block_len;
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t sha_rotr(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+void sha256_block(Sha256 *s, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha_rotr(w[i - 15], 7) ^ sha_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha_rotr(w[i - 2], 17) ^ sha_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (sha_rotr(e, 6) ^ sha_rotr(e, 11) ^ sha_rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (sha_rotr(a, 2) ^ sha_rotr(a, 13) ^ sha_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    s->h[0] += a, s->h[1] += b, s->h[2] += c, s->h[3] += d;
+    s->h[4] += e, s->h[5] += f, s->h[6] += g, s->h[7] += h;
+}
+
+void sha256_init(Sha256 *s) {
+    static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, h0, sizeof(h0));
+    s->total = 0;
+    s->block_len = 0;
+}
+
+void sha256_update(Sha256 *s, const unsigned char *p, size_t len) {
+    s->total += len;
+    if (s->block_len) {
+        size_t fill = 64 - s->block_len < len ? 64 - s->block_len : len;
+        memcpy(s->block + s->block_len, p, fill);
+        s->block_len += fill;
+        p += fill;
+        len -= fill;
+        if (s->block_len < 64) return;
+        sha256_block(s, s->block);
+        s->block_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(s, p);
+    memcpy(s->block, p, len);
+    s->block_len = len;
+}
+
+void sha256_final(Sha256 *s, unsigned char digest[32]) {
+    uint64_t bits = s->total * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (s->block_len < 56 ? 56 : 120) - s->block_len;
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = s->h[i] >> 24;
+        digest[4 * i + 1] = s->h[i] >> 16;
+        digest[4 * i + 2] = s->h[i] >> 8;
+        digest[4 * i + 3] = s->h[i];
+    }
+}
+
+// A digest as it is cached, and as it is stored in the cache file
+typedef struct {
+    uint64_t dev, ino;
+    int64_t size, mtime_sec;
+    int32_t mtime_nsec;
+    uint8_t algo, pad[3];
+    unsigned char digest[32];   // XXH64 in the first 8 bytes, big-endian
+} SumRecord;
+
+typedef struct SumEntry {
+    SumRecord r;
+    struct SumEntry *next;
+} SumEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SumEntry **buckets;
+    size_t num_buckets, entries;
+    size_t records;         // In the file, superseded ones included
+    int fd;                 // Cache file opened for appending, -1 if none
+    uint64_t hits, misses;
+    char path[PATH_MAX];    // -H; empty to keep digests in memory only
+} SumCache;
+
+SumCache sum_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, -1, 0, 0, ""};
+
+// The entry for (dev, ino, algo), whatever it was computed for (lock held)
+SumEntry *sum_cache_find(SumCache *c, uint64_t dev, uint64_t ino, int algo) {
+    if (!c->buckets) return NULL;
+    SumEntry *e = c->buckets[cache_hash(dev, ino, c->num_buckets)];
+    while (e && !(e->r.dev == dev && e->r.ino == ino && e->r.algo == algo)) e = e->next;
+    return e;
+}
+
+// Copy the cached digest of an unchanged file into digest
+int sum_cache_lookup(SumCache *c, const struct stat *st, int algo, unsigned char *digest) {
+    pthread_mutex_lock(&c->lock);
+    SumEntry *e = sum_cache_find(c, st->st_dev, st->st_ino, algo);
+    int hit = e && e->r.size == st->st_size && e->r.mtime_sec == st->st_mtim.tv_sec &&
+              e->r.mtime_nsec == st->st_mtim.tv_nsec;
+    if (hit) memcpy(digest, e->r.digest, sizeof(e->r.digest));
+    if (hit) c->hits++; else c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return hit;
+}
+
+int sum_cache_rewrite(SumCache *c);
+
+// Remember a digest, replacing the one for an older version of the file
+// (lock held); persist also appends it to the cache file
+void sum_cache_put(SumCache *c, const SumRecord *r, int persist) {
+    if (c->entries >= c->num_buckets) {
+        size_t buckets = c->num_buckets ? c->num_buckets * 2 : 4096;
+        SumEntry **grown = calloc(buckets, sizeof(SumEntry *));
+        if (grown) {
+            for (size_t i = 0; i < c->num_buckets; i++) {
+                for (SumEntry *e = c->buckets[i], *next; e; e = next) {
+                    next = e->next;
+                    size_t b = cache_hash(e->r.dev, e->r.ino, buckets);
+                    e->next = grown[b];
+                    grown[b] = e;
+                }
+            }
+            free(c->buckets);
+            c->buckets = grown;
+            c->num_buckets = buckets;
+        }
+    }
+    if (!c->buckets) return;
+    SumEntry *e = sum_cache_find(c, r->dev, r->ino, r->algo);
+    if (!e) {
+        if ((e = malloc(sizeof(SumEntry))) == NULL) return;
+        size_t b = cache_hash(r->dev, r->ino, c->num_buckets);
+        e->next = c->buckets[b];
+        c->buckets[b] = e;
+        c->entries++;
+    }
+    e->r = *r;
+    if (persist && c->fd >= 0) {
+        if (write_fully(c->fd, r, sizeof(*r)) < 0) {
+            perror("Checksum cache: write");
+            close(c->fd);
+            c->fd = -1;
+        }
+        c->records++;
+    }
+    if (persist && c->fd >= 0 && c->records > 2 * c->entries + 1024) {
+        int fd = sum_cache_rewrite(c);
+        close(c->fd);
+        c->fd = fd;
+        if (fd < 0)
+            fprintf(stderr, "Checksum cache: cannot rewrite %s, keeping digests in memory only\n", c->path);
+    }
+}
+
+// Write the live entries to a fresh file and rename it over the cache file
+// (lock held); returns its fd, positioned at the end for appending
+int sum_cache_rewrite(SumCache *c) {
+    char tmp[PATH_MAX + 8];
+    unsigned char header[12] = SUM_MAGIC;
+    uint32_t version = SUM_VERSION;
+    memcpy(header + 8, &version, 4);
+    int fd = create_state_temp(c->path, tmp, sizeof(tmp));
+    if (fd < 0) return -1;
+    int failed = write_fully(fd, header, sizeof(header)) < 0;
+    for (size_t i = 0; i < c->num_buckets && !failed; i++)
+        for (SumEntry *e = c->buckets[i]; e && !failed; e = e->next)
+            failed = write_fully(fd, &e->r, sizeof(e->r)) < 0;
+    if (failed || rename(tmp, c->path) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    c->records = c->entries;
+    return fd;
+}
+
+void sum_cache_load(SumCache *c) {
+    if (!c->path[0]) return;
+    unsigned char header[12];
+    SumRecord r;
+    ssize_t got = 0;
+    int fd = open_state_file(c->path, O_RDWR | O_APPEND);
+    if (fd < 0 && errno == EPERM)
+        fprintf(stderr, "Checksum cache: ignoring %s (not a file of this user)\n", c->path);
+    if (fd >= 0) {
+        if (read(fd, header, sizeof(header)) == sizeof(header) && memcmp(header, SUM_MAGIC, 8) == 0 &&
+            memcmp(header + 8, &(uint32_t){SUM_VERSION}, 4) == 0) {
+            while ((got = read(fd, &r, sizeof(r))) == sizeof(r)) {
+                sum_cache_put(c, &r, 0);
+                c->records++;
+            }
+        } else {
+            fprintf(stderr, "Checksum cache: ignoring %s (not a cache file of this version)\n", c->path);
+            got = -1;
+        }
+    }
+    // Superseded records are dropped when they outnumber the live ones; a
+    // record torn by a crash would misalign everything appended after it
+    if (fd < 0 || got != 0 || c->records > 2 * c->entries + 1024 || c->entries == 0) {
+        if (fd >= 0) close(fd);
+        c->fd = sum_cache_rewrite(c);
+    } else {
+        c->fd = fd;  // Reads left the offset at the end; O_APPEND keeps writes there anyway
+    }
+    if (c->fd < 0)
+        fprintf(stderr, "Checksum cache: cannot write %s, keeping digests in memory only\n", c->path);
+    else if (c->entries)
+        printf("Checksum cache: %zu digests loaded from %s\n", c->entries, c->path);
+}
+
+// One w24sum request, or archive manifest (see below)
+typedef struct {
+    Reply *reply;
+    ContentBatch batch;
+    TextStream out;         // Under lock, with the counters
+    pthread_mutex_t lock;
+    int algo;
+    int manifest;           // "size mtime [digest] path" lines instead of "digest size path"
+    int stopped;            // The client went away
+    unsigned long long files, bytes, hashed, cached, unreadable;
+} SumRun;
+
+void sum_send_line(SumRun *s, const unsigned char *digest, const struct stat *st, const char *path, int from_cache) {
+    char line[PATH_MAX + 128];
+    int n = 0, digest_len = !digest ? 0 : s->algo == SUM_SHA256 ? 32 : 8;
+    if (s->manifest)
+        n = snprintf(line, sizeof(line), "%lld %lld ", (long long)st->st_size, (long long)st->st_mtim.tv_sec);
+    for (int i = 0; i < digest_len; i++) n += snprintf(line + n, sizeof(line) - n, "%02x", digest[i]);
+    if (s->manifest)
+        n += snprintf(line + n, sizeof(line) - n, "%s%s\n", digest ? " " : "", path);
+    else
+        n += snprintf(line + n, sizeof(line) - n, " %lld %s\n", (long long)st->st_size, path);
+    pthread_mutex_lock(&s->lock);
+    if (digest && from_cache) s->cached++;
+    else if (digest) s->hashed++;
+    if (text_stream_write(&s->out, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1) < 0)
+        __atomic_store_n(&s->stopped, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Hash one file on a content thread; the digest is cached only if the file did
+// not change while it was read
+void sum_run(ContentJob *j, int self, char *buf) {
+    SumRun *s = j->arg;
+    struct stat before, after;
+    Xxh64 xxh;
+    Sha256 sha;
+    SumRecord r;
+    ssize_t n = 0;
+    (void)self;
+    if (__atomic_load_n(&s->stopped, __ATOMIC_RELAXED)) return;
+    int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &before) == 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (s->algo == SUM_SHA256) sha256_init(&sha); else xxh64_init(&xxh);
+        while ((n = read(fd, buf, CONTENT_BUFFER)) > 0 || (n < 0 && errno == EINTR)) {
+            if (n < 0) continue;
+            if (s->algo == SUM_SHA256) sha256_update(&sha, (unsigned char *)buf, n);
+            else xxh64_update(&xxh, (unsigned char *)buf, n);
+        }
+    }
+    if (fd < 0 || n < 0 || fstat(fd, &after) < 0) {
+        if (fd >= 0) close(fd);
+        pthread_mutex_lock(&s->lock);
+        s->unreadable++;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    close(fd);
+    memset(&r, 0, sizeof(r));
+    if (s->algo == SUM_SHA256) {
+        sha256_final(&sha, r.digest);
+    } else {
+        uint64_t h = htobe64(xxh64_final(&xxh));
+        memcpy(r.digest, &h, 8);
+    }
+    sum_send_line(s, r.digest, &after, j->path, 0);
+    if (before.st_size == after.st_size && before.st_mtim.tv_sec == after.st_mtim.tv_sec &&
+        before.st_mtim.tv_nsec == after.st_mtim.tv_nsec) {
+        r.dev = before.st_dev;
+        r.ino = before.st_ino;
+        r.size = before.st_size;
+        r.mtime_sec = before.st_mtim.tv_sec;
+        r.mtime_nsec = before.st_mtim.tv_nsec;
+        r.algo = s->algo;
+        pthread_mutex_lock(&sum_cache.lock);
+        sum_cache_put(&sum_cache, &r, 1);
+        pthread_mutex_unlock(&sum_cache.lock);
+    }
+}
+
+// file_visitor: answer from the cache, or queue the file for hashing
+int sum_queue_file(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    SumRun *s = arg;
+    unsigned char digest[32];
+    struct stat fresh;
+    (void)name, (void)hidden;
+    if (__atomic_load_n(&s->stopped, __ATOMIC_RELAXED)) return 1;
+    // Index records carry no device number, which the cache is keyed on
+    if (s->algo != SUM_NONE && st->st_dev == 0 && stat(path, &fresh) == 0) st = &fresh;
+    if (++s->files % CONTENT_CHECK_EVERY == 0 && client_gone(s->reply)) {
+        __atomic_store_n(&s->stopped, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    s->bytes += st->st_size;
+    if (s->algo == SUM_NONE)
+        sum_send_line(s, NULL, st, path, 0);
+    else if (sum_cache_lookup(&sum_cache, st, s->algo, digest))
+        sum_send_line(s, digest, st, path, 1);
+    else
+        content_queue_file(&s->batch, sum_run, s, path, st);
+    return 0;
+}
+
+// A line per file matching q, then the totals
+void sum_files(Reply *reply, const Query *q, int algo, int manifest, const char *command) {
+    SumRun s;
+    char msg[256];
+    memset(&s, 0, sizeof(s));
+    s.reply = reply;
+    s.algo = algo;
+    s.manifest = manifest;
+    if (text_stream_init(&s.out, reply) < 0) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    content_batch_init(&s.batch);
+    query_files_copied(q, sum_queue_file, &s);
+    content_batch_finish(&s.batch);
+
+    int n = snprintf(msg, sizeof(msg), "# %llu files, %llu bytes", s.files, s.bytes);
+    if (algo != SUM_NONE)
+        n += snprintf(msg + n, sizeof(msg) - n, ": %llu hashed, %llu from the cache", s.hashed, s.cached);
+    if (s.unreadable) n += snprintf(msg + n, sizeof(msg) - n, ", %llu unreadable", s.unreadable);
+    n += snprintf(msg + n, sizeof(msg) - n, "\n");
+    text_stream_write(&s.out, msg, n);
+    text_stream_end(&s.out, s.files > s.unreadable ? W24_STATUS_OK : W24_STATUS_NOT_FOUND);
+    if (s.stopped)
+        log_request("%s cancelled: the client went away\n", command);
+    pthread_mutex_destroy(&s.lock);
+}
+
+void send_sums(Reply *reply, char *args) {
+    Query q;
+    int algo = SUM_XXH64;
+    while (*args == ' ') args++;
+    if (strcmp(args, "-s") == 0 || strncmp(args, "-s ", 3) == 0) {
+        algo = SUM_SHA256;
+        args += 2;
+    }
+    if (parse_aggregate_query(reply, "w24sum", args, &q) < 0)
+        return;
+    sum_files(reply, &q, algo, 0, "w24sum");
+}
+
+// ---- Manifests ----
+// w24fz, w24ft, w24fdb, w24fda and w24find take -m to answer with the manifest
+// of the archive instead of the archive: a "size mtime path" line per file
+// (mtime in seconds since the epoch), then "# N files, B bytes". With
+// -m xxh64 or -m sha256 each line also carries the file's digest, "size mtime
+// digest path", served from the checksum cache where it can be. A client sees
+// what an archive would cost before asking for it, and can w24get only the
+// files, or the parts of them, it does not have yet.
+void send_manifest(Reply *reply, const Query *q, int codec) {
+    int algo = codec == CODEC_MANIFEST_XXH64 ? SUM_XXH64 : codec == CODEC_MANIFEST_SHA256 ? SUM_SHA256 : SUM_NONE;
+    sum_files(reply, q, algo, 1, "Manifest");
+}
+
+// Remove a trailing "-m [xxh64|sha256]" option from an archive command (after
+// any -z) and return the manifest it asks for, or 0 without one
+int take_manifest_option(char *buffer) {
+    char *opt = NULL;
+    for (char *p = strstr(buffer, " -m"); p; p = strstr(p + 1, " -m"))
+        if (p[3] == '\0' || p[3] == ' ') opt = p;
+    if (!opt)
+        return 0;
+    const char *hash = opt[3] ? opt + 4 : opt + 3;
+    int codec;
+    if (*hash == '\0') codec = CODEC_MANIFEST;
+    else if (strcmp(hash, "xxh64") == 0) codec = CODEC_MANIFEST_XXH64;
+    else if (strcmp(hash, "sha256") == 0) codec = CODEC_MANIFEST_SHA256;
+    else return CODEC_INVALID;
+    *opt = '\0';
+    return codec;
+}
+
+// ---- Ranged gets ----
+// w24get <path> [offset len] sends a file, or len bytes of it from offset (len
+// 0: to the end), as one W24_TYPE_FILE frame that sendfile() fills from the
+// page cache. The path is relative to HOME or absolute inside it, as manifests
+// print it; a range past the end is cut short. Every get is answered under
+// its own request ID, so a client can send several without waiting and take
+// the answers as they come back.
+void send_file_get(Reply *reply, char *args) {
+    char path[PATH_MAX], msg[128], *words[2] = {NULL, NULL};
+    long long offset = 0, len = 0;
+    struct stat st;
+    // The range is the last two words when both are numbers. A lone number is
+    // a range with its length missing; a path that itself ends in a number is
+    // asked for with an explicit range, "0 0" for all of it
+    while (*args == ' ') args++;
+    char *end = args + strlen(args);
+    while (end > args && end[-1] == ' ') *--end = '\0';
+    for (int i = 1; i >= 0; i--) {
+        char *space = end > args ? memrchr(args, ' ', end - args) : NULL;
+        if (!space || space + 1 == end || strspn(space + 1, "0123456789") < (size_t)(end - space - 1))
+            break;
+        words[i] = space + 1;
+        end = space;
+    }
+    if (words[0]) {
+        offset = strtoll(words[0], NULL, 10);
+        len = strtoll(words[1], NULL, 10);
+        while (end > args && end[-1] == ' ') end--;
+        *end = '\0';
+    }
+    if (*args == '\0' || (words[1] && !words[0])) {
+        send_text(reply, W24_STATUS_INVALID, "Usage: w24get <path> [offset len], len 0 reads to the end\n");
+        return;
+    }
+    int n = resolve_home_path(args, path, sizeof(path));
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        send_text(reply, W24_STATUS_INVALID, "w24get only sends files inside the home directory\n");
+        return;
+    }
+    // Non-blocking, so a FIFO cannot hold the worker up
+    int fd = open_beneath_home(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0 && errno == EXDEV) {
+        send_text(reply, W24_STATUS_INVALID, "w24get only sends files inside the home directory\n");
+        return;
+    }
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        send_text(reply, W24_STATUS_NOT_FOUND, "File not found\n");
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || offset > st.st_size) {
+        if (!S_ISREG(st.st_mode))
+            snprintf(msg, sizeof(msg), "Not a regular file\n");
+        else
+            snprintf(msg, sizeof(msg), "Offset past the end of the file (%lld bytes)\n", (long long)st.st_size);
+        close(fd);
+        send_text(reply, W24_STATUS_INVALID, msg);
+        return;
+    }
+    if (len == 0 || len > st.st_size - offset)
+        len = st.st_size - offset;
+    posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+    // The header shares a segment with the start of the data
+    unsigned char header[W24_HEADER_SIZE];
+    encode_header(header, W24_TYPE_FILE, W24_STATUS_OK, 0, reply->request_id, len);
+    int failed = send(reply->sock, header, sizeof(header), MSG_MORE) != sizeof(header) ||
+                 send_file_range(reply->sock, fd, offset, len) < 0;
+    close(fd);
+    if (failed)
+        log_request("w24get of %s stopped: the client went away\n", path);
+}
+
+// ---- Name lookups ----
+// w24fn with several names, -a (all matches) or glob patterns. Exact names come
+// from the basename hash; patterns narrow the sorted names to their literal
+// prefix, and "*.ext" patterns use the extension column. Without the index,
+// one walk serves every name of the request. Either way the matches are listed
+// in path order (byte order of the full path), and a plain name without -a
+// gives the first of them; neither the crawl nor the walkers keep a stable
+// order of their own.
+#define MATCH_LIMIT 10000       // Matches listed per name; the rest are only counted
+
+typedef struct {
+    char *path;
+    off_t size;
+    mode_t mode;
+} NameMatch;
+
+typedef struct {
+    const char *pattern;
+    int glob;               // Contains *, ? or [
+    int first_only;         // Exact name without -a: only the first match in path order
+    NameMatch *matches;
+    size_t count, cap;
+    size_t total;           // Matches found, listed or not
+    const char *cutoff;     // Once trimmed, the last path kept; later ones are only counted
+} NameLookup;
+
+int is_glob(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
+}
+
+// Does one [...] class at *p match c? Advances *p past the class.
+int glob_class(const char **p, unsigned char c) {
+    const char *s = *p + 1;
+    int negate = *s == '!' || *s == '^', match = 0;
+    if (negate) s++;
+    for (const char *start = s; *s && (*s != ']' || s == start); s++) {
+        unsigned char lo = *s, hi = lo;
+        if (s[1] == '-' && s[2] && s[2] != ']') {
+            hi = s[2];
+            s += 2;
+        }
+        if (c >= lo && c <= hi) match = 1;
+    }
+    if (*s != ']') return -1;  // Unterminated: the caller takes '[' literally
+    *p = s + 1;
+    return match != negate;
+}
+
+// Shell-style matching of a whole name (*, ?, [...], backslash escapes), byte by
+// byte: several times faster than fnmatch, which decodes multibyte characters
+int glob_match(const char *pattern, const char *name) {
+    const char *p = pattern, *n = name, *star = NULL, *star_name = NULL;
+    while (*n) {
+        const char *q = p;
+        int ok;
+        if (*p == '*') {
+            star = ++p;
+            star_name = n;
+            continue;
+        }
+        if (*p == '?') {
+            ok = 1;
+            q = p + 1;
+        } else if (*p == '[' && (ok = glob_class(&q, (unsigned char)*n)) >= 0) {
+            // q is past the class
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            ok = *p && *p == *n;
+            q = p + 1;
+        }
+        if (ok) {
+            p = q;
+            n++;
+        } else if (star) {
+            p = star;           // Let the last * take one more character
+            n = ++star_name;
+        } else {
+            return 0;
+        }
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+int name_lookup_matches(const NameLookup *l, const char *name) {
+    return l->glob ? glob_match(l->pattern, name) : strcmp(l->pattern, name) == 0;
+}
+
+int compare_name_matches(const void *a, const void *b) {
+    return strcmp(((const NameMatch *)a)->path, ((const NameMatch *)b)->path);
+}
+
+// Sort the matches and keep the first keep of them
+void name_lookup_trim(NameLookup *l, size_t keep) {
+    if (l->count == 0) return;
+    qsort(l->matches, l->count, sizeof(NameMatch), compare_name_matches);
+    for (; l->count > keep; l->count--)
+        free(l->matches[l->count - 1].path);
+    if (l->count == keep) l->cutoff = l->matches[keep - 1].path;
+}
+
+// Count a match and keep it if it is among the first MATCH_LIMIT (the first
+// one for first_only) in path order. Up to twice that many are gathered before
+// the list is sorted and cut back.
+void name_lookup_add(NameLookup *l, const char *path, const struct stat *st) {
+    l->total++;
+    if (l->cutoff && strcmp(path, l->cutoff) >= 0) return;
+    if (l->first_only && l->count == 1) {
+        char *copy = strdup(path);
+        if (!copy) return;
+        free(l->matches[0].path);
+        l->matches[0] = (NameMatch){copy, st->st_size, st->st_mode};
+        l->cutoff = copy;
+        return;
+    }
+    if (l->count == 2 * MATCH_LIMIT) name_lookup_trim(l, MATCH_LIMIT);
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        NameMatch *grown = realloc(l->matches, cap * sizeof(NameMatch));
+        if (!grown) return;
+        l->matches = grown;
+        l->cap = cap;
+    }
+    if ((l->matches[l->count].path = strdup(path)) == NULL) return;
+    l->matches[l->count].size = st->st_size;
+    l->matches[l->count].mode = st->st_mode;
+    if (++l->count == 1 && l->first_only) l->cutoff = l->matches[0].path;
+}
+
+// Candidate nodes of one lookup (read lock held); may include non-matches
+size_t index_name_candidates(const FileIndex *x, const NameLookup *l, uint32_t **out) {
+    size_t count = 0, cap = 0;
+    uint32_t *ids = NULL;
+    int ext = -1;
+#define CANDIDATE(id) do { \
+        if (count == cap) { \
+            uint32_t *grown = realloc(ids, (cap = cap ? cap * 2 : 64) * sizeof(uint32_t)); \
+            if (!grown) { *out = ids; return count; } \
+            ids = grown; \
+        } \
+        ids[count++] = (id); \
+    } while (0)
+
+    if (!l->glob) {
+        for (uint32_t n = x->name_buckets[index_hash(INDEX_NONE, l->pattern, x->num_buckets)]; n != INDEX_NONE;
+             n = x->nodes[n].name_next)
+            CANDIDATE(n);
+        *out = ids;
+        return count;
+    }
+    size_t prefix = strcspn(l->pattern, "*?[\\");
+    if (prefix == 0 && l->pattern[0] == '*' && l->pattern[1] == '.' && !is_glob(l->pattern + 2) &&
+        !strchr(l->pattern + 2, '\\') && !strchr(l->pattern + 2, '.'))
+        ext = index_ext_id((FileIndex *)x, l->pattern + 1, 0);  // Only looks: no insert without add
+    if (ext >= 0 && ext != EXT_OVERFLOW) {
+        // "*.conf": every node with that extension
+        for (uint32_t n = 1; n < x->num_nodes; n++)
+            if (x->exts[n] == ext) CANDIDATE(n);
+    } else {
+        // The sorted names starting with the literal prefix, plus whatever came
+        // since the sort; unless that is a large part of the index, which is
+        // faster to go through in memory order
+        uint32_t lo = 0, hi = x->num_sorted, end;
+        while (x->sorted_ok && prefix > 0 && lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (strncmp(index_name(x, x->sorted[mid]), l->pattern, prefix) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        for (end = lo, hi = x->num_sorted; x->sorted_ok && prefix > 0 && end < hi;) {
+            uint32_t mid = end + (hi - end) / 2;
+            if (strncmp(index_name(x, x->sorted[mid]), l->pattern, prefix) <= 0) end = mid + 1;
+            else hi = mid;
+        }
+        if (x->sorted_ok && prefix > 0 && end - lo < x->num_nodes / 8) {
+            for (; lo < end; lo++)
+                if (x->nodes[x->sorted[lo]].name_flags & NAME_SORTED) CANDIDATE(x->sorted[lo]);
+            for (uint32_t i = 0; i < x->num_recent; i++)
+                CANDIDATE(x->recent[i]);
+        } else {
+            for (uint32_t n = 1; n < x->num_nodes; n++)
+                if (x->nodes[n].type != NODE_FREE && x->nodes[n].type != NODE_DIR &&
+                    glob_match(l->pattern, index_name(x, n)))
+                    CANDIDATE(n);
+        }
+    }
+#undef CANDIDATE
+    *out = ids;
+    return count;
+}
+
+// Resolve every lookup from the index; returns -1 if the index cannot answer
+int index_lookup_names(NameLookup *lookups, int count) {
+    FileIndex *x = &file_index;
+    char path[PATH_MAX];
+    struct stat st;
+    if (!index_acquire_following(x)) return -1;
+    for (int i = 0; i < count; i++) {
+        NameLookup *l = &lookups[i];
+        uint32_t *ids = NULL;
+        size_t n = index_name_candidates(x, l, &ids), kept = 0;
+        for (size_t j = 0; j < n; j++)
+            if (x->nodes[ids[j]].type != NODE_FREE && x->nodes[ids[j]].type != NODE_DIR &&
+                name_lookup_matches(l, index_name(x, ids[j])))
+                ids[kept++] = ids[j];
+        for (size_t j = 0; j < kept; j++) {
+            if (index_path(x, ids[j], path, sizeof(path)) < 0) continue;
+            index_stat(x, ids[j], &st);
+            name_lookup_add(l, path, &st);
+        }
+        free(ids);
+    }
+    pthread_rwlock_unlock(&x->lock);
+    return 0;
+}
+
+// walk_filter for the walk fallback: only names some lookup wants are stat'ed
+int name_lookup_filter(const char *name, void *arg) {
+    NameLookup *lookups = ((NameLookup **)arg)[0];
+    int count = (int)(intptr_t)((NameLookup **)arg)[1];
+    for (int i = 0; i < count; i++)
+        if (name_lookup_matches(&lookups[i], name))
+            return 1;
+    return 0;
+}
+
+// file_visitor for the walk fallback
+int name_lookup_visit(const char *path, const char *name, const struct stat *st, int hidden, void *arg) {
+    NameLookup *lookups = ((NameLookup **)arg)[0];
+    int count = (int)(intptr_t)((NameLookup **)arg)[1];
+    (void)hidden;
+    for (int i = 0; i < count; i++)
+        if (name_lookup_matches(&lookups[i], name))
+            name_lookup_add(&lookups[i], path, st);
+    return 0;
+}
+
+// Append to a growing text reply
+void text_append(char **text, size_t *len, size_t *cap, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !*text) return;
+    if (*len + n + 1 > *cap) {
+        size_t grown_cap = (*cap + n + 1) * 2;
+        char *grown = realloc(*text, grown_cap);
+        if (!grown) return;
+        *text = grown;
+        *cap = grown_cap;
+    }
+    va_start(ap, fmt);
+    vsnprintf(*text + *len, *cap - *len, fmt, ap);
+    va_end(ap);
+    *len += n;
+}
+
+// w24fn [-a] name|pattern ...: one section per name, listing its matches
+void send_name_lookups(Reply *reply, char *args) {
+    NameLookup *lookups = calloc(W24_MAX_COMMAND / 2 + 1, sizeof(NameLookup));
+    int count = 0, all = 0;
+    char *saveptr, *token;
+    if (!lookups) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return;
+    }
+    for (token = strtok_r(args, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(token, "-a") == 0 && count == 0 && !all) {
+            all = 1;
+            continue;
+        }
+        lookups[count].pattern = token;
+        lookups[count].glob = is_glob(token);
+        lookups[count].first_only = !all && !lookups[count].glob;
+        count++;
+    }
+    if (count == 0) {
+        send_text(reply, W24_STATUS_INVALID, "Usage: w24fn [-a] <filename|pattern> ...\n");
+        free(lookups);
+        return;
+    }
+    if (index_lookup_names(lookups, count) < 0) {
+        void *arg[2] = {lookups, (void *)(intptr_t)count};
+        walk_files(getenv("HOME"), 0, name_lookup_filter, name_lookup_visit, arg);
+    }
+
+    size_t len = 0, cap = 4096, found = 0;
+    char *text = malloc(cap);
+    if (text) text[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        NameLookup *l = &lookups[i];
+        name_lookup_trim(l, l->first_only ? 1 : MATCH_LIMIT);
+        found += l->total;
+        if (l->count == 0) {
+            text_append(&text, &len, &cap, "%s: not found\n", l->pattern);
+        } else if (l->first_only) {
+            text_append(&text, &len, &cap, "%s: %s (%lld bytes, permissions %o)\n", l->pattern, l->matches[0].path,
+                        (long long)l->matches[0].size, l->matches[0].mode & 0777);
+        } else {
+            text_append(&text, &len, &cap, "%s: %zu match%s\n", l->pattern, l->total, l->total == 1 ? "" : "es");
+            for (size_t j = 0; j < l->count; j++)
+                text_append(&text, &len, &cap, "  %s (%lld bytes)\n", l->matches[j].path, (long long)l->matches[j].size);
+            if (l->total > l->count)
+                text_append(&text, &len, &cap, "  ... and %zu more\n", l->total - l->count);
+        }
+        for (size_t j = 0; j < l->count; j++)
+            free(l->matches[j].path);
+        free(l->matches);
+    }
+    if (text) send_text(reply, found ? W24_STATUS_OK : W24_STATUS_NOT_FOUND, text);
+    else send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+    free(text);
+    free(lookups);
+}
+
+// ---- Single-flight ----
+pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+Flight *flights;            // Archive commands being answered, by normalized key
+uint64_t flights_followed;
+
+void flight_release(Flight *f) {
+    pthread_mutex_lock(&flights_lock);
+    int last = --f->refs == 0;
+    pthread_mutex_unlock(&flights_lock);
+    if (!last) return;
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->progress);
+    free(f->key);
+    free(f);
+}
+
+// Register as the leader for key, unless an identical command is already being
+// answered: then return that flight with its spool opened in *fd for following.
+// Returns NULL with *fd = -1 if neither worked out.
+Flight *flight_begin(const char *key, ResultSpool *spool, int frame_type, int *fd) {
+    *fd = -1;
+    pthread_mutex_lock(&flights_lock);
+    Flight *f = flights;
+    while (f && strcmp(f->key, key) != 0) f = f->next;
+    if (f) {
+        // Open while listed: the leader deletes the spool only after unlisting it
+        if ((*fd = open(f->path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            f->refs++;
+            flights_followed++;
+        }
+        pthread_mutex_unlock(&flights_lock);
+        return *fd >= 0 ? f : NULL;
+    }
+    f = calloc(1, sizeof(Flight));
+    if (f && !(f->key = strdup(key))) {
+        free(f);
+        f = NULL;
+    }
+    if (f) {
+        snprintf(f->path, sizeof(f->path), "%s", spool->path);
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->progress, NULL);
+        f->frame_type = frame_type;
+        f->refs = 1;
+        f->next = flights;
+        flights = f;
+        spool->flight = f;
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return NULL;
+}
+
+// Leader: publish how the response ended and take the flight off the list
+void flight_end(ResultSpool *spool) {
+    Flight *f = spool->flight;
+    if (!f) return;
+    pthread_mutex_lock(&f->lock);
+    f->bytes = spool->bytes;
+    f->broken = spool->broken;
+    f->state = spool->complete ? FLIGHT_OK : spool->not_found ? FLIGHT_NOT_FOUND : FLIGHT_FAILED;
+    pthread_cond_broadcast(&f->progress);
+    pthread_mutex_unlock(&f->lock);
+    pthread_mutex_lock(&flights_lock);
+    for (Flight **link = &flights; *link; link = &(*link)->next) {
+        if (*link == f) {
+            *link = f->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&flights_lock);
+    spool->flight = NULL;
+    flight_release(f);
+}
+
+// Follower: send the leader's response from its spool as it grows
+void flight_follow(Reply *reply, Flight *f, int fd) {
+    uint64_t sent = 0;
+    int failed = 0;
+    log_request("Following the identical command in progress: %s\n", f->key);
+    pthread_mutex_lock(&f->lock);
+    while (1) {
+        while (f->bytes == sent && f->state == FLIGHT_RUNNING && !f->broken)
+            pthread_cond_wait(&f->progress, &f->lock);
+        uint64_t avail = f->bytes;
+        int state = f->state, broken = f->broken;
+        pthread_mutex_unlock(&f->lock);
+        if (broken || failed) {
+            if (sent > 0) shutdown(reply->sock, SHUT_RDWR);
+            else send_text(reply, W24_STATUS_ERROR, "Error: Failed to build archive\n");
+            break;
+        }
+        if (avail > sent) {
+            if (send_frame_header(reply, f->frame_type, W24_STATUS_OK, W24_FLAG_MORE, avail - sent) < 0 ||
+                send_file_range(reply->sock, fd, sent, avail - sent) < 0)
+                failed = 1;
+            sent = avail;
+        } else if (state == FLIGHT_OK) {
+            send_frame(reply, f->frame_type, W24_STATUS_OK, 0, NULL, 0);
+            break;
+        } else if (state == FLIGHT_NOT_FOUND) {
+            send_text(reply, W24_STATUS_NOT_FOUND, "No file found\n");
+            break;
+        } else if (state == FLIGHT_FAILED) {
+            failed = 1;
+        }
+        pthread_mutex_lock(&f->lock);
+    }
+    close(fd);
+    flight_release(f);
+}
+
+// Result cache lookups, storage and statistics
+void result_files_free(ResultFile *files, size_t n) {
+    for (size_t i = 0; i < n; i++) free(files[i].path);
+    free(files);
+}
 
-// Function to handle error messages
-void error(const char *msg) {
-    perror(msg);
-    exit(1);
+// Unlink an entry from the LRU list and delete it (lock held)
+void result_remove(ResultCache *c, ResultEntry *e) {
+    if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+    unlink(e->path);
+    c->bytes -= e->bytes;
+    c->entries--;
+    result_files_free(e->files, e->num_files);
+    free(e->key);
+    free(e->path);
+    free(e);
 }
 
-// Updated Directory Entry structure
-typedef struct {
-    char *name;     // Directory name
-    time_t ctime;   // Creation time of the directory
-} DirEntry;
+void fnv_mix(uint64_t *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        *h ^= p[i];
+        *h *= 0x100000001b3ULL;
+    }
+}
 
-// Function to compare directory names alphabetically
-int compare_by_name(const void *a, const void *b) {     // Cast void pointers to pointers to char pointers, for directory names
-    const char *dirA = *(const char**)a;
-    const char *dirB = *(const char**)b;
-    return strcmp(dirA, dirB);
+// Only directories matter to the generation
+int tree_generation_filter(const char *name, void *arg) {
+    (void)name, (void)arg;
+    return 0;
 }
 
-// Function to compare directories by creation time
-int compare_by_time(const void *a, const void *b) {    // Cast void pointers to pointers to time_t, which typically represents time in seconds
-    const time_t *timeA = (const time_t*)a;
-    const time_t *timeB = (const time_t*)b;
-    return (*timeA > *timeB) - (*timeA < *timeB);
+int tree_generation_visit(int event, const char *path, const char *name, const struct stat *st, int hidden, int wd,
+                          void *arg) {
+    (void)name, (void)hidden, (void)wd;
+    if (event == WALK_ENTER) {
+        fnv_mix(arg, path, strlen(path));
+        fnv_mix(arg, &st->st_ino, sizeof(st->st_ino));
+        fnv_mix(arg, &st->st_mtim, sizeof(st->st_mtim));
+    }
+    return 0;
 }
 
-// Modified list_directories to send output over socket
-void list_directories(int sock, const char *dir_path, int sort_by_time) {
-    DIR *d;
-    struct dirent *entry;
-    char output[1024] = "";  // Buffer to accumulate directory names
-    char temp[256];
-    int count = 0;
-    char *names[256];  // Array to store directory names for sorting
-    time_t times[256]; // Array to store times for time-based sorting
+// Hash the path and mtime of every directory below base_path. Entries are not
+// stat'ed unless readdir cannot tell whether they are directories, so this costs
+// a fraction of a walk. Symlinks to directories are followed, as the walks do.
+void tree_generation_walk(const char *base_path, uint64_t *h) {
+    walk_tree(base_path, 0, follow_links ? WALK_FOLLOW : 0, tree_generation_filter, NULL, NULL,
+              tree_generation_visit, h);
+}
 
-    if ((d = opendir(dir_path)) == NULL) { // Attempt to open the directory specified by dir_path
-        sprintf(output, "Failed to open directory %s\n", dir_path);     // If opening the directory fails, format an error message
-        write(sock, output, strlen(output));
-        return;
-    }
-// Read entries from the directory until there are no more
-    while ((entry = readdir(d)) != NULL) {
-            // Check if the directory entry is a directory and not '.' or '..'
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                    // Duplicate the directory name and save it in the names array
-            names[count] = strdup(entry->d_name);
-            struct stat info;
-            char full_path[1024];
-            snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-            stat(full_path, &info);
-            times[count] = info.st_ctime;
-            count++;
-        }
-    }
-    closedir(d);
-// Check if directories should be sorted by time rather than name
-    if (sort_by_time) {
-        qsort(times, count, sizeof(time_t), compare_by_time); // Sort the array of creation times using the compare_by_time function
-        for (int i = 0; i < count; i++) { // After sorting by time, generate a list of directory names in the sorted order
-            snprintf(temp, sizeof(temp), "%s\n", names[i]);
-            strcat(output, temp);
-        }
-    } else {  // Sort the array of directory names alphabetically using the compare_by_name function
-        qsort(names, count, sizeof(char*), compare_by_name);
-        for (int i = 0; i < count; i++) {     // Generate a list of directory names in alphabetical order
-            snprintf(temp, sizeof(temp), "%s\n", names[i]);
-            strcat(output, temp);
-        }
+uint64_t tree_generation(const char *base_path) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    if (index_acquire_following(&file_index)) {
+        // The index counts every change it applies: no need to walk
+        fnv_mix(&h, &file_index.generation, sizeof(file_index.generation));
+        pthread_rwlock_unlock(&file_index.lock);
+        return h;
     }
+    tree_generation_walk(base_path, &h);
+    return h;
+}
 
-    // Send the sorted output back to the client
-    write(sock, output, strlen(output));
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    // Free allocated memory
-    for (int i = 0; i < count; i++) {
-        free(names[i]);
+// Canonical form of an archive command, so that "w24ft h c" and "w24ft c  h c"
+// share a result. Returns -1 if the command does not parse.
+int normalize_archive_command(const char *buffer, int codec, char *key, size_t size) {
+    int n = 0;
+    if (strncmp(buffer, "w24fz ", 6) == 0) {
+        long long size1, size2;
+        if (sscanf(buffer + 6, "%lld %lld", &size1, &size2) != 2) return -1;
+        n = snprintf(key, size, "w24fz %lld %lld", size1, size2);
+    } else if (strncmp(buffer, "w24ft ", 6) == 0) {
+        // Only the first three types count, as in send_files_by_type
+        char copy[W24_MAX_COMMAND + 1], *types[3], *saveptr;
+        int num_types = 0;
+        snprintf(copy, sizeof(copy), "%s", buffer + 6);
+        for (char *t = strtok_r(copy, " ", &saveptr); t && num_types < 3; t = strtok_r(NULL, " ", &saveptr))
+            types[num_types++] = t;
+        if (num_types == 0) return -1;
+        qsort(types, num_types, sizeof(char *), compare_strings);
+        n = snprintf(key, size, "w24ft");
+        for (int i = 0; i < num_types && n < (int)size; i++)
+            if (i == 0 || strcmp(types[i], types[i - 1]) != 0)
+                n += snprintf(key + n, size - n, " %s", types[i]);
+    } else if (strncmp(buffer, "w24fdb ", 7) == 0 || strncmp(buffer, "w24fda ", 7) == 0) {
+        char date[32];
+        if (sscanf(buffer + 7, "%31s", date) != 1) return -1;
+        n = snprintf(key, size, "%.6s %s", buffer, date);
+    } else if (strncmp(buffer, "w24find ", 8) == 0) {
+        // Listings are not archives and are not cached
+        char copy[W24_MAX_COMMAND + 1], err[256];
+        Query q;
+        int list;
+        snprintf(copy, sizeof(copy), "%s", buffer + 8);
+        if (parse_find_query(copy, &q, &list, err, sizeof(err)) < 0 || list) return -1;
+        if ((n = find_query_key(&q, key, size)) < 0) return -1;
+    } else {
+        return -1;
     }
+    if (n < 0 || (size_t)n >= size) return -1;
+    n += snprintf(key + n, size - n, " -z %d", codec);
+    return (size_t)n < size ? 0 : -1;
 }
 
-// Recursive function to search for a file in the directory and its subdirectories
-int find_file(const char *basepath, const char *search_filename, char *result_path) {
-    DIR *dir;
-    struct dirent *entry;
-    char path[1024];
+// Do the files of a cached archive still look the way they did?
+int result_files_current(const ResultFile *files, size_t num_files) {
+    struct stat st;
+    for (size_t i = 0; i < num_files; i++) {
+        const ResultFile *f = &files[i];
+        if (stat(f->path, &st) < 0 || st.st_dev != f->dev || st.st_ino != f->ino || st.st_size != f->size ||
+            st.st_mtim.tv_sec != f->mtime.tv_sec || st.st_mtim.tv_nsec != f->mtime.tv_nsec)
+            return 0;
+    }
+    return 1;
+}
 
-    if (!(dir = opendir(basepath)))
-        return 0; // Unable to open directory
+// Copy of an entry's file list, so that it can be checked without the lock; NULL if out of memory
+ResultFile *result_files_copy(const ResultEntry *e) {
+    ResultFile *files = malloc((e->num_files ? e->num_files : 1) * sizeof(ResultFile));
+    for (size_t i = 0; files && i < e->num_files; i++) {
+        files[i] = e->files[i];
+        if ((files[i].path = strdup(e->files[i].path)) == NULL) {
+            result_files_free(files, i);
+            return NULL;
+        }
+    }
+    return files;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue; // Skip the dot and dot-dot directories
+ResultEntry *result_find(ResultCache *c, const char *key) {
+    ResultEntry *e = c->newest;
+    while (e && strcmp(e->key, key) != 0) e = e->older;
+    return e;
+}
 
-        snprintf(path, sizeof(path), "%s/%s", basepath, entry->d_name);
+// Answer from the cache if a current result exists. Returns 1 when the response was sent.
+// The files of a hit are stat'ed after dropping the lock, which would otherwise hold up
+// every archive request meanwhile; the entry is then looked up again by its id.
+int result_cache_serve(Reply *reply, const char *key, uint64_t generation) {
+    ResultCache *c = &result_cache;
+    int fd = -1, frame_type = 0, current = 0;
+    uint64_t bytes = 0, id = 0;
+    ResultFile *files = NULL;
+    size_t num_files = 0;
+    pthread_mutex_lock(&c->lock);
+    ResultEntry *e = result_find(c, key);
+    if (e && time(NULL) - e->created > c->ttl) {
+        result_remove(c, e);
+        c->expired++;
+        e = NULL;
+    } else if (e && e->generation != generation) {
+        result_remove(c, e);
+        c->invalidated++;
+        e = NULL;
+    }
+    if (e && (files = result_files_copy(e)) != NULL) {
+        id = e->id;
+        num_files = e->num_files;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (files) {
+        current = result_files_current(files, num_files);
+        result_files_free(files, num_files);
+    }
 
-        if (entry->d_type == DT_DIR) {
-            // Recursively search in this directory
-            if (find_file(path, search_filename, result_path)) {
-                closedir(dir);
-                return 1; // File found
-            }
-        } else {
-            if (strcmp(entry->d_name, search_filename) == 0) {
-                // File found, copy the full path to result
-                strncpy(result_path, path, 1024);
-                closedir(dir);
-                return 1;
-            }
+    pthread_mutex_lock(&c->lock);
+    e = files ? result_find(c, key) : NULL;
+    if (e && e->id != id)
+        e = NULL;  // Replaced or dropped meanwhile: run the query
+    if (e && !current) {
+        result_remove(c, e);
+        c->invalidated++;
+        e = NULL;
+    }
+    if (e && (fd = open(e->path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        bytes = e->bytes;
+        frame_type = e->frame_type;
+        // Move to the new end of the LRU list
+        if (e != c->newest) {
+            if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+            e->newer->older = e->older;
+            e->older = c->newest;
+            e->newer = NULL;
+            c->newest->newer = e;
+            c->newest = e;
         }
+        c->hits++;
+    } else {
+        c->misses++;
     }
-    closedir(dir);
-    return 0; // File not found
+    pthread_mutex_unlock(&c->lock);
+    if (fd < 0)
+        return 0;
+
+    // The open descriptor stays valid even if the entry is evicted meanwhile
+    if (send_frame_header(reply, frame_type, W24_STATUS_OK, W24_FLAG_MORE, bytes) < 0 ||
+        send_file_range(reply->sock, fd, 0, bytes) < 0)
+        shutdown(reply->sock, SHUT_RDWR);
+    else
+        send_frame(reply, frame_type, W24_STATUS_OK, 0, NULL, 0);
+    close(fd);
+    log_request("Result cache hit: %s, %llu bytes sent\n", key, (unsigned long long)bytes);
+    return 1;
 }
 
-// Function to send file information back to the client
-void send_file_info(int sock, const char *filename) {
-    char full_path[1024];
-    char output[2048];
-    struct stat statbuf;
+int result_spool_open(ResultSpool *s) {
+    memset(s, 0, sizeof(*s));
+    if (!result_cache.dir[0]) return -1;
+    snprintf(s->path, sizeof(s->path), "%s/result-XXXXXX", result_cache.dir);
+    s->fd = mkostemp(s->path, O_CLOEXEC);
+    return s->fd < 0 ? -1 : 0;
+}
 
-    // Start search from the home directory
-    if (find_file(getenv("HOME"), filename, full_path)) {
-        if (stat(full_path, &statbuf) == 0) {
-            // Prepare the output message with file details
-            snprintf(output, sizeof(output), "File: %s\nSize: %ld bytes\nCreated: %sPermissions: %o\n",
-                     filename, statbuf.st_size, ctime(&statbuf.st_ctime), statbuf.st_mode & 0777);
-            write(sock, output, strlen(output));
-        } else {
-            // Failed to stat the file, even though it was found
-            snprintf(output, sizeof(output), "Error accessing file details.\n");
-            write(sock, output, strlen(output));
+// Keep a finished spool as the result for key, or throw it away
+void result_cache_store(const char *key, uint64_t generation, ResultSpool *s) {
+    ResultCache *c = &result_cache;
+    ResultEntry *e = NULL;
+    close(s->fd);
+    if (s->complete && !s->broken && !s->discard && result_cache.limit > 0 &&
+        (e = calloc(1, sizeof(ResultEntry))) != NULL) {
+        e->key = strdup(key);
+        e->path = strdup(s->path);
+        if (!e->key || !e->path) {
+            free(e->key);
+            free(e->path);
+            free(e);
+            e = NULL;
         }
+    }
+    if (!e) {
+        unlink(s->path);
+        result_files_free(s->files, s->num_files);
+        return;
+    }
+    e->generation = generation;
+    e->created = time(NULL);
+    e->bytes = s->bytes;
+    e->frame_type = s->frame_type;
+    e->files = s->files;
+    e->num_files = s->num_files;
+
+    pthread_mutex_lock(&c->lock);
+    ResultEntry *old = result_find(c, key);
+    if (old) result_remove(c, old);  // A concurrent run of the same query got here first
+    e->id = ++c->next_id;
+    e->older = c->newest;
+    if (c->newest) c->newest->newer = e; else c->oldest = e;
+    c->newest = e;
+    c->bytes += e->bytes;
+    c->entries++;
+    while (c->bytes > c->limit && c->oldest != e) {
+        result_remove(c, c->oldest);
+        c->evicted++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Create the directory for spools and results inside the private state_dir; results
+// from an earlier run are not trusted and removed. Without a directory that only
+// this user can reach, neither the cache nor the sharing of identical queries runs.
+void result_cache_init(ResultCache *c) {
+    snprintf(c->dir, sizeof(c->dir), "%s/results-%d", state_dir, PORT);
+    if (private_dir(state_dir) < 0 || private_dir(c->dir) < 0) {
+        fprintf(stderr, "Result cache: cannot use %s (%s), archives are not cached\n", c->dir, strerror(errno));
+        c->dir[0] = '\0';
+        c->limit = 0;
+        return;
+    }
+    DIR *dir = opendir(c->dir);
+    struct dirent *d;
+    char path[PATH_MAX + 256];
+    while (dir && (d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "result-", 7) != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", c->dir, d->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+}
+
+// Text for the stats command
+void send_cache_stats(Reply *reply) {
+    char text[1536];
+    ResultCache *r = &result_cache;
+    MemberCache *m = &member_cache;
+    int n;
+    pthread_mutex_lock(&r->lock);
+    uint64_t lookups = r->hits + r->misses;
+    n = snprintf(text, sizeof(text),
+                 "Result cache: %llu hits, %llu misses (%.1f%% hit rate), %zu entries, %llu of %llu MiB, TTL %ds\n"
+                 "  dropped: %llu expired, %llu invalidated by changes, %llu evicted\n",
+                 (unsigned long long)r->hits, (unsigned long long)r->misses,
+                 lookups ? 100.0 * r->hits / lookups : 0.0, r->entries, (unsigned long long)(r->bytes >> 20),
+                 (unsigned long long)(r->limit >> 20), r->ttl, (unsigned long long)r->expired,
+                 (unsigned long long)r->invalidated, (unsigned long long)r->evicted);
+    pthread_mutex_unlock(&r->lock);
+    pthread_mutex_lock(&m->lock);
+    lookups = m->hits + m->misses;
+    snprintf(text + n, sizeof(text) - n,
+             "Member cache: %llu hits, %llu misses (%.1f%% hit rate), %zu entries, %zu of %zu MiB, %llu evicted%s%s\n",
+             (unsigned long long)m->hits, (unsigned long long)m->misses, lookups ? 100.0 * m->hits / lookups : 0.0,
+             m->entries, m->bytes >> 20, m->limit >> 20, (unsigned long long)m->evictions,
+             m->dir ? ", stored in " : "", m->dir ? m->dir : "");
+    pthread_mutex_unlock(&m->lock);
+    n = strlen(text);
+    pthread_mutex_lock(&flights_lock);
+    uint64_t followed = flights_followed;
+    pthread_mutex_unlock(&flights_lock);
+    pthread_mutex_lock(&scan_lock);
+    snprintf(text + n, sizeof(text) - n, "Shared work: %llu walks, %llu commands joined a walk, %llu followed an identical one\n",
+             (unsigned long long)scans_started, (unsigned long long)scans_joined, (unsigned long long)followed);
+    pthread_mutex_unlock(&scan_lock);
+    n = strlen(text);
+    FileIndex *x = &file_index;
+    if (!use_index) {
+        snprintf(text + n, sizeof(text) - n, "Index: off\n");
+    } else if (!__atomic_load_n(&x->ready, __ATOMIC_ACQUIRE)) {
+        snprintf(text + n, sizeof(text) - n, "Index: %s\n", x->inotify_fd < 0 ? "not available" : "building");
     } else {
-        // File not found
-        snprintf(output, sizeof(output), "File not found\n");
-        write(sock, output, strlen(output));
+        pthread_rwlock_rdlock(&x->lock);
+        snprintf(text + n, sizeof(text) - n, "Index: %u entries, %llu changes, %llu overflow rescans%s%s\n", x->live,
+                 (unsigned long long)x->generation, (unsigned long long)x->rescans,
+                 x->stale ? ", stale (commands walk the tree)" : "",
+                 follow_links && x->dir_links ? ", links to directories (searches walk the tree)" : "");
+        pthread_rwlock_unlock(&x->lock);
     }
+    n = strlen(text);
+    SumCache *c = &sum_cache;
+    pthread_mutex_lock(&c->lock);
+    lookups = c->hits + c->misses;
+    snprintf(text + n, sizeof(text) - n, "Checksum cache: %llu hits, %llu misses (%.1f%% hit rate), %zu digests%s%.512s\n",
+             (unsigned long long)c->hits, (unsigned long long)c->misses, lookups ? 100.0 * c->hits / lookups : 0.0,
+             c->entries, c->fd >= 0 ? ", stored in " : "", c->fd >= 0 ? c->path : "");
+    pthread_mutex_unlock(&c->lock);
+    send_text(reply, W24_STATUS_OK, text);
 }
 
-void find_files_by_size(const char *base_path, int size1, int size2, FILE *out) { // Function to find and list files within a specific size range in a directory hierarchy
-    DIR *dir;
-    struct dirent *entry;
-    struct stat statbuf;
-    char path[1024];
+// State kept for every connected client between commands. The buffers are
+// allocated when the client sends something and given back when it goes idle,
+// so a connection waiting for its next command costs little more than its socket.
+#define CONN_INBUF (W24_HEADER_SIZE + W24_MAX_COMMAND)
 
-    if (!(dir = opendir(base_path))) // Attempt to open the directory at the given base path
+typedef struct Connection {
+    int fd;                 // Client socket
+    unsigned char *inbuf;   // Bytes of the next frame received so far, CONN_INBUF of them, or NULL
+    size_t inlen;           // Number of bytes in inbuf
+    uint32_t request_id;    // Request ID of the command being served
+    char *command;          // Command being served, NUL-terminated (in inbuf's allocation)
+    uint32_t zc_next_id;    // The kernel numbers zero-copy sends per socket, across responses
+    struct Connection *next_ready; // Held by the event loop while the worker queue is full
+} Connection;
 
-        return;
+int epoll_fd = -1;          // Event loop watching the listening socket and idle clients
+WorkQueue worker_queue;     // Readable connections waiting for a worker
+WorkQueue archive_queue;    // Archive commands waiting for an archive worker
+int loop_wake_fd = -1;      // eventfd the workers use to tell the event loop there is room
+int loop_holding;           // The event loop holds readable connections back
 
-    while ((entry = readdir(dir)) != NULL) {  // Read each entry in the directory
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        // Build the full path for each file/directory
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
-        if (stat(path, &statbuf) == 0) {    // Retrieve information about the file/directory
-            if (S_ISDIR(statbuf.st_mode)) {    // If the entry is a directory, recursively search it
-                find_files_by_size(path, size1, size2, out);
-            } else if (S_ISREG(statbuf.st_mode)) { // If the entry is a regular file
-                // Check if the file size is within the specified range
-                if (statbuf.st_size >= size1 && statbuf.st_size <= size2) {
-                    fprintf(out, "%s\n", path);
-                }
-            }
-        }
-    }
-    closedir(dir);
+// Allocate the buffers of a connection that has something to read
+int connection_buffers(Connection *conn) {
+    conn->inbuf = malloc(CONN_INBUF + W24_MAX_COMMAND + 1);
+    conn->command = (char *)conn->inbuf + CONN_INBUF;
+    return conn->inbuf ? 0 : -1;
 }
 
-void send_files_by_size(int sock, int size1, int size2) {
-    char temp_file[] = "/tmp/file_list.txt";
-    FILE *out = fopen(temp_file, "w");
-    if (!out) {
-        char* error_msg = "Error: Unable to open temporary file\n";
-        write(sock, error_msg, strlen(error_msg));
-        return; // Exit if file cannot be opened
+// Hand the connection back to the event loop so its next command wakes a worker
+void rearm_connection(Connection *conn) {
+    if (conn->inlen == 0) {
+        free(conn->inbuf);  // Idle: no buffers until it sends again
+        conn->inbuf = NULL;
+        conn->command = NULL;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        perror("epoll_ctl rearm");
+        close(conn->fd);
+        free(conn->inbuf);
+        free(conn);
     }
+}
 
-    // Find all files within the size range and write their paths to the file
-    find_files_by_size(getenv("HOME"), size1, size2, out);
-    fclose(out);
+// Close the client socket; closing also removes it from the epoll set
+void close_connection(Connection *conn) {
+    close(conn->fd);
+    free(conn->inbuf);
+    free(conn);
+}
 
-    // Create a tar.gz file containing all the files listed in file_list.txt
-    char tar_command[256];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf /tmp/files.tar.gz -T %s", temp_file);
-    system(tar_command);
+// Take the next complete COMMAND frame out of the input buffer.
+// Returns 1 when conn->command holds a command, 0 if more bytes are needed, -1 on a protocol error.
+int next_command(Connection *conn) {
+    if (conn->inlen < W24_HEADER_SIZE)
+        return 0;
+    uint32_t id;
+    uint64_t length;
+    memcpy(&id, conn->inbuf + 4, 4);
+    memcpy(&length, conn->inbuf + 8, 8);
+    length = be64toh(length);
+    if (conn->inbuf[0] != W24_MAGIC || conn->inbuf[1] != W24_TYPE_COMMAND || length > W24_MAX_COMMAND)
+        return -1;
+    size_t frame_len = W24_HEADER_SIZE + length;
+    if (conn->inlen < frame_len)
+        return 0;
 
-    // Check if any files were added to the file list
-    struct stat statbuf;
-    stat(temp_file, &statbuf);
-    if (statbuf.st_size == 0) {  // File is empty, no files found
-        char* msg = "No file found\n";
-        write(sock, msg, strlen(msg));
-        unlink(temp_file);
-        return;
-    }
-
-    // Send the tar.gz file
-    FILE *file = fopen("/tmp/files.tar.gz", "rb");
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        long fsize = ftell(file);
-        rewind(file);
-
-        // Allocate buffer to hold file content and EOF marker
-        char *buffer = malloc(fsize + 4); // Additional space for EOF marker
-        if (!buffer) {
-            char* error_msg = "Error: Memory allocation failed\n";
-            write(sock, error_msg, strlen(error_msg));
-            fclose(file);
-            unlink("/tmp/files.tar.gz");
-            unlink(temp_file);
-            return;
-        }
+    conn->request_id = be32toh(id);
+    memcpy(conn->command, conn->inbuf + W24_HEADER_SIZE, length);
+    conn->command[length] = '\0';
+    // Keep any pipelined bytes that belong to the following frame
+    memmove(conn->inbuf, conn->inbuf + frame_len, conn->inlen - frame_len);
+    conn->inlen -= frame_len;
+    return 1;
+}
 
-        // Read file content into buffer
-        fread(buffer, 1, fsize, file);
+// Remove a trailing "-z <codec>" option from an archive command and return the level it
+// asks for: none, fast, default, max or auto. Without the option the level adapts (auto).
+int take_codec_option(char *buffer) {
+    char *opt = strstr(buffer, " -z ");
+    if (!opt)
+        return CODEC_AUTO;
+    char *name = opt + 4;
+    int codec;
+    if (strcmp(name, "none") == 0) codec = LEVEL_NONE;
+    else if (strcmp(name, "fast") == 0) codec = LEVEL_FAST;
+    else if (strcmp(name, "default") == 0) codec = LEVEL_DEFAULT;
+    else if (strcmp(name, "max") == 0) codec = LEVEL_MAX;
+    else if (strcmp(name, "auto") == 0) codec = CODEC_AUTO;
+    else return CODEC_INVALID;
+    *opt = '\0';
+    return codec;
+}
 
-        // Append EOF marker at the end of the buffer
-        memcpy(buffer + fsize, "EOF", 4);
+// The commands that answer with an archive of the files matching a query
+int is_query_archive(const char *buffer) {
+    return strncmp(buffer, "w24fz ", 6) == 0 || strncmp(buffer, "w24ft ", 6) == 0 ||
+           strncmp(buffer, "w24fdb ", 7) == 0 || strncmp(buffer, "w24fda ", 7) == 0 ||
+           strncmp(buffer, "w24find ", 8) == 0;
+}
 
-        // Send file data along with EOF marker
-        write(sock, buffer, fsize + 4);
+// Run one of the archive commands; these block on the directory walk and tar
+void run_archive_command(Reply *reply, char *buffer) {
+    if (strncmp(buffer, "w24get ", 7) == 0) {
+        // Handle the ranged file command, which takes no archive options
+        send_file_get(reply, buffer + 7);
+        return;
+    }
+    int explicit_codec = strstr(buffer, " -z ") != NULL;
+    int codec = take_codec_option(buffer);
+    if (codec == CODEC_INVALID) {
+        send_text(reply, W24_STATUS_INVALID, "Unknown codec. Use '-z none|fast|default|max|auto'.\n");
+        return;
+    }
+    int manifest = is_query_archive(buffer) ? take_manifest_option(buffer) : 0;
+    if (manifest == CODEC_INVALID) {
+        send_text(reply, W24_STATUS_INVALID, "Unknown hash. Use '-m', '-m xxh64' or '-m sha256'.\n");
+        return;
+    }
+    if (manifest && explicit_codec) {
+        send_text(reply, W24_STATUS_INVALID, "A manifest (-m) is not compressed, it takes no -z\n");
+        return;
+    }
+    if (manifest)
+        codec = manifest;
 
-        // Clean up
-        free(buffer);
-        fclose(file);
-    } else {
-        char* error_msg = "Error: Unable to open tar.gz file\n";
-        write(sock, error_msg, strlen(error_msg));
+    // Serve a repeat query from the result cache, or attach to an identical one in
+    // progress; otherwise spool this run's answer for followers and the cache
+    char key[W24_MAX_COMMAND + 32];
+    uint64_t generation = 0;
+    ResultSpool spool;
+    if (!manifest && normalize_archive_command(buffer, codec, key, sizeof(key)) == 0) {
+        if (result_cache.limit > 0) {
+            generation = tree_generation(getenv("HOME"));
+            if (result_cache_serve(reply, key, generation))
+                return;
+        }
+        if (result_spool_open(&spool) == 0) {
+            int fd;
+            Flight *running = flight_begin(key, &spool, codec == LEVEL_NONE ? W24_TYPE_TAR : W24_TYPE_ARCHIVE, &fd);
+            if (running) {
+                close(spool.fd);
+                unlink(spool.path);
+                flight_follow(reply, running, fd);
+                return;
+            }
+            reply->spool = &spool;
+        }
+    }
+
+    if (strncmp(buffer, "w24fz ", 6) == 0) {
+        // Handle file size range command
+        long long size1, size2;
+        if (sscanf(buffer + 6, "%lld %lld", &size1, &size2) != 2)
+            send_text(reply, W24_STATUS_INVALID, "Usage: w24fz <size1> <size2>\n");
+        else
+            send_files_by_size(reply, size1, size2, codec);
+    } else if (strncmp(buffer, "w24ft ", 6) == 0) {
+        // Handle file type command
+        char* types = buffer + 6;
+        send_files_by_type(reply, types, codec);
+    } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
+        // Handle files by date before command
+        char* date = buffer + 7;
+        send_files_by_date_before(reply, date, codec);
+    } else if (strncmp(buffer, "w24fda ", 7) == 0) {
+        // Handle files by date after command
+        char* date = buffer + 7;
+        send_files_by_date_after(reply, date, codec);
+    } else if (strncmp(buffer, "w24find ", 8) == 0) {
+        // Handle the compound query command
+        send_find(reply, buffer + 8, codec);
+    } else if (strncmp(buffer, "w24tree", 7) == 0) {
+        // Handle the recursive tree listing command
+        send_tree(reply, buffer + 7);
+    } else if (strncmp(buffer, "w24du", 5) == 0) {
+        // Handle the aggregate commands, which answer in a few lines
+        send_disk_usage(reply, buffer + 5);
+    } else if (strncmp(buffer, "w24top ", 7) == 0) {
+        send_top(reply, buffer + 7);
+    } else if (strncmp(buffer, "w24count", 8) == 0) {
+        send_count(reply, buffer + 8);
+    } else if (strncmp(buffer, "w24grep ", 8) == 0) {
+        // Handle the content search command
+        send_grep(reply, buffer + 8);
+    } else if (strncmp(buffer, "w24sum", 6) == 0) {
+        // Handle the checksum command
+        send_sums(reply, buffer + 6);
+    }
+    if (reply->spool) {
+        flight_end(&spool);
+        result_cache_store(key, generation, &spool);
     }
+    reply->spool = NULL;
+}
 
-    // Clean up temporary files
-    unlink("/tmp/files.tar.gz");
-    unlink(temp_file);
+// Check whether a command has to go to the archive pool
+int is_archive_command(const char *buffer) {
+    return is_query_archive(buffer) || strncmp(buffer, "w24top ", 7) == 0 ||
+           strncmp(buffer, "w24get ", 7) == 0 || strcmp(buffer, "w24tree") == 0 || strncmp(buffer, "w24tree ", 8) == 0 ||
+           strcmp(buffer, "w24du") == 0 || strncmp(buffer, "w24du ", 6) == 0 ||
+           strcmp(buffer, "w24count") == 0 || strncmp(buffer, "w24count ", 9) == 0 ||
+           strncmp(buffer, "w24grep ", 8) == 0 ||
+           strcmp(buffer, "w24sum") == 0 || strncmp(buffer, "w24sum ", 7) == 0;
 }
-// Function to recursively find and list files of specified types within a directory hierarchy
-// Function to recursively find and list files of specified types within a directory hierarchy
-void find_files_by_type(const char *base_path, const char **types, int num_types, FILE *out) {
-    DIR *dir;  // Pointer to the directory
-    struct dirent *entry;  // Pointer to each directory entry
-    struct stat statbuf;  // Structure to store file information
-    char path[1024];  // Buffer to hold the path of each file
 
-    // Try to open the directory specified by base_path
-    if (!(dir = opendir(base_path)))
-        return;  // Exit the function if the directory cannot be opened
+// ---- Watches ----
+// w24watch [resume:<token>] <predicates> keeps the connection and pushes what
+// changes among the files matching the w24find predicates. The first reply
+// lists the current matches; after that, one thread serves every watch from
+// the index's change log. Changes are gathered for WATCH_DELAY_MS and
+// coalesced per path, comparing the first state before with the last state
+// after, so a file written ten times shows up once and one created and removed
+// in between not at all. Lines are "+ size mtime path" (now matches),
+// "~ size mtime path" (still matches, changed) and "- size mtime path" (no
+// longer matches, or gone). Each batch ends with "# resume <token>". A client
+// that reconnects with that token gets only what it missed, as long as the
+// log still holds it; otherwise it is sent the full set again ("# resync").
+//
+// Sends never block: what a socket does not take stays in the watch's output
+// and goes out when epoll reports it writable. A watch with output pending is
+// given no new changes; the change log is its backlog, and one that falls out
+// of it while its client reads slowly is resynced like a resumed one.
+#define WATCH_DELAY_MS 200
+#define WATCH_EVENTS 64
 
-    // Loop through each entry in the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip the '.' and '..' entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+typedef struct Watch {
+    Connection *conn;
+    uint32_t request_id;
+    Query query;
+    uint64_t seq;           // Changes before this one have been sent
+    uint64_t token_seq;     // The last resume token sent
+    char *out;              // Frames not yet taken by the socket, from out_sent on
+    size_t out_len, out_sent, out_cap;
+    size_t frame;           // Start of the frame being filled, SIZE_MAX if none
+    int polling_out;        // EPOLLOUT is on for the socket
+    int failed;             // Out of memory, or the client went away
+    struct Watch *next;
+} Watch;
 
-        // Construct the full path of the current entry
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
-        // Attempt to get file attributes
-        if (stat(path, &statbuf) == 0) {
-            // If the entry is a directory, recursively search it
-            if (S_ISDIR(statbuf.st_mode)) {
-                find_files_by_type(path, types, num_types, out);
-            } else if (S_ISREG(statbuf.st_mode)) {  // If the entry is a regular file
-                // Loop through the list of file types we are interested in
-                for (int i = 0; i < num_types; i++) {
-                    char *ext = strrchr(entry->d_name, '.');  // Find the file extension
-                    // Check if the file has an extension and if it matches one of the types specified
-                    if (ext && strcmp(ext + 1, types[i]) == 0) {
-                        // If a match is found, print the file path to the output file
-                        fprintf(out, "%s\n", path);
-                        break;  // Exit the loop once a match is found to avoid redundant checks
-                    }
-                }
+Watch *watch_joining;       // Handed over by the workers, under change_lock
+pthread_once_t watch_once = PTHREAD_ONCE_INIT;
+
+void watch_free(Watch *w) {
+    close_connection(w->conn);
+    free(w->out);
+    free(w);
+}
+
+// Close the frame being filled: its header goes in the space kept for it
+void watch_end_frame(Watch *w) {
+    if (w->frame == SIZE_MAX) return;
+    encode_header((unsigned char *)w->out + w->frame, W24_TYPE_TEXT, W24_STATUS_OK, W24_FLAG_MORE, w->request_id,
+                  w->out_len - w->frame - W24_HEADER_SIZE);
+    w->frame = SIZE_MAX;
+}
+
+// Append text to the output, in frames of up to TEXT_CHUNK bytes as a TextStream sends them
+void watch_write(Watch *w, const char *data, size_t length) {
+    while (!w->failed && length > 0) {
+        if (w->frame == SIZE_MAX || w->out_len - w->frame - W24_HEADER_SIZE == TEXT_CHUNK) {
+            watch_end_frame(w);
+            w->frame = w->out_len;
+            w->out_len += W24_HEADER_SIZE;
+        }
+        size_t room = TEXT_CHUNK - (w->out_len - w->frame - W24_HEADER_SIZE);
+        size_t n = length < room ? length : room;
+        if (w->out_len + n > w->out_cap) {
+            size_t cap = w->out_cap ? w->out_cap : TEXT_CHUNK;
+            while (cap < w->out_len + n) cap *= 2;
+            char *grown = realloc(w->out, cap);
+            if (!grown) {
+                w->failed = 1;
+                return;
             }
+            w->out = grown;
+            w->out_cap = cap;
         }
+        memcpy(w->out + w->out_len, data, n);
+        w->out_len += n;
+        data += n;
+        length -= n;
     }
-    // Close the directory to free resources
-    closedir(dir);
 }
 
-void send_files_by_type(int sock, char *types_string) {
-    const char *types[3];
-    int num_types = 0;
-    char *token = strtok(types_string, " ");
-    while (token != NULL && num_types < 3) {
-        types[num_types++] = token;
-        token = strtok(NULL, " ");
-    }
-
-    char temp_file[] = "/tmp/file_list.txt";
-    FILE *out = fopen(temp_file, "w");
-    if (!out) {
-        char* error_msg = "Error: Unable to open temporary file\n";
-        write(sock, error_msg, strlen(error_msg));
-        return; // Exit if file cannot be opened
-    }
-
-    find_files_by_type(getenv("HOME"), types, num_types, out);
-    fclose(out);
-
-    // Create a tar.gz file containing all the files listed in file_list.txt
-    char tar_command[256];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf /tmp/files.tar.gz -T %s", temp_file);
-    system(tar_command);
-
-    // Send the tar.gz file
-    FILE *file = fopen("/tmp/files.tar.gz", "rb");
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        long fsize = ftell(file);
-        rewind(file);
-
-        // Allocate buffer to hold file content and EOF marker
-        char *buffer = malloc(fsize + 4); // Additional space for EOF marker
-        if (!buffer) {
-            char* error_msg = "Error: Memory allocation failed\n";
-            write(sock, error_msg, strlen(error_msg));
-            fclose(file);
-            unlink("/tmp/files.tar.gz");
-            unlink(temp_file);
-            return;
+// Send as much of the output as the socket takes now. Returns -1 once the watch has failed.
+int watch_send(Watch *w) {
+    while (!w->failed && w->out_sent < w->out_len) {
+        ssize_t n = send(w->conn->fd, w->out + w->out_sent, w->out_len - w->out_sent, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) w->failed = 1;
+        else w->out_sent += n;
+    }
+    if (w->out_sent == w->out_len) {
+        w->out_len = w->out_sent = 0;
+        if (w->out_cap > 4 * TEXT_CHUNK) {
+            // A full set went out: do not keep its buffer
+            free(w->out);
+            w->out = NULL;
+            w->out_cap = 0;
         }
+    }
+    return w->failed ? -1 : 0;
+}
 
-        // Read file content into buffer
-        fread(buffer, 1, fsize, file);
+int watch_pending(const Watch *w) {
+    return w->out_sent < w->out_len;
+}
 
-        // Append EOF marker at the end of the buffer
-        memcpy(buffer + fsize, "EOF", 4);
+void watch_line(Watch *w, char op, int64_t size, int64_t mtime, const char *path) {
+    char head[64];
+    int n = snprintf(head, sizeof(head), "%c %lld %lld ", op, (long long)size, (long long)mtime);
+    watch_write(w, head, n);
+    watch_write(w, path, strlen(path));
+    watch_write(w, "\n", 1);
+}
 
-        // Send file data along with EOF marker
-        write(sock, buffer, fsize + 4);
+// Send the resume token for everything sent so far
+int watch_flush(Watch *w) {
+    char line[80];
+    int n = snprintf(line, sizeof(line), "# resume %llx.%llx\n", (unsigned long long)file_index.instance,
+                     (unsigned long long)w->seq);
+    w->token_seq = w->seq;
+    watch_write(w, line, n);
+    watch_end_frame(w);
+    return watch_send(w);
+}
 
-        // Clean up
-        free(buffer);
-        fclose(file);
-    } else {
-        char* error_msg = "Error: Unable to open tar.gz file\n";
-        write(sock, error_msg, strlen(error_msg));
+// The full set of matches, and the change it is current as of
+int watch_send_all(Watch *w) {
+    ScanRecord *matches;
+    size_t count;
+    char line[64];
+    if (index_query_records(&w->query, &matches, &count, &w->seq) < 0) return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (!w->failed)
+            watch_line(w, '+', matches[i].st.st_size, matches[i].st.st_mtime, matches[i].path);
+        free(matches[i].path);
     }
+    free(matches);
+    int n = snprintf(line, sizeof(line), "# %zu files match\n", count);
+    watch_write(w, line, n);
+    return watch_flush(w);
+}
+
+typedef struct {
+    uint64_t seq;
+    IndexChange change;     // With its own copy of the path
+} WatchChange;
 
-    // Clean up temporary files
-    unlink("/tmp/files.tar.gz");
-    unlink(temp_file);
+int compare_watch_changes(const void *a, const void *b) {
+    const WatchChange *ca = a, *cb = b;
+    int c = strcmp(ca->change.path, cb->change.path);
+    if (c) return c;
+    return (ca->seq > cb->seq) - (ca->seq < cb->seq);
 }
 
-// Helper function to convert date string to time_t
-time_t parse_date(const char *date_str) {
-    struct tm tm;
-    memset(&tm, 0, sizeof(struct tm));
-    strptime(date_str, "%Y-%m-%d", &tm);
-    return mktime(&tm);
+// Whether the state `side` (0 before, 1 after) of a change matches the query
+int watch_matches(const Query *q, const IndexChange *c, int side) {
+    struct stat st;
+    const char *name = strrchr(c->path, '/');
+    if (!(side ? c->after : c->before)) return 0;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
+    st.st_size = c->size[side];
+    st.st_mtime = c->mtime[side];
+    return query_matches(q, name ? name + 1 : c->path, &st, c->hidden);
 }
-// Function to list all relevant files into a temporary file
-void find_files_by_date(const char *base_path, time_t input_date, FILE *out, int before) {
-    DIR *dir = opendir(base_path);
-    if (!dir) {
-        perror("Failed to open directory");
-        return;
-    }
 
-    struct dirent *entry;
-    char path[1024];
-    struct stat statbuf;
+// Send one watch its share of changes (sorted by path, then seq) up to end.
+// Batches with nothing for it only move its token on now and then, so that a
+// resume does not fall out of the log.
+int watch_send_changes(Watch *w, const WatchChange *changes, size_t count, uint64_t end) {
+    size_t lines = 0;
+    for (size_t i = 0; i < count;) {
+        size_t j = i, first = count;
+        for (; j < count && strcmp(changes[j].change.path, changes[i].change.path) == 0; j++)
+            if (first == count && changes[j].seq >= w->seq) first = j;
+        if (first < count) {
+            const IndexChange *a = &changes[first].change, *b = &changes[j - 1].change;
+            IndexChange net = *b;
+            net.before = a->before;
+            net.size[0] = a->size[0];
+            net.mtime[0] = a->mtime[0];
+            int was = watch_matches(&w->query, &net, 0), is = watch_matches(&w->query, &net, 1);
+            if (was || is) {
+                // ~ matched before and after (changed in place, or removed and created again)
+                char op = was && is ? '~' : is ? '+' : '-';
+                watch_line(w, op, net.size[is], net.mtime[is], net.path);
+                lines++;
+            }
+        }
+        i = j;
+    }
+    w->seq = end;
+    if (lines == 0 && end - w->token_seq < CHANGE_LOG / 2) return 0;
+    return watch_flush(w);
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] == '.') continue;  // Skip '.' and '..'
-        
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
-        if (stat(path, &statbuf) == -1) continue;  // Skip if stat fails
+// Turn EPOLLOUT on or off for a watch's socket, as it has output pending or not
+void watch_poll_out(int epoll_fd, Watch *w) {
+    int want = watch_pending(w);
+    if (want == w->polling_out) return;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0), .data.ptr = w};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->conn->fd, &ev) == 0) w->polling_out = want;
+    else w->failed = 1;
+}
 
-        if (S_ISREG(statbuf.st_mode) &&
-            ((before && statbuf.st_mtime <= input_date) || (!before && statbuf.st_mtime >= input_date))) {
-            fprintf(out, "%s\n", path);
-        } else if (S_ISDIR(statbuf.st_mode)) {
-            find_files_by_date(path, input_date, out, before);
+// Drop the watches that failed or whose client hung up
+void watch_drop_failed(int epoll_fd, Watch **watches) {
+    for (Watch **link = watches; *link;) {
+        Watch *w = *link;
+        if (w->failed) {
+            *link = w->next;
+            log_request("Watch ended: the client went away\n");
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->conn->fd, NULL);
+            watch_free(w);
+        } else {
+            link = &w->next;
         }
     }
-    closedir(dir);
 }
 
-// Execute tar command using fork and exec with improved error handling
-int execute_tar(const char *tar_args[]) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("Failed to fork");
-        return -1;
-    } else if (pid > 0) {
-        // Parent process: waiting for the child to terminate
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) {
-            int exit_status = WEXITSTATUS(status);
-            printf("tar exited with status %d\n", exit_status);
-            if (exit_status != 0) {
-                return -1;
+int64_t watch_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void *watch_thread(void *arg) {
+    FileIndex *x = &file_index;
+    Watch *watches = NULL;
+    struct epoll_event events[WATCH_EVENTS];
+    uint64_t seen = 0;          // change_published as of the last batch
+    int64_t batch_at = -1;      // When to send the changes collected, -1 if none are waiting
+    (void)arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event wake = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_wake_fd, &wake) < 0)
+        error("ERROR creating watch epoll instance");
+    while (1) {
+        // Wait for changes, a new watch, a client hanging up or a socket taking more
+        int timeout = batch_at < 0 ? -1 : batch_at > watch_now_ms() ? (int)(batch_at - watch_now_ms()) : 0;
+        int n = epoll_wait(epoll_fd, events, WATCH_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            Watch *w = events[i].data.ptr;
+            if (!w) {
+                eventfd_t count;
+                eventfd_read(watch_wake_fd, &count);
+            } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // Hung up, or sent something, which also ends its watch
+                w->failed = 1;
+            } else if (events[i].events & EPOLLOUT && watch_send(w) == 0 && !watch_pending(w) && batch_at < 0) {
+                batch_at = watch_now_ms();  // Drained: catch it up with what it was not given
             }
-        } else if (WIFSIGNALED(status)) {
-            printf("tar killed by signal %d\n", WTERMSIG(status));
-            return -1;
         }
-        return 0;
-    } else {
-        // Child process: running the tar command
-        execvp("tar", (char *const *)tar_args);
-        // Note that execvp only returns if an error occurred
-        fprintf(stderr, "Execution of tar failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-}
 
-// Main function for archiving and sending files
-void send_files_by_date(int sock, const char *date, int before) {
-    char temp_file[] = "/tmp/file_list.txt";
-    FILE *out = fopen(temp_file, "w");
-    if (!out) {
-        perror("Failed to open temporary file");
-        return;
-    }
+        pthread_mutex_lock(&change_lock);
+        uint64_t published = change_published;
+        while (watch_joining) {
+            Watch *w = watch_joining;
+            watch_joining = w->next;
+            w->next = watches;
+            watches = w;
+            w->polling_out = watch_pending(w);
+            struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (w->polling_out ? EPOLLOUT : 0), .data.ptr = w};
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->conn->fd, &ev) < 0) w->failed = 1;
+            if (batch_at < 0) batch_at = watch_now_ms();  // A resumed one has changes to catch up on
+        }
+        pthread_mutex_unlock(&change_lock);
+        if (published != seen && batch_at < 0)
+            batch_at = watch_now_ms() + WATCH_DELAY_MS;  // Let a burst of changes collect
 
-    time_t input_date = parse_date(date);
-    find_files_by_date(getenv("HOME"), input_date, out, before);
-    fclose(out);
+        watch_drop_failed(epoll_fd, &watches);
+        if (batch_at < 0 || watch_now_ms() < batch_at) continue;
+        batch_at = -1;
+        seen = published;
+        if (!watches) continue;
 
-    printf("File search completed, checking file list...\n");
-    // Check if the file list is empty
-    struct stat statbuf;
-    if (stat(temp_file, &statbuf) == -1 || statbuf.st_size == 0) {
-        printf("No files matched the criteria or failed to write to file list.\n");
-        unlink(temp_file);
-        return;
-    }
+        // Copy out the changes the furthest-behind watch that can take them has not seen
+        WatchChange *changes = NULL;
+        size_t count = 0;
+        uint64_t from = UINT64_MAX, end = 0, oldest = 0;
+        pthread_rwlock_rdlock(&x->lock);
+        end = x->change_seq;
+        oldest = end > CHANGE_LOG ? end - CHANGE_LOG : 0;
+        for (Watch *w = watches; w; w = w->next)
+            if (!watch_pending(w) && w->seq < from) from = w->seq;
+        if (from < oldest) from = oldest;
+        if (from < end && (changes = malloc((end - from) * sizeof(WatchChange))) != NULL) {
+            for (uint64_t seq = from; seq < end; seq++) {
+                WatchChange *c = &changes[count];
+                c->seq = seq;
+                c->change = x->changes[seq % CHANGE_LOG];
+                if ((c->change.path = strdup(c->change.path)) != NULL) count++;
+            }
+        }
+        pthread_rwlock_unlock(&x->lock);
+        qsort(changes, count, sizeof(WatchChange), compare_watch_changes);
 
-    printf("Archiving files...\n");
-    const char *tar_args[] = {"tar", "-czf", "/tmp/files.tar.gz", "-T", temp_file, NULL};
-    if (execute_tar(tar_args) != 0) {
-        perror("Failed to create archive");
-        unlink(temp_file);
-        return;
+        for (Watch *w = watches; w; w = w->next) {
+            if (watch_pending(w)) continue;  // Still sending: it catches up once drained
+            if (w->seq < oldest) {
+                // Fell out of the log: start over from the full set
+                watch_write(w, "# resync\n", 9);
+                if (watch_send_all(w) < 0) w->failed = 1;
+            } else if (w->seq < end) {
+                watch_send_changes(w, changes, count, end);
+            }
+            if (!w->failed) watch_poll_out(epoll_fd, w);
+        }
+        for (size_t i = 0; i < count; i++) free(changes[i].change.path);
+        free(changes);
+        watch_drop_failed(epoll_fd, &watches);
     }
+    return NULL;
+}
 
-    printf("Archive created, preparing to send files...\n");
-    int file = open("/tmp/files.tar.gz", O_RDONLY);
-    if (file == -1) {
-        perror("Failed to open archive for reading");
-        unlink(temp_file);
-        unlink("/tmp/files.tar.gz");
-        return;
-    }
+void watch_start() {
+    pthread_t tid;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) error("ERROR creating watch eventfd");
+    __atomic_store_n(&watch_wake_fd, fd, __ATOMIC_RELEASE);
+    if (pthread_create(&tid, NULL, watch_thread, NULL) != 0)
+        error("ERROR creating watch thread");
+    pthread_detach(tid);
+}
 
-    struct stat file_stat;
-    if (fstat(file, &file_stat) == -1) {
-        perror("Failed to get file size");
-        close(file);
-        unlink(temp_file);
-        unlink("/tmp/files.tar.gz");
-        return;
+// w24watch: send the initial set (or what was missed since the resume token)
+// and hand the connection to the watch thread. Returns 1 if the connection
+// stays with the worker (the command was refused), 0 once handed over.
+int start_watch(Connection *conn, Reply *reply, char *args) {
+    char predicates[W24_MAX_COMMAND + 1] = "", err[256], *saveptr;
+    unsigned long long instance = 0, seq = 0;
+    int resume = 0, list;
+    Watch *w = calloc(1, sizeof(Watch));
+    if (!w) {
+        send_text(reply, W24_STATUS_ERROR, "Out of memory\n");
+        return 1;
+    }
+    for (char *token = strtok_r(args, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+        if (strncmp(token, "resume:", 7) == 0) {
+            resume = sscanf(token + 7, "%llx.%llx", &instance, &seq) == 2 ? 1 : -1;
+        } else {
+            strcat(predicates, " ");
+            strcat(predicates, token);
+        }
     }
+    err[0] = '\0';
+    if (resume < 0)
+        snprintf(err, sizeof(err), "Invalid resume token\n");
+    else if (parse_find_query(predicates, &w->query, &list, err, sizeof(err)) == 0 && list)
+        snprintf(err, sizeof(err), "w24watch takes predicates only, no -l\n");
+    if (err[0]) {
+        send_text(reply, W24_STATUS_INVALID, err);
+        free(w);
+        return 1;
+    }
+    if (!index_acquire(&file_index)) {
+        send_text(reply, W24_STATUS_ERROR, "w24watch needs the live index, which is off or incomplete\n");
+        free(w);
+        return 1;
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    w->conn = conn;
+    w->request_id = reply->request_id;
+    w->frame = SIZE_MAX;
 
-    // Allocate buffer to hold file content and EOF marker
-    char *buffer = malloc(file_stat.st_size + 4); // Additional space for EOF marker
-    if (!buffer) {
-        perror("Memory allocation failed");
-        close(file);
-        unlink(temp_file);
-        unlink("/tmp/files.tar.gz");
-        return;
+    pthread_rwlock_rdlock(&file_index.lock);
+    uint64_t end = file_index.change_seq, oldest = end > CHANGE_LOG ? end - CHANGE_LOG : 0;
+    pthread_rwlock_unlock(&file_index.lock);
+    int failed;
+    if (resume && instance == file_index.instance && seq >= oldest && seq <= end) {
+        w->seq = seq;  // The watch thread sends what was missed
+        failed = watch_flush(w) < 0;
+    } else {
+        if (resume) watch_write(w, "# resync\n", 9);
+        failed = watch_send_all(w) < 0;
     }
+    if (failed) {
+        watch_free(w);
+        return 0;
+    }
+    log_request("Watch started:%s\n", predicates);
+    pthread_once(&watch_once, watch_start);
+    pthread_mutex_lock(&change_lock);
+    w->next = watch_joining;
+    watch_joining = w;
+    pthread_mutex_unlock(&change_lock);
+    watch_wake();
+    return 0;
+}
 
-    if (read(file, buffer, file_stat.st_size) != file_stat.st_size) {
-        perror("Error reading file");
-        free(buffer);
-        close(file);
-        unlink(temp_file);
-        unlink("/tmp/files.tar.gz");
-        return;
+// Serve the command held in conn->command.
+// Returns 1 when the connection stays with this worker, 0 when it was closed or handed off.
+int serve_command(Connection *conn) {
+    char *buffer = conn->command;
+    Reply reply = {.sock = conn->fd, .request_id = conn->request_id, .zc_next_id = &conn->zc_next_id, .spool = NULL};
+
+    // Remove newline character from the command if present
+    buffer[strcspn(buffer, "\n")] = 0;
+
+    if (strcmp(buffer, "quitc") == 0) {
+        close_connection(conn);  // Close the socket once 'quitc' is received
+        return 0;
     }
 
-    // Append EOF marker at the end of the buffer
-    memcpy(buffer + file_stat.st_size, "EOF", 4);
+    if (strncmp(buffer, "dirlist", 7) == 0) {
+        // Parse command for sorting type, then the optional page size and cursor
+        char *saveptr;
+        char *sort_type = strtok_r(buffer + 7, " ", &saveptr);
+        char *option, *cursor = NULL;
+        long limit = 0;
+        int sort_by_time = 0; // Default to alphabetical sort
+        int valid = sort_type != NULL;
+
+        // Determine the sorting type based on the command suffix
+        if (valid && strcmp(sort_type, "-t") == 0) {
+            sort_by_time = 1; // Sort by time if '-t' is specified
+        } else if (valid && strcmp(sort_type, "-a") != 0) {
+            valid = 0;
+        }
+        while (valid && (option = strtok_r(NULL, " ", &saveptr)) != NULL) {
+            char *value = strtok_r(NULL, " ", &saveptr);
+            if (value && strcmp(option, "-n") == 0 && (limit = atol(value)) > 0)
+                continue;
+            if (value && strcmp(option, "-c") == 0 && !cursor)
+                cursor = value;
+            else
+                valid = 0;
+        }
+        if (!valid) {
+            // Handle error or unrecognized sort type
+            send_text(&reply, W24_STATUS_INVALID, "Unrecognized sorting option. Use '-a' for alphabetical or '-t' for time-based sorting, "
+                                                  "optionally with '-n <count>' and '-c <cursor>'.\n");
+            return 1;
+        }
+
+        // Fetch the directory path (usually the home directory)
+        char *dir_path = getenv("HOME"); // Default directory path
 
-    // Send file data along with EOF marker
-    if (write(sock, buffer, file_stat.st_size + 4) < 0) {
-        perror("Failed to send file");
+        // Call the list_directories function with the path, sort type and page
+        list_directories(&reply, dir_path, sort_by_time, limit, cursor);
+    } else if (strcmp(buffer, "stats") == 0) {
+        send_cache_stats(&reply);
+    } else if (strncmp(buffer, "w24fn ", 6) == 0) {
+        char* filename = buffer + 6;
+        char path[1024];
+        // A single plain name keeps the original reply; a name with spaces is
+        // tried whole first, since it used to be looked up that way
+        if (!is_glob(filename) && (!strchr(filename, ' ') || index_find_file(filename, path, sizeof(path)) == 1))
+            send_file_info(&reply, filename);
+        else
+            send_name_lookups(&reply, filename);
+    } else if (strncmp(buffer, "w24watch ", 9) == 0) {
+        // The connection now belongs to the watch thread, or was refused
+        return start_watch(conn, &reply, buffer + 9);
+    } else if (is_archive_command(buffer)) {
+        // Archive jobs block for a long time, hand them to the archive pool
+        if (queue_push(&archive_queue, conn) < 0)
+            close_connection(conn);
+        return 0;  // The archive worker re-arms the connection when done
+    } else {
+        send_text(&reply, W24_STATUS_INVALID, "Invalid command\n");
     }
+    return 1;
+}
 
-    free(buffer);
-    close(file);
+// Read and serve commands from a connection. served says whether a command was
+// already answered in this turn; after one command only frames that are already
+// buffered are served, so a busy client cannot monopolise a worker.
+// Returns 1 when the connection should be re-armed, 0 when it was closed or handed off.
+int crequest(Connection *conn, int served) {
+    while (1) {
+        int r = next_command(conn);
+        if (r < 0) {
+            fprintf(stderr, "Protocol error from client, closing connection\n");
+            close_connection(conn);
+            return 0;
+        }
+        if (r == 1) {
+            if (!serve_command(conn))
+                return 0;
+            served = 1;
+            continue;
+        }
+        if (served)
+            return 1;  // Wait in epoll for the next command
 
-    // Clean up
-    unlink(temp_file);
-    unlink("/tmp/files.tar.gz");
+        if (!conn->inbuf && connection_buffers(conn) < 0) {
+            close_connection(conn);
+            return 0;
+        }
+        ssize_t n = recv(conn->fd, conn->inbuf + conn->inlen, CONN_INBUF - conn->inlen, MSG_DONTWAIT);
+        if (n > 0) {
+            conn->inlen += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;  // Partial frame, wait for the rest
+        if (n < 0) perror("ERROR reading from socket");
+        close_connection(conn);  // Client went away or the socket failed
+        return 0;
+    }
 }
 
-// Public functions that handle sending files before and after a specific date
-void send_files_by_date_before(int sock, const char *date) {
-    send_files_by_date(sock, date, 1);  // before = 1
+// Worker thread: serve the commands of a readable connection, then re-arm it
+void *worker_thread(void *arg) {
+    Connection *conn;
+    (void)arg;
+    while ((conn = queue_pop(&worker_queue)) != NULL) {
+        if (__atomic_load_n(&loop_holding, __ATOMIC_SEQ_CST))
+            eventfd_write(loop_wake_fd, 1);  // A held connection fits now
+        if (crequest(conn, 0))
+            rearm_connection(conn);
+    }
+    return NULL;
 }
 
-void send_files_by_date_after(int sock, const char *date) {
-    send_files_by_date(sock, date, 0);  // before = 0
+// Archive worker thread: run the queued archive command, then go back to the connection
+void *archive_thread(void *arg) {
+    Connection *conn;
+    (void)arg;
+    while ((conn = queue_pop(&archive_queue)) != NULL) {
+        Reply reply = {.sock = conn->fd, .request_id = conn->request_id, .zc_next_id = &conn->zc_next_id, .spool = NULL};
+        run_archive_command(&reply, conn->command);
+        if (crequest(conn, 1))
+            rearm_connection(conn);
+    }
+    return NULL;
 }
 
-void crequest(int sock) {
-    char buffer[256];
-    int n;
+// Work shared by the threads of one benchmark run: blocks are taken round-robin
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int threads;
+    int index;
+    uint64_t compressed;
+} BenchJob;
 
-    // Enter an infinite loop to handle commands until 'quitc'
-    while (1) {
-        bzero(buffer, 256);
-        n = read(sock, buffer, 255);
-        if (n < 0) error("ERROR reading from socket");
+void *bench_thread(void *arg) {
+    BenchJob *job = arg;
+    Deflater *d = malloc(sizeof(Deflater));
+    size_t nblocks = (job->size + block_size - 1) / block_size;
+    for (size_t b = job->index; d && b < nblocks; b += job->threads) {
+        size_t len = job->size - b * block_size < block_size ? job->size - b * block_size : block_size;
+        Chunk *member = gzip_block(d, LEVEL_DEFAULT, job->data + b * block_size, len);
+        if (member) job->compressed += member->len;
+        free(member);
+    }
+    free(d);
+    return NULL;
+}
 
-        // Remove newline character from the command if present
-        buffer[strcspn(buffer, "\n")] = 0;
+// -T: compress a file with 1 to 16 threads using the archive block size and report throughput
+void benchmark_compression(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        error("ERROR opening benchmark file");
+    unsigned char *data = malloc(st.st_size + 1);
+    if (!data || read(fd, data, st.st_size) != st.st_size)
+        error("ERROR reading benchmark file");
+    close(fd);
 
-        if (strcmp(buffer, "quitc") == 0) {
-            break; // Exit the loop and terminate child process
+    printf("%s: %lld bytes, block size %zu\n", path, (long long)st.st_size, block_size);
+    printf("threads  seconds     MB/s  ratio\n");
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        BenchJob jobs[16];
+        pthread_t tids[16];
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < threads; i++) {
+            jobs[i] = (BenchJob){data, st.st_size, threads, i, 0};
+            pthread_create(&tids[i], NULL, bench_thread, &jobs[i]);
         }
-
-        if (strncmp(buffer, "dirlist", 7) == 0) {
-            // Parse command for sorting type
-            char *sort_type = buffer + 8;
-            int sort_by_time = 0; // Default to alphabetical sort
-
-            // Determine the sorting type based on the command suffix
-            if (strcmp(sort_type, "-t") == 0) {
-                sort_by_time = 1; // Sort by time if '-t' is specified
-            } else if (strcmp(sort_type, "-a") == 0) {
-                sort_by_time = 0; // Sort alphabetically if '-a' is specified
-            } else {
-                // Handle error or unrecognized sort type
-                char *error_msg = "Unrecognized sorting option. Use '-a' for alphabetical or '-t' for time-based sorting.\n";
-                write(sock, error_msg, strlen(error_msg));
-                continue;
-            }
-
-            // Fetch the directory path (usually the home directory)
-            char *dir_path = getenv("HOME"); // Default directory path
-
-            // Call the list_directories function with the path and sort type
-            list_directories(sock, dir_path, sort_by_time);
-        } else if (strncmp(buffer, "w24fn ", 6) == 0) {
-            char* filename = buffer + 6;
-            send_file_info(sock, filename);
-        } else if (strncmp(buffer, "w24fz ", 6) == 0) {
-            // Handle file size range command
-            int size1, size2;
-            sscanf(buffer + 6, "%d %d", &size1, &size2);
-            send_files_by_size(sock, size1, size2);
-        } else if (strncmp(buffer, "w24ft ", 6) == 0) {
-            // Handle file type command
-            char* types = buffer + 6;
-            send_files_by_type(sock, types);
-        } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
-            // Handle files by date before command
-            char* date = buffer + 7;
-            send_files_by_date_before(sock, date);
-        } else if (strncmp(buffer, "w24fda ", 7) == 0) {
-            // Handle files by date after command
-            char* date = buffer + 7;
-            send_files_by_date_after(sock, date);
-        } else {
-            char* msg = "Invalid command\n";
-            write(sock, msg, strlen(msg));
+        uint64_t compressed = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+            compressed += jobs[i].compressed;
         }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%7d  %7.3f  %7.1f  %5.3f\n", threads, secs, st.st_size / secs / 1e6,
+               st.st_size ? (double)compressed / st.st_size : 0.0);
     }
+    free(data);
+}
 
-    close(sock); // Close the socket once 'quitc' is received
+// Start count detached threads running fn
+void start_pool(int count, void *(*fn)(void *)) {
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, fn, NULL) != 0)
+            error("ERROR creating thread");
+        pthread_detach(tid);
+    }
 }
 
-void handle_client(int);
+// Raise the open file limit so idle clients are not capped by the default of 1024
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
 
 int main(int argc, char *argv[]) {
     int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
+    struct sockaddr_in serv_addr;
+    int workers = DEFAULT_WORKERS;
+    int archive_workers = DEFAULT_ARCHIVE_WORKERS;
+    const char *bench_file = NULL;
+    int opt;
+
+    // -w sets the command workers, -a the archive workers, -c the compressor
+    // threads per archive, -b the compression block size in KiB, -n disables
+    // zero-copy sends (to compare CPU per GB), -q sets the io_uring queue depth
+    // for file reads (0 uses the thread pool instead), -o the order files go
+    // into archives (walk, disk or ext), -m caps the compressed member cache in
+    // MiB (0 disables it), -C keeps it in a directory across restarts, -r caps the
+    // result cache in MiB (0 disables it) and -t sets its TTL in seconds, -i turns
+    // off the live index so every command walks the tree and -S names its snapshot
+    // file ("" for none; by default it is kept in the private state_dir), -p sets the directory walker threads (0: walks run on
+    // the thread that needs them), -H names the checksum cache file ("" keeps
+    // digests in memory only); -T benchmarks
+    snprintf(state_dir, sizeof(state_dir), "/tmp/w24-%u", (unsigned)geteuid());
+    snprintf(index_snapshot, sizeof(index_snapshot), "%s/index-%d", state_dir, PORT);
+    snprintf(sum_cache.path, sizeof(sum_cache.path), "%s/sums-%d", state_dir, PORT);
+    while ((opt = getopt(argc, argv, "w:a:c:b:T:nq:o:m:C:r:t:iPS:p:H:v")) != -1) {
+        switch (opt) {
+        case 'w': workers = atoi(optarg); break;
+        case 'a': archive_workers = atoi(optarg); break;
+        case 'c': compress_threads = atoi(optarg); break;
+        case 'b': block_size = (size_t)atol(optarg) * 1024; break;
+        case 'T': bench_file = optarg; break;
+        case 'n': zero_copy = 0; break;
+        case 'q': ingest_depth = atoi(optarg); break;
+        case 'm': member_cache.limit = (size_t)atol(optarg) << 20; break;
+        case 'C': member_cache.dir = optarg; break;
+        case 'r': result_cache.limit = (uint64_t)atol(optarg) << 20; break;
+        case 't': result_cache.ttl = atoi(optarg); break;
+        case 'i': use_index = 0; break;
+        case 'P': follow_links = 0; break;
+        case 'v': verbose = 1; break;
+        case 'S': snprintf(index_snapshot, sizeof(index_snapshot), "%s", optarg); break;
+        case 'p': walk_threads = atoi(optarg) < 0 ? 0 : atoi(optarg); break;
+        case 'H': snprintf(sum_cache.path, sizeof(sum_cache.path), "%s", optarg); break;
+        case 'o':
+            if (strcmp(optarg, "disk") == 0) file_order = ORDER_DISK;
+            else if (strcmp(optarg, "ext") == 0) file_order = ORDER_EXT;
+            else if (strcmp(optarg, "walk") == 0) file_order = ORDER_WALK;
+            else {
+                fprintf(stderr, "Unknown file order '%s' (walk, disk or ext)\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers] [-a archive_workers] [-c compress_threads] "
+                            "[-b block_kib] [-n] [-q queue_depth] [-o walk|disk|ext] [-m cache_mib] "
+                            "[-C cache_dir] [-r result_mib] [-t ttl_seconds] [-i] [-P] [-S snapshot_file] [-p walkers] "
+                            "[-H checksum_file] [-T benchmark_file] [-v]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (workers < 1) workers = 1;
+    if (archive_workers < 1) archive_workers = 1;
+    if (compress_threads < 1) compress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (compress_threads < 1) compress_threads = 1;
+    if (block_size < 4096) block_size = 4096;
+    if (ingest_depth > 4096) ingest_depth = 4096;
+    size_t state_len = strlen(state_dir);
+    if ((strncmp(index_snapshot, state_dir, state_len) == 0 || strncmp(sum_cache.path, state_dir, state_len) == 0) &&
+        private_dir(state_dir) < 0) {
+        fprintf(stderr, "Not keeping state in %s: %s\n", state_dir, strerror(errno));
+        if (strncmp(index_snapshot, state_dir, state_len) == 0) index_snapshot[0] = '\0';
+        if (strncmp(sum_cache.path, state_dir, state_len) == 0) sum_cache.path[0] = '\0';
+    }
 
-    // Handle SIGCHLD to prevent child processes from becoming zombies
-    signal(SIGCHLD, SIG_IGN);
+    // A client closing early must not kill the whole server with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    compression_init();
+    cache_init(&member_cache);
+    result_cache_init(&result_cache);
+    if (bench_file) {
+        benchmark_compression(bench_file);
+        return 0;
+    }
+    sum_cache_load(&sum_cache);
 
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) 
         error("ERROR opening socket");
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     // Initialize server structure with zeros
     bzero((char *) &serv_addr, sizeof(serv_addr));
@@ -626,25 +8536,95 @@ int main(int argc, char *argv[]) {
         error("ERROR on binding");
 
     // Listen for incoming connections
-    listen(sockfd, 5);
-    clilen = sizeof(cli_addr);
+    if (listen(sockfd, SOMAXCONN) < 0)
+        error("ERROR on listen");
+
+    if (queue_init(&worker_queue, QUEUE_CAPACITY) < 0 || queue_init(&archive_queue, QUEUE_CAPACITY) < 0)
+        error("ERROR allocating queues");
+    start_pool(workers, worker_thread);
+    start_pool(archive_workers, archive_thread);
+    pipeline_pools_start(archive_workers);
+    ingest_probe();
+    if (!ingest_uring) {
+        if (queue_init(&ingest_queue, QUEUE_CAPACITY) < 0)
+            error("ERROR allocating ingest queue");
+        start_pool(INGEST_THREADS, ingest_thread);
+        printf("io_uring not available, reading files with %d threads\n", INGEST_THREADS);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    scan_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    walk_pool_start();
+    content_pool_start();
+    if (use_index)
+        index_start(&file_index);
 
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+        error("ERROR creating epoll instance");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+        error("ERROR adding listening socket to epoll");
+    loop_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.ptr = &loop_wake_fd;
+    if (loop_wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loop_wake_fd, &ev) < 0)
+        error("ERROR adding wake-up eventfd to epoll");
+
+    // Readable connections the worker queue had no room for, oldest first. They
+    // stay registered but not re-armed, so the loop never blocks on the queue.
+    Connection *held = NULL, **held_tail = &held;
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0)
-            error("ERROR on accept");
-
-        int pid = fork();
-        if (pid < 0)
-            error("ERROR on fork");
-
-        if (pid == 0) {  // This is the child process
-            close(sockfd);
-            // Function to handle communication with the client
-            handle_client(newsockfd);
-            exit(0);
-        } else {
-            close(newsockfd);  // Parent doesn't need this socket
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR on epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                // Accept every pending client; each one only costs a descriptor until it sends a command
+                while ((newsockfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    Connection *conn = calloc(1, sizeof(Connection));
+                    if (!conn) {
+                        close(newsockfd);
+                        continue;
+                    }
+                    conn->fd = newsockfd;
+                    struct epoll_event cev;
+                    cev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    cev.data.ptr = conn;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, newsockfd, &cev) < 0) {
+                        perror("epoll_ctl add");
+                        close_connection(conn);
+                    }
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                    perror("ERROR on accept");
+            } else if (events[i].data.ptr == &loop_wake_fd) {
+                eventfd_t count;
+                eventfd_read(loop_wake_fd, &count);
+            } else {
+                // One-shot events guarantee a connection is queued at most once at a time
+                Connection *conn = events[i].data.ptr;
+                conn->next_ready = NULL;
+                *held_tail = conn;
+                held_tail = &conn->next_ready;
+            }
+        }
+        if (held) {
+            // Set before trying, so that a worker taking a job after a failed push wakes the loop
+            __atomic_store_n(&loop_holding, 1, __ATOMIC_SEQ_CST);
+            while (held) {
+                Connection *next = held->next_ready;  // A worker may be done with held as soon as it is queued
+                if (queue_try_push(&worker_queue, held) < 0) break;
+                held = next;
+            }
+            if (!held) {
+                held_tail = &held;
+                __atomic_store_n(&loop_holding, 0, __ATOMIC_SEQ_CST);
+            }
         }
     }
     
@@ -652,7 +8632,3 @@ int main(int argc, char *argv[]) {
     close(sockfd);
     return 0;
 }
-
-void handle_client(int sock) {
-    crequest(sock);  // Function previously discussed that handles client requests
-}
\ No newline at end of file
@@ -0,0 +1,1170 @@
+// Test driver for serverw24.c: the encoders, hashes and path checks are called
+// directly, and one archive is built by the real pipeline and unpacked again.
+// The server source is compiled in with its main() renamed. gzip and tar from
+// the system decode the output, as they would on the client side.
+//
+//   gcc -O2 -Wall -o w24tests Project/tests/tests.c -pthread -lm && ./w24tests
+
+#define main server_main
+#include "../serverw24.c"
+#undef main
+
+int checks = 0;
+int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+void check(int ok, const char *what, const char *file, int line) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s:%d: FAILED: %s\n", file, line, what);
+    }
+}
+
+char tmp_dir[] = "/tmp/w24tests-XXXXXX";
+
+// ---- Helpers ----
+
+int write_file(const char *path, const void *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int rc = write_all(fd, data, len);
+    close(fd);
+    return rc;
+}
+
+// Read a whole file into a malloc'd buffer; returns NULL if it cannot be read
+unsigned char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    *len = 0;
+    if (!f) return NULL;
+    size_t cap = 65536, n = 0, r;
+    unsigned char *buf = malloc(cap);
+    while (buf && (r = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += r;
+        if (n == cap) buf = realloc(buf, cap *= 2);
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+int same_file(const char *path, const void *data, size_t len) {
+    size_t n;
+    unsigned char *got = read_file(path, &n);
+    int same = got && n == len && memcmp(got, data, len) == 0;
+    free(got);
+    return same;
+}
+
+int read_all(int fd, void *data, size_t len) {
+    unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Run a shell command with the test directory as its working directory
+int run(const char *fmt, ...) {
+    char cmd[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = snprintf(cmd, sizeof(cmd), "cd %s && ", tmp_dir);
+    vsnprintf(cmd + n, sizeof(cmd) - n, fmt, ap);
+    va_end(ap);
+    return system(cmd);
+}
+
+void hex(const unsigned char *p, size_t len, char *out) {
+    for (size_t i = 0; i < len; i++)
+        sprintf(out + 2 * i, "%02x", p[i]);
+}
+
+// byte_sink that appends to a growing buffer
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+} Buffer;
+
+void buffer_sink(void *arg, const void *data, size_t len) {
+    Buffer *b = arg;
+    if (b->len + len > b->cap) {
+        while (b->len + len > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// Sample inputs: empty, text, zeros, noise, and noise too long for one window
+size_t sample(int which, unsigned char **out) {
+    static const size_t sizes[] = {0, 0, 200000, 5000, 300000};
+    size_t len = which == 1 ? 64 * 1024 : sizes[which];
+    unsigned char *p = malloc(len + 1);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < len; i++) {
+        if (which == 1) {
+            p[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+        } else if (which == 2) {
+            p[i] = 0;
+        } else {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            p[i] = x;
+        }
+    }
+    *out = p;
+    return len;
+}
+#define SAMPLES 5
+
+// ---- Framing ----
+
+void test_header() {
+    unsigned char h[W24_HEADER_SIZE];
+    static const unsigned char want[W24_HEADER_SIZE] = {
+        0x57, 3, 0, 1, 0x01, 0x02, 0x03, 0x04, 0, 0, 0, 0x01, 0x02, 0x03, 0x04, 0x05};
+    encode_header(h, W24_TYPE_ARCHIVE, W24_STATUS_OK, W24_FLAG_MORE, 0x01020304, 0x0102030405ULL);
+    CHECK(memcmp(h, want, sizeof(h)) == 0);
+}
+
+// ---- Hashes ----
+
+void test_hashes() {
+    static const struct {
+        const char *input;
+        uint64_t xxh64;
+        const char *sha256;
+    } vectors[] = {
+        {"", 0xef46db3751d8e999ULL, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", 0x44bc2cf5ad770999ULL, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0xf06103773e8585dfULL,
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    };
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const unsigned char *in = (const unsigned char *)vectors[i].input;
+        size_t len = strlen(vectors[i].input);
+        Xxh64 x;
+        xxh64_init(&x);
+        xxh64_update(&x, in, len);
+        CHECK(xxh64_final(&x) == vectors[i].xxh64);
+
+        Sha256 s;
+        unsigned char digest[32];
+        char text[65];
+        sha256_init(&s);
+        sha256_update(&s, in, len);
+        sha256_final(&s, digest);
+        hex(digest, 32, text);
+        CHECK(strcmp(text, vectors[i].sha256) == 0);
+    }
+
+    // Fed in uneven pieces, the streaming hashes must match a single update
+    unsigned char *data;
+    size_t len = sample(3, &data);
+    Xxh64 whole, parts;
+    Sha256 s_whole, s_parts;
+    unsigned char d_whole[32], d_parts[32];
+    xxh64_init(&whole);
+    xxh64_update(&whole, data, len);
+    sha256_init(&s_whole);
+    sha256_update(&s_whole, data, len);
+    xxh64_init(&parts);
+    sha256_init(&s_parts);
+    for (size_t off = 0, step = 1; off < len; off += step, step = step * 3 % 97 + 1) {
+        size_t n = step < len - off ? step : len - off;
+        xxh64_update(&parts, data + off, n);
+        sha256_update(&s_parts, data + off, n);
+    }
+    sha256_final(&s_whole, d_whole);
+    sha256_final(&s_parts, d_parts);
+    CHECK(xxh64_final(&whole) == xxh64_final(&parts));
+    CHECK(memcmp(d_whole, d_parts, 32) == 0);
+    free(data);
+
+    CHECK(crc32_update(0, (const unsigned char *)"123456789", 9) == 0xcbf43926);
+}
+
+// ---- Deflate and gzip ----
+
+void test_gzip() {
+    static const int levels[] = {LEVEL_NONE, LEVEL_FAST, LEVEL_DEFAULT, LEVEL_MAX};
+    Deflater *d = malloc(sizeof(Deflater));
+    char gz[PATH_MAX], out[PATH_MAX];
+    snprintf(gz, sizeof(gz), "%s/sample.gz", tmp_dir);
+    snprintf(out, sizeof(out), "%s/sample", tmp_dir);
+    for (int which = 0; which < SAMPLES; which++) {
+        unsigned char *data;
+        size_t len = sample(which, &data);
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            Chunk *c = gzip_block(d, levels[l], data, len);
+            CHECK(c != NULL);
+            if (!c) continue;
+            // Trailer: CRC-32 and length of the input, little-endian
+            CHECK(c->len >= 18 && c->data[0] == 0x1f && c->data[1] == 0x8b);
+            uint32_t crc, isize;
+            memcpy(&crc, c->data + c->len - 8, 4);
+            memcpy(&isize, c->data + c->len - 4, 4);
+            CHECK(le32toh(crc) == crc32_update(0, data, len));
+            CHECK(le32toh(isize) == (uint32_t)len);
+            CHECK(write_file(gz, c->data, c->len) == 0);
+            CHECK(run("gzip -dc sample.gz > sample") == 0);
+            CHECK(same_file(out, data, len));
+            if (failures) fprintf(stderr, "  (sample %d, level %d)\n", which, levels[l]);
+            chunk_free(c);
+        }
+        free(data);
+    }
+
+    // Independent members concatenate into one stream
+    unsigned char *a, *b;
+    size_t a_len = sample(1, &a), b_len = sample(4, &b);
+    Buffer joined = {0};
+    Chunk *ca = gzip_block(d, LEVEL_DEFAULT, a, a_len);
+    Chunk *cb = gzip_block(d, LEVEL_FAST, b, b_len);
+    buffer_sink(&joined, ca->data, ca->len);
+    buffer_sink(&joined, cb->data, cb->len);
+    unsigned char *both = malloc(a_len + b_len);
+    memcpy(both, a, a_len);
+    memcpy(both + a_len, b, b_len);
+    CHECK(write_file(gz, joined.data, joined.len) == 0);
+    CHECK(run("gzip -dc sample.gz > sample") == 0);
+    CHECK(same_file(out, both, a_len + b_len));
+    chunk_free(ca);
+    chunk_free(cb);
+    free(joined.data);
+    free(both);
+    free(a);
+    free(b);
+    free(d);
+}
+
+// ---- Tar headers ----
+
+void tar_add(Buffer *tar, const char *name, const unsigned char *data, size_t len) {
+    static const unsigned char pad[512];
+    struct stat st = {0};
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = len;
+    st.st_mtime = 1700000000;
+    tar_write_header(buffer_sink, tar, name, &st, '0');
+    buffer_sink(tar, data, len);
+    buffer_sink(tar, pad, (512 - len % 512) % 512);
+}
+
+void test_tar() {
+    char split_name[200], long_name[200], path[PATH_MAX];
+    // 60 + 1 + 79 characters: too long for the name field, fits the ustar prefix split
+    memset(split_name, 'd', 60);
+    split_name[60] = '/';
+    memset(split_name + 61, 'f', 79);
+    split_name[140] = '\0';
+    // 130 characters without a usable '/': needs a GNU LongLink entry
+    snprintf(long_name, sizeof(long_name), "x/%0128d", 7);
+
+    Buffer tar = {0};
+    const unsigned char *text = (const unsigned char *)"hello\n";
+    unsigned char *noise;
+    size_t noise_len = sample(3, &noise);
+    tar_add(&tar, "short.txt", text, 6);
+    CHECK(tar.len == 1024);
+    // Header checksum: the sum of all bytes with the checksum field read as spaces
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : tar.data[i];
+    CHECK(strtoul((const char *)tar.data + 148, NULL, 8) == sum);
+    CHECK(memcmp(tar.data + 257, "ustar", 6) == 0);
+
+    size_t before = tar.len;
+    tar_add(&tar, split_name, noise, noise_len);
+    CHECK(tar.data[before + 156] == '0');  // No LongLink entry in front
+    CHECK(memcmp(tar.data + before + 345, split_name, 60) == 0);
+
+    before = tar.len;
+    tar_add(&tar, long_name, text, 6);
+    CHECK(tar.data[before + 156] == 'L');
+
+    static const unsigned char end[1024];
+    buffer_sink(&tar, end, sizeof(end));
+    snprintf(path, sizeof(path), "%s/t.tar", tmp_dir);
+    CHECK(write_file(path, tar.data, tar.len) == 0);
+    CHECK(run("mkdir -p tar && tar -xf t.tar -C tar") == 0);
+    snprintf(path, sizeof(path), "%s/tar/short.txt", tmp_dir);
+    CHECK(same_file(path, text, 6));
+    snprintf(path, sizeof(path), "%s/tar/%s", tmp_dir, split_name);
+    CHECK(same_file(path, noise, noise_len));
+    snprintf(path, sizeof(path), "%s/tar/%s", tmp_dir, long_name);
+    CHECK(same_file(path, text, 6));
+    free(tar.data);
+    free(noise);
+}
+
+// ---- Tree listing varints ----
+
+void test_varint() {
+    unsigned char p[10];
+    CHECK(tree_put_varint(p, 0) == 1 && p[0] == 0);
+    CHECK(tree_put_varint(p, 127) == 1 && p[0] == 127);
+    CHECK(tree_put_varint(p, 300) == 2 && p[0] == 0xac && p[1] == 0x02);
+    CHECK(tree_put_varint(p, UINT64_MAX) == 10 && p[9] == 0x01);
+    CHECK(tree_put_signed(p, -1) == 1 && p[0] == 1);
+    CHECK(tree_put_signed(p, 1) == 1 && p[0] == 2);
+}
+
+// ---- Globs ----
+
+void test_glob() {
+    CHECK(is_glob("*.c") && is_glob("a?") && is_glob("[ab]") && !is_glob("plain.txt"));
+    CHECK(glob_match("*.c", "serverw24.c"));
+    CHECK(!glob_match("*.c", "serverw24.h"));
+    CHECK(glob_match("w24?", "w24a") && !glob_match("w24?", "w24"));
+    CHECK(glob_match("[a-c]x", "bx") && !glob_match("[a-c]x", "dx"));
+    CHECK(glob_match("*", ""));
+}
+
+// ---- Paths under HOME ----
+
+void test_home_paths() {
+    char home[64], outside[64], path[PATH_MAX], want[PATH_MAX];
+    snprintf(home, sizeof(home), "%s/home", tmp_dir);
+    snprintf(outside, sizeof(outside), "%s/outside", tmp_dir);
+    mkdir(home, 0755);
+    mkdir(outside, 0755);
+    setenv("HOME", home, 1);
+
+    CHECK(resolve_home_path("", path, sizeof(path)) == (int)strlen(home) && strcmp(path, home) == 0);
+    snprintf(want, sizeof(want), "%s/a/b", home);
+    CHECK(resolve_home_path("a/b/", path, sizeof(path)) == (int)strlen(want) && strcmp(path, want) == 0);
+    CHECK(resolve_home_path(want, path, sizeof(path)) > 0 && strcmp(path, want) == 0);
+    snprintf(want, sizeof(want), "%s/a/..b", home);
+    CHECK(resolve_home_path("a/..b", path, sizeof(path)) > 0 && strcmp(path, want) == 0);
+    CHECK(resolve_home_path("..", path, sizeof(path)) < 0);
+    CHECK(resolve_home_path("a/../../x", path, sizeof(path)) < 0);
+    CHECK(resolve_home_path("/etc", path, sizeof(path)) < 0);
+    CHECK(resolve_home_path(outside, path, sizeof(path)) < 0);
+    snprintf(want, sizeof(want), "%s2", home);  // Shares HOME's prefix but is not inside it
+    CHECK(resolve_home_path(want, path, sizeof(path)) < 0);
+
+    // Symlinks: one staying inside HOME opens, one leading out is refused
+    run("echo secret > outside/secret && mkdir -p home/in && echo ok > home/in/file && "
+        "ln -s ../outside/secret home/escape && ln -s in/file home/inside");
+    snprintf(path, sizeof(path), "%s/inside", home);
+    int fd = open_beneath_home(path, O_RDONLY);
+    CHECK(fd >= 0);
+    if (fd >= 0) close(fd);
+    snprintf(path, sizeof(path), "%s/escape", home);
+    errno = 0;
+    fd = open_beneath_home(path, O_RDONLY);
+    CHECK(fd < 0 && errno == EXDEV);
+    if (fd >= 0) close(fd);
+    run("rm home/escape home/inside");
+}
+
+// ---- Index snapshots ----
+
+// Add a node of this type; index_add may move the node table
+uint32_t add_node(FileIndex *x, uint32_t parent, const char *name, int type) {
+    uint32_t n = index_add(x, parent, name);
+    x->nodes[n].type = type;
+    return n;
+}
+
+// An index of root holding d/, d/f.txt and g.txt, built the way the crawl builds it
+void build_index(FileIndex *x, const char *root) {
+    memset(x, 0, sizeof(*x));
+    x->free_list = INDEX_NONE;
+    x->inotify_fd = -1;
+    snprintf(x->root, sizeof(x->root), "%s", root);
+    uint32_t r = index_add(x, INDEX_NONE, "");
+    index_grow_hash(x);
+    x->nodes[r].type = NODE_DIR;
+    uint32_t d = add_node(x, r, "d", NODE_DIR);
+    add_node(x, d, "f.txt", NODE_FILE);
+    add_node(x, r, "g.txt", NODE_FILE);
+}
+
+void free_index(FileIndex *x) {
+    free(x->nodes);
+    free(x->sizes);
+    free(x->mtimes);
+    free(x->exts);
+    free(x->kinds);
+    free(x->names);
+    free(x->buckets);
+    free(x->name_buckets);
+    if (x->ext_names)
+        for (uint32_t i = 1; i <= x->num_exts; i++) free(x->ext_names[i]);
+    free(x->ext_names);
+    free(x->ext_table);
+}
+
+// Load the snapshot into a fresh index of root; returns index_load's result
+int load_index(const char *root, uint32_t *live) {
+    FileIndex y;
+    memset(&y, 0, sizeof(y));
+    y.free_list = INDEX_NONE;
+    y.inotify_fd = -1;
+    snprintf(y.root, sizeof(y.root), "%s", root);
+    int rc = index_load(&y);
+    *live = y.live;
+    free_index(&y);
+    return rc;
+}
+
+// Change the node table of the saved snapshot and fix up its checksum, as a forger would
+void forge_snapshot(void (*edit)(IndexNode *nodes)) {
+    size_t len;
+    unsigned char *map = read_file(index_snapshot, &len);
+    SnapshotHeader *h = (SnapshotHeader *)map;
+    edit((IndexNode *)(map + sizeof(SnapshotHeader)));
+    h->checksum = snapshot_checksum(0xcbf29ce484222325ULL, map + sizeof(SnapshotHeader),
+                                    len - sizeof(SnapshotHeader));
+    write_file(index_snapshot, map, len);
+    free(map);
+}
+
+void edit_name(IndexNode *nodes) { nodes[2].name = 1u << 30; }
+void edit_parent(IndexNode *nodes) { nodes[2].parent = 1000000; }
+void edit_cycle(IndexNode *nodes) { nodes[1].first_child = 1; }
+void edit_orphan(IndexNode *nodes) { nodes[1].first_child = INDEX_NONE; }
+
+void test_snapshot() {
+    char root[64], dir[64], saved[PATH_MAX + 16];
+    uint32_t live;
+    FileIndex x;
+    snprintf(root, sizeof(root), "%s/home", tmp_dir);
+    snprintf(dir, sizeof(dir), "%s/state", tmp_dir);
+    CHECK(private_dir(dir) == 0);
+    CHECK(private_dir(dir) == 0);  // Already there and ours
+    chmod(dir, 0755);
+    CHECK(private_dir(dir) < 0);   // Others may look in
+    chmod(dir, 0700);
+    run("ln -s state state-link");
+    snprintf(saved, sizeof(saved), "%s/state-link", tmp_dir);
+    CHECK(private_dir(saved) < 0);
+
+    snprintf(index_snapshot, sizeof(index_snapshot), "%s/index", dir);
+    build_index(&x, root);
+    index_save(&x);
+    CHECK(x.saved == x.generation);
+    CHECK(load_index(root, &live) == 0 && live == 4);
+    CHECK(load_index(dir, &live) < 0);  // Of another directory
+    snprintf(saved, sizeof(saved), "%s.good", index_snapshot);
+    rename(index_snapshot, saved);
+
+    void (*edits[])(IndexNode *) = {edit_name, edit_parent, edit_cycle, edit_orphan};
+    for (size_t i = 0; i < sizeof(edits) / sizeof(edits[0]); i++) {
+        run("cp state/index.good state/index");
+        forge_snapshot(edits[i]);
+        CHECK(load_index(root, &live) < 0);
+    }
+
+    // Only a regular file of ours, reached without a link, is loaded
+    run("cp state/index.good state/other && ln -sf other state/index");
+    CHECK(load_index(root, &live) < 0);
+    run("rm state/index && cp state/index.good state/index && chown 65534 state/index");
+    CHECK(geteuid() != 0 || load_index(root, &live) < 0);
+
+    // Saving does not write through a link planted at a predictable name
+    run("rm -f state/index state/index.tmp && echo keep > victim && ln -s ../victim state/index.tmp");
+    index_save(&x);
+    snprintf(saved, sizeof(saved), "%s/victim", tmp_dir);
+    CHECK(same_file(saved, "keep\n", 5));
+    CHECK(load_index(root, &live) == 0 && live == 4);
+    free_index(&x);
+    index_snapshot[0] = '\0';
+}
+
+// ---- Index updates ----
+
+// Take a node out of its hash chains, as if the table could not grow when it was added
+void unfile_node(FileIndex *x, uint32_t n) {
+    uint32_t *link = &x->buckets[index_hash(x->nodes[n].parent, index_name(x, n), x->num_buckets)];
+    while (*link != n) link = &x->nodes[*link].hash_next;
+    *link = x->nodes[n].hash_next;
+    link = &x->name_buckets[index_hash(INDEX_NONE, index_name(x, n), x->num_buckets)];
+    while (*link != n) link = &x->nodes[*link].name_next;
+    *link = x->nodes[n].name_next;
+}
+
+void test_index_updates() {
+    char name[32];
+    FileIndex x;
+    build_index(&x, "/nowhere");
+    uint32_t d = index_lookup(&x, 0, "d");
+    CHECK(d != INDEX_NONE && index_lookup(&x, d, "f.txt") != INDEX_NONE);
+
+    // Past the first table size the hash is rebuilt; every name stays reachable
+    for (int i = 0; i < 70000; i++) {
+        snprintf(name, sizeof(name), "n%d.dat", i);
+        uint32_t n = index_add(&x, d, name);  // May move the node table
+        x.nodes[n].type = NODE_FILE;
+    }
+    CHECK(x.num_buckets > 65536 && x.live == 70004);
+    for (int i = 0; i < 70000; i += 2) {
+        snprintf(name, sizeof(name), "n%d.dat", i);
+        index_remove(&x, index_lookup(&x, d, name));
+    }
+    int found = 0, gone = 0;
+    for (int i = 0; i < 70000; i++) {
+        snprintf(name, sizeof(name), "n%d.dat", i);
+        uint32_t n = index_lookup(&x, d, name);
+        if (i % 2 == 0) gone += n == INDEX_NONE;
+        else found += n != INDEX_NONE && strcmp(index_name(&x, n), name) == 0;
+    }
+    CHECK(found == 35000 && gone == 35000);
+    CHECK(index_check_loaded(&x) == 0);
+
+    // A node missing from the hash chains is removed without touching them
+    uint32_t lost = index_add(&x, d, "lost.dat");
+    x.nodes[lost].type = NODE_FILE;
+    unfile_node(&x, lost);
+    index_remove(&x, lost);
+    CHECK(x.nodes[lost].type == NODE_FREE && index_lookup(&x, d, "n1.dat") != INDEX_NONE);
+    CHECK(index_check_loaded(&x) == 0);
+
+    // Removing the directory takes everything below it
+    index_remove(&x, d);
+    CHECK(x.live == 2 && index_lookup(&x, 0, "g.txt") != INDEX_NONE && index_check_loaded(&x) == 0);
+    free_index(&x);
+}
+
+// ---- Checksum cache ----
+
+SumRecord sum_record(uint64_t ino, int64_t mtime) {
+    SumRecord r;
+    memset(&r, 0, sizeof(r));
+    r.dev = 1;
+    r.ino = ino;
+    r.size = 100;
+    r.mtime_sec = mtime;
+    r.algo = SUM_SHA256;
+    memset(r.digest, (int)(ino + mtime), sizeof(r.digest));
+    return r;
+}
+
+void sum_cache_open(SumCache *c, const char *path) {
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    c->fd = -1;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    sum_cache_load(c);
+}
+
+void sum_cache_close(SumCache *c) {
+    for (size_t i = 0; i < c->num_buckets; i++)
+        for (SumEntry *e = c->buckets[i], *next; e; e = next) {
+            next = e->next;
+            free(e);
+        }
+    free(c->buckets);
+    if (c->fd >= 0) close(c->fd);
+}
+
+void test_sum_cache() {
+    char path[64], victim[64];
+    struct stat st;
+    SumCache c;
+    snprintf(path, sizeof(path), "%s/state/sums", tmp_dir);
+    snprintf(victim, sizeof(victim), "%s/victim", tmp_dir);
+    sum_cache_open(&c, path);
+    CHECK(c.fd >= 0);
+    // The same files hashed again and again: the file is compacted while running
+    for (int round = 0; round < 50; round++)
+        for (uint64_t ino = 1; ino <= 100; ino++) {
+            SumRecord r = sum_record(ino, round);
+            sum_cache_put(&c, &r, 1);
+        }
+    CHECK(c.entries == 100 && c.records <= 2 * c.entries + 1024);
+    CHECK(stat(path, &st) == 0 && (size_t)st.st_size <= 12 + (2 * 100 + 1024) * sizeof(SumRecord));
+    sum_cache_close(&c);
+
+    sum_cache_open(&c, path);
+    SumRecord want = sum_record(7, 49);
+    struct stat file = {0};
+    unsigned char digest[32];
+    file.st_dev = 1;
+    file.st_ino = 7;
+    file.st_size = 100;
+    file.st_mtim.tv_sec = 49;
+    CHECK(c.entries == 100 && sum_cache_lookup(&c, &file, SUM_SHA256, digest) &&
+          memcmp(digest, want.digest, 32) == 0);
+    sum_cache_close(&c);
+
+    // A cache file planted by someone else is not believed
+    run("chown 65534 state/sums");
+    sum_cache_open(&c, path);
+    CHECK(geteuid() != 0 || c.entries == 0);
+    sum_cache_close(&c);
+
+    // Nor is one reached through a link, and the link's target is left alone
+    run("rm -f state/sums && echo keep > victim && ln -s ../victim state/sums && ln -sf ../victim state/sums.tmp");
+    sum_cache_open(&c, path);
+    CHECK(c.entries == 0 && same_file(victim, "keep\n", 5));
+    CHECK(lstat(path, &st) == 0 && S_ISREG(st.st_mode));  // Replaced by a fresh cache file
+    sum_cache_close(&c);
+}
+
+// ---- File ingest ----
+
+// A path swapped for a FIFO after the walk must not block the open, and the
+// stat of every slot must describe the file that was opened
+void test_ingest() {
+    char fifo[64], file[64];
+    IngestEngine e;
+    FileItem items[2];
+    struct stat st;
+    snprintf(fifo, sizeof(fifo), "%s/fifo", tmp_dir);
+    snprintf(file, sizeof(file), "%s/one", tmp_dir);
+    CHECK(mkfifo(fifo, 0600) == 0);
+    CHECK(write_file(file, "hello\n", 6) == 0);
+    memset(items, 0, sizeof(items));
+    items[0].path = fifo;
+    items[1].path = file;
+
+    alarm(30);  // A blocked open would otherwise hang the tests
+    for (int ring = ingest_uring; ring >= 0; ring--) {
+        int saved = ingest_uring;
+        ingest_uring = ring;
+        CHECK(ingest_init(&e) == 0);
+        ingest_uring = saved;
+        CHECK(e.use_ring == ring);
+        e.slots[0].item = &items[0];
+        e.slots[1].item = &items[1];
+        if (ring) {
+            ingest_batch(&e, 2);
+        } else {
+            ingest_slot_sync(&e.slots[0]);
+            ingest_slot_sync(&e.slots[1]);
+        }
+        CHECK(e.slots[0].fd >= 0 && e.slots[0].stat_ok && S_ISFIFO(e.slots[0].st.st_mode) && e.slots[0].got == 0);
+        CHECK(e.slots[1].fd >= 0 && e.slots[1].stat_ok && e.slots[1].got == 6 &&
+              memcmp(e.slots[1].buf, "hello\n", 6) == 0);
+        for (int i = 0; i < 2; i++) {
+            CHECK(fstat(e.slots[i].fd, &st) == 0 && st.st_ino == e.slots[i].st.st_ino &&
+                  st.st_dev == e.slots[i].st.st_dev);
+            close(e.slots[i].fd);
+        }
+        ingest_destroy(&e);
+    }
+    alarm(0);
+    unlink(fifo);
+}
+
+// ---- Archive round trip ----
+
+typedef struct {
+    Reply reply;
+    char command[256];
+    void (*handler)(Reply *reply, char *command);
+} CommandJob;
+
+void *command_job(void *arg) {
+    CommandJob *job = arg;
+    job->handler(&job->reply, job->command);
+    close(job->reply.sock);
+    return NULL;
+}
+
+// Run an archive worker command as a client would see it and collect the
+// payload of the response. Returns the frame type of the payload, or -1 if the
+// stream was malformed; status receives the status of the frames if not NULL.
+int fetch_by(void (*handler)(Reply *, char *), const char *command, Buffer *payload, int *status) {
+    int sv[2];
+    uint32_t zc_next_id = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+    CommandJob job = {.reply = {.sock = sv[0], .request_id = 42, .zc_next_id = &zc_next_id}, .handler = handler};
+    snprintf(job.command, sizeof(job.command), "%s", command);
+    pthread_t tid;
+    pthread_create(&tid, NULL, command_job, &job);
+
+    int type = -1, more = 1;
+    unsigned char h[W24_HEADER_SIZE];
+    while (more) {
+        if (read_all(sv[1], h, sizeof(h)) < 0 || h[0] != W24_MAGIC) {
+            type = -1;
+            break;
+        }
+        uint32_t id;
+        uint64_t len;
+        memcpy(&id, h + 4, 4);
+        memcpy(&len, h + 8, 8);
+        len = be64toh(len);
+        if (be32toh(id) != 42 || (type >= 0 && h[1] != type)) {
+            type = -1;
+            break;
+        }
+        type = h[1];
+        if (status) *status = h[2];
+        more = h[3] & W24_FLAG_MORE;
+        while (len > 0) {
+            unsigned char buf[65536];
+            size_t n = len < sizeof(buf) ? len : sizeof(buf);
+            if (read_all(sv[1], buf, n) < 0) {
+                more = 0;
+                type = -1;
+                break;
+            }
+            buffer_sink(payload, buf, n);
+            len -= n;
+        }
+    }
+    close(sv[1]);
+    pthread_join(tid, NULL);
+    return type;
+}
+
+int fetch(const char *command, Buffer *payload, int *status) {
+    return fetch_by(run_archive_command, command, payload, status);
+}
+
+void test_archive() {
+    char path[PATH_MAX];
+    unsigned char *big, *small;
+    size_t big_len = sample(4, &big), small_len = sample(1, &small);
+    run("mkdir -p home/sub/deeper home/.hidden");
+    snprintf(path, sizeof(path), "%s/home/big.dat", tmp_dir);
+    write_file(path, big, big_len);
+    snprintf(path, sizeof(path), "%s/home/sub/deeper/small.dat", tmp_dir);
+    write_file(path, small, small_len);
+    snprintf(path, sizeof(path), "%s/home/sub/skip.txt", tmp_dir);
+    write_file(path, "no\n", 3);
+
+    static const struct {
+        const char *command;
+        int type;
+        const char *file, *unpack;
+    } runs[] = {
+        {"w24ft dat -z default", W24_TYPE_ARCHIVE, "a.tar.gz", "tar -xzf a.tar.gz -C a"},
+        {"w24ft dat -z none", W24_TYPE_TAR, "a.tar", "tar -xf a.tar -C a"},
+    };
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        Buffer payload = {0};
+        CHECK(fetch(runs[i].command, &payload, NULL) == runs[i].type);
+        snprintf(path, sizeof(path), "%s/%s", tmp_dir, runs[i].file);
+        CHECK(write_file(path, payload.data, payload.len) == 0);
+        CHECK(run("rm -rf a && mkdir a && %s", runs[i].unpack) == 0);
+        // Members are named by their full path without the leading '/'; .txt is left out
+        CHECK(run("test \"$(cd a && find . -type f | sort | tr '\\n' ' ')\" = "
+                  "'./%s/home/big.dat ./%s/home/sub/deeper/small.dat '", tmp_dir + 1, tmp_dir + 1) == 0);
+        snprintf(path, sizeof(path), "%s/a%s/home/big.dat", tmp_dir, tmp_dir);
+        CHECK(same_file(path, big, big_len));
+        snprintf(path, sizeof(path), "%s/a%s/home/sub/deeper/small.dat", tmp_dir, tmp_dir);
+        CHECK(same_file(path, small, small_len));
+        free(payload.data);
+    }
+    free(big);
+    free(small);
+}
+
+// ---- Result cache ----
+
+int fetch_same(const char *command, const Buffer *want) {
+    Buffer got = {0};
+    int same = fetch(command, &got, NULL) == W24_TYPE_ARCHIVE && got.len == want->len &&
+               memcmp(got.data, want->data, got.len) == 0;
+    free(got.data);
+    return same;
+}
+
+void *fetch_job(void *arg) {
+    Buffer *payload = arg;
+    fetch("w24ft dat -z fast", payload, NULL);
+    return NULL;
+}
+
+void test_result_cache() {
+    char path[64];
+    ResultCache *c = &result_cache;
+    Buffer first = {0};
+
+    // Spools only go into a directory of ours that no one else can reach
+    snprintf(state_dir, sizeof(state_dir), "%s/open", tmp_dir);
+    mkdir(state_dir, 0777);
+    chmod(state_dir, 0777);
+    result_cache_init(c);
+    CHECK(c->dir[0] == '\0' && c->limit == 0);
+    snprintf(state_dir, sizeof(state_dir), "%s/state", tmp_dir);
+    run("mkdir -m 700 state/results-%d && chown 65534 state/results-%d", PORT, PORT);
+    c->limit = (uint64_t)DEFAULT_RESULT_MIB << 20;
+    result_cache_init(c);
+    CHECK(geteuid() != 0 || (c->dir[0] == '\0' && c->limit == 0));
+    run("rm -rf state/results-%d", PORT);
+    c->limit = (uint64_t)DEFAULT_RESULT_MIB << 20;
+    result_cache_init(c);
+    CHECK(c->dir[0] != '\0');
+
+    // A repeat is served from the cache, byte for byte
+    CHECK(fetch("w24ft dat", &first, NULL) == W24_TYPE_ARCHIVE);
+    CHECK(c->entries == 1 && c->hits == 0);
+    CHECK(fetch_same("w24ft dat", &first));
+    CHECK(c->hits == 1);
+
+    // A file rewritten in place leaves the directories alone, but not the cached result
+    struct timespec later = {0, 0};
+    snprintf(path, sizeof(path), "%s/home/big.dat", tmp_dir);
+    utimensat(AT_FDCWD, path, (struct timespec[]){later, later}, 0);
+    CHECK(!fetch_same("w24ft dat", &first));
+    CHECK(c->hits == 1 && c->invalidated == 1);
+
+    // Identical queries at once all get the whole archive, and a later one a hit
+    pthread_t tids[4];
+    Buffer payloads[4] = {{0}};
+    for (int i = 0; i < 4; i++)
+        pthread_create(&tids[i], NULL, fetch_job, &payloads[i]);
+    for (int i = 0; i < 4; i++)
+        pthread_join(tids[i], NULL);
+    for (int i = 1; i < 4; i++)
+        CHECK(payloads[i].len == payloads[0].len && memcmp(payloads[i].data, payloads[0].data, payloads[0].len) == 0);
+    snprintf(path, sizeof(path), "%s/fast.tar.gz", tmp_dir);
+    write_file(path, payloads[0].data, payloads[0].len);
+    CHECK(run("tar -tzf fast.tar.gz | grep -q big.dat") == 0);
+    uint64_t hits = c->hits;
+    CHECK(fetch_same("w24ft dat -z fast", &payloads[0]));
+    CHECK(c->hits == hits + 1);
+    for (int i = 0; i < 4; i++)
+        free(payloads[i].data);
+    free(first.data);
+}
+
+// ---- Ranged gets ----
+
+void test_get() {
+    char path[PATH_MAX], command[PATH_MAX + 32];
+    unsigned char *data;
+    size_t len = sample(1, &data);
+    int status;
+    run("mkdir -p home/get && echo out > outside/get.txt");
+    snprintf(path, sizeof(path), "%s/home/get/file 2", tmp_dir);
+    write_file(path, data, len);
+
+    // The whole file, by relative or absolute path, or any range of it
+    Buffer got = {0};
+    CHECK(fetch_by(send_file_get, "get/file 2 0 0", &got, &status) == W24_TYPE_FILE && status == W24_STATUS_OK &&
+          got.len == len && memcmp(got.data, data, len) == 0);
+    got.len = 0;
+    snprintf(command, sizeof(command), "%s 100 1000", path);
+    CHECK(fetch_by(send_file_get, command, &got, NULL) == W24_TYPE_FILE && got.len == 1000 &&
+          memcmp(got.data, data + 100, 1000) == 0);
+    got.len = 0;
+    CHECK(fetch_by(send_file_get, "get/file 2 100 0", &got, NULL) == W24_TYPE_FILE && got.len == len - 100 &&
+          memcmp(got.data, data + 100, len - 100) == 0);
+    got.len = 0;
+    snprintf(command, sizeof(command), "get/file 2 %zu 1000", len - 10);  // Cut short at the end
+    CHECK(fetch_by(send_file_get, command, &got, NULL) == W24_TYPE_FILE && got.len == 10 &&
+          memcmp(got.data, data + len - 10, 10) == 0);
+    got.len = 0;
+    snprintf(command, sizeof(command), "get/file 2 %zu 0", len);
+    CHECK(fetch_by(send_file_get, command, &got, NULL) == W24_TYPE_FILE && got.len == 0);
+
+    // Refused: past the end, a missing length, outside HOME, not a file
+    const char *refused[] = {"get/file 2 99999999 1", "get/file 2", "../outside/get.txt", "/etc/passwd", "get"};
+    for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+        got.len = 0;
+        CHECK(fetch_by(send_file_get, refused[i], &got, &status) == W24_TYPE_TEXT && status != W24_STATUS_OK);
+    }
+    free(got.data);
+    free(data);
+    run("rm -rf home/get outside/get.txt");
+}
+
+// ---- Directory listings ----
+
+struct {
+    char path[64];
+    int sort_by_time;
+    size_t limit;
+} dirlist_query;
+
+// Handler for fetch_by: one page of the dirlist query, the command being its cursor
+void dirlist_page(Reply *reply, char *cursor) {
+    list_directories(reply, dirlist_query.path, dirlist_query.sort_by_time, dirlist_query.limit,
+                     cursor[0] ? cursor : NULL);
+}
+
+// The page after cursor ("" for the first), NUL-terminated; the caller frees it
+char *dirlist_fetch(const char *cursor, int *status) {
+    Buffer text = {0};
+    fetch_by(dirlist_page, cursor, &text, status);
+    buffer_sink(&text, "", 1);
+    return (char *)text.data;
+}
+
+void test_dirlist() {
+    char *got;
+    int status;
+    snprintf(dirlist_query.path, sizeof(dirlist_query.path), "%s/list", tmp_dir);
+    run("mkdir -p list/c list/a list/b list/d && touch list/file");
+
+    // Pages by name, each ending with the cursor of its last entry
+    dirlist_query.limit = 2;
+    got = dirlist_fetch("", &status);
+    CHECK(got && status == W24_STATUS_OK && strcmp(got, "a\nb\nNext page: dirlist -a -n 2 -c a62\n") == 0);
+    free(got);
+    got = dirlist_fetch("a62", NULL);
+    CHECK(got && strcmp(got, "c\nd\n") == 0);
+    free(got);
+
+    // The cursor still places the page when directories come and go meanwhile,
+    // even the one it names
+    run("mkdir list/bb && rmdir list/b");
+    got = dirlist_fetch("a62", NULL);
+    CHECK(got && strcmp(got, "bb\nc\nNext page: dirlist -a -n 2 -c a63\n") == 0);
+    free(got);
+    got = dirlist_fetch("a", &status);
+    CHECK(got && status == W24_STATUS_INVALID);
+    free(got);
+
+    // By creation time, oldest first, whatever the names
+    dirlist_query.sort_by_time = 1;
+    run("mkdir list2 && mkdir list2/z && sleep 0.02 && mkdir list2/x && sleep 0.02 && mkdir list2/y");
+    snprintf(dirlist_query.path, sizeof(dirlist_query.path), "%s/list2", tmp_dir);
+    got = dirlist_fetch("", NULL);
+    char *next = got ? strstr(got, " -c ") : NULL;
+    CHECK(got && strncmp(got, "z\nx\nNext page: dirlist -t -n 2 -c t", 35) == 0 && next);
+    if (next) {
+        char cursor[128];
+        snprintf(cursor, sizeof(cursor), "%.*s", (int)strcspn(next + 4, "\n"), next + 4);
+        char *rest = dirlist_fetch(cursor, NULL);
+        CHECK(rest && strcmp(rest, "y\n") == 0);
+        free(rest);
+    }
+    free(got);
+    dirlist_query.sort_by_time = 0;
+    dirlist_query.limit = 0;
+    run("rm -rf list list2");
+}
+
+// ---- Name lookups ----
+
+// The w24fn reply to args, NUL-terminated; the caller frees it
+char *lookup_names(const char *args) {
+    Buffer text = {0};
+    fetch_by(send_name_lookups, args, &text, NULL);
+    buffer_sink(&text, "", 1);
+    return (char *)text.data;
+}
+
+void test_name_lookups() {
+    char want[1024], path[1024];
+    char *got;
+
+    // From the walk: matches in path order, including those behind a link to a
+    // directory, whatever order the walkers meet them in
+    run("mkdir -p home/names/b home/names/a/z far && ln -s ../../far home/names/c");
+    run("touch home/names/b/x.c home/names/a/z/x.c home/names/a/x.c far/x.c");
+    got = lookup_names("-a x.c");
+    snprintf(want, sizeof(want), "x.c: 4 matches\n  %s/home/names/a/x.c (0 bytes)\n  %s/home/names/a/z/x.c (0 bytes)\n"
+             "  %s/home/names/b/x.c (0 bytes)\n  %s/home/names/c/x.c (0 bytes)\n", tmp_dir, tmp_dir, tmp_dir, tmp_dir);
+    CHECK(got && strcmp(got, want) == 0);
+    free(got);
+    got = lookup_names("x.c nothing.c");
+    snprintf(want, sizeof(want), "x.c: %s/home/names/a/x.c (0 bytes, permissions", tmp_dir);
+    CHECK(got && strncmp(got, want, strlen(want)) == 0 && strstr(got, "nothing.c: not found\n"));
+    free(got);
+    CHECK(find_file(getenv("HOME"), "x.c", path) == 1);
+    snprintf(want, sizeof(want), "%s/home/names/a/x.c", tmp_dir);
+    CHECK(strcmp(path, want) == 0);
+
+    // Under -P the link is left alone
+    follow_links = 0;
+    got = lookup_names("-a x.c");
+    CHECK(got && strncmp(got, "x.c: 3 matches\n", 15) == 0 && !strstr(got, "names/c/"));
+    free(got);
+    follow_links = 1;
+
+    // From the index: the same order, though the node ids say otherwise
+    FileIndex *x = &file_index;
+    snprintf(want, sizeof(want), "%s/home", tmp_dir);
+    build_index(x, want);
+    add_node(x, add_node(x, 0, "a", NODE_DIR), "f.txt", NODE_FILE);
+    add_node(x, 0, "f.txt", NODE_FILE);
+    x->ready = 1;
+    use_index = 1;
+    CHECK(index_find_file("f.txt", path, sizeof(path)) == 1);
+    snprintf(want, sizeof(want), "%s/home/a/f.txt", tmp_dir);
+    CHECK(strcmp(path, want) == 0);
+    got = lookup_names("-a f.txt");
+    snprintf(want, sizeof(want), "f.txt: 3 matches\n  %s/home/a/f.txt (0 bytes)\n  %s/home/d/f.txt (0 bytes)\n"
+             "  %s/home/f.txt (0 bytes)\n", tmp_dir, tmp_dir, tmp_dir);
+    CHECK(got && strcmp(got, want) == 0);
+    free(got);
+
+    // An index holding a link to a directory leaves following lookups to the walk
+    add_node(x, 0, "link", NODE_LINK);
+    x->dir_links++;
+    CHECK(index_find_file("f.txt", path, sizeof(path)) < 0);
+    follow_links = 0;
+    CHECK(index_find_file("f.txt", path, sizeof(path)) == 1);
+    follow_links = 1;
+    use_index = 0;
+    x->ready = 0;
+    free_index(x);
+    memset(x, 0, sizeof(*x));
+    run("rm -rf home/names far");
+}
+
+// ---- Watches ----
+
+// A regular file of size bytes in the index, changed as the indexer changes it
+uint32_t watch_file(FileIndex *x, uint32_t dir, const char *name, off_t size) {
+    uint32_t n = index_add(x, dir, name);
+    x->nodes[n].type = NODE_FILE;
+    x->nodes[n].mode = S_IFREG | 0644;
+    x->sizes[n] = size;
+    x->mtimes[n] = 1000;
+    index_log_change(x, n, NULL, 0);
+    return n;
+}
+
+void watch_resize(FileIndex *x, uint32_t n, off_t size) {
+    struct stat before;
+    index_stat(x, n, &before);
+    x->sizes[n] = size;
+    index_log_change(x, n, &before, 0);
+}
+
+// What one watch is sent for the changes from seq on, as its client reads it
+char *watch_batch(FileIndex *x, const char *predicates, uint64_t seq) {
+    char args[64], err[256];
+    int sv[2], list;
+    Buffer text = {0};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return NULL;
+    Connection conn = {.fd = sv[0]};
+    Watch w = {.conn = &conn, .request_id = 7, .frame = SIZE_MAX, .seq = seq, .token_seq = seq};
+    snprintf(args, sizeof(args), "%s", predicates);
+    parse_find_query(args, &w.query, &list, err, sizeof(err));
+
+    size_t count = 0;
+    WatchChange *changes = malloc(x->change_seq * sizeof(WatchChange));
+    for (uint64_t i = 0; i < x->change_seq; i++) {
+        changes[count].seq = i;
+        changes[count].change = x->changes[i % CHANGE_LOG];
+        changes[count++].change.path = strdup(x->changes[i % CHANGE_LOG].path);
+    }
+    qsort(changes, count, sizeof(WatchChange), compare_watch_changes);
+    watch_send_changes(&w, changes, count, x->change_seq);
+    close(sv[0]);
+
+    unsigned char h[W24_HEADER_SIZE];
+    while (read_all(sv[1], h, sizeof(h)) == 0) {
+        uint64_t len;
+        memcpy(&len, h + 8, 8);
+        len = be64toh(len);
+        unsigned char *payload = malloc(len);
+        if (h[1] != W24_TYPE_TEXT || !(h[3] & W24_FLAG_MORE) || read_all(sv[1], payload, len) < 0) {
+            free(payload);
+            break;
+        }
+        buffer_sink(&text, payload, len);
+        free(payload);
+    }
+    close(sv[1]);
+    buffer_sink(&text, "", 1);
+    for (size_t i = 0; i < count; i++) free(changes[i].change.path);
+    free(changes);
+    free(w.out);
+    return (char *)text.data;
+}
+
+void test_watch() {
+    char want[256], token[64];
+    FileIndex *x = &file_index;
+    build_index(x, "/r");
+    uint32_t f = index_lookup(x, index_lookup(x, 0, "d"), "f.txt"), g = index_lookup(x, 0, "g.txt");
+    x->nodes[f].mode = x->nodes[g].mode = S_IFREG | 0644;
+    x->sizes[f] = 50;
+    x->sizes[g] = 20;
+    x->mtimes[f] = x->mtimes[g] = 1000;
+    x->ready = 1;
+
+    watch_file(x, 0, "a.dat", 10);
+    uint64_t after_create = x->change_seq;
+    watch_resize(x, g, 30);
+    watch_resize(x, g, 40);
+    index_remove(x, f);
+    index_remove(x, watch_file(x, 0, "tmp.dat", 10));
+    watch_resize(x, watch_file(x, 0, "h.txt", 2), 3);
+
+    // One line per path, comparing where it stood before the batch with where
+    // it ends: a file changed twice shows once, one created and removed not at all
+    char *got = watch_batch(x, "size:5-100", 0);
+    snprintf(token, sizeof(token), "# resume %llx.%llx\n", (unsigned long long)file_index.instance,
+             (unsigned long long)x->change_seq);
+    snprintf(want, sizeof(want), "+ 10 1000 /r/a.dat\n- 50 1000 /r/d/f.txt\n~ 40 1000 /r/g.txt\n%s", token);
+    CHECK(got && strcmp(got, want) == 0);
+    free(got);
+
+    // A resumed watch gets only what came after its token
+    got = watch_batch(x, "size:5-100", after_create);
+    snprintf(want, sizeof(want), "- 50 1000 /r/d/f.txt\n~ 40 1000 /r/g.txt\n%s", token);
+    CHECK(got && strcmp(got, want) == 0);
+    free(got);
+
+    // Leaving the predicates is a removal for the watch, entering them a creation
+    after_create = x->change_seq;
+    watch_resize(x, g, 200);
+    watch_resize(x, index_lookup(x, 0, "h.txt"), 9);
+    got = watch_batch(x, "size:5-100", after_create);
+    snprintf(token, sizeof(token), "# resume %llx.%llx\n", (unsigned long long)file_index.instance,
+             (unsigned long long)x->change_seq);
+    snprintf(want, sizeof(want), "- 40 1000 /r/g.txt\n+ 9 1000 /r/h.txt\n%s", token);
+    CHECK(got && strcmp(got, want) == 0);
+    free(got);
+
+    x->ready = 0;
+    for (uint64_t i = 0; i < x->change_seq && i < CHANGE_LOG; i++) free(x->changes[i].path);
+    free(x->changes);
+    free_index(x);
+    memset(x, 0, sizeof(*x));
+}
+
+int main() {
+    if (!mkdtemp(tmp_dir))
+        error("ERROR creating test directory");
+    signal(SIGPIPE, SIG_IGN);
+    compression_init();
+    cache_init(&member_cache);
+    use_index = 0;
+    zero_copy = 0;  // MSG_ZEROCOPY is for TCP, the archive test talks over a socketpair
+
+    test_header();
+    test_hashes();
+    test_gzip();
+    test_tar();
+    test_varint();
+    test_glob();
+    test_home_paths();
+    test_snapshot();
+    test_index_updates();
+    test_sum_cache();
+
+    // The archive pipeline needs the server's thread pools
+    compress_threads = 2;
+    if (queue_init(&archive_queue, QUEUE_CAPACITY) < 0)
+        error("ERROR allocating queues");
+    pipeline_pools_start(2);
+    ingest_probe();
+    if (!ingest_uring) {
+        if (queue_init(&ingest_queue, QUEUE_CAPACITY) < 0)
+            error("ERROR allocating ingest queue");
+        start_pool(INGEST_THREADS, ingest_thread);
+    }
+    walk_pool_start();
+    test_ingest();
+    test_archive();
+    test_result_cache();
+    test_get();
+    test_dirlist();
+    test_name_lookups();
+    test_watch();
+
+    run("cd / && rm -rf %s", tmp_dir);
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures != 0;
+}